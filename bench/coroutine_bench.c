@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../vm.h"
+
+// Measures the cost of a resume/yield round trip against a plain function
+// call doing the same work, and the throughput of a generator pipeline
+// against building the whole list first.
+
+#define ROUNDS 2000000
+#define ITEMS 1000000
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+static const char *calls =
+    "def next(x) { return x + 1; }\n"
+    "var i = 0;\n"
+    "while (i < " TO_STRING(ROUNDS) ") { i = next(i); }\n";
+
+static const char *switches =
+    "def next(x) { while (true) { x = yield(x + 1); } }\n"
+    "var co = coroutine(next);\n"
+    "var i = 0;\n"
+    "while (i < " TO_STRING(ROUNDS) ") { i = resume(co, i); }\n";
+
+// Numbers 0..n-1, squared, summed
+static const char *pipeline =
+    "def count(n) { var i = 0; while (i < n) { yield(i); i = i + 1; } "
+    "return nil; }\n"
+    "def square(source) {\n"
+    "  var v = resume(source, " TO_STRING(ITEMS) ");\n"
+    "  while (!isDone(source)) { yield(v * v); v = resume(source, nil); }\n"
+    "  return nil;\n"
+    "}\n"
+    "var squares = coroutine(square);\n"
+    "var sum = 0;\n"
+    "var v = resume(squares, coroutine(count));\n"
+    "while (!isDone(squares)) { sum = sum + v; v = resume(squares, nil); }\n";
+
+static const char *materialized =
+    "struct Cons(first, rest) { var first = first; var rest = rest; }\n"
+    "def count(n) { var list = nil; while (n > 0) { n = n - 1; "
+    "list = Cons(n, list); } return list; }\n"
+    "def square(list) { var out = nil; while (!(list == nil)) { "
+    "out = Cons(list.first * list.first, out); list = list.rest; } "
+    "return out; }\n"
+    "var list = square(count(" TO_STRING(ITEMS) "));\n"
+    "var sum = 0;\n"
+    "while (!(list == nil)) { sum = sum + list.first; list = list.rest; }\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs script in a fresh VM and returns the seconds it took. Sets objects to
+// the number of heap objects left behind.
+static void countObject(Obj *object, void *count) { (*(long *)count)++; }
+
+static double measure(const char *script, long *objects) {
+  VM vm;
+  initVM(&vm);
+  double start = now();
+  if (interpret(&vm, script) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  double elapsed = now() - start;
+  *objects = 0;
+  visitHeap(&vm, countObject, objects);
+  freeVM(&vm);
+  return elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  long objects;
+  double call = measure(calls, &objects);
+  double swap = measure(switches, &objects);
+  printf("%-14s %12s\n", "round trip", "ns");
+  printf("%-14s %12.1f\n", "call/return", call * 1e9 / ROUNDS);
+  printf("%-14s %12.1f\n", "resume/yield", swap * 1e9 / ROUNDS);
+
+  long streamedObjects, listObjects;
+  double streamed = measure(pipeline, &streamedObjects);
+  double listed = measure(materialized, &listObjects);
+  printf("\n%-14s %12s %12s\n", "pipeline", "items/sec", "objects");
+  printf("%-14s %12.0f %12ld\n", "generators", ITEMS / streamed,
+         streamedObjects);
+  printf("%-14s %12.0f %12ld\n", "lists", ITEMS / listed, listObjects);
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../gc.h"
+#include "../vm.h"
+
+// Measures how much of a parent's heap forked workers keep sharing with it.
+// The parent builds a large tree, leaving as much garbage between its nodes,
+// and then forks workers that collect the
+// whole heap and make garbage while reading the tree, each reporting its
+// resident, proportional and private dirty memory. Once with the heap as
+// malloc left it and once after compactHeap moved it into an arena, each in
+// a process of its own.
+
+#define WORKERS 4
+
+static const char *setup =
+    "struct T(left, right) { var left = left; var right = right; }\n"
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "var dropped = nil;\n"
+    "def make(depth) {\n"
+    "  if (depth == 0) { return \"leaf\" + \"!\"; }\n"
+    "  var t = T(make(depth - 1), make(depth - 1));\n"
+    "  dropped = P(t, dropped);\n"
+    "  return t;\n"
+    "}\n"
+    "def count(t) {\n"
+    "  if (t == \"leaf!\") { return 1; }\n"
+    "  return count(t.left) + count(t.right);\n"
+    "}\n"
+    "var root = make(17);\n"
+    "dropped = nil;\n"
+    "var junk = nil;\n";
+
+static const char *work =
+    "var n = count(root);\n"
+    "var i = 0;\n"
+    "while (i < 300000) { junk = P(i, P(i, i)); i = i + 1; }\n"
+    "n = n + count(root);\n";
+
+typedef struct {
+  double ms;
+  long rss;
+  long pss;
+  long dirty;
+} Usage;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads a field of the process's memory totals, in kilobytes
+static long readRollup(const char *field) {
+  FILE *file = fopen("/proc/self/smaps_rollup", "r");
+  if (file == NULL) {
+    return -1;
+  }
+  char line[256];
+  long value = -1;
+  size_t length = strlen(field);
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, field, length) == 0 && line[length] == ':') {
+      value = atol(line + length + 1);
+      break;
+    }
+  }
+  fclose(file);
+  return value;
+}
+
+static void runWorker(VM *vm, int out) {
+  double start = now();
+  collectGarbage(vm);
+  if (interpret(vm, work) != INTERPRET_OK) {
+    exit(1);
+  }
+  collectGarbage(vm);
+  Usage usage = {(now() - start) * 1e3, readRollup("Rss"), readRollup("Pss"),
+                 readRollup("Private_Dirty")};
+  if (write(out, &usage, sizeof(usage)) != sizeof(usage)) {
+    exit(1);
+  }
+  _exit(0);
+}
+
+static void measure(const char *name, bool compact) {
+  VM vm;
+  initVM(&vm);
+  if (interpret(&vm, setup) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  collectGarbage(&vm);
+  double start = now();
+  if (compact && !compactHeap(&vm)) {
+    fprintf(stderr, "could not compact\n");
+    exit(1);
+  }
+  double compacting = (now() - start) * 1e3;
+  long parent = readRollup("Rss");
+
+  int pipes[2];
+  if (pipe(pipes) != 0) {
+    exit(1);
+  }
+  for (int i = 0; i < WORKERS; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      exit(1);
+    }
+    if (pid == 0) {
+      close(pipes[0]);
+      runWorker(&vm, pipes[1]);
+    }
+  }
+  close(pipes[1]);
+  Usage total = {0, 0, 0, 0};
+  for (int i = 0; i < WORKERS; i++) {
+    Usage usage;
+    if (read(pipes[0], &usage, sizeof(usage)) != sizeof(usage)) {
+      fprintf(stderr, "worker failed\n");
+      exit(1);
+    }
+    total.ms += usage.ms;
+    total.rss += usage.rss;
+    total.pss += usage.pss;
+    total.dirty += usage.dirty;
+  }
+  close(pipes[0]);
+  while (wait(NULL) > 0) {
+  }
+  printf("%-14s %10.1f %10ld %10.0f %10ld %10ld %10ld\n", name, compacting,
+         parent, total.ms / WORKERS, total.rss / WORKERS, total.pss / WORKERS,
+         total.dirty / WORKERS);
+  freeVM(&vm);
+}
+
+int main(int argc, const char *argv[]) {
+  printf("%d workers, memory per worker in kB\n", WORKERS);
+  printf("%-14s %10s %10s %10s %10s %10s %10s\n", "heap", "compact ms",
+         "parent", "worker ms", "rss", "pss", "dirty");
+  for (int compact = 0; compact < 2; compact++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      measure(compact ? "compacted" : "malloc", compact);
+      exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../vm.h"
+
+// Measures the pauses of the collector while a script keeps a large heap
+// alive and churns through garbage, with every cycle run in one slice
+// against the incremental collector at a few pause targets, and what
+// collecting costs an allocation loop. Minor collections of the nursery count
+// as pauses too. Then measures how full collections of a large tree scale
+// with the threads marking and sweeping it, first while all of it is live
+// and then once it is all garbage.
+
+static const char *script =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "struct Node(value, next) { var value = value; var next = next; }\n"
+    "var live = nil;\n"
+    "var i = 0;\n"
+    "while (i < 200000) { live = Node(P(i, i), live); i = i + 1; }\n"
+    "var junk = nil;\n"
+    "i = 0;\n"
+    "while (i < 2000000) { junk = P(i, P(i, i)); i = i + 1; }\n";
+
+static const char *tree =
+    "struct T(left, right) { var left = left; var right = right; }\n"
+    "def make(depth) {\n"
+    "  if (depth == 0) { return nil; }\n"
+    "  return T(make(depth - 1), make(depth - 1));\n"
+    "}\n"
+    "var root = make(19);\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void measure(const char *name, bool enabled, int64_t pauseTarget) {
+  VM vm;
+  initVM(&vm);
+  vm.gc.enabled = enabled;
+  vm.gc.pauseTarget = pauseTarget;
+  double start = now();
+  if (interpret(&vm, script) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  double elapsed = now() - start;
+  Collector *gc = &vm.gc;
+  double mean = gc->slices ? gc->totalPause / 1e6 / gc->slices : 0;
+  printf("%-14s %8.0f %8u %8llu %10llu %10.3f %10.3f %10.1f\n", name,
+         elapsed * 1e3, gc->cycles, (unsigned long long)gc->minors,
+         (unsigned long long)gc->slices, mean,
+         gc->longestPause / 1e6, (double)gc->allocated / (1024 * 1024));
+  freeVM(&vm);
+}
+
+static void scale(int threads) {
+  VM vm;
+  initVM(&vm);
+  vm.gc.threads = threads;
+  if (interpret(&vm, tree) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  collectGarbage(&vm);
+  double heap = (double)vm.gc.allocated / (1024 * 1024);
+  double start = now();
+  collectGarbage(&vm);
+  double live = now() - start;
+  if (interpret(&vm, "root = nil;\n") != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  start = now();
+  collectGarbage(&vm);
+  double dead = now() - start;
+  printf("%-14d %10.1f %10.2f %10.0f %10.2f\n", threads, heap, live * 1e3,
+         heap / live, dead * 1e3);
+  freeVM(&vm);
+}
+
+int main(int argc, const char *argv[]) {
+  printf("%-14s %8s %8s %8s %10s %10s %10s %10s\n", "collector", "ms",
+         "cycles", "minors", "slices", "mean ms", "max ms", "heap MB");
+  measure("off", false, GC_PAUSE_DEFAULT);
+  measure("stop the world", true, 0);
+  measure("2000 us", true, 2000);
+  measure("500 us", true, 500);
+  measure("100 us", true, 100);
+
+  printf("\n%ld cpus\n", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-14s %10s %10s %10s %10s\n", "threads", "heap MB", "live ms",
+         "MB/s", "dead ms");
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    scale(threads);
+  }
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../image.h"
+#include "../vm.h"
+
+// Measures how long a VM takes to get to the state a prelude leaves it in:
+// by compiling and running the prelude, or by loading an image of a VM that
+// did. The prelude defines many small functions, as a standard library
+// would, and builds a lookup table of structs and strings.
+
+#define FUNCTIONS 2000
+#define ENTRIES 20000
+#define RUNS 30
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns a prelude with the given number of functions and entries
+static char *makePrelude(int functions, int entries) {
+  size_t capacity = 256 + (size_t)functions * 160;
+  char *source = (char *)malloc(capacity);
+  size_t length = 0;
+  length += snprintf(source + length, capacity - length,
+                     "struct Entry(key, value, next) { var key = key; var "
+                     "value = value; var next = next; }\n");
+  for (int i = 0; i < functions; i++) {
+    length += snprintf(source + length, capacity - length,
+                       "def helper%d(a, b) { if (a < b) { return a * %d + b; "
+                       "} return helper%d(b, a) - \"%d\"; }\n",
+                       i, i, i, i);
+  }
+  length += snprintf(source + length, capacity - length,
+                     "var table = nil;\nvar i = 0;\n"
+                     "while (i < %d) { table = Entry(\"key\" + \"s\", i, "
+                     "table); i = i + 1; }\n",
+                     entries);
+  return source;
+}
+
+static double startFromSource(const char *prelude) {
+  double start = now();
+  VM vm;
+  initVM(&vm);
+  if (interpret(&vm, prelude) != INTERPRET_OK) {
+    exit(1);
+  }
+  double elapsed = now() - start;
+  freeVM(&vm);
+  return elapsed;
+}
+
+static double startFromImage(const char *path) {
+  double start = now();
+  VM vm;
+  initVM(&vm);
+  if (!loadImage(&vm, path)) {
+    exit(1);
+  }
+  double elapsed = now() - start;
+  freeVM(&vm);
+  return elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  char path[] = "/tmp/image_benchXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+  char *prelude = makePrelude(FUNCTIONS, ENTRIES);
+
+  VM writer;
+  initVM(&writer);
+  if (interpret(&writer, prelude) != INTERPRET_OK ||
+      !saveImage(&writer, path)) {
+    return 1;
+  }
+  freeVM(&writer);
+  struct stat st;
+  stat(path, &st);
+
+  // One of each first, so both start with the files and code in the cache
+  startFromSource(prelude);
+  startFromImage(path);
+  double source = 0;
+  double image = 0;
+  for (int i = 0; i < RUNS; i++) {
+    source += startFromSource(prelude);
+    image += startFromImage(path);
+  }
+  printf("%d functions, %d entries, %zu bytes of source, %lld bytes of "
+         "image\n",
+         FUNCTIONS, ENTRIES, strlen(prelude), (long long)st.st_size);
+  printf("%-10s %12s\n", "start", "ms");
+  printf("%-10s %12.3f\n", "source", source / RUNS * 1000);
+  printf("%-10s %12.3f\n", "image", image / RUNS * 1000);
+  printf("%.1fx faster\n", source / image);
+  free(prelude);
+  remove(path);
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../scanner.h"
+
+// Reports scanner throughput in MB/s over large generated sources. Each
+// source repeats a snippet until it reaches the target size.
+
+#define TARGET_SIZE (64 * 1024 * 1024)
+#define ROUNDS 3
+
+typedef struct {
+  const char *name;
+  const char *snippet;
+} Workload;
+
+static const Workload workloads[] = {
+    {"code",
+     "def score(order, weight) {\n"
+     "  if (order.total > 100 and weight <= 20) { return order.total * 3; }\n"
+     "  var result = score(order, weight - 1) + 42;\n"
+     "  return result;\n"
+     "}\n"},
+    {"data",
+     "var record = Record(\"customer name goes here\", 1234567, \"city\", "
+     "true);\n"},
+    {"long names",
+     "var averageOrderTotalForCustomer = computeAverageOrderTotal(customerRecord"
+     "sByRegion, selectedRegionIdentifier);\n"},
+    {"indented",
+     "                if (x) {\n                    print x;\n"
+     "                }\n"},
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *generate(const char *snippet, size_t *length) {
+  size_t snippetLength = strlen(snippet);
+  size_t copies = TARGET_SIZE / snippetLength;
+  char *source = malloc(copies * snippetLength);
+  if (source == NULL) {
+    exit(1);
+  }
+  for (size_t i = 0; i < copies; i++) {
+    memcpy(source + i * snippetLength, snippet, snippetLength);
+  }
+  *length = copies * snippetLength;
+  return source;
+}
+
+int main(int argc, const char *argv[]) {
+  printf("%-12s %10s %14s %12s\n", "source", "MB/s", "tokens/sec", "tokens");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    size_t length;
+    char *source = generate(workloads[w].snippet, &length);
+
+    double best = 0;
+    long tokens = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+      Scanner scanner;
+      initScanner(&scanner, source, length);
+      tokens = 0;
+      double start = now();
+      for (;;) {
+        Token token = scanToken(&scanner);
+        if (token.type == TOKEN_EOF) {
+          break;
+        }
+        if (token.type == TOKEN_ERROR) {
+          fprintf(stderr, "scan error on line %d\n", token.line);
+          exit(1);
+        }
+        tokens++;
+      }
+      double elapsed = now() - start;
+      if (best == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+
+    printf("%-12s %10.1f %14.0f %12ld\n", workloads[w].name,
+           length / best / (1024 * 1024), tokens / best, tokens);
+    free(source);
+  }
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "../vm.h"
+
+// Reports loopback echo throughput of one VM as the number of connections it
+// keeps in flight grows. Every connection has a client fiber doing request
+// and reply round trips of a 64 byte message with an echo fiber, so with n
+// connections up to 2n reads are pending at once. Also times many fibers
+// sleeping together.
+
+#define ROUND_TRIPS 200000
+#define MESSAGE_SIZE 64
+#define SLEEPERS 10000
+#define SLEEP_MS 100
+
+static const int connections[] = {1, 16, 256, 4096};
+
+static const char *echoScript =
+    "var server = listen(0);\n"
+    "var port = localPort(server);\n"
+    "var message = \"0123456789abcdef0123456789abcdef"
+    "0123456789abcdef0123456789abcdef\";\n"
+    "def echo(fd) {\n"
+    "  var msg = read(fd, 4096);\n"
+    "  while (!(msg == \"\")) { write(fd, msg); msg = read(fd, 4096); }\n"
+    "  close(fd);\n"
+    "  return nil;\n"
+    "}\n"
+    "def serve(n) {\n"
+    "  while (n > 0) { spawn(echo, accept(server)); n = n - 1; }\n"
+    "  return nil;\n"
+    "}\n"
+    "def client(rounds) {\n"
+    "  var fd = connect(port);\n"
+    "  while (rounds > 0) { write(fd, message); read(fd, 4096); "
+    "rounds = rounds - 1; }\n"
+    "  close(fd);\n"
+    "  return nil;\n"
+    "}\n"
+    "spawn(serve, connections);\n"
+    "var i = 0;\n"
+    "while (i < connections) { spawn(client, rounds); i = i + 1; }\n"
+    "runLoop();\n";
+
+static const char *sleepScript =
+    "def nap(ms) { sleep(ms); return nil; }\n"
+    "var i = 0;\n"
+    "while (i < sleepers) { spawn(nap, ms); i = i + 1; }\n"
+    "runLoop();\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double measure(const char *source) {
+  VM vm;
+  initVM(&vm);
+  double start = now();
+  if (interpret(&vm, source) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  double elapsed = now() - start;
+  freeVM(&vm);
+  return elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  // Each connection takes two descriptors
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  printf("%-12s %14s %10s\n", "connections", "round trips/s", "MB/s");
+  char source[4096];
+  for (size_t c = 0; c < sizeof(connections) / sizeof(connections[0]);
+       c++) {
+    int count = connections[c];
+    if ((rlim_t)count * 2 + 16 > limit.rlim_cur) {
+      printf("%-12d %14s\n", count, "fd limit");
+      continue;
+    }
+    int rounds = ROUND_TRIPS / count;
+    snprintf(source, sizeof(source),
+             "var connections = %d;\nvar rounds = %d;\n%s", count, rounds,
+             echoScript);
+    double elapsed = measure(source);
+    double trips = (double)rounds * count;
+    printf("%-12d %14.0f %10.1f\n", count, trips / elapsed,
+           trips * MESSAGE_SIZE * 2 / elapsed / (1024 * 1024));
+  }
+
+  snprintf(source, sizeof(source), "var sleepers = %d;\nvar ms = %d;\n%s",
+           SLEEPERS, SLEEP_MS, sleepScript);
+  double elapsed = measure(source);
+  printf("\n%d fibers sleeping %dms each: %.0fms\n", SLEEPERS, SLEEP_MS,
+         elapsed * 1000);
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../vm.h"
+
+// Compares compiling a small rule script on every evaluation with interpret()
+// against preparing it once and running it with sethiRun().
+
+#define RUNS 20000
+
+static const char *script =
+    "struct Order(id, total) { var id = id; var total = total; }\n"
+    "def discount(order) {\n"
+    "  if (order.total > 100) { return order.total / 10; }\n"
+    "  return 0;\n"
+    "}\n"
+    "var order = Order(7, 250);\n"
+    "var result = order.total - discount(order);\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double measureInterpret() {
+  VM vm;
+  initVM(&vm);
+  double start = now();
+  for (int i = 0; i < RUNS; i++) {
+    if (interpret(&vm, script) != INTERPRET_OK) {
+      fprintf(stderr, "script failed\n");
+      exit(1);
+    }
+  }
+  double elapsed = now() - start;
+  freeVM(&vm);
+  return elapsed;
+}
+
+static double measurePrepared() {
+  VM vm;
+  initVM(&vm);
+  double start = now();
+  Program *program = sethiPrepare(script);
+  if (program == NULL) {
+    fprintf(stderr, "script failed to compile\n");
+    exit(1);
+  }
+  for (int i = 0; i < RUNS; i++) {
+    if (sethiRun(&vm, program, 0, NULL, NULL) != INTERPRET_OK) {
+      fprintf(stderr, "script failed\n");
+      exit(1);
+    }
+  }
+  double elapsed = now() - start;
+  sethiFreeProgram(program);
+  freeVM(&vm);
+  return elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  double compiled = measureInterpret();
+  double prepared = measurePrepared();
+
+  printf("%-12s %12s %12s\n", "mode", "runs/sec", "us/run");
+  printf("%-12s %12.0f %12.2f\n", "interpret", RUNS / compiled,
+         compiled * 1e6 / RUNS);
+  printf("%-12s %12.0f %12.2f\n", "prepared", RUNS / prepared,
+         prepared * 1e6 / RUNS);
+  printf("speedup %.2fx\n", compiled / prepared);
+}
@@ -0,0 +1,101 @@
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../vm.h"
+
+// Measures what one more VM costs when many run the same prepared program:
+// the time to create one and run the program once in it, the heap it keeps
+// while alive, and how fresh VMs scale across threads.
+
+#define VMS 2000
+#define RUNS_PER_THREAD 2000
+
+static const char *script =
+    "struct Order(id, customer, total) { var id = id; var customer = customer;"
+    " var total = total; }\n"
+    "def discount(order) {\n"
+    "  if (order.customer == \"wholesale\") { return order.total / 5; }\n"
+    "  if (order.total > 100) { return order.total / 10; }\n"
+    "  return 0;\n"
+    "}\n"
+    "def label(order) {\n"
+    "  if (discount(order) > 0) { return \"discounted\"; }\n"
+    "  return \"full price\";\n"
+    "}\n"
+    "var order = Order(arg(0), \"wholesale\", 250);\n"
+    "var status = label(order);\n"
+    "return order.total - discount(order);\n";
+
+static Program *program;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void runOnce(VM *vm, int id) {
+  Value args[1] = {MAKE_NUM(id)};
+  Value result;
+  if (sethiRun(vm, program, 1, args, &result) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+}
+
+static void *worker(void *arg) {
+  for (int i = 0; i < RUNS_PER_THREAD; i++) {
+    VM vm;
+    initVM(&vm);
+    runOnce(&vm, i);
+    freeVM(&vm);
+  }
+  return NULL;
+}
+
+static double measureThreads(int threadCount) {
+  pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+  double start = now();
+  for (int i = 0; i < threadCount; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < threadCount; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now() - start;
+  free(threads);
+  return threadCount * RUNS_PER_THREAD / elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  int maxThreads =
+      argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  program = sethiPrepare(script);
+
+  // Warm up: a fresh VM and its first run
+  VM *vms = malloc(sizeof(VM) * VMS);
+  size_t before = mallinfo2().uordblks;
+  double start = now();
+  for (int i = 0; i < VMS; i++) {
+    initVM(&vms[i]);
+    runOnce(&vms[i], i);
+  }
+  double elapsed = now() - start;
+  size_t after = mallinfo2().uordblks;
+  for (int i = 0; i < VMS; i++) {
+    freeVM(&vms[i]);
+  }
+  free(vms);
+  printf("create and first run: %.2f us per VM\n", elapsed * 1e6 / VMS);
+  printf("heap kept per VM:     %zu bytes (plus %zu for the VM struct)\n",
+         (after - before) / VMS, sizeof(VM));
+
+  printf("\n%8s %12s\n", "threads", "runs/sec");
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    printf("%8d %12.0f\n", threads, measureThreads(threads));
+  }
+  sethiFreeProgram(program);
+}
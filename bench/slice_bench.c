@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../vm.h"
+
+// Measures the latency of short requests sharing one thread with long
+// running programs. A round robin scheduler gives each program with work left
+// one slice at a time; requests arrive at a fixed rate while a few hogs keep
+// the thread busy, each starting over as soon as it is done. Without a budget
+// every run goes to completion, so a request waits for whatever hogs are
+// ahead of it; with one, it waits a slice per hog at most.
+
+#define HOGS 3
+#define REQUESTS 300
+// Milliseconds between two requests arriving
+#define INTERVAL 2.0
+
+static const char *hogSource =
+    "def step(x) { return x + 1; }\n"
+    "var i = 0;\n"
+    "while (i < 1000000) { i = step(i); }\n"
+    "return i;\n";
+
+static const char *requestSource =
+    "var s = 0;\n"
+    "var i = 0;\n"
+    "while (i < 2000) { s = s + i; i = i + 1; }\n"
+    "return s;\n";
+
+typedef struct {
+  const char *name;
+  int64_t ticks;
+  int64_t micros;
+} Budget;
+
+typedef struct {
+  VM vm;
+  bool hog;
+  double arrived;
+} Job;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Runs the mix under budget and prints the request latencies, along with the
+// time one hog takes on its own when it is suspended every slice
+static void measure(Budget budget, Program *hog, Program *request) {
+  VM solo;
+  initVM(&solo);
+  solo.sliceTicks = budget.ticks;
+  solo.sliceMicros = budget.micros;
+  Value result;
+  double soloStart = now();
+  InterpretResult status = sethiRun(&solo, hog, 0, NULL, &result);
+  while (status == INTERPRET_SUSPENDED) {
+    status = sethiResume(&solo, &result);
+  }
+  double soloMs = (now() - soloStart) * 1000;
+  freeVM(&solo);
+
+  Job *jobs = (Job *)malloc((HOGS + REQUESTS) * sizeof(Job));
+  for (int i = 0; i < HOGS + REQUESTS; i++) {
+    initVM(&jobs[i].vm);
+    jobs[i].vm.sliceTicks = budget.ticks;
+    jobs[i].vm.sliceMicros = budget.micros;
+    jobs[i].hog = i < HOGS;
+  }
+  // Jobs waiting for a slice, oldest first
+  int queue[HOGS + REQUESTS];
+  int head = 0;
+  int length = 0;
+  double latencies[REQUESTS];
+  int served = 0;
+  int arrived = 0;
+
+  for (int i = 0; i < HOGS; i++) {
+    queue[length++] = i;
+  }
+  double start = now();
+  while (served < REQUESTS) {
+    double elapsed = (now() - start) * 1000;
+    while (arrived < REQUESTS && arrived * INTERVAL <= elapsed) {
+      jobs[HOGS + arrived].arrived = arrived * INTERVAL;
+      queue[(head + length++) % (HOGS + REQUESTS)] = HOGS + arrived;
+      arrived++;
+    }
+    int index = queue[head];
+    head = (head + 1) % (HOGS + REQUESTS);
+    length--;
+    // A job not left suspended starts its program over
+    Job *job = &jobs[index];
+    status =
+        job->vm.suspended
+            ? sethiResume(&job->vm, &result)
+            : sethiRun(&job->vm, job->hog ? hog : request, 0, NULL, &result);
+    if (job->hog || status == INTERPRET_SUSPENDED) {
+      queue[(head + length++) % (HOGS + REQUESTS)] = index;
+    } else {
+      latencies[served++] = (now() - start) * 1000 - job->arrived;
+    }
+  }
+  qsort(latencies, REQUESTS, sizeof(double), compareDoubles);
+  printf("%-12s %10.3f %10.3f %10.3f %12.1f\n", budget.name,
+         latencies[REQUESTS / 2], latencies[REQUESTS * 99 / 100],
+         latencies[REQUESTS - 1], soloMs);
+  for (int i = 0; i < HOGS + REQUESTS; i++) {
+    freeVM(&jobs[i].vm);
+  }
+  free(jobs);
+}
+
+int main(int argc, const char *argv[]) {
+  Program *hog = sethiPrepare(hogSource);
+  Program *request = sethiPrepare(requestSource);
+  if (hog == NULL || request == NULL) {
+    return 1;
+  }
+  Budget budgets[] = {
+      {"none", 0, 0},           {"1M ticks", 1000000, 0},
+      {"100k ticks", 100000, 0}, {"10k ticks", 10000, 0},
+      {"1k ticks", 1000, 0},     {"1 ms", 0, 1000},
+      {"100 us", 0, 100},
+  };
+  printf("%d hogs, a request every %.1f ms; latencies in ms\n", HOGS,
+         INTERVAL);
+  printf("%-12s %10s %10s %10s %12s\n", "budget", "p50", "p99", "max",
+         "hog alone");
+  for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+    measure(budgets[i], hog, request);
+  }
+  sethiFreeProgram(hog);
+  sethiFreeProgram(request);
+}
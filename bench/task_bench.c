@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../task.h"
+#include "../vm.h"
+
+// Sorts many independent lists with the insertion sort of file_test.sethi,
+// first in one VM and then spread over tasks for growing numbers of
+// workers. With nothing shared between tasks the speedup should follow the
+// number of cores.
+
+#define TASKS 64
+
+static const char *prelude =
+    "struct Cons(first, r) { var first = first; var rest = r; }\n"
+    "def insert(list, element) {\n"
+    "  if (list == nil) { return Cons(element, nil); }\n"
+    "  if (list.first < element) {\n"
+    "    return Cons(list.first, insert(list.rest, element));\n"
+    "  }\n"
+    "  return Cons(element, list);\n"
+    "}\n"
+    "def sort(list) {\n"
+    "  if (list == nil) { return list; }\n"
+    "  return insert(sort(list.rest), list.first);\n"
+    "}\n"
+    "def down(n) { var list = nil; var i = 0; "
+    "while (i < n) { list = Cons(i, list); i = i + 1; } return list; }\n"
+    "def work(seed) {\n"
+    "  var i = 0; var total = 0;\n"
+    "  while (i < 300) { total = total + sort(down(20)).first + seed; "
+    "i = i + 1; }\n"
+    "  return total;\n"
+    "}\n"
+    "var tasks = 64;\n";
+
+static const char *serial = "var i = 0; var total = 0;\n"
+                            "while (i < tasks) { total = total + work(i); "
+                            "i = i + 1; }\n";
+
+static const char *parallel =
+    "var pending = nil; var i = 0; var total = 0;\n"
+    "while (i < tasks) { pending = Cons(spawnTask(work, i), pending); "
+    "i = i + 1; }\n"
+    "while (!(pending == nil)) { total = total + join(pending.first); "
+    "pending = pending.rest; }\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double measure(const char *body) {
+  char source[4096];
+  snprintf(source, sizeof(source), "%s%s", prelude, body);
+  VM vm;
+  initVM(&vm);
+  double start = now();
+  if (interpret(&vm, source) != INTERPRET_OK) {
+    fprintf(stderr, "script failed\n");
+    exit(1);
+  }
+  double elapsed = now() - start;
+  freeVM(&vm);
+  return elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  int maxWorkers =
+      argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  double base = measure(serial);
+  printf("%8s %12s %9s %11s\n", "workers", "tasks/sec", "speedup",
+         "efficiency");
+  printf("%8s %12.1f %9.2f %11s\n", "serial", TASKS / base, 1.0, "");
+  for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+    startTaskPool(workers);
+    double elapsed = measure(parallel);
+    stopTaskPool();
+    printf("%8d %12.1f %9.2f %10.0f%%\n", workers, TASKS / elapsed,
+           base / elapsed, 100 * base / elapsed / workers);
+  }
+}
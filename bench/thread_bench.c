@@ -0,0 +1,62 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../vm.h"
+
+// Measures interpreter throughput with one independent VM per thread. With
+// no shared state the runs per second should grow linearly with threads.
+
+#define RUNS_PER_THREAD 20
+
+static const char *script =
+    "def fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }\n"
+    "var result = fib(20);\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg) {
+  for (int i = 0; i < RUNS_PER_THREAD; i++) {
+    VM vm;
+    initVM(&vm);
+    if (interpret(&vm, script) != INTERPRET_OK) {
+      fprintf(stderr, "script failed\n");
+      exit(1);
+    }
+    freeVM(&vm);
+  }
+  return NULL;
+}
+
+static double measure(int threadCount) {
+  pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+  double start = now();
+  for (int i = 0; i < threadCount; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < threadCount; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now() - start;
+  free(threads);
+  return threadCount * RUNS_PER_THREAD / elapsed;
+}
+
+int main(int argc, const char *argv[]) {
+  int maxThreads =
+      argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  printf("%8s %12s %9s %11s\n", "threads", "runs/sec", "speedup", "efficiency");
+  double base = measure(1);
+  printf("%8d %12.1f %9.2f %10.0f%%\n", 1, base, 1.0, 100.0);
+  for (int threads = 2; threads <= maxThreads; threads *= 2) {
+    double rate = measure(threads);
+    printf("%8d %12.1f %9.2f %10.0f%%\n", threads, rate, rate / base,
+           100 * rate / base / threads);
+  }
+}
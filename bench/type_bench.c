@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../perf.h"
+#include "../vm.h"
+
+// Measures what the checks type inference leaves out are worth. Each program
+// runs at -O1 twice: once written so its types are known from literals and
+// constructors, and once taking the same values as parameters, which could
+// be anything, so every instruction keeps its check. With --perf-counters,
+// also prints what the hardware counted per run of each.
+
+#define RUNS 5
+
+typedef struct {
+  const char *name;
+  const char *typed;
+  const char *untyped;
+} Workload;
+
+static const Workload workloads[] = {
+    {"arithmetic",
+     "def f(n) { var s = 0; var i = 0; var x = 3;\n"
+     "  while (i < 3000000) { s = s + x * 2 - 1; i = i + 1; } return s; }\n"
+     "var result = f(0);\n",
+     "def f(zero, one, x) { var s = zero; var i = zero;\n"
+     "  while (i < 3000000) { s = s + x * 2 - one; i = i + one; } return s; }\n"
+     "var result = f(0, 1, 3);\n"},
+    {"fields",
+     "struct P(x, y) { var x = x; var y = y; }\n"
+     "def make(x, y) { return P(x, y); }\n"
+     "def f(n) { var q = make(1, 2); var s = 0; var i = 0;\n"
+     "  while (i < 2000000) { s = s + q.x + q.y; i = i + 1; } return s; }\n"
+     "var result = f(0);\n",
+     "struct P(x, y) { var x = x; var y = y; }\n"
+     "def f(q, zero, one) { var s = zero; var i = zero;\n"
+     "  while (i < 2000000) { s = s + q.x + q.y; i = i + one; } return s; }\n"
+     "var result = f(P(1, 2), 0, 1);\n"},
+    {"calls",
+     "def inc(a, b) { if (a < b) { return a + 1; } return a; }\n"
+     "def f(n) { var g = inc; var i = 0;\n"
+     "  while (i < 1000000) { i = g(i, 1000000); } return i; }\n"
+     "var result = f(0);\n",
+     "def inc(a, b) { if (a < b) { return a + 1; } return a; }\n"
+     "def f(g, zero, n) { var i = zero;\n"
+     "  while (i < n) { i = g(i, n); } return i; }\n"
+     "var result = f(inc, 0, 1000000);\n"},
+};
+
+// Counts every run, if asked to
+static PerfCounters perf;
+static bool counting = false;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the fastest of a few runs of source at -O1, in milliseconds, and
+// sets counts to what was counted per run
+static double measure(const char *source, PerfCounts *counts) {
+  PerfCounts before = perf.total;
+  double best = 0;
+  for (int i = 0; i < RUNS; i++) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = 1;
+    vm.perf = counting ? &perf : NULL;
+    double start = now();
+    if (interpret(&vm, source) != INTERPRET_OK) {
+      fprintf(stderr, "script failed\n");
+      exit(1);
+    }
+    double elapsed = (now() - start) * 1000;
+    freeVM(&vm);
+    if (i == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    counts->counts[i] = (perf.total.counts[i] - before.counts[i]) / RUNS;
+  }
+  return best;
+}
+
+int main(int argc, const char *argv[]) {
+  int count = sizeof(workloads) / sizeof(workloads[0]);
+  PerfCounts counts[2 * count];
+  if (argc > 1 && strcmp(argv[1], "--perf-counters") == 0) {
+    counting = true;
+    if (openPerfCounters(&perf, false) == 0) {
+      fprintf(stderr, "Performance counters are not available.\n");
+    }
+  }
+  printf("%-12s %12s %12s %10s\n", "program", "checked ms", "proven ms",
+         "speedup");
+  for (int i = 0; i < count; i++) {
+    double untyped = measure(workloads[i].untyped, &counts[2 * i]);
+    double typed = measure(workloads[i].typed, &counts[2 * i + 1]);
+    printf("%-12s %12.1f %12.1f %9.2fx\n", workloads[i].name, untyped, typed,
+           untyped / typed);
+  }
+  if (!counting) {
+    return 0;
+  }
+  for (int i = 0; i < 2 * count; i++) {
+    printf("\n%s, %s, per run\n", workloads[i / 2].name,
+           i % 2 == 0 ? "checked" : "proven");
+    printPerfCounts(&perf, &counts[i], stdout);
+  }
+  closePerfCounters(&perf);
+}
@@ -0,0 +1,1205 @@
+#include "buffer.h"
+#include "memory.h"
+#include "value.h"
+#include "vm.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SETHI_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Kernels picked for this CPU when the natives are first defined
+static const BufferKernels *kernels;
+static pthread_once_t kernelsSelected = PTHREAD_ONCE_INIT;
+
+// ---- Scalar kernels ----
+
+static int64_t sum32Scalar(const int32_t *a, int32_t n) {
+  int64_t sum = 0;
+  for (int32_t i = 0; i < n; i++) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+static int64_t sum64Scalar(const int64_t *a, int32_t n) {
+  uint64_t sum = 0;
+  for (int32_t i = 0; i < n; i++) {
+    sum += (uint64_t)a[i];
+  }
+  return (int64_t)sum;
+}
+
+static int32_t min32Scalar(const int32_t *a, int32_t n) {
+  int32_t result = a[0];
+  for (int32_t i = 1; i < n; i++) {
+    result = a[i] < result ? a[i] : result;
+  }
+  return result;
+}
+
+static int32_t max32Scalar(const int32_t *a, int32_t n) {
+  int32_t result = a[0];
+  for (int32_t i = 1; i < n; i++) {
+    result = a[i] > result ? a[i] : result;
+  }
+  return result;
+}
+
+static int64_t min64Scalar(const int64_t *a, int32_t n) {
+  int64_t result = a[0];
+  for (int32_t i = 1; i < n; i++) {
+    result = a[i] < result ? a[i] : result;
+  }
+  return result;
+}
+
+static int64_t max64Scalar(const int64_t *a, int32_t n) {
+  int64_t result = a[0];
+  for (int32_t i = 1; i < n; i++) {
+    result = a[i] > result ? a[i] : result;
+  }
+  return result;
+}
+
+static void add32Scalar(const int32_t *a, const int32_t *b, int32_t *out,
+                        int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    out[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+  }
+}
+
+static void add64Scalar(const int64_t *a, const int64_t *b, int64_t *out,
+                        int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    out[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+  }
+}
+
+static void mul32Scalar(const int32_t *a, const int32_t *b, int32_t *out,
+                        int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    out[i] = (int32_t)((uint32_t)a[i] * (uint32_t)b[i]);
+  }
+}
+
+static void mul64Scalar(const int64_t *a, const int64_t *b, int64_t *out,
+                        int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    out[i] = (int64_t)((uint64_t)a[i] * (uint64_t)b[i]);
+  }
+}
+
+static void scale32Scalar(const int32_t *a, int32_t k, int32_t *out,
+                          int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    out[i] = (int32_t)((uint32_t)a[i] * (uint32_t)k);
+  }
+}
+
+static void scale64Scalar(const int64_t *a, int64_t k, int64_t *out,
+                          int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    out[i] = (int64_t)((uint64_t)a[i] * (uint64_t)k);
+  }
+}
+
+static int64_t dot32Scalar(const int32_t *a, const int32_t *b, int32_t n) {
+  uint64_t sum = 0;
+  for (int32_t i = 0; i < n; i++) {
+    sum += (uint64_t)((int64_t)a[i] * b[i]);
+  }
+  return (int64_t)sum;
+}
+
+static int64_t dot64Scalar(const int64_t *a, const int64_t *b, int32_t n) {
+  uint64_t sum = 0;
+  for (int32_t i = 0; i < n; i++) {
+    sum += (uint64_t)a[i] * (uint64_t)b[i];
+  }
+  return (int64_t)sum;
+}
+
+// Writes every element and only advances past the kept ones so the loop has
+// no data dependent branch
+static int32_t filter32Scalar(const int32_t *a, const int32_t *mask,
+                              int32_t *out, int32_t n) {
+  int32_t count = 0;
+  for (int32_t i = 0; i < n; i++) {
+    out[count] = a[i];
+    count += mask[i] != 0;
+  }
+  return count;
+}
+
+static int32_t filter64Scalar(const int64_t *a, const int32_t *mask,
+                              int64_t *out, int32_t n) {
+  int32_t count = 0;
+  for (int32_t i = 0; i < n; i++) {
+    out[count] = a[i];
+    count += mask[i] != 0;
+  }
+  return count;
+}
+
+static void prefix32Scalar(const int32_t *a, int32_t *out, int32_t n) {
+  uint32_t running = 0;
+  for (int32_t i = 0; i < n; i++) {
+    running += (uint32_t)a[i];
+    out[i] = (int32_t)running;
+  }
+}
+
+static void prefix64Scalar(const int64_t *a, int64_t *out, int32_t n) {
+  uint64_t running = 0;
+  for (int32_t i = 0; i < n; i++) {
+    running += (uint64_t)a[i];
+    out[i] = (int64_t)running;
+  }
+}
+
+static void greater32Scalar(const int32_t *a, int32_t k, int32_t *mask,
+                            int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    mask[i] = a[i] > k;
+  }
+}
+
+static void greater64Scalar(const int64_t *a, int64_t k, int32_t *mask,
+                            int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    mask[i] = a[i] > k;
+  }
+}
+
+static void less32Scalar(const int32_t *a, int32_t k, int32_t *mask,
+                         int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    mask[i] = a[i] < k;
+  }
+}
+
+static void less64Scalar(const int64_t *a, int64_t k, int32_t *mask,
+                         int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    mask[i] = a[i] < k;
+  }
+}
+
+static const BufferKernels scalarKernels = {
+    .name = "scalar",
+    .sum32 = sum32Scalar,
+    .sum64 = sum64Scalar,
+    .min32 = min32Scalar,
+    .max32 = max32Scalar,
+    .min64 = min64Scalar,
+    .max64 = max64Scalar,
+    .add32 = add32Scalar,
+    .add64 = add64Scalar,
+    .mul32 = mul32Scalar,
+    .mul64 = mul64Scalar,
+    .scale32 = scale32Scalar,
+    .scale64 = scale64Scalar,
+    .dot32 = dot32Scalar,
+    .dot64 = dot64Scalar,
+    .filter32 = filter32Scalar,
+    .filter64 = filter64Scalar,
+    .prefix32 = prefix32Scalar,
+    .prefix64 = prefix64Scalar,
+    .greater32 = greater32Scalar,
+    .greater64 = greater64Scalar,
+    .less32 = less32Scalar,
+    .less64 = less64Scalar,
+};
+
+#ifdef SETHI_X86_SIMD
+
+// ---- SSE4.1 kernels (4 x int32 / 2 x int64 lanes) ----
+
+#define SSE4 __attribute__((target("sse4.1")))
+#define LOAD128(ptr) _mm_loadu_si128((const __m128i *)(ptr))
+#define STORE128(ptr, v) _mm_storeu_si128((__m128i *)(ptr), v)
+
+SSE4 static int64_t sum32Sse4(const int32_t *a, int32_t n) {
+  __m128i acc = _mm_setzero_si128();
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = LOAD128(a + i);
+    acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(v));
+    acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+  }
+  int64_t lanes[2];
+  STORE128(lanes, acc);
+  int64_t sum = lanes[0] + lanes[1];
+  for (; i < n; i++) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+SSE4 static int64_t sum64Sse4(const int64_t *a, int32_t n) {
+  __m128i acc = _mm_setzero_si128();
+  int32_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    acc = _mm_add_epi64(acc, LOAD128(a + i));
+  }
+  uint64_t lanes[2];
+  STORE128(lanes, acc);
+  uint64_t sum = lanes[0] + lanes[1];
+  for (; i < n; i++) {
+    sum += (uint64_t)a[i];
+  }
+  return (int64_t)sum;
+}
+
+SSE4 static int32_t min32Sse4(const int32_t *a, int32_t n) {
+  int32_t result = a[0];
+  int32_t i = 0;
+  if (n >= 4) {
+    __m128i acc = LOAD128(a);
+    for (i = 4; i + 4 <= n; i += 4) {
+      acc = _mm_min_epi32(acc, LOAD128(a + i));
+    }
+    int32_t lanes[4];
+    STORE128(lanes, acc);
+    result = min32Scalar(lanes, 4);
+  }
+  for (; i < n; i++) {
+    result = a[i] < result ? a[i] : result;
+  }
+  return result;
+}
+
+SSE4 static int32_t max32Sse4(const int32_t *a, int32_t n) {
+  int32_t result = a[0];
+  int32_t i = 0;
+  if (n >= 4) {
+    __m128i acc = LOAD128(a);
+    for (i = 4; i + 4 <= n; i += 4) {
+      acc = _mm_max_epi32(acc, LOAD128(a + i));
+    }
+    int32_t lanes[4];
+    STORE128(lanes, acc);
+    result = max32Scalar(lanes, 4);
+  }
+  for (; i < n; i++) {
+    result = a[i] > result ? a[i] : result;
+  }
+  return result;
+}
+
+SSE4 static void add32Sse4(const int32_t *a, const int32_t *b, int32_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    STORE128(out + i, _mm_add_epi32(LOAD128(a + i), LOAD128(b + i)));
+  }
+  add32Scalar(a + i, b + i, out + i, n - i);
+}
+
+SSE4 static void add64Sse4(const int64_t *a, const int64_t *b, int64_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    STORE128(out + i, _mm_add_epi64(LOAD128(a + i), LOAD128(b + i)));
+  }
+  add64Scalar(a + i, b + i, out + i, n - i);
+}
+
+SSE4 static void mul32Sse4(const int32_t *a, const int32_t *b, int32_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    STORE128(out + i, _mm_mullo_epi32(LOAD128(a + i), LOAD128(b + i)));
+  }
+  mul32Scalar(a + i, b + i, out + i, n - i);
+}
+
+SSE4 static void scale32Sse4(const int32_t *a, int32_t k, int32_t *out,
+                             int32_t n) {
+  __m128i kv = _mm_set1_epi32(k);
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    STORE128(out + i, _mm_mullo_epi32(LOAD128(a + i), kv));
+  }
+  scale32Scalar(a + i, k, out + i, n - i);
+}
+
+// _mm_mul_epi32 multiplies the even lanes into 64 bit products, so the odd
+// lanes are shifted down and multiplied separately
+SSE4 static int64_t dot32Sse4(const int32_t *a, const int32_t *b, int32_t n) {
+  __m128i acc = _mm_setzero_si128();
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i va = LOAD128(a + i);
+    __m128i vb = LOAD128(b + i);
+    acc = _mm_add_epi64(acc, _mm_mul_epi32(va, vb));
+    acc = _mm_add_epi64(acc, _mm_mul_epi32(_mm_srli_epi64(va, 32),
+                                           _mm_srli_epi64(vb, 32)));
+  }
+  uint64_t lanes[2];
+  STORE128(lanes, acc);
+  return (int64_t)(lanes[0] + lanes[1] +
+                   (uint64_t)dot32Scalar(a + i, b + i, n - i));
+}
+
+SSE4 static void prefix32Sse4(const int32_t *a, int32_t *out, int32_t n) {
+  __m128i carry = _mm_setzero_si128();
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i x = LOAD128(a + i);
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi32(x, carry);
+    STORE128(out + i, x);
+    carry = _mm_shuffle_epi32(x, 0xFF);
+  }
+  uint32_t running = i > 0 ? (uint32_t)out[i - 1] : 0;
+  for (; i < n; i++) {
+    running += (uint32_t)a[i];
+    out[i] = (int32_t)running;
+  }
+}
+
+SSE4 static void greater32Sse4(const int32_t *a, int32_t k, int32_t *mask,
+                               int32_t n) {
+  __m128i kv = _mm_set1_epi32(k);
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i m = _mm_cmpgt_epi32(LOAD128(a + i), kv);
+    STORE128(mask + i, _mm_srli_epi32(m, 31));
+  }
+  greater32Scalar(a + i, k, mask + i, n - i);
+}
+
+SSE4 static void less32Sse4(const int32_t *a, int32_t k, int32_t *mask,
+                            int32_t n) {
+  __m128i kv = _mm_set1_epi32(k);
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i m = _mm_cmpgt_epi32(kv, LOAD128(a + i));
+    STORE128(mask + i, _mm_srli_epi32(m, 31));
+  }
+  less32Scalar(a + i, k, mask + i, n - i);
+}
+
+static const BufferKernels sse4Kernels = {
+    .name = "sse4.1",
+    .sum32 = sum32Sse4,
+    .sum64 = sum64Sse4,
+    .min32 = min32Sse4,
+    .max32 = max32Sse4,
+    .min64 = min64Scalar,
+    .max64 = max64Scalar,
+    .add32 = add32Sse4,
+    .add64 = add64Sse4,
+    .mul32 = mul32Sse4,
+    .mul64 = mul64Scalar,
+    .scale32 = scale32Sse4,
+    .scale64 = scale64Scalar,
+    .dot32 = dot32Sse4,
+    .dot64 = dot64Scalar,
+    .filter32 = filter32Scalar,
+    .filter64 = filter64Scalar,
+    .prefix32 = prefix32Sse4,
+    .prefix64 = prefix64Scalar,
+    .greater32 = greater32Sse4,
+    .greater64 = greater64Scalar,
+    .less32 = less32Sse4,
+    .less64 = less64Scalar,
+};
+
+// ---- AVX2 kernels (8 x int32 / 4 x int64 lanes) ----
+
+#define AVX2 __attribute__((target("avx2")))
+#define LOAD256(ptr) _mm256_loadu_si256((const __m256i *)(ptr))
+#define STORE256(ptr, v) _mm256_storeu_si256((__m256i *)(ptr), v)
+
+// Lane indices that pack the kept lanes of an 8 bit keep mask to the front
+static int32_t filterPermutations[256][8];
+static pthread_once_t filterPermutationsBuilt = PTHREAD_ONCE_INIT;
+
+static void buildFilterPermutations() {
+  for (int bits = 0; bits < 256; bits++) {
+    int count = 0;
+    for (int lane = 0; lane < 8; lane++) {
+      if (bits & (1 << lane)) {
+        filterPermutations[bits][count++] = lane;
+      }
+    }
+    while (count < 8) {
+      filterPermutations[bits][count++] = 0;
+    }
+  }
+}
+
+// AVX2 has no 64 bit low multiply, so it is built from 32 bit halves
+AVX2 static inline __m256i mullo64(__m256i a, __m256i b) {
+  __m256i low = _mm256_mul_epu32(a, b);
+  __m256i cross =
+      _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                       _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static int64_t sum32Avx2(const int32_t *a, int32_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(LOAD128(a + i)));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(LOAD128(a + i + 4)));
+  }
+  int64_t lanes[4];
+  STORE256(lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum32Scalar(a + i, n - i);
+}
+
+AVX2 static int64_t sum64Avx2(const int64_t *a, int32_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_epi64(acc, LOAD256(a + i));
+  }
+  uint64_t lanes[4];
+  STORE256(lanes, acc);
+  return (int64_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                   (uint64_t)sum64Scalar(a + i, n - i));
+}
+
+AVX2 static int32_t min32Avx2(const int32_t *a, int32_t n) {
+  if (n < 8) {
+    return min32Scalar(a, n);
+  }
+  __m256i acc = LOAD256(a);
+  int32_t i = 8;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_min_epi32(acc, LOAD256(a + i));
+  }
+  int32_t lanes[8];
+  STORE256(lanes, acc);
+  int32_t result = min32Scalar(lanes, 8);
+  for (; i < n; i++) {
+    result = a[i] < result ? a[i] : result;
+  }
+  return result;
+}
+
+AVX2 static int32_t max32Avx2(const int32_t *a, int32_t n) {
+  if (n < 8) {
+    return max32Scalar(a, n);
+  }
+  __m256i acc = LOAD256(a);
+  int32_t i = 8;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_max_epi32(acc, LOAD256(a + i));
+  }
+  int32_t lanes[8];
+  STORE256(lanes, acc);
+  int32_t result = max32Scalar(lanes, 8);
+  for (; i < n; i++) {
+    result = a[i] > result ? a[i] : result;
+  }
+  return result;
+}
+
+AVX2 static int64_t min64Avx2(const int64_t *a, int32_t n) {
+  if (n < 4) {
+    return min64Scalar(a, n);
+  }
+  __m256i acc = LOAD256(a);
+  int32_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = LOAD256(a + i);
+    acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(acc, v));
+  }
+  int64_t lanes[4];
+  STORE256(lanes, acc);
+  int64_t result = min64Scalar(lanes, 4);
+  for (; i < n; i++) {
+    result = a[i] < result ? a[i] : result;
+  }
+  return result;
+}
+
+AVX2 static int64_t max64Avx2(const int64_t *a, int32_t n) {
+  if (n < 4) {
+    return max64Scalar(a, n);
+  }
+  __m256i acc = LOAD256(a);
+  int32_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = LOAD256(a + i);
+    acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(v, acc));
+  }
+  int64_t lanes[4];
+  STORE256(lanes, acc);
+  int64_t result = max64Scalar(lanes, 4);
+  for (; i < n; i++) {
+    result = a[i] > result ? a[i] : result;
+  }
+  return result;
+}
+
+AVX2 static void add32Avx2(const int32_t *a, const int32_t *b, int32_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    STORE256(out + i, _mm256_add_epi32(LOAD256(a + i), LOAD256(b + i)));
+  }
+  add32Scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void add64Avx2(const int64_t *a, const int64_t *b, int64_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    STORE256(out + i, _mm256_add_epi64(LOAD256(a + i), LOAD256(b + i)));
+  }
+  add64Scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void mul32Avx2(const int32_t *a, const int32_t *b, int32_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    STORE256(out + i, _mm256_mullo_epi32(LOAD256(a + i), LOAD256(b + i)));
+  }
+  mul32Scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void mul64Avx2(const int64_t *a, const int64_t *b, int64_t *out,
+                           int32_t n) {
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    STORE256(out + i, mullo64(LOAD256(a + i), LOAD256(b + i)));
+  }
+  mul64Scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void scale32Avx2(const int32_t *a, int32_t k, int32_t *out,
+                             int32_t n) {
+  __m256i kv = _mm256_set1_epi32(k);
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    STORE256(out + i, _mm256_mullo_epi32(LOAD256(a + i), kv));
+  }
+  scale32Scalar(a + i, k, out + i, n - i);
+}
+
+AVX2 static void scale64Avx2(const int64_t *a, int64_t k, int64_t *out,
+                             int32_t n) {
+  __m256i kv = _mm256_set1_epi64x(k);
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    STORE256(out + i, mullo64(LOAD256(a + i), kv));
+  }
+  scale64Scalar(a + i, k, out + i, n - i);
+}
+
+AVX2 static int64_t dot32Avx2(const int32_t *a, const int32_t *b, int32_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i va = LOAD256(a + i);
+    __m256i vb = LOAD256(b + i);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(va, vb));
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_srli_epi64(va, 32),
+                                                 _mm256_srli_epi64(vb, 32)));
+  }
+  uint64_t lanes[4];
+  STORE256(lanes, acc);
+  return (int64_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                   (uint64_t)dot32Scalar(a + i, b + i, n - i));
+}
+
+AVX2 static int64_t dot64Avx2(const int64_t *a, const int64_t *b, int32_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_epi64(acc, mullo64(LOAD256(a + i), LOAD256(b + i)));
+  }
+  uint64_t lanes[4];
+  STORE256(lanes, acc);
+  return (int64_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                   (uint64_t)dot64Scalar(a + i, b + i, n - i));
+}
+
+// Packs the kept lanes of each block to the front with a lane permutation.
+// The full 8 lane store is safe because out never runs ahead of the input.
+AVX2 static int32_t filter32Avx2(const int32_t *a, const int32_t *mask,
+                                 int32_t *out, int32_t n) {
+  __m256i zero = _mm256_setzero_si256();
+  int32_t count = 0;
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i dropped = _mm256_cmpeq_epi32(LOAD256(mask + i), zero);
+    int bits = _mm256_movemask_ps(_mm256_castsi256_ps(dropped)) ^ 0xFF;
+    __m256i lanes = LOAD256(filterPermutations[bits]);
+    STORE256(out + count, _mm256_permutevar8x32_epi32(LOAD256(a + i), lanes));
+    count += __builtin_popcount(bits);
+  }
+  return count + filter32Scalar(a + i, mask + i, out + count, n - i);
+}
+
+// Scans within each 128 bit half, then carries the low half's total into the
+// high half and the running total into both
+AVX2 static void prefix32Avx2(const int32_t *a, int32_t *out, int32_t n) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i carry = zero;
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = LOAD256(a + i);
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i low = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(3));
+    x = _mm256_add_epi32(x, _mm256_blend_epi32(zero, low, 0xF0));
+    x = _mm256_add_epi32(x, carry);
+    STORE256(out + i, x);
+    carry = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7));
+  }
+  uint32_t running = i > 0 ? (uint32_t)out[i - 1] : 0;
+  for (; i < n; i++) {
+    running += (uint32_t)a[i];
+    out[i] = (int32_t)running;
+  }
+}
+
+AVX2 static void prefix64Avx2(const int64_t *a, int64_t *out, int32_t n) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i carry = zero;
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = LOAD256(a + i);
+    x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+    __m256i low = _mm256_permute4x64_epi64(x, 0x55);
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(zero, low, 0xF0));
+    x = _mm256_add_epi64(x, carry);
+    STORE256(out + i, x);
+    carry = _mm256_permute4x64_epi64(x, 0xFF);
+  }
+  uint64_t running = i > 0 ? (uint64_t)out[i - 1] : 0;
+  for (; i < n; i++) {
+    running += (uint64_t)a[i];
+    out[i] = (int64_t)running;
+  }
+}
+
+AVX2 static void greater32Avx2(const int32_t *a, int32_t k, int32_t *mask,
+                               int32_t n) {
+  __m256i kv = _mm256_set1_epi32(k);
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i m = _mm256_cmpgt_epi32(LOAD256(a + i), kv);
+    STORE256(mask + i, _mm256_srli_epi32(m, 31));
+  }
+  greater32Scalar(a + i, k, mask + i, n - i);
+}
+
+AVX2 static void less32Avx2(const int32_t *a, int32_t k, int32_t *mask,
+                            int32_t n) {
+  __m256i kv = _mm256_set1_epi32(k);
+  int32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i m = _mm256_cmpgt_epi32(kv, LOAD256(a + i));
+    STORE256(mask + i, _mm256_srli_epi32(m, 31));
+  }
+  less32Scalar(a + i, k, mask + i, n - i);
+}
+
+// The 64 bit comparison results are narrowed to one int32 per lane
+AVX2 static void greater64Avx2(const int64_t *a, int64_t k, int32_t *mask,
+                               int32_t n) {
+  __m256i kv = _mm256_set1_epi64x(k);
+  __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i m = _mm256_cmpgt_epi64(LOAD256(a + i), kv);
+    __m128i packed =
+        _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(m, evens));
+    STORE128(mask + i, _mm_srli_epi32(packed, 31));
+  }
+  greater64Scalar(a + i, k, mask + i, n - i);
+}
+
+AVX2 static void less64Avx2(const int64_t *a, int64_t k, int32_t *mask,
+                            int32_t n) {
+  __m256i kv = _mm256_set1_epi64x(k);
+  __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+  int32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i m = _mm256_cmpgt_epi64(kv, LOAD256(a + i));
+    __m128i packed =
+        _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(m, evens));
+    STORE128(mask + i, _mm_srli_epi32(packed, 31));
+  }
+  less64Scalar(a + i, k, mask + i, n - i);
+}
+
+static const BufferKernels avx2Kernels = {
+    .name = "avx2",
+    .sum32 = sum32Avx2,
+    .sum64 = sum64Avx2,
+    .min32 = min32Avx2,
+    .max32 = max32Avx2,
+    .min64 = min64Avx2,
+    .max64 = max64Avx2,
+    .add32 = add32Avx2,
+    .add64 = add64Avx2,
+    .mul32 = mul32Avx2,
+    .mul64 = mul64Avx2,
+    .scale32 = scale32Avx2,
+    .scale64 = scale64Avx2,
+    .dot32 = dot32Avx2,
+    .dot64 = dot64Avx2,
+    .filter32 = filter32Avx2,
+    .filter64 = filter64Scalar,
+    .prefix32 = prefix32Avx2,
+    .prefix64 = prefix64Avx2,
+    .greater32 = greater32Avx2,
+    .greater64 = greater64Avx2,
+    .less32 = less32Avx2,
+    .less64 = less64Avx2,
+};
+
+#endif
+
+// Returns the kernels for the given level, or NULL if they were not compiled
+// for this architecture. Does not check that the cpu supports them.
+const BufferKernels *kernelsForLevel(SimdLevel level) {
+  switch (level) {
+  case SIMD_SCALAR:
+    return &scalarKernels;
+#ifdef SETHI_X86_SIMD
+  case SIMD_SSE4:
+    return &sse4Kernels;
+  case SIMD_AVX2:
+    pthread_once(&filterPermutationsBuilt, buildFilterPermutations);
+    return &avx2Kernels;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+// Returns the best level the cpu supports. The SETHI_SIMD environment
+// variable ("scalar" or "sse4") can lower it, e.g. to compare kernels.
+SimdLevel detectSimdLevel() {
+  SimdLevel level = SIMD_SCALAR;
+#ifdef SETHI_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    level = SIMD_AVX2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    level = SIMD_SSE4;
+  }
+#endif
+  const char *cap = getenv("SETHI_SIMD");
+  if (cap != NULL) {
+    if (strcmp(cap, "scalar") == 0) {
+      level = SIMD_SCALAR;
+    } else if (strcmp(cap, "sse4") == 0 && level > SIMD_SSE4) {
+      level = SIMD_SSE4;
+    }
+  }
+  return level;
+}
+
+// Returns the bytes allocated for the elements of a buffer. An empty buffer
+// still has room for one.
+size_t bufferDataSize(BufferKind kind, int32_t length) {
+  size_t elementSize = kind == BUFFER_INT32 ? sizeof(int32_t) : sizeof(int64_t);
+  return (length > 0 ? length : 1) * elementSize;
+}
+
+// Creates a zero filled ObjBuffer on the heap
+ObjBuffer *createBuffer(VM *vm, BufferKind kind, int32_t length) {
+  ObjBuffer *output = (ObjBuffer *)allocate(MEMORY_OBJECTS, sizeof(ObjBuffer));
+  void *data = allocateZeroed(MEMORY_OBJECTS, bufferDataSize(kind, length));
+
+  ((Obj *)output)->type = OBJ_BUFFER;
+  output->kind = kind;
+  output->length = length;
+  output->data = data;
+  trackObject(vm, &output->obj);
+
+  return output;
+}
+
+// ---- Natives ----
+
+#define AS_INT32(buffer) ((int32_t *)(buffer)->data)
+#define AS_INT64(buffer) ((int64_t *)(buffer)->data)
+
+// Reads argument index as a buffer. Raises a runtime error if it is not one.
+static bool bufferArg(VM *vm, Value *args, int index, ObjBuffer **out) {
+  if (!isObjectOfType(args[index], OBJ_BUFFER)) {
+    runtimeError(vm, "Argument %d must be a Buffer, got %s", index + 1,
+                 typeName(args[index]));
+    return false;
+  }
+  *out = (ObjBuffer *)args[index].as.obj;
+  return true;
+}
+
+static bool numberArg(VM *vm, Value *args, int index, int *out) {
+  if (!IS_NUM(args[index])) {
+    runtimeError(vm, "Argument %d must be a Number, got %s", index + 1,
+                 typeName(args[index]));
+    return false;
+  }
+  *out = args[index].as.number;
+  return true;
+}
+
+static bool sameShape(VM *vm, ObjBuffer *a, ObjBuffer *b) {
+  if (a->kind != b->kind || a->length != b->length) {
+    runtimeError(vm, "Buffers must have the same kind and length");
+    return false;
+  }
+  return true;
+}
+
+// Numbers are ints, so 64 bit results are range checked
+static bool toNumber(VM *vm, int64_t value, Value *result) {
+  if (value < INT_MIN || value > INT_MAX) {
+    runtimeError(vm, "Result %lld does not fit in a Number", (long long)value);
+    return false;
+  }
+  *result = MAKE_NUM((int)value);
+  return true;
+}
+
+static bool newBuffer(VM *vm, BufferKind kind, Value *args, Value *result) {
+  int length;
+  if (!numberArg(vm, args, 0, &length)) {
+    return false;
+  }
+  if (length < 0) {
+    runtimeError(vm, "Buffer length cannot be negative");
+    return false;
+  }
+  if (!reserveMemory(vm, sizeof(ObjBuffer) + bufferDataSize(kind, length))) {
+    return false;
+  }
+  *result = MAKE_OBJ((Obj *)createBuffer(vm, kind, length));
+  return true;
+}
+
+static bool int32BufferNative(VM *vm, int argCount, Value *args,
+                              Value *result) {
+  return newBuffer(vm, BUFFER_INT32, args, result);
+}
+
+static bool int64BufferNative(VM *vm, int argCount, Value *args,
+                              Value *result) {
+  return newBuffer(vm, BUFFER_INT64, args, result);
+}
+
+static bool bufLengthNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *buffer;
+  if (!bufferArg(vm, args, 0, &buffer)) {
+    return false;
+  }
+  *result = MAKE_NUM(buffer->length);
+  return true;
+}
+
+static bool indexArg(VM *vm, Value *args, int index, ObjBuffer *buffer,
+                     int *out) {
+  if (!numberArg(vm, args, index, out)) {
+    return false;
+  }
+  if (*out < 0 || *out >= buffer->length) {
+    runtimeError(vm, "Index %d out of bounds for buffer of length %d", *out,
+                 buffer->length);
+    return false;
+  }
+  return true;
+}
+
+static bool bufGetNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *buffer;
+  int index;
+  if (!bufferArg(vm, args, 0, &buffer) ||
+      !indexArg(vm, args, 1, buffer, &index)) {
+    return false;
+  }
+  if (buffer->kind == BUFFER_INT32) {
+    *result = MAKE_NUM(AS_INT32(buffer)[index]);
+    return true;
+  }
+  return toNumber(vm, AS_INT64(buffer)[index], result);
+}
+
+static bool bufSetNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *buffer;
+  int index;
+  int value;
+  if (!bufferArg(vm, args, 0, &buffer) ||
+      !indexArg(vm, args, 1, buffer, &index) ||
+      !numberArg(vm, args, 2, &value)) {
+    return false;
+  }
+  if (buffer->kind == BUFFER_INT32) {
+    AS_INT32(buffer)[index] = value;
+  } else {
+    AS_INT64(buffer)[index] = value;
+  }
+  *result = args[2];
+  return true;
+}
+
+// Fills the buffer with start, start + step, start + 2 * step, ...
+static bool bufRangeNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *buffer;
+  int start;
+  int step;
+  if (!bufferArg(vm, args, 0, &buffer) || !numberArg(vm, args, 1, &start) ||
+      !numberArg(vm, args, 2, &step)) {
+    return false;
+  }
+  uint64_t value = (uint64_t)(int64_t)start;
+  for (int32_t i = 0; i < buffer->length; i++) {
+    if (buffer->kind == BUFFER_INT32) {
+      AS_INT32(buffer)[i] = (int32_t)value;
+    } else {
+      AS_INT64(buffer)[i] = (int64_t)value;
+    }
+    value += (uint64_t)(int64_t)step;
+  }
+  *result = args[0];
+  return true;
+}
+
+static bool bufFillNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *buffer;
+  int value;
+  if (!bufferArg(vm, args, 0, &buffer) || !numberArg(vm, args, 1, &value)) {
+    return false;
+  }
+  for (int32_t i = 0; i < buffer->length; i++) {
+    if (buffer->kind == BUFFER_INT32) {
+      AS_INT32(buffer)[i] = value;
+    } else {
+      AS_INT64(buffer)[i] = value;
+    }
+  }
+  *result = args[0];
+  return true;
+}
+
+static bool bufSumNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *buffer;
+  if (!bufferArg(vm, args, 0, &buffer)) {
+    return false;
+  }
+  int64_t sum = buffer->kind == BUFFER_INT32
+                    ? kernels->sum32(AS_INT32(buffer), buffer->length)
+                    : kernels->sum64(AS_INT64(buffer), buffer->length);
+  return toNumber(vm, sum, result);
+}
+
+static bool extremum(VM *vm, Value *args, Value *result, bool max) {
+  ObjBuffer *buffer;
+  if (!bufferArg(vm, args, 0, &buffer)) {
+    return false;
+  }
+  if (buffer->length == 0) {
+    runtimeError(vm, "Cannot take the %s of an empty buffer",
+                 max ? "max" : "min");
+    return false;
+  }
+  int32_t n = buffer->length;
+  if (buffer->kind == BUFFER_INT32) {
+    int32_t *data = AS_INT32(buffer);
+    *result = MAKE_NUM(max ? kernels->max32(data, n) : kernels->min32(data, n));
+    return true;
+  }
+  int64_t *data = AS_INT64(buffer);
+  return toNumber(vm, max ? kernels->max64(data, n) : kernels->min64(data, n),
+                  result);
+}
+
+static bool bufMinNative(VM *vm, int argCount, Value *args, Value *result) {
+  return extremum(vm, args, result, false);
+}
+
+static bool bufMaxNative(VM *vm, int argCount, Value *args, Value *result) {
+  return extremum(vm, args, result, true);
+}
+
+// Applies an elementwise kernel to two buffers of the same shape, writing
+// the result to a new buffer
+static bool elementwise(VM *vm, Value *args, Value *result, bool multiply) {
+  ObjBuffer *a;
+  ObjBuffer *b;
+  if (!bufferArg(vm, args, 0, &a) || !bufferArg(vm, args, 1, &b) ||
+      !sameShape(vm, a, b)) {
+    return false;
+  }
+  if (!reserveMemory(vm,
+                     sizeof(ObjBuffer) + bufferDataSize(a->kind, a->length))) {
+    return false;
+  }
+  ObjBuffer *out = createBuffer(vm, a->kind, a->length);
+  if (a->kind == BUFFER_INT32) {
+    (multiply ? kernels->mul32 : kernels->add32)(AS_INT32(a), AS_INT32(b),
+                                                 AS_INT32(out), a->length);
+  } else {
+    (multiply ? kernels->mul64 : kernels->add64)(AS_INT64(a), AS_INT64(b),
+                                                 AS_INT64(out), a->length);
+  }
+  *result = MAKE_OBJ((Obj *)out);
+  return true;
+}
+
+static bool bufAddNative(VM *vm, int argCount, Value *args, Value *result) {
+  return elementwise(vm, args, result, false);
+}
+
+static bool bufMulNative(VM *vm, int argCount, Value *args, Value *result) {
+  return elementwise(vm, args, result, true);
+}
+
+static bool bufScaleNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *a;
+  int k;
+  if (!bufferArg(vm, args, 0, &a) || !numberArg(vm, args, 1, &k)) {
+    return false;
+  }
+  if (!reserveMemory(vm,
+                     sizeof(ObjBuffer) + bufferDataSize(a->kind, a->length))) {
+    return false;
+  }
+  ObjBuffer *out = createBuffer(vm, a->kind, a->length);
+  if (a->kind == BUFFER_INT32) {
+    kernels->scale32(AS_INT32(a), k, AS_INT32(out), a->length);
+  } else {
+    kernels->scale64(AS_INT64(a), k, AS_INT64(out), a->length);
+  }
+  *result = MAKE_OBJ((Obj *)out);
+  return true;
+}
+
+static bool bufDotNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *a;
+  ObjBuffer *b;
+  if (!bufferArg(vm, args, 0, &a) || !bufferArg(vm, args, 1, &b) ||
+      !sameShape(vm, a, b)) {
+    return false;
+  }
+  int64_t dot = a->kind == BUFFER_INT32
+                    ? kernels->dot32(AS_INT32(a), AS_INT32(b), a->length)
+                    : kernels->dot64(AS_INT64(a), AS_INT64(b), a->length);
+  return toNumber(vm, dot, result);
+}
+
+// Returns a new buffer of the elements whose mask entry is nonzero. The mask
+// must be an int32 buffer of the same length, e.g. from bufGreater.
+static bool bufFilterNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjBuffer *a;
+  ObjBuffer *mask;
+  if (!bufferArg(vm, args, 0, &a) || !bufferArg(vm, args, 1, &mask)) {
+    return false;
+  }
+  if (mask->kind != BUFFER_INT32 || mask->length != a->length) {
+    runtimeError(vm, "Mask must be an int32 buffer of the same length");
+    return false;
+  }
+  if (!reserveMemory(vm,
+                     sizeof(ObjBuffer) + bufferDataSize(a->kind, a->length))) {
+    return false;
+  }
+  ObjBuffer *out = createBuffer(vm, a->kind, a->length);
+  if (a->kind == BUFFER_INT32) {
+    out->length = kernels->filter32(AS_INT32(a), AS_INT32(mask),
+                                    AS_INT32(out), a->length);
+  } else {
+    out->length = kernels->filter64(AS_INT64(a), AS_INT32(mask),
+                                    AS_INT64(out), a->length);
+  }
+  *result = MAKE_OBJ((Obj *)out);
+  return true;
+}
+
+static bool bufPrefixSumNative(VM *vm, int argCount, Value *args,
+                               Value *result) {
+  ObjBuffer *a;
+  if (!bufferArg(vm, args, 0, &a)) {
+    return false;
+  }
+  if (!reserveMemory(vm,
+                     sizeof(ObjBuffer) + bufferDataSize(a->kind, a->length))) {
+    return false;
+  }
+  ObjBuffer *out = createBuffer(vm, a->kind, a->length);
+  if (a->kind == BUFFER_INT32) {
+    kernels->prefix32(AS_INT32(a), AS_INT32(out), a->length);
+  } else {
+    kernels->prefix64(AS_INT64(a), AS_INT64(out), a->length);
+  }
+  *result = MAKE_OBJ((Obj *)out);
+  return true;
+}
+
+// Builds an int32 mask buffer comparing each element against k
+static bool compare(VM *vm, Value *args, Value *result, bool greater) {
+  ObjBuffer *a;
+  int k;
+  if (!bufferArg(vm, args, 0, &a) || !numberArg(vm, args, 1, &k)) {
+    return false;
+  }
+  if (!reserveMemory(vm, sizeof(ObjBuffer) +
+                             bufferDataSize(BUFFER_INT32, a->length))) {
+    return false;
+  }
+  ObjBuffer *mask = createBuffer(vm, BUFFER_INT32, a->length);
+  if (a->kind == BUFFER_INT32) {
+    (greater ? kernels->greater32 : kernels->less32)(AS_INT32(a), k,
+                                                     AS_INT32(mask), a->length);
+  } else {
+    (greater ? kernels->greater64 : kernels->less64)(AS_INT64(a), k,
+                                                     AS_INT32(mask), a->length);
+  }
+  *result = MAKE_OBJ((Obj *)mask);
+  return true;
+}
+
+static bool bufGreaterNative(VM *vm, int argCount, Value *args, Value *result) {
+  return compare(vm, args, result, true);
+}
+
+static bool bufLessNative(VM *vm, int argCount, Value *args, Value *result) {
+  return compare(vm, args, result, false);
+}
+
+static void selectKernels() { kernels = kernelsForLevel(detectSimdLevel()); }
+
+// Selects the kernels for this cpu and binds the buffer natives as globals
+void defineBufferNatives(VM *vm) {
+  pthread_once(&kernelsSelected, selectKernels);
+
+  defineNative(vm, "int32Buffer", int32BufferNative, 1);
+  defineNative(vm, "int64Buffer", int64BufferNative, 1);
+  defineNative(vm, "bufLength", bufLengthNative, 1);
+  defineNative(vm, "bufGet", bufGetNative, 2);
+  defineNative(vm, "bufSet", bufSetNative, 3);
+  defineNative(vm, "bufRange", bufRangeNative, 3);
+  defineNative(vm, "bufFill", bufFillNative, 2);
+  defineNative(vm, "bufSum", bufSumNative, 1);
+  defineNative(vm, "bufMin", bufMinNative, 1);
+  defineNative(vm, "bufMax", bufMaxNative, 1);
+  defineNative(vm, "bufAdd", bufAddNative, 2);
+  defineNative(vm, "bufMul", bufMulNative, 2);
+  defineNative(vm, "bufScale", bufScaleNative, 2);
+  defineNative(vm, "bufDot", bufDotNative, 2);
+  defineNative(vm, "bufFilter", bufFilterNative, 2);
+  defineNative(vm, "bufPrefixSum", bufPrefixSumNative, 1);
+  defineNative(vm, "bufGreater", bufGreaterNative, 2);
+  defineNative(vm, "bufLess", bufLessNative, 2);
+}
@@ -0,0 +1,62 @@
+#ifndef sethi_buffer_h
+#define sethi_buffer_h
+
+#include "common.h"
+#include "value.h"
+
+typedef enum { BUFFER_INT32, BUFFER_INT64 } BufferKind;
+
+// Represents a typed numeric buffer in SethiScript. Elements are stored
+// unboxed so bulk operations can run over them with native kernels.
+typedef struct {
+  Obj obj;
+  BufferKind kind;
+  int32_t length;
+  // int32_t or int64_t elements depending on kind
+  void *data;
+} ObjBuffer;
+
+typedef enum { SIMD_SCALAR, SIMD_SSE4, SIMD_AVX2 } SimdLevel;
+
+// Bulk kernels over raw element arrays. Arithmetic wraps on overflow. Sums
+// and dot products of int32 elements accumulate in 64 bits. Masks are int32
+// arrays where nonzero means keep.
+typedef struct {
+  const char *name;
+  int64_t (*sum32)(const int32_t *a, int32_t n);
+  int64_t (*sum64)(const int64_t *a, int32_t n);
+  // min and max require n > 0
+  int32_t (*min32)(const int32_t *a, int32_t n);
+  int32_t (*max32)(const int32_t *a, int32_t n);
+  int64_t (*min64)(const int64_t *a, int32_t n);
+  int64_t (*max64)(const int64_t *a, int32_t n);
+  void (*add32)(const int32_t *a, const int32_t *b, int32_t *out, int32_t n);
+  void (*add64)(const int64_t *a, const int64_t *b, int64_t *out, int32_t n);
+  void (*mul32)(const int32_t *a, const int32_t *b, int32_t *out, int32_t n);
+  void (*mul64)(const int64_t *a, const int64_t *b, int64_t *out, int32_t n);
+  void (*scale32)(const int32_t *a, int32_t k, int32_t *out, int32_t n);
+  void (*scale64)(const int64_t *a, int64_t k, int64_t *out, int32_t n);
+  int64_t (*dot32)(const int32_t *a, const int32_t *b, int32_t n);
+  int64_t (*dot64)(const int64_t *a, const int64_t *b, int32_t n);
+  // Returns the number of elements written to out
+  int32_t (*filter32)(const int32_t *a, const int32_t *mask, int32_t *out,
+                      int32_t n);
+  int32_t (*filter64)(const int64_t *a, const int32_t *mask, int64_t *out,
+                      int32_t n);
+  // Inclusive prefix sums
+  void (*prefix32)(const int32_t *a, int32_t *out, int32_t n);
+  void (*prefix64)(const int64_t *a, int64_t *out, int32_t n);
+  // Writes 1 to mask where the comparison holds and 0 elsewhere
+  void (*greater32)(const int32_t *a, int32_t k, int32_t *mask, int32_t n);
+  void (*greater64)(const int64_t *a, int64_t k, int32_t *mask, int32_t n);
+  void (*less32)(const int32_t *a, int32_t k, int32_t *mask, int32_t n);
+  void (*less64)(const int64_t *a, int64_t k, int32_t *mask, int32_t n);
+} BufferKernels;
+
+size_t bufferDataSize(BufferKind kind, int32_t length);
+ObjBuffer *createBuffer(VM *vm, BufferKind kind, int32_t length);
+const BufferKernels *kernelsForLevel(SimdLevel level);
+SimdLevel detectSimdLevel();
+void defineBufferNatives(VM *vm);
+
+#endif
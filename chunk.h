@@ -36,9 +36,21 @@ typedef enum {
   OP_OR,
   OP_CALL,
   OP_DOT,
-  OP_TABLE,
+  OP_STRUCT,
   OP_NAMESPACE,
-  OP_TYPE
+  OP_TYPE,
+  OP_CALL_DIRECT,
+  // Unchecked forms the optimizer emits where it has proven the operands are
+  // numbers, or a struct of a known shape for OP_FIELD
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MUL_NUM,
+  OP_DIVIDE_NUM,
+  OP_LESS_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_EQUAL_NUM,
+  OP_GREATER_EQUAL_NUM,
+  OP_FIELD
 } OpCode;
 
 typedef struct Chunk {
@@ -5,6 +5,8 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "table.h"
 #include "value.h"
@@ -13,50 +15,49 @@
 #include <string.h>
 
 #define UINT_16_SIZE 65535
-
-typedef struct {
-  Token previous;
-  Token current;
-  bool hadError;
-  bool panicMode;
-} Parser;
-
-Compiler *current;
-Parser parser;
-Chunk *compilingChunk;
-Chunk *mainChunk;
-
-// Initializes the current Compiler with no locals and 0 depth
-void initCompiler(Compiler *c) {
-  c->currentScope = 0;
-  c->localCount = 0;
-  current = c;
+// Longest function body, in bytes, that replaces calls to it
+#define INLINE_MAX 16
+
+// Initializes the Compiler with no locals and 0 depth. Objects it creates
+// are allocated in the given vm.
+void initCompiler(Compiler *compiler, VM *vm) {
+  compiler->vm = vm;
+  compiler->currentScope = 0;
+  compiler->localCount = 0;
+  compiler->compilingChunk = NULL;
+  compiler->mainChunk = NULL;
+  initTable(&compiler->pinned);
+  compiler->wholeProgram = false;
+  compiler->boundCalls = 0;
 }
 // Moves the parser down one;
-static void advance() {
-  parser.previous = parser.current;
-  parser.current = scanToken();
+static void advance(Compiler *compiler) {
+  compiler->parser.previous = compiler->parser.current;
+  compiler->parser.current = scanToken(&compiler->scanner);
 }
 
 // Checks if the current token is the given type, and advances the parser if it
 // is.
-static bool match(TokenType type) {
-  if (parser.current.type == type) {
-    advance();
+static bool match(Compiler *compiler, TokenType type) {
+  if (compiler->parser.current.type == type) {
+    advance(compiler);
     return true;
   }
   return false;
 }
 
 // Returns true if the current token has given type. Does not advance parser.
-static bool check(TokenType type) { return parser.current.type == type; }
+static bool check(Compiler *compiler, TokenType type) {
+  return compiler->parser.current.type == type;
+}
 
 // Prints what line and token the error is on as well as a message
-static void errorAtToken(Token *token, const char *message) {
-  if (parser.panicMode) {
+static void errorAtToken(Compiler *compiler, Token *token,
+                         const char *message) {
+  if (compiler->parser.panicMode) {
     return;
   }
-  parser.panicMode = true;
+  compiler->parser.panicMode = true;
   printf("Error on line, %d, at ", token->line);
   if (token->type == TOKEN_EOF) {
     printf("end of file ");
@@ -67,18 +68,18 @@ static void errorAtToken(Token *token, const char *message) {
   }
 
   printf("%s\n", message);
-  parser.hadError = true;
+  compiler->parser.hadError = true;
 }
 
 // Advances the parser until it gets to a statement boundry and turns panic mode
 // off
-static void synchronize() {
-  parser.panicMode = false;
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMI)
+static void synchronize(Compiler *compiler) {
+  compiler->parser.panicMode = false;
+  while (compiler->parser.current.type != TOKEN_EOF) {
+    if (compiler->parser.previous.type == TOKEN_SEMI)
       return;
 
-    switch (parser.previous.type) {
+    switch (compiler->parser.previous.type) {
     case TOKEN_FOR:
       return;
     case TOKEN_WHILE:
@@ -96,246 +97,303 @@ static void synchronize() {
     default:
       break;
     }
-    advance();
+    advance(compiler);
   }
 }
 
 // Consumes the given type at the current slot of the parser and throws error if
 // it does not exist
-static void consume(TokenType type, const char *message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Compiler *compiler, TokenType type, const char *message) {
+  if (compiler->parser.current.type == type) {
+    advance(compiler);
     return;
   }
 
-  errorAtToken(&parser.current, message);
+  errorAtToken(compiler, &compiler->parser.current, message);
 }
 
 // Returns the current compiling chunk.
-static Chunk *currentChunk() { return compilingChunk; }
+static Chunk *currentChunk(Compiler *compiler) {
+  return compiler->compilingChunk;
+}
 
 // Sets the current compiling chunk
-static void setCurrentChunk(Chunk *chunk) { compilingChunk = chunk; }
+static void setCurrentChunk(Compiler *compiler, Chunk *chunk) {
+  compiler->compilingChunk = chunk;
+}
+
+// Returns true if a and b are the same constant
+static bool sameConstant(Value a, Value b) {
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+  case VALUE_NUM:
+    return a.as.number == b.as.number;
+  case VALUE_BOOL:
+    return a.as.boolean == b.as.boolean;
+  case VALUE_OBJ:
+    return a.as.obj == b.as.obj;
+  default:
+    return true;
+  }
+}
+
+// Adds val to the current chunk's constants, reusing an equal constant if one
+// is already there. Constant operands are one byte, so errors if the pool is
+// full.
+static int makeConstant(Compiler *compiler, Value val) {
+  ValueArray *constants = &currentChunk(compiler)->constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (sameConstant(constants->values[i], val)) {
+      return i;
+    }
+  }
+  if (constants->count > UINT8_MAX) {
+    errorAtToken(compiler, &compiler->parser.previous,
+                 "Too many constants in one chunk");
+    return 0;
+  }
+  return addConstant(currentChunk(compiler), val);
+}
 
 // Emits one OP.
-static void emitByte(uint8_t byte, int line) {
-  Chunk *chunk = currentChunk();
+static void emitByte(Compiler *compiler, uint8_t byte, int line) {
+  Chunk *chunk = currentChunk(compiler);
   writeChunk(chunk, byte, line);
 }
 
 // Emits two OPS.
-static void emitBytes(uint8_t byte1, uint8_t byte2, int line) {
-  emitByte(byte1, line);
-  emitByte(byte2, line);
+static void emitBytes(Compiler *compiler, uint8_t byte1, uint8_t byte2,
+                      int line) {
+  emitByte(compiler, byte1, line);
+  emitByte(compiler, byte2, line);
 }
 
 // Emits return OP.
-static void emitReturn(int line) { emitByte(OP_RETURN, line); }
+static void emitReturn(Compiler *compiler, int line) {
+  emitByte(compiler, OP_RETURN, line);
+}
 
 // Emits a jump instruction and two bytes as placeholders for the length of the
 // jump.
-static void emitJump(uint8_t op) {
-  emitByte(op, parser.previous.line);
-  emitByte('\xff', parser.previous.line);
-  emitByte('\xff', parser.previous.line);
+static void emitJump(Compiler *compiler, uint8_t op) {
+  emitByte(compiler, op, compiler->parser.previous.line);
+  emitByte(compiler, '\xff', compiler->parser.previous.line);
+  emitByte(compiler, '\xff', compiler->parser.previous.line);
 }
 // Emits a jump back instruction and two bytes representing how far back to
 // jump. Throws error if jump is larger than UINT_16_SIZE
 /// @param backCount represents the count of the byte which ip will be set too.
-static void emitJumpBack(int backCount) {
+static void emitJumpBack(Compiler *compiler, int backCount) {
   // Add 3 to compensate for where the pointer is after processing both operands
-  if (currentChunk()->count - backCount + 3 > UINT_16_SIZE) {
-    errorAtToken(&parser.previous, "Loop is too large");
+  if (currentChunk(compiler)->count - backCount + 3 > UINT_16_SIZE) {
+    errorAtToken(compiler, &compiler->parser.previous, "Loop is too large");
   }
-  uint16_t jumpLength = (uint16_t)(currentChunk()->count - backCount + 3);
+  uint16_t jumpLength =
+      (uint16_t)(currentChunk(compiler)->count - backCount + 3);
   uint8_t msb = (uint8_t)(jumpLength >> 8);
   uint8_t lsb = (uint8_t)jumpLength;
-  emitByte(OP_JUMP_BACK, parser.previous.line);
-  emitByte(msb, parser.previous.line);
-  emitByte(lsb, parser.previous.line);
+  emitByte(compiler, OP_JUMP_BACK, compiler->parser.previous.line);
+  emitByte(compiler, msb, compiler->parser.previous.line);
+  emitByte(compiler, lsb, compiler->parser.previous.line);
 }
 
-// Ends compile by emitting a return OP
-static void endCompile(int line) { emitReturn(line); }
+// Ends compile by emitting a return OP. The script returns nil unless it
+// returned a value at the top level.
+static void endCompile(Compiler *compiler, int line) {
+  emitByte(compiler, OP_NIL, line);
+  emitReturn(compiler, line);
+}
 
-static void expressionStatement();
-static void printStatement();
-static void statement();
-static void globalDeclaration();
-static void localDeclaration();
+static void expressionStatement(Compiler *compiler);
+static void printStatement(Compiler *compiler);
+static void statement(Compiler *compiler);
+static void globalDeclaration(Compiler *compiler);
+static void localDeclaration(Compiler *compiler);
 
 // Add local to compiler
-static void addLocal(Local local) {
-  current->locals[current->localCount] = local;
-  current->localCount++;
+static void addLocal(Compiler *compiler, Local local) {
+  compiler->locals[compiler->localCount] = local;
+  compiler->localCount++;
 }
 
 // What to do when entering block
-static void enterBlock() { current->currentScope++; }
+static void enterBlock(Compiler *compiler) { compiler->currentScope++; }
 // Parse the block
-static void block() {
-  while (!check(TOKEN_RIGHT_CURLY) && !check(TOKEN_EOF)) {
-    localDeclaration();
+static void block(Compiler *compiler) {
+  while (!check(compiler, TOKEN_RIGHT_CURLY) && !check(compiler, TOKEN_EOF)) {
+    localDeclaration(compiler);
   }
 }
 
 // What to do when exiting block
-static void exitBlock(bool emitPops) {
-  current->currentScope--;
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth >
-             current->currentScope) {
-    current->localCount--;
+static void exitBlock(Compiler *compiler, bool emitPops) {
+  compiler->currentScope--;
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->currentScope) {
+    compiler->localCount--;
     if (emitPops) {
-      emitByte(OP_POP, parser.current.line);
+      emitByte(compiler, OP_POP, compiler->parser.current.line);
     }
   }
 }
 
 // Parse block statement
-static void blockStatement() {
-  enterBlock();
-  block();
-  consume(TOKEN_RIGHT_CURLY, "Expects a closing }");
-  exitBlock(true);
+static void blockStatement(Compiler *compiler) {
+  enterBlock(compiler);
+  block(compiler);
+  consume(compiler, TOKEN_RIGHT_CURLY, "Expects a closing }");
+  exitBlock(compiler, true);
 }
 
 // Patches section of chunk starting the byte after "start" and encompassing two
 // bytes total. Patches with value which would bring ip to current tip of chunk
 // if the ip starts by pointing at second byte.
-static void patchJump(int startCount) {
+static void patchJump(Compiler *compiler, int startCount) {
 
-  if (currentChunk()->count - startCount - 2 > UINT_16_SIZE) {
-    errorAtToken(&parser.previous, "Cannot jump that much code");
+  if (currentChunk(compiler)->count - startCount - 2 > UINT_16_SIZE) {
+    errorAtToken(compiler, &compiler->parser.previous,
+                 "Cannot jump that much code");
   }
-  uint16_t jumpLength = currentChunk()->count - startCount - 2;
+  uint16_t jumpLength = currentChunk(compiler)->count - startCount - 2;
   uint8_t msb = (uint8_t)(jumpLength >> 8);
   uint8_t lsb = (uint8_t)jumpLength;
-  currentChunk()->code[startCount] = msb;
-  currentChunk()->code[startCount + 1] = lsb;
+  currentChunk(compiler)->code[startCount] = msb;
+  currentChunk(compiler)->code[startCount + 1] = lsb;
 }
 
 // Parses an if statement
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Needs '(' after if token");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Needs closing ')' for if token");
+static void ifStatement(Compiler *compiler) {
+  consume(compiler, TOKEN_LEFT_PAREN, "Needs '(' after if token");
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Needs closing ')' for if token");
 
-  int skipIfJump = currentChunk()->count + 1;
-  emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP, parser.previous.line);
+  int skipIfJump = currentChunk(compiler)->count + 1;
+  emitJump(compiler, OP_JUMP_IF_FALSE);
+  emitByte(compiler, OP_POP, compiler->parser.previous.line);
 
-  statement();
+  statement(compiler);
 
-  int exitJumpCount = currentChunk()->count + 1;
-  emitJump(OP_JUMP);
-  patchJump(skipIfJump);
+  int exitJumpCount = currentChunk(compiler)->count + 1;
+  emitJump(compiler, OP_JUMP);
+  patchJump(compiler, skipIfJump);
 
-  if (match(TOKEN_ELSE)) {
-    statement();
+  if (match(compiler, TOKEN_ELSE)) {
+    statement(compiler);
   }
-  emitByte(OP_POP, parser.previous.line);
-  patchJump(exitJumpCount);
+  emitByte(compiler, OP_POP, compiler->parser.previous.line);
+  patchJump(compiler, exitJumpCount);
 }
 
 // Parses while statement
-static void whileStatement() {
-  consume(TOKEN_LEFT_PAREN, "Needs '(' after if token");
-  int beforeExpressionCount = currentChunk()->count;
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Needs closing ')' for if token");
-
-  int skipWhileJump = currentChunk()->count + 1;
-  emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP, parser.previous.line);
-  statement();
-  emitJumpBack(beforeExpressionCount);
-
-  patchJump(skipWhileJump);
-  emitByte(OP_POP, parser.previous.line);
+static void whileStatement(Compiler *compiler) {
+  consume(compiler, TOKEN_LEFT_PAREN, "Needs '(' after if token");
+  int beforeExpressionCount = currentChunk(compiler)->count;
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Needs closing ')' for if token");
+
+  int skipWhileJump = currentChunk(compiler)->count + 1;
+  emitJump(compiler, OP_JUMP_IF_FALSE);
+  emitByte(compiler, OP_POP, compiler->parser.previous.line);
+  statement(compiler);
+  emitJumpBack(compiler, beforeExpressionCount);
+
+  patchJump(compiler, skipWhileJump);
+  emitByte(compiler, OP_POP, compiler->parser.previous.line);
 }
 
 // Pushes a constant op, adds a constant to the pool, and adds its index
 // afterwards
-static void constant(bool canAssign) {
-  int line = parser.previous.line;
+static void constant(Compiler *compiler, bool canAssign) {
+  int line = compiler->parser.previous.line;
 
-  switch (parser.previous.type) {
+  switch (compiler->parser.previous.type) {
   case TOKEN_TRUE:
-    emitByte(OP_TRUE, line);
+    emitByte(compiler, OP_TRUE, line);
     break;
   case TOKEN_FALSE:
-    emitByte(OP_FALSE, line);
+    emitByte(compiler, OP_FALSE, line);
     break;
   case TOKEN_NIL:
-    emitByte(OP_NIL, line);
+    emitByte(compiler, OP_NIL, line);
     break;
   default: {
-    Value val = MAKE_NUM(atoi(parser.previous.start));
-    int index = addConstant(currentChunk(), val);
-    emitBytes(OP_CONSTANT, index, line);
+    // The token is not NUL terminated, so only its own digits are read
+    Token *token = &compiler->parser.previous;
+    int64_t number = 0;
+    for (int i = 0; i < token->length; i++) {
+      number = number * 10 + (token->start[i] - '0');
+      if (number > INT32_MAX) {
+        errorAtToken(compiler, token, "Number is too large");
+        return;
+      }
+    }
+    int index = makeConstant(compiler, MAKE_NUM((int)number));
+    emitBytes(compiler, OP_CONSTANT, index, line);
   }
   }
 }
 
 // Parses and expression and consumes a final parenthesis
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expects a ')'");
+static void grouping(Compiler *compiler, bool canAssign) {
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expects a ')'");
 }
 
-static void unary(bool canAssign) {
-  TokenType type = parser.previous.type;
-  int line = parser.previous.line;
+static void unary(Compiler *compiler, bool canAssign) {
+  TokenType type = compiler->parser.previous.type;
+  int line = compiler->parser.previous.line;
 
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(compiler, PREC_UNARY);
 
   switch (type) {
   case TOKEN_MINUS:
-    emitByte(OP_NEGATE, line);
+    emitByte(compiler, OP_NEGATE, line);
     break;
   case TOKEN_BANG:
-    emitByte(OP_FALSIFY, line);
+    emitByte(compiler, OP_FALSIFY, line);
     break;
   default:
     break;
   }
 }
 
-static void binary(bool canAssign) {
-  TokenType type = parser.previous.type;
-  int line = parser.previous.line;
+static void binary(Compiler *compiler, bool canAssign) {
+  TokenType type = compiler->parser.previous.type;
+  int line = compiler->parser.previous.line;
   ParseRule *rule = getRule(type);
 
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
 
   switch (type) {
   case TOKEN_PLUS:
-    emitByte(OP_ADD, line);
+    emitByte(compiler, OP_ADD, line);
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT, line);
+    emitByte(compiler, OP_SUBTRACT, line);
     break;
   case TOKEN_SLASH:
-    emitByte(OP_DIVIDE, line);
+    emitByte(compiler, OP_DIVIDE, line);
     break;
   case TOKEN_STAR:
-    emitByte(OP_MUL, line);
+    emitByte(compiler, OP_MUL, line);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emitByte(OP_EQUALITY, line);
+    emitByte(compiler, OP_EQUALITY, line);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS, line);
+    emitByte(compiler, OP_LESS, line);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER, line);
+    emitByte(compiler, OP_GREATER, line);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitByte(OP_GREATER_EQUAL, line);
+    emitByte(compiler, OP_GREATER_EQUAL, line);
     break;
   case TOKEN_LESS_EQUAL:
-    emitByte(OP_LESS_EQUAL, line);
+    emitByte(compiler, OP_LESS_EQUAL, line);
     break;
   default:
     break;
@@ -343,13 +401,14 @@ static void binary(bool canAssign) {
 }
 
 // Parses a string
-static void string(bool canAssign) {
-  int line = parser.previous.line;
+static void string(Compiler *compiler, bool canAssign) {
+  int line = compiler->parser.previous.line;
+  Token *token = &compiler->parser.previous;
   Value val = {.type = VALUE_OBJ,
-               .as.obj = (Obj *)copyString(parser.previous.start + 1,
-                                           parser.previous.length - 2)};
-  int index = addConstant(compilingChunk, val);
-  emitBytes(OP_CONSTANT, index, line);
+               .as.obj = (Obj *)copyString(compiler->vm, token->start + 1,
+                                           token->length - 2)};
+  int index = makeConstant(compiler, val);
+  emitBytes(compiler, OP_CONSTANT, index, line);
 }
 
 // Returns true if the given token and this one represent the same identifer
@@ -364,10 +423,10 @@ static bool sameIdentifier(Token *one, Token *two) {
 
 // Returns the index of the local on the stack which is equivalent to the given
 // token. Returns -1 if none exist.
-static int getLocal(Token *token) {
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    if (current->locals[i].depth != -1 &&
-        sameIdentifier(&current->locals[i].token, token)) {
+static int getLocal(Compiler *compiler, Token *token) {
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    if (compiler->locals[i].depth != -1 &&
+        sameIdentifier(&compiler->locals[i].token, token)) {
       return i;
     }
   }
@@ -375,15 +434,128 @@ static int getLocal(Token *token) {
 }
 
 // Parses a variable
-static void variable(bool canAssign) {
-  int index = getLocal(&parser.previous);
+// Returns the function bound to name if calls to it can be bound statically:
+// the program defines it, and nothing can bind name to anything else.
+static ObjFunc *staticCallee(Compiler *compiler, ObjString *name) {
+  if (!compiler->wholeProgram || get(&compiler->pinned, name) == NULL) {
+    return NULL;
+  }
+  Value *bound = get(&compiler->vm->table, name);
+  if (bound == NULL || !isObjectOfType(*bound, OBJ_FUNCTION)) {
+    return NULL;
+  }
+  return (ObjFunc *)bound->as.obj;
+}
+
+// Finds the part of func's body that can stand in for a call: a short run of
+// simple instructions that takes the arguments off the stack and leaves the
+// result in their place. The body may first read every parameter in order,
+// since the arguments are already on the stack in that order. Sets start
+// and end around the run and returns false if the body is not like that.
+static bool inlineBody(ObjFunc *func, int *start, int *end) {
+  Chunk *chunk = func->chunk;
+  int offset = 0;
+  int copies = 0;
+  while (copies < func->numParams && offset + 1 < chunk->count &&
+         chunk->code[offset] == OP_GET_LOC && chunk->code[offset + 1] == copies) {
+    offset += 2;
+    copies++;
+  }
+  if (copies != 0 && copies != func->numParams) {
+    return false;
+  }
+
+  // The run may only touch the copies, or the parameters themselves when
+  // there are none
+  int height = func->numParams + copies;
+  *start = offset;
+  while (offset < chunk->count && offset - *start <= INLINE_MAX) {
+    int pops = 0;
+    switch (chunk->code[offset]) {
+    case OP_RETURN:
+      *end = offset;
+      return height == copies + 1;
+    case OP_CONSTANT:
+    case OP_GET_GLOB:
+      offset++;
+      height++;
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      height++;
+      break;
+    case OP_NAMESPACE:
+      offset++;
+      pops = 1;
+      break;
+    case OP_TYPE:
+    case OP_NEGATE:
+    case OP_FALSIFY:
+      pops = 1;
+      break;
+    case OP_EQUALITY:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MUL:
+    case OP_DIVIDE:
+      pops = 2;
+      break;
+    default:
+      return false;
+    }
+    if (height - pops < copies) {
+      return false;
+    }
+    height = height - pops + (pops > 0);
+    offset++;
+  }
+  return false;
+}
+
+// Emits the run of func's body between start and end in place of a call,
+// adding the constants it uses to the current chunk.
+static void emitInline(Compiler *compiler, ObjFunc *func, int start, int end,
+                       int line) {
+  Chunk *body = func->chunk;
+  for (int offset = start; offset < end; offset++) {
+    uint8_t op = body->code[offset];
+    emitByte(compiler, op, line);
+    if (op == OP_CONSTANT || op == OP_GET_GLOB || op == OP_NAMESPACE) {
+      offset++;
+      Value constant = body->constants.values[body->code[offset]];
+      emitByte(compiler, makeConstant(compiler, constant), line);
+    }
+  }
+}
+
+// Deletes count bytes at offset from the current chunk. Jumps are relative,
+// so the code after offset stays correct as long as no finished jump crosses
+// offset.
+static void removeBytes(Compiler *compiler, int offset, int count) {
+  Chunk *chunk = currentChunk(compiler);
+  int after = chunk->count - offset - count;
+  memmove(chunk->code + offset, chunk->code + offset + count, after);
+  memmove(chunk->lines + offset, chunk->lines + offset + count,
+          sizeof(int) * after);
+  chunk->count -= count;
+}
+
+static void variable(Compiler *compiler, bool canAssign) {
+  int index = getLocal(compiler, &compiler->parser.previous);
   OpCode setOp;
   OpCode getOp;
   if (index == -1) {
-    index = addConstant(compilingChunk, (Value){.type = VALUE_OBJ,
-                                                .as.obj = (Obj *)copyString(
-                                                    parser.previous.start,
-                                                    parser.previous.length)});
+    index = makeConstant(
+        compiler,
+        (Value){.type = VALUE_OBJ,
+                .as.obj = (Obj *)copyString(compiler->vm,
+                                            compiler->parser.previous.start,
+                                            compiler->parser.previous.length)});
     setOp = OP_SET_GLOB;
     getOp = OP_GET_GLOB;
   } else {
@@ -391,61 +563,93 @@ static void variable(bool canAssign) {
     getOp = OP_GET_LOC;
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, index, parser.previous.line);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    emitBytes(OP_NIL, OP_NIL, parser.previous.line);
-    emitByte(OP_NIL, parser.previous.line);
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
+    emitBytes(compiler, setOp, index, compiler->parser.previous.line);
+  } else if (match(compiler, TOKEN_LEFT_PAREN)) {
+    int placeholders = currentChunk(compiler)->count;
+    emitBytes(compiler, OP_NIL, OP_NIL, compiler->parser.previous.line);
+    emitByte(compiler, OP_NIL, compiler->parser.previous.line);
     uint8_t numParams = 0;
-    while (!match(TOKEN_RIGHT_PAREN) && !match(TOKEN_EOF) && !parser.hadError) {
+    while (!match(compiler, TOKEN_RIGHT_PAREN) &&
+           !match(compiler, TOKEN_EOF) && !compiler->parser.hadError) {
       numParams++;
-      expression();
+      expression(compiler);
 
-      if (match(TOKEN_RIGHT_PAREN)) {
+      if (match(compiler, TOKEN_RIGHT_PAREN)) {
         break;
       }
-      consume(TOKEN_COMMA, "Needs comma between variables");
+      consume(compiler, TOKEN_COMMA, "Needs comma between variables");
+    }
+
+    ObjFunc *callee = NULL;
+    int start, end;
+    if (getOp == OP_GET_GLOB) {
+      Value name = currentChunk(compiler)->constants.values[index];
+      callee = staticCallee(compiler, (ObjString *)name.as.obj);
+    }
+    if (callee != NULL && callee->numParams == numParams) {
+      // Small functions run in place on their arguments, without a frame.
+      // A function still being compiled is only called, never inlined.
+      if (callee->chunk != currentChunk(compiler) &&
+          inlineBody(callee, &start, &end)) {
+        removeBytes(compiler, placeholders, 3);
+        emitInline(compiler, callee, start, end,
+                   compiler->parser.previous.line);
+        compiler->boundCalls++;
+        return;
+      }
+      // Other calls go straight to the function, which is known to take
+      // this many arguments
+      emitBytes(compiler, OP_CALL_DIRECT, numParams,
+                compiler->parser.previous.line);
+      emitByte(compiler,
+               makeConstant(compiler, (Value){.type = VALUE_OBJ,
+                                              .as.obj = (Obj *)callee}),
+               compiler->parser.previous.line);
+      compiler->boundCalls++;
+      return;
     }
-    emitBytes(getOp, index, parser.previous.line);
-    emitBytes(OP_CALL, numParams, parser.previous.line);
+    emitBytes(compiler, getOp, index, compiler->parser.previous.line);
+    emitBytes(compiler, OP_CALL, numParams, compiler->parser.previous.line);
   } else {
-    emitBytes(getOp, index, parser.previous.line);
+    emitBytes(compiler, getOp, index, compiler->parser.previous.line);
   }
 }
 
 // Parses AND operator skips rest of expression if first operand is false
-static void and_(bool canAssign) {
-  int jumpCount = currentChunk()->count + 1;
-  emitJump(OP_JUMP_IF_FALSE);
-  parsePrecedence(PREC_AND + 1);
-  emitByte(OP_AND, parser.previous.line);
-  patchJump(jumpCount);
+static void and_(Compiler *compiler, bool canAssign) {
+  int jumpCount = currentChunk(compiler)->count + 1;
+  emitJump(compiler, OP_JUMP_IF_FALSE);
+  parsePrecedence(compiler, PREC_AND + 1);
+  emitByte(compiler, OP_AND, compiler->parser.previous.line);
+  patchJump(compiler, jumpCount);
 }
 
 // Parses OR operator and skips rest of expression if the first one is true
-static void or_(bool canAssign) {
-  int jumpTheJumpCount = currentChunk()->count + 1;
-  emitJump(OP_JUMP_IF_FALSE);
-  int jumpTheSecondPartCount = currentChunk()->count + 1;
-  emitJump(OP_JUMP);
-  patchJump(jumpTheJumpCount);
-  parsePrecedence(PREC_OR + 1);
-  emitByte(OP_OR, parser.previous.line);
-  patchJump(jumpTheSecondPartCount);
+static void or_(Compiler *compiler, bool canAssign) {
+  int jumpTheJumpCount = currentChunk(compiler)->count + 1;
+  emitJump(compiler, OP_JUMP_IF_FALSE);
+  int jumpTheSecondPartCount = currentChunk(compiler)->count + 1;
+  emitJump(compiler, OP_JUMP);
+  patchJump(compiler, jumpTheJumpCount);
+  parsePrecedence(compiler, PREC_OR + 1);
+  emitByte(compiler, OP_OR, compiler->parser.previous.line);
+  patchJump(compiler, jumpTheSecondPartCount);
 }
 
 // Parses dot expressions
-static void namespace(bool canAssign) {
-  if (match(TOKEN_IDENTIFIER)) {
-    int index = addConstant(
-        compilingChunk,
+static void namespace(Compiler *compiler, bool canAssign) {
+  if (match(compiler, TOKEN_IDENTIFIER)) {
+    int index = makeConstant(
+        compiler,
         (Value){.type = VALUE_OBJ,
-                .as.obj = (Obj *)copyString(parser.previous.start,
-                                            parser.previous.length)});
-    emitBytes(OP_NAMESPACE, index, parser.previous.line);
+                .as.obj = (Obj *)copyString(compiler->vm,
+                                            compiler->parser.previous.start,
+                                            compiler->parser.previous.length)});
+    emitBytes(compiler, OP_NAMESPACE, index, compiler->parser.previous.line);
   } else {
-    errorAtToken(&parser.current, "Must be an identifer");
+    errorAtToken(compiler, &compiler->parser.current, "Must be an identifer");
   }
 }
 
@@ -490,302 +694,488 @@ ParseRule *getRule(TokenType type) { return &rules[type]; }
 
 // Advances past the current token and parses the expression as long as it has
 // precedence greater than or equal to the given precedence.
-void parsePrecedence(Precedence precedence) {
-  advance();
+void parsePrecedence(Compiler *compiler, Precedence precedence) {
+  advance(compiler);
 
-  ParseFn prefix = getRule(parser.previous.type)->prefix;
+  ParseFn prefix = getRule(compiler->parser.previous.type)->prefix;
 
   if (prefix == NULL) {
-    errorAtToken(&parser.previous, "Requires expression after prefix");
+    errorAtToken(compiler, &compiler->parser.previous,
+                 "Requires expression after prefix");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefix(canAssign);
+  prefix(compiler, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
+  while (precedence <= getRule(compiler->parser.current.type)->precedence) {
+    advance(compiler);
 
-    ParseFn infix = getRule(parser.previous.type)->infix;
+    ParseFn infix = getRule(compiler->parser.previous.type)->infix;
     if (infix == NULL) {
-      errorAtToken(&parser.previous, "No infix operator associated with token");
+      errorAtToken(compiler, &compiler->parser.previous,
+                   "No infix operator associated with token");
       return;
     }
 
-    infix(canAssign);
+    infix(compiler, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    errorAtToken(&parser.current, "Illegal assignment target");
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    errorAtToken(compiler, &compiler->parser.current,
+                 "Illegal assignment target");
   }
 }
 
-void printStatement() {
-  expression();
-  consume(TOKEN_SEMI, "Expected semicolon");
-  emitByte(OP_PRINT, parser.current.line);
+void printStatement(Compiler *compiler) {
+  expression(compiler);
+  consume(compiler, TOKEN_SEMI, "Expected semicolon");
+  emitByte(compiler, OP_PRINT, compiler->parser.current.line);
 }
 
-void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMI, "Expected semicolon");
-  emitByte(OP_POP, parser.current.line);
+void expressionStatement(Compiler *compiler) {
+  expression(compiler);
+  consume(compiler, TOKEN_SEMI, "Expected semicolon");
+  emitByte(compiler, OP_POP, compiler->parser.current.line);
 }
 
 // Parses a return statment
-static void returnStatement() {
-  if (!check(TOKEN_SEMI) && !check(TOKEN_EOF)) {
-    expression();
+static void returnStatement(Compiler *compiler) {
+  if (!check(compiler, TOKEN_SEMI) && !check(compiler, TOKEN_EOF)) {
+    expression(compiler);
   } else {
-    emitByte(OP_NIL, parser.previous.line);
+    emitByte(compiler, OP_NIL, compiler->parser.previous.line);
   }
-  consume(TOKEN_SEMI, "Needs ';' to finish line");
-  emitByte(OP_RETURN, parser.previous.line);
+  consume(compiler, TOKEN_SEMI, "Needs ';' to finish line");
+  emitByte(compiler, OP_RETURN, compiler->parser.previous.line);
 }
 
 // Defines variable
-static void definition(int index) {
-  if (current->currentScope == 0) {
-    emitBytes(OP_DEFINE_GLOB, index, parser.current.line);
+static void definition(Compiler *compiler, int index) {
+  if (compiler->currentScope == 0) {
+    emitBytes(compiler, OP_DEFINE_GLOB, index, compiler->parser.current.line);
   } else {
-    current->locals[current->localCount - 1].depth = current->currentScope;
+    compiler->locals[compiler->localCount - 1].depth = compiler->currentScope;
   }
 }
 
 // Parses parameters by having the compiler add locals and moving the parser so
 // that it has the closing ')' in the previous slot. Returns number of
 // parameters
-static int parseParameters() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function definition");
-  enterBlock();
+static int parseParameters(Compiler *compiler) {
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after function definition");
+  enterBlock(compiler);
   int numParams = 0;
 
-  while (!match(TOKEN_RIGHT_PAREN) && !match(TOKEN_EOF) && !parser.hadError) {
-    consume(TOKEN_IDENTIFIER, "Needs identifier after '(' in function def");
+  while (!match(compiler, TOKEN_RIGHT_PAREN) && !match(compiler, TOKEN_EOF) &&
+         !compiler->parser.hadError) {
+    consume(compiler, TOKEN_IDENTIFIER,
+            "Needs identifier after '(' in function def");
     Local newLocal;
     numParams++;
-    newLocal.token = parser.previous;
-    newLocal.depth = current->currentScope;
-    for (int i = current->localCount - 1; i >= 0; i--) {
-      if (current->locals[i].depth < current->currentScope) {
+    newLocal.token = compiler->parser.previous;
+    newLocal.depth = compiler->currentScope;
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+      if (compiler->locals[i].depth < compiler->currentScope) {
         break;
       }
-      if (sameIdentifier(&newLocal.token, &current->locals[i].token)) {
-        errorAtToken(
+      if (sameIdentifier(&newLocal.token, &compiler->locals[i].token)) {
+        errorAtToken(compiler, 
             &newLocal.token,
             "Cannot declare the same variable twice in the same scope");
         return 0;
       }
     }
-    addLocal(newLocal);
-    if (match(TOKEN_RIGHT_PAREN)) {
+    addLocal(compiler, newLocal);
+    if (match(compiler, TOKEN_RIGHT_PAREN)) {
       break;
     }
-    consume(TOKEN_COMMA, "Needs commas between variables");
+    consume(compiler, TOKEN_COMMA, "Needs commas between variables");
   }
 
   return numParams;
 }
 
 // Creates callable with name and number of params
-static void createNamedCallable(ObjString *name, int numParams) {
+static ObjFunc *createNamedCallable(Compiler *compiler, ObjString *name,
+                                    int numParams) {
 
-  Chunk *chunk = (Chunk *)malloc(sizeof(Chunk));
+  Chunk *chunk = (Chunk *)allocate(MEMORY_OBJECTS, sizeof(Chunk));
   initChunk(chunk);
-  setCurrentChunk(chunk);
+  setCurrentChunk(compiler, chunk);
 
-  Value funcVal =
-      (Value){.type = VALUE_OBJ, .as.obj = (Obj *)createFunc(chunk, numParams)};
-
-  set(&vm.table, name, funcVal);
+  ObjFunc *func = createFunc(compiler->vm, chunk, numParams);
+  set(&compiler->vm->table, name,
+      (Value){.type = VALUE_OBJ, .as.obj = (Obj *)func});
+  return func;
 }
 
 // Creates a callable in the vms table. Creates a new chunk and sets the
-// compiling one to this. Returns name of function
-static ObjString *createCallable() {
-  consume(TOKEN_IDENTIFIER, "Expect identifier");
+// compiling one to this. Returns name of function, and sets func to it
+static ObjString *createCallable(Compiler *compiler, ObjFunc **func) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect identifier");
   ObjString *funcName =
-      copyString(parser.previous.start, parser.previous.length);
+      copyString(compiler->vm, compiler->parser.previous.start,
+                 compiler->parser.previous.length);
 
-  int numParams = parseParameters();
-  createNamedCallable(funcName, numParams);
+  int numParams = parseParameters(compiler);
+  *func = createNamedCallable(compiler, funcName, numParams);
   return funcName;
 }
 
+// Where a callable's body starts, to compile it again from
+typedef struct {
+  Scanner scanner;
+  Parser parser;
+  int localCount;
+  int currentScope;
+  int boundCalls;
+  bool wholeProgram;
+} BodyStart;
+
+static BodyStart startBody(Compiler *compiler) {
+  return (BodyStart){.scanner = compiler->scanner,
+                     .parser = compiler->parser,
+                     .localCount = compiler->localCount,
+                     .currentScope = compiler->currentScope,
+                     .boundCalls = compiler->boundCalls,
+                     .wholeProgram = compiler->wholeProgram};
+}
+
+// Called after the body of func has been compiled. If it bound calls
+// statically, rewinds to start and returns true to have the body compiled
+// again, looking every call up by name, into func's fallback chunk.
+static bool fallbackBody(Compiler *compiler, BodyStart *start,
+                         ObjFunc *func) {
+  if (!compiler->wholeProgram || compiler->boundCalls == start->boundCalls ||
+      compiler->parser.hadError) {
+    compiler->wholeProgram = start->wholeProgram;
+    return false;
+  }
+  compiler->scanner = start->scanner;
+  compiler->parser = start->parser;
+  compiler->localCount = start->localCount;
+  compiler->currentScope = start->currentScope;
+  compiler->wholeProgram = false;
+  func->fallback = (Chunk *)allocate(MEMORY_OBJECTS, sizeof(Chunk));
+  initChunk(func->fallback);
+  setCurrentChunk(compiler, func->fallback);
+  compiler->vm->staticCalls = true;
+  return true;
+}
+
 // Declares and defines local and global variables
-static void varDeclaration() {
-  consume(TOKEN_IDENTIFIER, "Expect identifier");
+static void varDeclaration(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect identifier");
   int index;
 
   // Declares variable
-  if (current->currentScope > 0) {
+  if (compiler->currentScope > 0) {
     Local newLocal;
-    newLocal.token = parser.previous;
+    newLocal.token = compiler->parser.previous;
     newLocal.depth = -1;
-    for (int i = current->localCount - 1; i >= 0; i--) {
-      if (current->locals[i].depth < current->currentScope) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+      if (compiler->locals[i].depth < compiler->currentScope) {
         break;
       }
-      if (sameIdentifier(&newLocal.token, &current->locals[i].token)) {
-        errorAtToken(
+      if (sameIdentifier(&newLocal.token, &compiler->locals[i].token)) {
+        errorAtToken(compiler, 
             &newLocal.token,
             "Cannot declare the same variable twice in the same scope");
         return;
       }
     }
-    addLocal(newLocal);
+    addLocal(compiler, newLocal);
   } else {
     // Creates string for global variable (part of defining; put here for
     // succictness)
-    index = addConstant(compilingChunk, (Value){.type = VALUE_OBJ,
-                                                .as.obj = (Obj *)copyString(
-                                                    parser.previous.start,
-                                                    parser.previous.length)});
+    index = makeConstant(
+        compiler,
+        (Value){.type = VALUE_OBJ,
+                .as.obj = (Obj *)copyString(compiler->vm,
+                                            compiler->parser.previous.start,
+                                            compiler->parser.previous.length)});
   }
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
   } else {
-    emitByte(OP_NIL, parser.current.line);
+    emitByte(compiler, OP_NIL, compiler->parser.current.line);
   }
-  definition(index);
-  consume(TOKEN_SEMI, "Expected semicolon");
+  definition(compiler, index);
+  consume(compiler, TOKEN_SEMI, "Expected semicolon");
 }
 
 // Compiles the function for the predicate. Has form isNAME
-static void predDeclaration(ObjString *type) {
+static void predDeclaration(Compiler *compiler, ObjString *type) {
   char *heapStr = (char *)malloc(type->length + 2);
 
   heapStr[0] = 'i';
   heapStr[1] = 's';
 
   memcpy(heapStr + 2, type->string, type->length);
-  ObjString *pred = copyString(heapStr, type->length + 2);
+  ObjString *pred = copyString(compiler->vm, heapStr, type->length + 2);
 
   free(heapStr);
-  createNamedCallable(pred, 1);
-
-  uint8_t index = addConstant(
-      currentChunk(), (Value){.type = VALUE_OBJ, .as.obj = (Obj *)type});
-  emitByte(OP_TYPE, parser.previous.line);
-  emitByte(OP_CONSTANT, parser.previous.line);
-  emitByte(index, parser.previous.line);
-  emitByte(OP_EQUALITY, parser.previous.line);
-  emitByte(OP_RETURN, parser.previous.line);
-
-  setCurrentChunk(mainChunk);
+  createNamedCallable(compiler, pred, 1);
+
+  uint8_t index = makeConstant(
+      compiler,
+      (Value){.type = VALUE_OBJ, .as.obj = (Obj *)type});
+  emitByte(compiler, OP_TYPE, compiler->parser.previous.line);
+  emitByte(compiler, OP_CONSTANT, compiler->parser.previous.line);
+  emitByte(compiler, index, compiler->parser.previous.line);
+  emitByte(compiler, OP_EQUALITY, compiler->parser.previous.line);
+  emitByte(compiler, OP_RETURN, compiler->parser.previous.line);
+
+  setCurrentChunk(compiler, compiler->mainChunk);
 }
 
 // Compiles a struct; creates a constructor and predicate function in the heap;
 // stores them in the vm table
 // Compiles the function for constructor
-static void structDeclaration() {
-  ObjString *type = createCallable();
-
-  consume(TOKEN_LEFT_CURLY, "Needs '{' after function def");
-  enterBlock();
-  uint8_t fields = 0;
-  while (match(TOKEN_VAR)) {
-    varDeclaration();
-    fields += 1;
-    Local last = current->locals[current->localCount - 1];
-    Value identifier = (Value){
-        .type = VALUE_OBJ,
-        .as.obj = (Obj *)copyString(last.token.start, last.token.length)};
-    int index = addConstant(currentChunk(), identifier);
-    emitBytes(OP_CONSTANT, index, parser.previous.line);
-    Local empty;
-    empty.depth = current->currentScope;
-    empty.token =
-        (Token){.type = TOKEN_IDENTIFIER, .start = "", 0, parser.previous.line};
-    addLocal(empty);
-  }
-
-  consume(TOKEN_RIGHT_CURLY, "Needs '}' to close the function");
-  emitBytes(OP_TABLE, fields, parser.previous.line);
-  int index = addConstant(currentChunk(),
-                          (Value){.type = VALUE_OBJ, .as.obj = (Obj *)type});
-  emitBytes(index, OP_RETURN, parser.previous.line);
-  exitBlock(false);
-  exitBlock(false);
-  setCurrentChunk(mainChunk);
-
-  predDeclaration(type);
+static void structDeclaration(Compiler *compiler) {
+  ObjFunc *constructor;
+  ObjString *type = createCallable(compiler, &constructor);
+  ObjShape *shape = NULL;
+  BodyStart start = startBody(compiler);
+
+  do {
+    consume(compiler, TOKEN_LEFT_CURLY, "Needs '{' after function def");
+    enterBlock(compiler);
+    // Each field stays on the stack as a local, so the values end up on top
+    // in declaration order for OP_STRUCT
+    ObjString *names[256];
+    int fields = 0;
+    while (match(compiler, TOKEN_VAR)) {
+      varDeclaration(compiler);
+      if (fields == 255) {
+        errorAtToken(compiler, &compiler->parser.previous,
+                     "Struct has too many fields");
+        break;
+      }
+      Local last = compiler->locals[compiler->localCount - 1];
+      names[fields++] =
+          copyString(compiler->vm, last.token.start, last.token.length);
+    }
+
+    consume(compiler, TOKEN_RIGHT_CURLY, "Needs '}' to close the function");
+    // The fallback builds structs of the same shape
+    if (shape == NULL) {
+      shape = createShape(compiler->vm, type, fields, names);
+    }
+    emitBytes(compiler, OP_STRUCT, fields, compiler->parser.previous.line);
+    int index = makeConstant(
+        compiler, (Value){.type = VALUE_OBJ, .as.obj = (Obj *)shape});
+    emitBytes(compiler, index, OP_RETURN, compiler->parser.previous.line);
+    exitBlock(compiler, false);
+  } while (fallbackBody(compiler, &start, constructor));
+  exitBlock(compiler, false);
+  setCurrentChunk(compiler, compiler->mainChunk);
+
+  predDeclaration(compiler, type);
 }
 
 // Compiles a function and creates a function object in the heap, and stores it
 // in the vms table
-static void funcDeclaration() {
-  createCallable();
-
-  consume(TOKEN_LEFT_CURLY, "Expects '{' after function def");
-  block();
-  // Default return
-  emitBytes(OP_NIL, OP_RETURN, parser.previous.line);
-  consume(TOKEN_RIGHT_CURLY, "Expects '}' after function body");
+static void funcDeclaration(Compiler *compiler) {
+  ObjFunc *func;
+  createCallable(compiler, &func);
+  BodyStart start = startBody(compiler);
+
+  do {
+    consume(compiler, TOKEN_LEFT_CURLY, "Expects '{' after function def");
+    block(compiler);
+    // Default return
+    emitBytes(compiler, OP_NIL, OP_RETURN, compiler->parser.previous.line);
+    consume(compiler, TOKEN_RIGHT_CURLY, "Expects '}' after function body");
+  } while (fallbackBody(compiler, &start, func));
 
   // Returns compilation to the main chunk
-  setCurrentChunk(mainChunk);
+  setCurrentChunk(compiler, compiler->mainChunk);
 
   // Remove locals
-  exitBlock(false);
+  exitBlock(compiler, false);
 }
 
-void statement() {
-
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_LEFT_CURLY)) {
-    blockStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
+void statement(Compiler *compiler) {
+
+  if (match(compiler, TOKEN_PRINT)) {
+    printStatement(compiler);
+  } else if (match(compiler, TOKEN_LEFT_CURLY)) {
+    blockStatement(compiler);
+  } else if (match(compiler, TOKEN_IF)) {
+    ifStatement(compiler);
+  } else if (match(compiler, TOKEN_RETURN)) {
+    returnStatement(compiler);
+  } else if (match(compiler, TOKEN_WHILE)) {
+    whileStatement(compiler);
   } else {
-    expressionStatement();
+    expressionStatement(compiler);
   }
 }
 
-void globalDeclaration() {
-  if (match(TOKEN_DEF)) {
-    funcDeclaration();
-    if (parser.panicMode)
-      synchronize();
-  } else if (match(TOKEN_STRUCT)) {
-    structDeclaration();
-    if (parser.panicMode)
-      synchronize();
+void globalDeclaration(Compiler *compiler) {
+  if (match(compiler, TOKEN_DEF)) {
+    funcDeclaration(compiler);
+    if (compiler->parser.panicMode)
+      synchronize(compiler);
+  } else if (match(compiler, TOKEN_STRUCT)) {
+    structDeclaration(compiler);
+    if (compiler->parser.panicMode)
+      synchronize(compiler);
   } else {
-    localDeclaration();
+    localDeclaration(compiler);
   }
 }
 
-void localDeclaration() {
-  if (match(TOKEN_VAR)) {
-    varDeclaration();
+void localDeclaration(Compiler *compiler) {
+  if (match(compiler, TOKEN_VAR)) {
+    varDeclaration(compiler);
   } else {
-    statement();
+    statement(compiler);
   }
-  if (parser.panicMode)
-    synchronize();
+  if (compiler->parser.panicMode)
+    synchronize(compiler);
 }
 
-void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+void expression(Compiler *compiler) {
+  parsePrecedence(compiler, PREC_ASSIGNMENT);
+}
 
-bool compile(const char *source, Chunk *chunk) {
-  initScanner(source);
-  parser.hadError = false;
-  parser.panicMode = false;
-  mainChunk = chunk;
-  setCurrentChunk(mainChunk);
+// Compiles the length bytes at source onto the end of the compiler's main
+// chunk. The compiler keeps its state afterwards, so more source can be
+// appended to the same chunk later. Returns false on a compile error.
+bool compileAppend(Compiler *compiler, const char *source, size_t length) {
+  initScanner(&compiler->scanner, source, length);
+  compiler->parser.hadError = false;
+  compiler->parser.panicMode = false;
+  setCurrentChunk(compiler, compiler->mainChunk);
+
+  advance(compiler);
+  while (!match(compiler, TOKEN_EOF)) {
+    globalDeclaration(compiler);
+  }
 
-  advance();
-  while (!match(TOKEN_EOF)) {
-    globalDeclaration();
+  endCompile(compiler, compiler->parser.current.line);
+  if (compiler->parser.hadError) {
+    // Blocks left open by the error are abandoned
+    compiler->localCount = 0;
+    compiler->currentScope = 0;
+    setCurrentChunk(compiler, compiler->mainChunk);
   }
+  return !compiler->parser.hadError;
+}
+
+// Marks name as a global the program may bind more than once
+static void markReassigned(Compiler *compiler, Table *reassigned,
+                           const char *name, int length) {
+  set(reassigned, copyString(compiler->vm, name, length), MAKE_NIL());
+}
+
+// Records a def or struct binding name, which rebinds it if it is already
+// bound.
+static void markDefined(Compiler *compiler, Table *defined, Table *reassigned,
+                        const char *name, int length) {
+  ObjString *key = copyString(compiler->vm, name, length);
+  if (get(defined, key) != NULL || findGlobal(compiler->vm, key) != NULL) {
+    markReassigned(compiler, reassigned, name, length);
+  }
+  set(defined, key, MAKE_NIL());
+}
+
+// Returns true if table lists a name the VM has bound to a function
+static bool bindsFunction(VM *vm, Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL) {
+      Value *bound = get(&vm->table, entry->key);
+      if (bound != NULL && isObjectOfType(*bound, OBJ_FUNCTION)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
 
-  endCompile(parser.current.line);
-  return !parser.hadError;
+// Scans the whole source ahead of compiling it for the functions calls can
+// be bound to statically: those it defines with def or struct, counting each
+// struct's isNAME predicate, that were not bound before, and that neither
+// the source nor code compiled earlier assigns, declares with var or defines
+// again. Functions compiled earlier that bound calls to a function the
+// source binds again are deoptimized first. Code of a prepared program the
+// VM runs may bind any of its globals, so then nothing is bound statically.
+static void findPinned(Compiler *compiler, const char *source,
+                       size_t length) {
+  VM *vm = compiler->vm;
+  Scanner scanner;
+  initScanner(&scanner, source, length);
+  Table defined;
+  Table reassigned;
+  initTable(&defined);
+  initTable(&reassigned);
+  Token previous = {.type = TOKEN_EOF};
+  for (;;) {
+    Token token = scanToken(&scanner);
+    if (token.type == TOKEN_EOF) {
+      break;
+    }
+    if (token.type == TOKEN_IDENTIFIER && previous.type == TOKEN_VAR) {
+      markReassigned(compiler, &reassigned, token.start, token.length);
+    } else if (token.type == TOKEN_EQUAL &&
+               previous.type == TOKEN_IDENTIFIER) {
+      markReassigned(compiler, &reassigned, previous.start, previous.length);
+    } else if (token.type == TOKEN_IDENTIFIER &&
+               (previous.type == TOKEN_DEF || previous.type == TOKEN_STRUCT)) {
+      markDefined(compiler, &defined, &reassigned, token.start, token.length);
+      if (previous.type == TOKEN_STRUCT) {
+        char *predicate = (char *)malloc(token.length + 2);
+        predicate[0] = 'i';
+        predicate[1] = 's';
+        memcpy(predicate + 2, token.start, token.length);
+        markDefined(compiler, &defined, &reassigned, predicate,
+                    token.length + 2);
+        free(predicate);
+      }
+    }
+    previous = token;
+  }
+
+  if (bindsFunction(vm, &defined) || bindsFunction(vm, &reassigned)) {
+    deoptimize(vm);
+  }
+  compiler->wholeProgram =
+      vm->sharedTable == NULL && noteHeapAssignments(vm, &reassigned);
+  for (int i = 0; compiler->wholeProgram && i < defined.capacity; i++) {
+    ObjString *name = defined.entries[i].key;
+    if (name != NULL && get(&reassigned, name) == NULL) {
+      set(&compiler->pinned, name, MAKE_NIL());
+    }
+  }
+  freeTable(&defined);
+  freeTable(&reassigned);
+}
+
+// Compiles the length bytes at source into chunk. Functions and interned
+// strings are created in vm and functions are bound in its global table.
+// Strings and names are copied out of source, so it can be released after.
+// Since the whole program is seen at once, calls to the functions it defines
+// and binds only once are bound statically, and small ones inlined; each
+// function doing so keeps a fallback that looks its calls up by name, run
+// once a later compile binds one of them again. At optimization level 1 and
+// above the new code also goes through the optimizer. Everything compiled is
+// permanent, never collected.
+bool compile(VM *vm, const char *source, size_t length, Chunk *chunk) {
+  Compiler state;
+  initCompiler(&state, vm);
+  state.mainChunk = chunk;
+  Obj *existing = vm->objects;
+  findPinned(&state, source, length);
+  bool compiled = compileAppend(&state, source, length);
+  if (compiled && vm->optimizationLevel > 0) {
+    optimizeProgram(vm, chunk, existing, &state.pinned);
+  }
+  freeTable(&state.pinned);
+  makePermanent(vm, existing, chunk);
+  return compiled;
 }
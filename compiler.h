@@ -3,6 +3,7 @@
 #include "chunk.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 //Represents a Precedence for an operation.
 typedef enum {
     PREC_NONE,
@@ -18,8 +19,10 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
+typedef struct Compiler Compiler;
+
 //Reprsents a function which parses tokens. CanAssign represents if the parsed expression returned by this function can be assigned to a value.
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Compiler* compiler, bool canAssign);
 
 //Represents a Local with a Token and depth
 typedef struct {
@@ -27,12 +30,31 @@ typedef struct {
     int depth;
 } Local;
 
-//Represents a Compiler object and stores a list of current Locals, number of current locals, and the current depth
+//Represents the tokens the parser is between and its error state
 typedef struct {
+    Token previous;
+    Token current;
+    bool hadError;
+    bool panicMode;
+} Parser;
+
+//Represents a Compiler object. Holds all state for one compilation: the vm objects are created in, the scanner and parser, the chunk being written to, and a list of current Locals, number of current locals, and the current depth
+struct Compiler {
+    VM* vm;
+    Scanner scanner;
+    Parser parser;
+    Chunk* compilingChunk;
+    Chunk* mainChunk;
     Local locals[256];
     int localCount;
     int currentScope;
-} Compiler;
+    //Functions the source defines that nothing can bind to anything else. Calls to them, once defined, are bound statically
+    Table pinned;
+    //Set when the whole program is compiled at once, so calls can be bound statically and inlined
+    bool wholeProgram;
+    //Calls bound statically so far. A function body with any is compiled a second time as its fallback
+    int boundCalls;
+};
 //Represents how a certain token parses. Includes functions for when it is in a prefix as well as infix context and its precedence.
 typedef struct {
     ParseFn prefix;
@@ -41,10 +63,11 @@ typedef struct {
 } ParseRule;
 
 
-bool compile(const char* source, Chunk* chunk);
-void parsePrecedence(Precedence precedence);
-void expression();
-void initCompiler(Compiler* current);
+bool compile(VM* vm, const char* source, size_t length, Chunk* chunk);
+bool compileAppend(Compiler* compiler, const char* source, size_t length);
+void parsePrecedence(Compiler* compiler, Precedence precedence);
+void expression(Compiler* compiler);
+void initCompiler(Compiler* compiler, VM* vm);
 ParseRule* getRule(TokenType type);
 // ObjString* makeObjString(const char* start, int length);
 
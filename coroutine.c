@@ -0,0 +1,160 @@
+#include "coroutine.h"
+#include "loop.h"
+#include "memory.h"
+#include "perf.h"
+#include "value.h"
+#include "vm.h"
+#include <stdlib.h>
+
+// Creates a coroutine that calls func when first resumed
+ObjCoroutine *createCoroutine(VM *vm, ObjFunc *func) {
+  ObjCoroutine *output =
+      (ObjCoroutine *)allocate(MEMORY_OBJECTS, sizeof(ObjCoroutine));
+  output->func = func;
+  output->state = COROUTINE_NEW;
+  // Frames at the bottom of a coroutine's stack return to whoever resumed it
+  output->context = (Context){.chunk = func->chunk,
+                              .ip = func->chunk->code,
+                              .returnIp = NULL,
+                              .frameBottom = 0,
+                              .stack = output->stack,
+                              .stackTop = output->stack};
+  output->resumerCoroutine = NULL;
+  output->fiber = false;
+  output->scanned = 0;
+  output->remembered = false;
+
+  output->obj.type = OBJ_COROUTINE;
+  trackObject(vm, &output->obj);
+  return output;
+}
+
+// Saves the running stack's registers. top is where its stack will end once
+// the call being made has returned.
+void saveContext(VM *vm, Context *context, Value *top) {
+  context->chunk = vm->chunk;
+  context->ip = vm->ip;
+  context->returnIp = vm->returnIp;
+  context->frameBottom = vm->frameBottom;
+  context->stack = vm->stack;
+  context->stackTop = top;
+}
+
+void loadContext(VM *vm, Context *context) {
+  vm->chunk = context->chunk;
+  vm->ip = context->ip;
+  vm->returnIp = context->returnIp;
+  vm->frameBottom = context->frameBottom;
+  vm->stack = context->stack;
+  vm->stackTop = context->stackTop;
+  if (vm->perf != NULL && vm->perf->byFunction) {
+    switchPerfFunction(vm, false);
+  }
+}
+
+// Switches to context from inside a native taking argCount arguments. The
+// call's epilogue takes argCount values and the three frame placeholders off
+// whichever stack is running, then pushes the native's result, so that many
+// slots are left above the top for it to drop.
+static void switchFromNative(VM *vm, Context *context, int argCount) {
+  loadContext(vm, context);
+  vm->stackTop += argCount + 3;
+}
+
+// Called when the function at the bottom of the running coroutine returns.
+// Continues whoever resumed it, with returnVal as the result of resume, or
+// for a fiber the next fiber the event loop runs.
+void finishCoroutine(VM *vm, Value returnVal) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  coroutine->state = COROUTINE_DONE;
+  if (coroutine->fiber) {
+    push(vm, finishFiber(vm));
+    return;
+  }
+  vm->coroutine = coroutine->resumerCoroutine;
+  loadContext(vm, &coroutine->resumer);
+  push(vm, returnVal);
+}
+
+static bool coroutineNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!isObjectOfType(args[0], OBJ_FUNCTION) ||
+      ((ObjFunc *)args[0].as.obj)->numParams != 1) {
+    runtimeError(vm, "coroutine expects a function of one parameter, got %s",
+                 typeName(args[0]));
+    return false;
+  }
+  *result = MAKE_OBJ((Obj *)createCoroutine(vm, (ObjFunc *)args[0].as.obj));
+  return true;
+}
+
+// resume(coroutine, value) runs coroutine until it yields or returns, and
+// evaluates to the value it yielded or returned. The first resume passes
+// value as the function's argument, later ones as the result of yield.
+static bool resumeNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!isObjectOfType(args[0], OBJ_COROUTINE)) {
+    runtimeError(vm, "resume expects a Coroutine, got %s", typeName(args[0]));
+    return false;
+  }
+  ObjCoroutine *coroutine = (ObjCoroutine *)args[0].as.obj;
+  if (coroutine->state == COROUTINE_DONE) {
+    runtimeError(vm, "Cannot resume a coroutine that has returned");
+    return false;
+  }
+  if (coroutine->state == COROUTINE_RUNNING) {
+    runtimeError(vm, "Cannot resume a coroutine that is already running");
+    return false;
+  }
+  if (coroutine->fiber || coroutine->state == COROUTINE_WAITING) {
+    runtimeError(vm, "Cannot resume a coroutine run by the event loop");
+    return false;
+  }
+
+  // A new coroutine's stack is empty, so the value resume leaves on it is
+  // the function's parameter
+  *result = args[1];
+  markResumed(&vm->gc, coroutine);
+  saveContext(vm, &coroutine->resumer, args - 3);
+  coroutine->resumerCoroutine = vm->coroutine;
+  coroutine->state = COROUTINE_RUNNING;
+  vm->coroutine = coroutine;
+  switchFromNative(vm, &coroutine->context, argCount);
+  return true;
+}
+
+// yield(value) suspends the running coroutine, handing value to whoever
+// resumed it, and evaluates to the value of the next resume
+static bool yieldNative(VM *vm, int argCount, Value *args, Value *result) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  if (coroutine == NULL) {
+    runtimeError(vm, "yield can only be called inside a coroutine");
+    return false;
+  }
+  if (coroutine->fiber) {
+    yieldFiber(vm, argCount, args, result);
+    return true;
+  }
+  *result = args[0];
+  saveContext(vm, &coroutine->context, args - 3);
+  coroutine->state = COROUTINE_SUSPENDED;
+  vm->coroutine = coroutine->resumerCoroutine;
+  switchFromNative(vm, &coroutine->resumer, argCount);
+  return true;
+}
+
+static bool isDoneNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!isObjectOfType(args[0], OBJ_COROUTINE)) {
+    runtimeError(vm, "isDone expects a Coroutine, got %s", typeName(args[0]));
+    return false;
+  }
+  *result = MAKE_BOOL(((ObjCoroutine *)args[0].as.obj)->state ==
+                      COROUTINE_DONE);
+  return true;
+}
+
+// Binds the coroutine natives as globals
+void defineCoroutineNatives(VM *vm) {
+  defineNative(vm, "coroutine", coroutineNative, 1);
+  defineNative(vm, "resume", resumeNative, 2);
+  defineNative(vm, "yield", yieldNative, 1);
+  defineNative(vm, "isDone", isDoneNative, 1);
+}
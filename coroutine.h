@@ -0,0 +1,57 @@
+#ifndef sethi_coroutine_h
+#define sethi_coroutine_h
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+typedef enum {
+  // Not resumed yet. The first resume calls its function.
+  COROUTINE_NEW,
+  COROUTINE_SUSPENDED,
+  COROUTINE_RUNNING,
+  // Parked by the event loop until its I/O, timer or turn comes
+  COROUTINE_WAITING,
+  // Its function has returned
+  COROUTINE_DONE
+} CoroutineState;
+
+// The registers of a stack that is not running. Switching stacks saves and
+// restores only these.
+typedef struct {
+  Chunk *chunk;
+  uint8_t *ip;
+  uint8_t *returnIp;
+  uint8_t frameBottom;
+  Value *stack;
+  Value *stackTop;
+} Context;
+
+// A function running on its own value stack, which suspends itself with
+// yield(value) and continues when resumed. Its frames live on that stack, so
+// it can yield from any depth of calls.
+typedef struct ObjCoroutine {
+  Obj obj;
+  ObjFunc *func;
+  CoroutineState state;
+  // Where it continues when resumed
+  Context context;
+  // Where the code that resumed it continues when it yields or returns
+  Context resumer;
+  struct ObjCoroutine *resumerCoroutine;
+  // Run by the event loop instead of by resume
+  bool fiber;
+  // The collector cycle that last scanned its stack
+  uint32_t scanned;
+  // In the collector's remembered set
+  bool remembered;
+  Value stack[STACK_MAX];
+} ObjCoroutine;
+
+ObjCoroutine *createCoroutine(VM *vm, ObjFunc *func);
+void saveContext(VM *vm, Context *context, Value *top);
+void loadContext(VM *vm, Context *context);
+void finishCoroutine(VM *vm, Value returnVal);
+void defineCoroutineNatives(VM *vm);
+
+#endif
@@ -60,13 +60,30 @@ static int callInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
-// Prints instruction for table with a 1 byte operand representing number of
-// fields
-static int tableInstruction(const char *name, Chunk *chunk, int offset) {
+// Prints a call with its number of params and the function it calls
+static int directCallInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%s   ", name);
+  printf("Number of params for function: ");
+  printf("%4d ", chunk->code[offset + 1]);
+  printValue(chunk->constants.values[chunk->code[offset + 2]]);
+  return offset + 3;
+}
+
+// Prints a field read with the index of the field in its struct
+static int fieldInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%s   ", name);
+  printf("Index of field: ");
+  printf("%4d", chunk->code[offset + 1]);
+  return offset + 2;
+}
+
+// Prints instruction for struct with a 1 byte operand representing number of
+// fields and one for its shape
+static int structInstruction(const char *name, Chunk *chunk, int offset) {
   printf("%s  ", name);
   int fields = chunk->code[offset + 1];
   int index = chunk->code[offset + 2];
-  printf("fields/type: ");
+  printf("fields/shape: ");
   printf("%u/<", fields);
   printValue(chunk->constants.values[index]);
   printf(">");
@@ -147,12 +164,32 @@ int dissasembleInstruction(Chunk *chunk, int offset) {
     return callInstruction("OP_CALL", chunk, offset);
   case OP_DOT:
     return simpleInstruction("OP_DOT", offset);
-  case OP_TABLE:
-    return tableInstruction("OP_TABLE", chunk, offset);
+  case OP_STRUCT:
+    return structInstruction("OP_STRUCT", chunk, offset);
   case OP_NAMESPACE:
     return constantInstruction("OP_NAMESPACE", chunk, offset);
   case OP_TYPE:
     return simpleInstruction("OP_TYPE", offset);
+  case OP_CALL_DIRECT:
+    return directCallInstruction("OP_CALL_DIRECT", chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+  case OP_MUL_NUM:
+    return simpleInstruction("OP_MUL_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  case OP_LESS_EQUAL_NUM:
+    return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+  case OP_GREATER_EQUAL_NUM:
+    return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+  case OP_FIELD:
+    return fieldInstruction("OP_FIELD", chunk, offset);
   default:
     printf("Cannot recognize code: %d\n", code);
     return offset + 1;
@@ -0,0 +1,1523 @@
+#include "gc.h"
+#include "buffer.h"
+#include "chunk.h"
+#include "coroutine.h"
+#include "loop.h"
+#include "memory.h"
+#include "table.h"
+#include "task.h"
+#include "vm.h"
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+static int64_t nanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void initWorker(Collector *gc, GcWorker *worker, int index) {
+  worker->gc = gc;
+  worker->index = index;
+  worker->stack = NULL;
+  worker->count = 0;
+  worker->capacity = 0;
+  pthread_mutex_init(&worker->lock, NULL);
+  worker->shared = NULL;
+  atomic_init(&worker->sharedCount, 0);
+  worker->sharedCapacity = 0;
+  worker->job = 0;
+  worker->work = 0;
+  worker->reported = 0;
+  worker->deferred = NULL;
+  worker->deferredCount = 0;
+  worker->deferredCapacity = 0;
+  worker->freed = 0;
+}
+
+static void freeWorker(GcWorker *worker) {
+  FREE_ARRAY(Obj *, worker->stack, worker->capacity);
+  FREE_ARRAY(Obj *, worker->shared, worker->sharedCapacity);
+  FREE_ARRAY(Obj *, worker->deferred, worker->deferredCapacity);
+  pthread_mutex_destroy(&worker->lock);
+  worker->stack = NULL;
+  worker->count = 0;
+  worker->capacity = 0;
+  worker->shared = NULL;
+  worker->sharedCapacity = 0;
+  worker->deferred = NULL;
+  worker->deferredCapacity = 0;
+}
+
+void initCollector(Collector *gc) {
+  gc->phase = GC_IDLE;
+  gc->enabled = true;
+  gc->cycles = 0;
+  initWorker(gc, &gc->marker, 0);
+  gc->globalsIndex = 0;
+  gc->globalsCapacity = 0;
+  gc->regions = NULL;
+  gc->regionCount = 0;
+  gc->regionCapacity = 0;
+  atomic_init(&gc->sweepIndex, 0);
+  gc->fillRegion = 0;
+  gc->fillSlot = 0;
+  gc->arenas = NULL;
+  gc->arenaCount = 0;
+  gc->allocated = 0;
+  gc->threshold = GC_MIN_HEAP;
+  gc->debt = 0;
+  gc->tasks = NULL;
+  gc->taskCount = 0;
+  gc->taskCapacity = 0;
+  gc->nursery = NULL;
+  gc->nurseryTop = NULL;
+  gc->nurseryEnd = NULL;
+  gc->remembered = NULL;
+  gc->rememberedCount = 0;
+  gc->rememberedCapacity = 0;
+  gc->youngGlobals = false;
+  gc->minors = 0;
+  gc->youngBytes = 0;
+  gc->promotedBytes = 0;
+  gc->pauseTarget = GC_PAUSE_DEFAULT;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    gc->pauses[i] = 0;
+  }
+  gc->slices = 0;
+  gc->totalPause = 0;
+  gc->longestPause = 0;
+  gc->threads = 1;
+  gc->helpers = NULL;
+  gc->helperThreads = NULL;
+  gc->helperCount = 0;
+  gc->memory = NULL;
+  pthread_mutex_init(&gc->jobLock, NULL);
+  pthread_cond_init(&gc->jobStarted, NULL);
+  pthread_cond_init(&gc->jobFinished, NULL);
+  gc->job = 0;
+  gc->jobKind = GC_JOB_MARK;
+  gc->busy = 0;
+  gc->stopping = false;
+  gc->parallel = false;
+  atomic_init(&gc->stop, false);
+  atomic_init(&gc->active, 0);
+  atomic_init(&gc->hungry, 0);
+  atomic_init(&gc->jobWork, 0);
+  gc->budget = 0;
+  gc->deadline = 0;
+}
+
+static void stopHelpers(Collector *gc) {
+  pthread_mutex_lock(&gc->jobLock);
+  gc->stopping = true;
+  pthread_cond_broadcast(&gc->jobStarted);
+  pthread_mutex_unlock(&gc->jobLock);
+  for (int i = 0; i < gc->helperCount; i++) {
+    pthread_join(gc->helperThreads[i], NULL);
+    freeWorker(&gc->helpers[i]);
+  }
+  release(MEMORY_COLLECTOR, gc->helpers,
+          sizeof(GcWorker) * (GC_MAX_THREADS - 1));
+  release(MEMORY_COLLECTOR, gc->helperThreads,
+          sizeof(pthread_t) * (GC_MAX_THREADS - 1));
+  gc->helpers = NULL;
+  gc->helperThreads = NULL;
+  gc->helperCount = 0;
+  gc->stopping = false;
+}
+
+static bool inArena(Collector *gc, Obj *object) {
+  for (int i = 0; i < gc->arenaCount; i++) {
+    Arena *arena = &gc->arenas[i];
+    if ((char *)object >= arena->start &&
+        (char *)object < arena->start + arena->size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Freeing a task waits for it to finish running the VM's functions, and a
+// struct's size is read from its shape as it is freed, so tasks are freed
+// first and shapes last
+static int freeingPass(Obj *object) {
+  return object->type == OBJ_TASK ? 0 : object->type == OBJ_SHAPE ? 2 : 1;
+}
+
+// Stops the helper threads and frees the old generation, along with the
+// collector's own memory
+void freeCollector(Collector *gc) {
+  stopHelpers(gc);
+  for (int pass = 0; pass < 3; pass++) {
+    for (int i = 0; i < gc->regionCount; i++) {
+      for (int slot = 0; slot < GC_REGION_OBJECTS; slot++) {
+        Obj *object = gc->regions[i]->objects[slot];
+        if (object != NULL && freeingPass(object) == pass &&
+            !inArena(gc, object)) {
+          freeObject(object);
+          gc->regions[i]->objects[slot] = NULL;
+        }
+      }
+    }
+  }
+  for (int i = 0; i < gc->arenaCount; i++) {
+    munmap(gc->arenas[i].start, gc->arenas[i].size);
+    countMemory(MEMORY_COLLECTOR, -(long long)gc->arenas[i].size);
+  }
+  for (int i = 0; i < gc->regionCount; i++) {
+    release(MEMORY_COLLECTOR, gc->regions[i], sizeof(Region));
+  }
+  FREE_ARRAY(Region *, gc->regions, gc->regionCapacity);
+  FREE_ARRAY(Arena, gc->arenas, gc->arenaCount);
+  gc->regions = NULL;
+  gc->regionCount = 0;
+  gc->regionCapacity = 0;
+  gc->arenas = NULL;
+  gc->arenaCount = 0;
+  freeWorker(&gc->marker);
+  FREE_ARRAY(struct ObjTask *, gc->tasks, gc->taskCapacity);
+  FREE_ARRAY(ObjCoroutine *, gc->remembered, gc->rememberedCapacity);
+  release(MEMORY_COLLECTOR, gc->nursery, GC_NURSERY);
+  gc->tasks = NULL;
+  gc->taskCapacity = 0;
+  gc->remembered = NULL;
+  gc->rememberedCapacity = 0;
+  gc->nursery = NULL;
+  gc->nurseryTop = NULL;
+  gc->nurseryEnd = NULL;
+}
+
+// Returns the bytes object holds, including what it points to and frees
+// with it
+size_t objectSize(Obj *object) {
+  switch (object->type) {
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunc) + sizeof(Chunk);
+  case OBJ_STRUCT:
+    return sizeof(ObjStruct) +
+           sizeof(Value) * ((ObjStruct *)object)->shape->count;
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_BUFFER: {
+    ObjBuffer *buffer = (ObjBuffer *)object;
+    size_t elementSize =
+        buffer->kind == BUFFER_INT32 ? sizeof(int32_t) : sizeof(int64_t);
+    return sizeof(ObjBuffer) + elementSize * buffer->length;
+  }
+  case OBJ_SHAPE:
+    return sizeof(ObjShape) +
+           sizeof(ObjString *) * (((ObjShape *)object)->count + 1);
+  case OBJ_COROUTINE:
+    return sizeof(ObjCoroutine);
+  case OBJ_TASK:
+    return sizeof(ObjTask);
+  default:
+    return 0;
+  }
+}
+
+static Region *addRegion(Collector *gc) {
+  if (gc->regionCount == gc->regionCapacity) {
+    int capacity = GROW_CAPACITY(gc->regionCapacity);
+    gc->regions =
+        GROW_ARRAY(Region *, gc->regions, gc->regionCapacity, capacity);
+    gc->regionCapacity = capacity;
+  }
+  Region *region = (Region *)allocateZeroed(MEMORY_COLLECTOR, sizeof(Region));
+  gc->regions[gc->regionCount++] = region;
+  return region;
+}
+
+// Adds a new object, with its fields set, to vm's heap. It takes the next
+// free slot, in a new region once there is none, with its bit set so it is
+// black if a cycle is under way. The objects made since the cycle started
+// are also listed from vm->objects, for the compiler to find those it made.
+void trackObject(VM *vm, Obj *object) {
+  Collector *gc = &vm->gc;
+  size_t size = objectSize(object);
+  Region *region;
+  for (;;) {
+    region = gc->fillRegion < gc->regionCount ? gc->regions[gc->fillRegion]
+                                              : addRegion(gc);
+    while (region->count < GC_REGION_OBJECTS &&
+           gc->fillSlot < GC_REGION_OBJECTS &&
+           region->objects[gc->fillSlot] != NULL) {
+      gc->fillSlot++;
+    }
+    if (region->count < GC_REGION_OBJECTS &&
+        gc->fillSlot < GC_REGION_OBJECTS) {
+      break;
+    }
+    gc->fillRegion++;
+    gc->fillSlot = 0;
+  }
+  int slot = gc->fillSlot++;
+  region->objects[slot] = object;
+  region->marks[slot / 64] |= (uint64_t)1 << (slot % 64);
+  region->count++;
+  object->mark = MARK_OLD;
+  object->region = (uint32_t)gc->fillRegion;
+  object->slot = (uint16_t)slot;
+  object->next = vm->objects;
+  vm->objects = object;
+  gc->allocated += size;
+  gc->debt += size;
+}
+
+// Calls visit with every object of vm's old generation
+void visitHeap(VM *vm, void (*visit)(Obj *object, void *context),
+               void *context) {
+  for (int i = 0; i < vm->gc.regionCount; i++) {
+    for (int slot = 0; slot < GC_REGION_OBJECTS; slot++) {
+      if (vm->gc.regions[i]->objects[slot] != NULL) {
+        visit(vm->gc.regions[i]->objects[slot], context);
+      }
+    }
+  }
+}
+
+static void keepForever(Collector *gc, Value value) {
+  if (!IS_OBJ(value) || value.as.obj->mark == MARK_PERMANENT) {
+    return;
+  }
+  Obj *object = value.as.obj;
+  object->mark = MARK_PERMANENT;
+  gc->allocated -= objectSize(object);
+  switch (object->type) {
+  case OBJ_FUNCTION: {
+    ObjFunc *func = (ObjFunc *)object;
+    Chunk *chunks[] = {func->chunk, func->fallback};
+    for (int c = 0; c < 2 && chunks[c] != NULL; c++) {
+      ValueArray *constants = &chunks[c]->constants;
+      for (int i = 0; i < constants->count; i++) {
+        keepForever(gc, constants->values[i]);
+      }
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    keepForever(gc, MAKE_OBJ((Obj *)shape->type));
+    for (int i = 0; i < shape->count; i++) {
+      keepForever(gc, MAKE_OBJ((Obj *)shape->names[i]));
+    }
+    break;
+  }
+  case OBJ_STRUCT: {
+    ObjStruct *s = (ObjStruct *)object;
+    keepForever(gc, MAKE_OBJ((Obj *)s->shape));
+    for (int i = 0; i < s->shape->count; i++) {
+      keepForever(gc, s->fields[i]);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Makes the objects created in vm since the object since, and the constants
+// of chunk, permanent. Compiled code is never collected, since frames only
+// point at chunks, and so neither is anything its constants use.
+void makePermanent(VM *vm, Obj *since, Chunk *chunk) {
+  for (Obj *object = vm->objects; object != since; object = object->next) {
+    keepForever(&vm->gc, MAKE_OBJ(object));
+  }
+  if (chunk != NULL) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+      keepForever(&vm->gc, chunk->constants.values[i]);
+    }
+  }
+}
+
+static GcWorker *workerAt(Collector *gc, int index) {
+  return index == 0 ? &gc->marker : &gc->helpers[index - 1];
+}
+
+static void pushGray(GcWorker *worker, Obj *object) {
+  if (worker->count == worker->capacity) {
+    int capacity = GROW_CAPACITY(worker->capacity);
+    worker->stack =
+        GROW_ARRAY(Obj *, worker->stack, worker->capacity, capacity);
+    worker->capacity = capacity;
+  }
+  worker->stack[worker->count++] = object;
+}
+
+// Shades object for worker. While marking, an object that refers to others
+// goes on the worker's stack to have them traced later. Outside marking this
+// only keeps an object the sweep has not reached yet, which is how interned
+// strings found again are saved. Young objects are made after the cycle
+// started, so they are left to minor collections. When workers mark
+// together, the one whose atomic or sets the bit is the one that traces the
+// object.
+static void shade(GcWorker *worker, Obj *object) {
+  Collector *gc = worker->gc;
+  if (object->mark == MARK_PERMANENT || object->mark == MARK_YOUNG) {
+    return;
+  }
+  uint64_t *word = &gc->regions[object->region]->marks[object->slot / 64];
+  uint64_t bit = (uint64_t)1 << (object->slot % 64);
+  if (!gc->parallel) {
+    if (*word & bit) {
+      return;
+    }
+    *word |= bit;
+  } else if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) {
+    return;
+  }
+  if (gc->phase != GC_MARK || object->type == OBJ_STRING ||
+      object->type == OBJ_BUFFER || object->type == OBJ_NATIVE) {
+    return;
+  }
+  pushGray(worker, object);
+}
+
+static void shadeValue(GcWorker *worker, Value value) {
+  if (IS_OBJ(value)) {
+    shade(worker, value.as.obj);
+  }
+}
+
+void markObject(Collector *gc, Obj *object) { shade(&gc->marker, object); }
+
+void markValue(Collector *gc, Value value) {
+  shadeValue(&gc->marker, value);
+}
+
+// Marks the values on the stack from stack up to top, whose innermost frame
+// starts at frameBottom. The three slots below each frame hold the caller's
+// chunk, return address and frame bottom rather than values, so the walk
+// follows the saved frame bottoms and skips them.
+static void markFrames(GcWorker *worker, Value *stack, Value *top,
+                       uint8_t frameBottom) {
+  for (Value *slot = top - 1; slot >= stack; slot--) {
+    if (frameBottom > 0 && slot == stack + frameBottom - 1) {
+      frameBottom = (uint8_t)slot->as.number;
+      slot -= 2;
+      continue;
+    }
+    shadeValue(worker, *slot);
+  }
+}
+
+static void markCoroutineStack(GcWorker *worker, ObjCoroutine *coroutine) {
+  coroutine->scanned = worker->gc->cycles;
+  Context *context = &coroutine->context;
+  markFrames(worker, context->stack, context->stackTop,
+             context->frameBottom);
+}
+
+static void remember(Collector *gc, ObjCoroutine *coroutine) {
+  if (gc->rememberedCount == gc->rememberedCapacity) {
+    int capacity = GROW_CAPACITY(gc->rememberedCapacity);
+    gc->remembered = GROW_ARRAY(ObjCoroutine *, gc->remembered,
+                                gc->rememberedCapacity, capacity);
+    gc->rememberedCapacity = capacity;
+  }
+  gc->remembered[gc->rememberedCount++] = coroutine;
+  coroutine->remembered = true;
+}
+
+// The stack barrier. A coroutine's stack changes without write barriers
+// while it runs, so it is remembered for the next minor collection, and
+// scanned before it runs for the first time in a cycle. Called just before
+// coroutine continues.
+void markResumed(Collector *gc, ObjCoroutine *coroutine) {
+  if (gc->nursery != NULL && !coroutine->remembered) {
+    remember(gc, coroutine);
+  }
+  if (gc->phase != GC_MARK || coroutine->scanned == gc->cycles) {
+    return;
+  }
+  markObject(gc, &coroutine->obj);
+  markCoroutineStack(&gc->marker, coroutine);
+}
+
+// Keeps task, and what it shares with the VM that spawned it, alive until it
+// has finished running
+void keepTask(Collector *gc, ObjTask *task) {
+  if (gc->taskCount == gc->taskCapacity) {
+    int capacity = GROW_CAPACITY(gc->taskCapacity);
+    gc->tasks = GROW_ARRAY(ObjTask *, gc->tasks, gc->taskCapacity, capacity);
+    gc->taskCapacity = capacity;
+  }
+  gc->tasks[gc->taskCount++] = task;
+}
+
+// Traces the objects a gray object refers to, making it black
+static void blacken(GcWorker *worker, Obj *object) {
+  switch (object->type) {
+  case OBJ_STRUCT: {
+    ObjStruct *s = (ObjStruct *)object;
+    shade(worker, (Obj *)s->shape);
+    for (int i = 0; i < s->shape->count; i++) {
+      shadeValue(worker, s->fields[i]);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    shade(worker, (Obj *)shape->type);
+    for (int i = 0; i < shape->count; i++) {
+      shade(worker, (Obj *)shape->names[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunc *func = (ObjFunc *)object;
+    Chunk *chunks[] = {func->chunk, func->fallback};
+    for (int c = 0; c < 2 && chunks[c] != NULL; c++) {
+      ValueArray *constants = &chunks[c]->constants;
+      for (int i = 0; i < constants->count; i++) {
+        shadeValue(worker, constants->values[i]);
+      }
+    }
+    break;
+  }
+  case OBJ_COROUTINE: {
+    ObjCoroutine *coroutine = (ObjCoroutine *)object;
+    shade(worker, (Obj *)coroutine->func);
+    // A running coroutine's stack was scanned with the running stacks, and
+    // a finished one's holds nothing live
+    if (coroutine->scanned != worker->gc->cycles &&
+        coroutine->state != COROUTINE_RUNNING &&
+        coroutine->state != COROUTINE_DONE) {
+      markCoroutineStack(worker, coroutine);
+    }
+    break;
+  }
+  case OBJ_TASK: {
+    ObjTask *task = (ObjTask *)object;
+    shade(worker, (Obj *)task->func);
+    if (task->joined) {
+      shadeValue(worker, task->result);
+    } else {
+      for (int i = 0; i < task->kept.count; i++) {
+        shadeValue(worker, task->kept.values[i]);
+      }
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Marks the roots that change without write barriers: every stack in use,
+// the arguments of the run, the fibers of the event loop and running tasks
+static void markRoots(VM *vm) {
+  Collector *gc = &vm->gc;
+  // The running stack, then the stacks of whoever resumed it, down to the
+  // main stack
+  Value *stack = vm->stack;
+  Value *top = vm->stackTop;
+  uint8_t frameBottom = vm->frameBottom;
+  ObjCoroutine *running = vm->coroutine;
+  for (;;) {
+    markFrames(&gc->marker, stack, top, frameBottom);
+    if (running == NULL) {
+      break;
+    }
+    running->scanned = gc->cycles;
+    markObject(gc, &running->obj);
+    Context *below = running->fiber ? &vm->loop->main : &running->resumer;
+    running = running->fiber ? NULL : running->resumerCoroutine;
+    stack = below->stack;
+    top = below->stackTop;
+    frameBottom = below->frameBottom;
+  }
+
+  for (int i = 0; i < vm->argCount; i++) {
+    markValue(gc, vm->args[i]);
+  }
+
+  EventLoop *loop = vm->loop;
+  if (loop != NULL) {
+    for (int i = 0; i < loop->readyCount; i++) {
+      Ready *ready =
+          &loop->ready[(loop->readyHead + i) % loop->readyCapacity];
+      markObject(gc, &ready->coroutine->obj);
+      markValue(gc, ready->value);
+    }
+    for (int i = 0; i < loop->requestCapacity; i++) {
+      IoRequest *request = &loop->requests[i];
+      if (request->coroutine != NULL) {
+        markObject(gc, &request->coroutine->obj);
+        if (request->data != NULL) {
+          markObject(gc, &request->data->obj);
+        }
+      }
+    }
+    for (int i = 0; i < loop->timerCount; i++) {
+      markObject(gc, &loop->timers[i].coroutine->obj);
+    }
+  }
+
+  for (int i = 0; i < gc->taskCount; i++) {
+    if (taskFinished(gc->tasks[i])) {
+      gc->tasks[i--] = gc->tasks[--gc->taskCount];
+    } else {
+      markObject(gc, &gc->tasks[i]->obj);
+    }
+  }
+}
+
+// Copies a young object out to the old generation, unless it was already.
+// A string is interned as it is copied, so one whose text is interned
+// already becomes that string.
+static Obj *promote(VM *vm, Obj *object) {
+  if (object->next != NULL) {
+    return object->next;
+  }
+  size_t size = objectSize(object);
+  Obj *copy;
+  if (object->type == OBJ_STRING) {
+    ObjString *string = (ObjString *)object;
+    copy = (Obj *)copyString(vm, string->string, string->length);
+  } else {
+    copy = (Obj *)allocate(MEMORY_OBJECTS, size);
+    memcpy(copy, object, size);
+    trackObject(vm, copy);
+  }
+  vm->gc.promotedBytes += size;
+  object->next = copy;
+  return copy;
+}
+
+static void evacuate(Value *slot, void *vm) {
+  if (slot->type == VALUE_OBJ && slot->as.obj->mark == MARK_YOUNG) {
+    slot->as.obj = promote((VM *)vm, slot->as.obj);
+  }
+}
+
+typedef void (*Update)(Value *slot, void *context);
+
+// Passes a reference held as a pointer to update as a value, storing it back
+// only if update changed it, so objects nothing moved are not written to
+#define UPDATE_POINTER(pointer, update, context)                               \
+  do {                                                                         \
+    Value value = MAKE_OBJ((Obj *)(pointer));                                  \
+    (update)(&value, (context));                                               \
+    if (value.as.obj != (Obj *)(pointer)) {                                    \
+      (pointer) = (void *)value.as.obj;                                        \
+    }                                                                          \
+  } while (false)
+
+// Updates the values on a stack, skipping frame slots the way markFrames
+// does
+static void updateFrames(Value *stack, Value *top, uint8_t frameBottom,
+                         Update update, void *context) {
+  for (Value *slot = top - 1; slot >= stack; slot--) {
+    if (frameBottom > 0 && slot == stack + frameBottom - 1) {
+      frameBottom = (uint8_t)slot->as.number;
+      slot -= 2;
+      continue;
+    }
+    update(slot, context);
+  }
+}
+
+// Updates the values on the running stack and the stacks below it
+static void updateRunning(VM *vm, Update update, void *context) {
+  Value *stack = vm->stack;
+  Value *top = vm->stackTop;
+  uint8_t frameBottom = vm->frameBottom;
+  ObjCoroutine *running = vm->coroutine;
+  for (;;) {
+    updateFrames(stack, top, frameBottom, update, context);
+    if (running == NULL) {
+      break;
+    }
+    Context *below = running->fiber ? &vm->loop->main : &running->resumer;
+    running = running->fiber ? NULL : running->resumerCoroutine;
+    stack = below->stack;
+    top = below->stackTop;
+    frameBottom = below->frameBottom;
+  }
+}
+
+// Updates the values the event loop holds for the fibers it will resume
+static void updateLoop(VM *vm, Update update, void *context) {
+  EventLoop *loop = vm->loop;
+  if (loop == NULL) {
+    return;
+  }
+  for (int i = 0; i < loop->readyCount; i++) {
+    update(&loop->ready[(loop->readyHead + i) % loop->readyCapacity].value,
+           context);
+  }
+  for (int i = 0; i < loop->requestCapacity; i++) {
+    IoRequest *request = &loop->requests[i];
+    if (request->coroutine != NULL && request->data != NULL) {
+      UPDATE_POINTER(request->data, update, context);
+    }
+  }
+}
+
+static void updateGlobals(VM *vm, Update update, void *context) {
+  for (int i = 0; i < vm->table.capacity; i++) {
+    if (vm->table.entries[i].key != NULL) {
+      update(&vm->table.entries[i].value, context);
+    }
+  }
+}
+
+// Calls visit with the roots of vm's heap besides its globals: every stack
+// in use and the coroutines running on them, the arguments of the run, the
+// fibers of the event loop and the running tasks
+void visitRoots(VM *vm, void (*visit)(Value *value, void *context),
+                void *context) {
+  updateRunning(vm, visit, context);
+  // Coroutines never move, so visit sees copies of these
+  for (ObjCoroutine *running = vm->coroutine; running != NULL;
+       running = running->fiber ? NULL : running->resumerCoroutine) {
+    Value value = MAKE_OBJ((Obj *)running);
+    visit(&value, context);
+  }
+  for (int i = 0; i < vm->argCount; i++) {
+    visit(&vm->args[i], context);
+  }
+  updateLoop(vm, visit, context);
+  EventLoop *loop = vm->loop;
+  if (loop != NULL) {
+    for (int i = 0; i < loop->readyCount; i++) {
+      UPDATE_POINTER(
+          loop->ready[(loop->readyHead + i) % loop->readyCapacity].coroutine,
+          visit, context);
+    }
+    for (int i = 0; i < loop->requestCapacity; i++) {
+      if (loop->requests[i].coroutine != NULL) {
+        UPDATE_POINTER(loop->requests[i].coroutine, visit, context);
+      }
+    }
+    for (int i = 0; i < loop->timerCount; i++) {
+      UPDATE_POINTER(loop->timers[i].coroutine, visit, context);
+    }
+  }
+  for (int i = 0; i < vm->gc.taskCount; i++) {
+    UPDATE_POINTER(vm->gc.tasks[i], visit, context);
+  }
+}
+
+// Calls visit with every value object refers to, the way blacken traces it
+void visitReferences(Obj *object, void (*visit)(Value *value, void *context),
+                     void *context) {
+  switch (object->type) {
+  case OBJ_STRUCT: {
+    ObjStruct *s = (ObjStruct *)object;
+    UPDATE_POINTER(s->shape, visit, context);
+    for (int i = 0; i < s->shape->count; i++) {
+      visit(&s->fields[i], context);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    UPDATE_POINTER(shape->type, visit, context);
+    for (int i = 0; i < shape->count; i++) {
+      UPDATE_POINTER(shape->names[i], visit, context);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunc *func = (ObjFunc *)object;
+    Chunk *chunks[] = {func->chunk, func->fallback};
+    for (int c = 0; c < 2 && chunks[c] != NULL; c++) {
+      ValueArray *constants = &chunks[c]->constants;
+      for (int i = 0; i < constants->count; i++) {
+        visit(&constants->values[i], context);
+      }
+    }
+    break;
+  }
+  case OBJ_COROUTINE: {
+    ObjCoroutine *coroutine = (ObjCoroutine *)object;
+    UPDATE_POINTER(coroutine->func, visit, context);
+    if (coroutine->state != COROUTINE_RUNNING &&
+        coroutine->state != COROUTINE_DONE) {
+      Context *stack = &coroutine->context;
+      updateFrames(stack->stack, stack->stackTop, stack->frameBottom, visit,
+                   context);
+    }
+    break;
+  }
+  case OBJ_TASK: {
+    ObjTask *task = (ObjTask *)object;
+    UPDATE_POINTER(task->func, visit, context);
+    visit(&task->arg, context);
+    visit(&task->result, context);
+    for (int i = 0; i < task->kept.count; i++) {
+      visit(&task->kept.values[i], context);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// The minor collection. Copies the young objects reachable from the
+// running stacks, the remembered coroutines, the event loop and, after a
+// young global was set, the globals into the old generation, then empties
+// the nursery. Nothing is freed one at a time.
+static void evacuateYoung(VM *vm) {
+  Collector *gc = &vm->gc;
+  if (gc->nursery == NULL) {
+    return;
+  }
+  // Copies are added in front of the old generation, so the ones whose
+  // fields are still to be evacuated are those in front of traced
+  Obj *traced = vm->objects;
+  updateRunning(vm, evacuate, vm);
+
+  for (int i = 0; i < gc->rememberedCount; i++) {
+    ObjCoroutine *coroutine = gc->remembered[i];
+    coroutine->remembered = false;
+    if (coroutine->state != COROUTINE_RUNNING &&
+        coroutine->state != COROUTINE_DONE) {
+      Context *context = &coroutine->context;
+      updateFrames(context->stack, context->stackTop, context->frameBottom,
+                   evacuate, vm);
+    }
+  }
+  gc->rememberedCount = 0;
+
+  if (gc->youngGlobals) {
+    updateGlobals(vm, evacuate, vm);
+    gc->youngGlobals = false;
+  }
+  updateLoop(vm, evacuate, vm);
+
+  while (vm->objects != traced) {
+    Obj *newest = vm->objects;
+    for (Obj *object = newest; object != traced; object = object->next) {
+      if (object->type == OBJ_STRUCT) {
+        ObjStruct *s = (ObjStruct *)object;
+        for (int i = 0; i < s->shape->count; i++) {
+          evacuate(&s->fields[i], vm);
+        }
+      }
+    }
+    traced = newest;
+  }
+
+  // The running coroutines go on changing their stacks
+  for (ObjCoroutine *running = vm->coroutine; running != NULL;
+       running = running->fiber ? NULL : running->resumerCoroutine) {
+    remember(gc, running);
+  }
+  gc->youngBytes += gc->nurseryTop - gc->nursery;
+  gc->nurseryTop = gc->nursery;
+  gc->minors++;
+}
+
+static void startCycle(VM *vm) {
+  Collector *gc = &vm->gc;
+  evacuateYoung(vm);
+  // Turn every object white. Those made from now on are black.
+  for (int i = 0; i < gc->regionCount; i++) {
+    memset(gc->regions[i]->marks, 0, sizeof(gc->regions[i]->marks));
+  }
+  vm->objects = NULL;
+  gc->cycles++;
+  gc->phase = GC_MARK;
+  gc->globalsIndex = 0;
+  gc->globalsCapacity = vm->table.capacity;
+  markRoots(vm);
+}
+
+// Traces one gray object or global. Returns the bytes traced, or 0 once
+// nothing is left to trace.
+static size_t markStep(VM *vm) {
+  Collector *gc = &vm->gc;
+  if (gc->marker.count > 0) {
+    Obj *object = gc->marker.stack[--gc->marker.count];
+    blacken(&gc->marker, object);
+    return objectSize(object);
+  }
+  Table *globals = &vm->table;
+  if (gc->globalsCapacity != globals->capacity) {
+    gc->globalsCapacity = globals->capacity;
+    gc->globalsIndex = 0;
+  }
+  if (gc->globalsIndex < globals->capacity) {
+    Entry *entry = &globals->entries[gc->globalsIndex++];
+    if (entry->key != NULL) {
+      markObject(gc, &entry->key->obj);
+      markValue(gc, entry->value);
+    }
+    return sizeof(Entry);
+  }
+  return 0;
+}
+
+static void defer(GcWorker *worker, Obj *object) {
+  if (worker->deferredCount == worker->deferredCapacity) {
+    int capacity = GROW_CAPACITY(worker->deferredCapacity);
+    worker->deferred = GROW_ARRAY(Obj *, worker->deferred,
+                                  worker->deferredCapacity, capacity);
+    worker->deferredCapacity = capacity;
+  }
+  worker->deferred[worker->deferredCount++] = object;
+}
+
+// Frees the objects of region that were not marked and empties their slots.
+// Strings have to leave the intern table and tasks may have to run others
+// while they wait to be freed, so those are left to the main thread, and so
+// are frozen objects, whose memory is the arena's. Shapes are compiled, so
+// permanent, and a struct's size can be read while other regions are freed.
+// Marked objects are not even read. Returns the bytes swept, counting a slot
+// for each of them.
+static size_t sweepRegion(Collector *gc, Region *region, GcWorker *worker) {
+  size_t work = sizeof(region->marks);
+  for (int slot = 0; slot < GC_REGION_OBJECTS && region->count > 0; slot++) {
+    Obj *object = region->objects[slot];
+    if (object == NULL) {
+      continue;
+    }
+    if (region->marks[slot / 64] >> (slot % 64) & 1) {
+      work += sizeof(Obj *);
+      continue;
+    }
+    size_t size = objectSize(object);
+    work += size;
+    if (object->mark == MARK_PERMANENT) {
+      continue;
+    }
+    region->objects[slot] = NULL;
+    region->count--;
+    worker->freed += size;
+    if (object->type == OBJ_STRING || object->type == OBJ_TASK ||
+        object->mark == MARK_FROZEN) {
+      defer(worker, object);
+    } else {
+      freeObject(object);
+    }
+  }
+  return work;
+}
+
+// Frees what worker left for the main thread, removing strings from the
+// intern table so it does not keep them alive
+static void freeDeferred(VM *vm, GcWorker *worker) {
+  for (int i = 0; i < worker->deferredCount; i++) {
+    Obj *object = worker->deferred[i];
+    if (object->type == OBJ_STRING) {
+      removeKey(&vm->strings, (ObjString *)object);
+    }
+    if (object->mark != MARK_FROZEN) {
+      freeObject(object);
+    }
+  }
+  worker->deferredCount = 0;
+  vm->gc.allocated -= worker->freed;
+  worker->freed = 0;
+}
+
+// Sweeps the next region. Returns the bytes swept, or 0 once every region
+// has been, dropping the empty ones at the end.
+static size_t sweepStep(VM *vm) {
+  Collector *gc = &vm->gc;
+  int index = gc->sweepIndex;
+  if (index >= gc->regionCount) {
+    while (gc->regionCount > 0 &&
+           gc->regions[gc->regionCount - 1]->count == 0) {
+      release(MEMORY_COLLECTOR, gc->regions[--gc->regionCount],
+              sizeof(Region));
+    }
+    gc->fillRegion = 0;
+    gc->fillSlot = 0;
+    return 0;
+  }
+  gc->sweepIndex = index + 1;
+  size_t work = sweepRegion(gc, gc->regions[index], &gc->marker);
+  freeDeferred(vm, &gc->marker);
+  return work;
+}
+
+// Adds the work worker did since it last reported to the job's total, and
+// returns whether the job should stop. The main thread stops it once the
+// slice's budget is done or its deadline has passed.
+static bool shouldStop(GcWorker *worker) {
+  Collector *gc = worker->gc;
+  size_t added = worker->work - worker->reported;
+  size_t total = atomic_fetch_add(&gc->jobWork, added) + added;
+  worker->reported = worker->work;
+  if (worker->index == 0 && !atomic_load(&gc->stop) &&
+      (total >= gc->budget || nanoseconds() >= gc->deadline)) {
+    atomic_store(&gc->stop, true);
+  }
+  return atomic_load(&gc->stop);
+}
+
+// Moves the older half of worker's gray objects to where workers that ran
+// out can steal them, once one has and worker shares none already
+static void share(GcWorker *worker) {
+  if (atomic_load(&worker->gc->hungry) == 0 || worker->count < 2 ||
+      atomic_load(&worker->sharedCount) > 0) {
+    return;
+  }
+  int half = worker->count / 2;
+  pthread_mutex_lock(&worker->lock);
+  if (worker->sharedCapacity < half) {
+    int capacity = worker->sharedCapacity;
+    while (capacity < half) {
+      capacity = GROW_CAPACITY(capacity);
+    }
+    worker->shared = GROW_ARRAY(Obj *, worker->shared,
+                                worker->sharedCapacity, capacity);
+    worker->sharedCapacity = capacity;
+  }
+  memcpy(worker->shared, worker->stack, sizeof(Obj *) * half);
+  atomic_store(&worker->sharedCount, half);
+  pthread_mutex_unlock(&worker->lock);
+  memmove(worker->stack, worker->stack + half,
+          sizeof(Obj *) * (worker->count - half));
+  worker->count -= half;
+}
+
+// Takes gray objects for worker once its stack is empty: everything it
+// shared itself, or else half of what another worker shares, visiting them
+// in order from its own. Returns whether it found any.
+static bool steal(GcWorker *worker) {
+  Collector *gc = worker->gc;
+  for (int i = 0; i < gc->threads; i++) {
+    GcWorker *victim = workerAt(gc, (worker->index + i) % gc->threads);
+    if (atomic_load(&victim->sharedCount) == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&victim->lock);
+    int available = atomic_load(&victim->sharedCount);
+    int taken = victim == worker ? available : (available + 1) / 2;
+    for (int j = 1; j <= taken; j++) {
+      pushGray(worker, victim->shared[available - j]);
+    }
+    atomic_store(&victim->sharedCount, available - taken);
+    pthread_mutex_unlock(&victim->lock);
+    if (taken > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool anyShared(Collector *gc) {
+  for (int i = 0; i < gc->threads; i++) {
+    if (atomic_load(&workerAt(gc, i)->sharedCount) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Traces gray objects until the job is stopped or none are left. A worker
+// that runs out steals more, and marking is over once every worker has run
+// out and none are shared.
+static void markWorker(GcWorker *worker) {
+  Collector *gc = worker->gc;
+  for (;;) {
+    for (int units = 1; worker->count > 0; units++) {
+      Obj *object = worker->stack[--worker->count];
+      blacken(worker, object);
+      worker->work += objectSize(object);
+      if (units % 64 == 0) {
+        if (shouldStop(worker)) {
+          return;
+        }
+        share(worker);
+      }
+    }
+    if (steal(worker)) {
+      continue;
+    }
+    atomic_fetch_sub(&gc->active, 1);
+    atomic_fetch_add(&gc->hungry, 1);
+    bool found = false;
+    while (!shouldStop(worker)) {
+      if (anyShared(gc)) {
+        atomic_fetch_add(&gc->active, 1);
+        if (steal(worker)) {
+          found = true;
+          break;
+        }
+        atomic_fetch_sub(&gc->active, 1);
+      } else if (atomic_load(&gc->active) == 0) {
+        break;
+      }
+      sched_yield();
+    }
+    atomic_fetch_sub(&gc->hungry, 1);
+    if (!found) {
+      return;
+    }
+  }
+}
+
+// Sweeps the next region no worker has claimed yet, until the job is
+// stopped or none are left
+static void sweepWorker(GcWorker *worker) {
+  Collector *gc = worker->gc;
+  do {
+    int index = atomic_fetch_add(&gc->sweepIndex, 1);
+    if (index >= gc->regionCount) {
+      return;
+    }
+    worker->work += sweepRegion(gc, gc->regions[index], worker);
+  } while (!shouldStop(worker));
+}
+
+static void runWorker(GcWorker *worker, GcJob kind) {
+  if (kind == GC_JOB_MARK) {
+    markWorker(worker);
+  } else {
+    sweepWorker(worker);
+  }
+}
+
+static void *helperMain(void *arg) {
+  GcWorker *worker = (GcWorker *)arg;
+  Collector *gc = worker->gc;
+  useAccount(gc->memory);
+  pthread_mutex_lock(&gc->jobLock);
+  for (;;) {
+    while (gc->job == worker->job && !gc->stopping) {
+      pthread_cond_wait(&gc->jobStarted, &gc->jobLock);
+    }
+    if (gc->stopping) {
+      break;
+    }
+    worker->job = gc->job;
+    if (worker->index >= gc->threads) {
+      continue;
+    }
+    GcJob kind = gc->jobKind;
+    pthread_mutex_unlock(&gc->jobLock);
+    runWorker(worker, kind);
+    flushAccount();
+    pthread_mutex_lock(&gc->jobLock);
+    if (--gc->busy == 0) {
+      pthread_cond_signal(&gc->jobFinished);
+    }
+  }
+  pthread_mutex_unlock(&gc->jobLock);
+  return NULL;
+}
+
+// Starts helper threads until there is one for every thread but the main
+static void startHelpers(Collector *gc) {
+  if (gc->helpers == NULL) {
+    gc->helpers = (GcWorker *)allocate(
+        MEMORY_COLLECTOR, sizeof(GcWorker) * (GC_MAX_THREADS - 1));
+    gc->helperThreads = (pthread_t *)allocate(
+        MEMORY_COLLECTOR, sizeof(pthread_t) * (GC_MAX_THREADS - 1));
+  }
+  while (gc->helperCount < gc->threads - 1) {
+    GcWorker *helper = &gc->helpers[gc->helperCount];
+    initWorker(gc, helper, gc->helperCount + 1);
+    helper->job = gc->job;
+    pthread_create(&gc->helperThreads[gc->helperCount], NULL, helperMain,
+                   helper);
+    gc->helperCount++;
+  }
+}
+
+// Runs kind on every thread, the main one included, until it is done or has
+// done budget bytes of work or deadline has passed. Returns the bytes done.
+static size_t runJob(Collector *gc, GcJob kind, size_t budget,
+                     int64_t deadline) {
+  startHelpers(gc);
+  atomic_store(&gc->stop, false);
+  atomic_store(&gc->jobWork, 0);
+  gc->budget = budget;
+  gc->deadline = deadline;
+  for (int i = 0; i < gc->threads; i++) {
+    workerAt(gc, i)->work = 0;
+    workerAt(gc, i)->reported = 0;
+  }
+  pthread_mutex_lock(&gc->jobLock);
+  gc->jobKind = kind;
+  gc->busy = gc->threads - 1;
+  gc->job++;
+  pthread_cond_broadcast(&gc->jobStarted);
+  pthread_mutex_unlock(&gc->jobLock);
+
+  runWorker(&gc->marker, kind);
+
+  pthread_mutex_lock(&gc->jobLock);
+  while (gc->busy > 0) {
+    pthread_cond_wait(&gc->jobFinished, &gc->jobLock);
+  }
+  pthread_mutex_unlock(&gc->jobLock);
+  size_t work = 0;
+  for (int i = 0; i < gc->threads; i++) {
+    work += workerAt(gc, i)->work;
+  }
+  return work;
+}
+
+// Marks on every thread, then gathers the gray objects a stopped job left
+// back on the main thread's stack. Returns the bytes traced.
+static size_t markParallel(VM *vm, size_t budget, int64_t deadline) {
+  Collector *gc = &vm->gc;
+  atomic_store(&gc->active, gc->threads);
+  atomic_store(&gc->hungry, 0);
+  gc->parallel = true;
+  size_t work = runJob(gc, GC_JOB_MARK, budget, deadline);
+  gc->parallel = false;
+  for (int i = 0; i < gc->threads; i++) {
+    GcWorker *worker = workerAt(gc, i);
+    int shared = atomic_load(&worker->sharedCount);
+    for (int j = 0; j < shared; j++) {
+      pushGray(&gc->marker, worker->shared[j]);
+    }
+    atomic_store(&worker->sharedCount, 0);
+    if (worker != &gc->marker) {
+      for (int j = 0; j < worker->count; j++) {
+        pushGray(&gc->marker, worker->stack[j]);
+      }
+      worker->count = 0;
+    }
+  }
+  return work;
+}
+
+// Sweeps regions on every thread, then frees what the workers left for the
+// main thread. Returns the bytes swept.
+static size_t sweepParallel(VM *vm, size_t budget, int64_t deadline) {
+  Collector *gc = &vm->gc;
+  size_t work = runJob(gc, GC_JOB_SWEEP, budget, deadline);
+  if (gc->sweepIndex > gc->regionCount) {
+    gc->sweepIndex = gc->regionCount;
+  }
+  for (int i = 0; i < gc->threads; i++) {
+    freeDeferred(vm, workerAt(gc, i));
+  }
+  return work;
+}
+
+// Does a unit of the cycle's work and returns the bytes it traced or swept,
+// or 0 once the cycle is over. A unit is one object, global or region on the
+// main thread, or with several threads as much as fits in budget and
+// deadline.
+static size_t collectStep(VM *vm, size_t budget, int64_t deadline) {
+  Collector *gc = &vm->gc;
+  if (gc->phase == GC_MARK) {
+    size_t work = gc->threads > 1 && gc->marker.count >= GC_PARALLEL_MIN
+                      ? markParallel(vm, budget, deadline)
+                      : markStep(vm);
+    if (work > 0) {
+      return work;
+    }
+    gc->phase = GC_SWEEP;
+    gc->sweepIndex = 0;
+  }
+  if (gc->phase == GC_SWEEP) {
+    size_t work = gc->threads > 1 && gc->regionCount - gc->sweepIndex > 1
+                      ? sweepParallel(vm, budget, deadline)
+                      : sweepStep(vm);
+    if (work > 0) {
+      return work;
+    }
+  }
+  gc->phase = GC_IDLE;
+  gc->threshold = gc->allocated * 2 > GC_MIN_HEAP ? gc->allocated * 2
+                                                  : GC_MIN_HEAP;
+  return 0;
+}
+
+static void recordPause(Collector *gc, int64_t pause) {
+  int bucket = 0;
+  for (int64_t micros = pause / 1000; micros > 0 &&
+                                      bucket < GC_PAUSE_BUCKETS - 1;
+       micros >>= 1) {
+    bucket++;
+  }
+  gc->pauses[bucket]++;
+  gc->slices++;
+  gc->totalPause += pause;
+  if (pause > gc->longestPause) {
+    gc->longestPause = pause;
+  }
+}
+
+// Runs a minor collection. Called by the interpreter when the nursery is
+// full, before the object it is making and while every live value is on a
+// stack. Makes the nursery the first time.
+void collectYoung(VM *vm) {
+  Collector *gc = &vm->gc;
+  if (gc->nursery == NULL) {
+    gc->nursery = (char *)allocate(MEMORY_COLLECTOR, GC_NURSERY);
+    gc->nurseryTop = gc->nursery;
+    gc->nurseryEnd = gc->nursery + GC_NURSERY;
+    return;
+  }
+  int64_t start = nanoseconds();
+  evacuateYoung(vm);
+  recordPause(gc, nanoseconds() - start);
+}
+
+// Runs a slice of the collector, starting a cycle if the heap has grown past
+// the threshold. Called by the interpreter between instructions once it has
+// allocated GC_STEP bytes, when every live value is on a stack. The slice
+// stops once it has done the work owed for those bytes, or once the pause
+// target has passed, leaving the rest to a slice that comes sooner.
+void stepCollector(VM *vm) {
+  Collector *gc = &vm->gc;
+  size_t owed = gc->debt * GC_WORK_RATIO;
+  gc->debt = 0;
+  if (!gc->enabled ||
+      (gc->phase == GC_IDLE && gc->allocated < gc->threshold)) {
+    return;
+  }
+  int64_t start = nanoseconds();
+  int64_t deadline = start + gc->pauseTarget * 1000;
+  if (gc->phase == GC_IDLE) {
+    startCycle(vm);
+  }
+  // Without a pause target each cycle runs whole in the slice starting it
+  if (gc->pauseTarget == 0) {
+    while (collectStep(vm, SIZE_MAX, INT64_MAX)) {
+    }
+    recordPause(gc, nanoseconds() - start);
+    return;
+  }
+  size_t done = 0;
+  // Reading the clock costs more than tracing an object, so it is read once
+  // every GC_CLOCK_WORK bytes
+  size_t clock = GC_CLOCK_WORK;
+  while (done < owed) {
+    size_t work = collectStep(vm, owed - done, deadline);
+    if (work == 0) {
+      owed = 0;
+      break;
+    }
+    done += work;
+    if (done >= clock) {
+      if (nanoseconds() >= deadline) {
+        break;
+      }
+      clock = done + GC_CLOCK_WORK;
+    }
+  }
+  if (done < owed) {
+    gc->debt = (owed - done) / GC_WORK_RATIO;
+  }
+  recordPause(gc, nanoseconds() - start);
+}
+
+// Finishes the cycle under way and then runs a whole new one in a single
+// pause, so everything unreachable now is freed
+void collectGarbage(VM *vm) {
+  Collector *gc = &vm->gc;
+  MemoryAccount *outer = useAccount(&vm->memory);
+  int64_t start = nanoseconds();
+  while (collectStep(vm, SIZE_MAX, INT64_MAX)) {
+  }
+  startCycle(vm);
+  while (collectStep(vm, SIZE_MAX, INT64_MAX)) {
+  }
+  gc->debt = 0;
+  recordPause(gc, nanoseconds() - start);
+  useAccount(outer);
+}
+
+// Returns the bytes object takes in an arena, or 0 if compactHeap leaves it
+// where it is. Only structs and strings move: nothing changes them, so the
+// arena's pages are never written to again.
+static size_t arenaSize(Obj *object) {
+  if (object->mark != MARK_OLD) {
+    return 0;
+  }
+  size_t size;
+  if (object->type == OBJ_STRUCT) {
+    size = objectSize(object);
+  } else if (object->type == OBJ_STRING) {
+    size = sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  } else {
+    return 0;
+  }
+  return (size + sizeof(Value) - 1) / sizeof(Value) * sizeof(Value);
+}
+
+// Keeps the memory at start, which holds frozen objects, until the heap is
+// freed and the memory unmapped with it
+void addArena(Collector *gc, char *start, size_t size) {
+  countMemory(MEMORY_COLLECTOR, (long long)size);
+  gc->arenas =
+      GROW_ARRAY(Arena, gc->arenas, gc->arenaCount, gc->arenaCount + 1);
+  gc->arenas[gc->arenaCount].start = start;
+  gc->arenas[gc->arenaCount].size = size;
+  gc->arenaCount++;
+}
+
+static void relocate(Value *slot, void *context) {
+  if (slot->type == VALUE_OBJ && slot->as.obj->mark == MARK_MOVED) {
+    slot->as.obj = slot->as.obj->next;
+  }
+}
+
+// Points every reference to a moved object at its copy
+static void relocateAll(VM *vm) {
+  Collector *gc = &vm->gc;
+  visitRoots(vm, relocate, NULL);
+  updateGlobals(vm, relocate, NULL);
+  // Names of globals are moved too when they are not compiled, such as
+  // those of natives a host defined
+  Table *tables[] = {&vm->strings, &vm->table};
+  for (int t = 0; t < 2; t++) {
+    for (int i = 0; i < tables[t]->capacity; i++) {
+      Entry *entry = &tables[t]->entries[i];
+      if (entry->key != NULL && entry->key->obj.mark == MARK_MOVED) {
+        entry->key = (ObjString *)entry->key->obj.next;
+      }
+    }
+  }
+  for (int i = 0; i < gc->regionCount; i++) {
+    for (int slot = 0; slot < GC_REGION_OBJECTS; slot++) {
+      Obj *object = gc->regions[i]->objects[slot];
+      if (object != NULL) {
+        visitReferences(object, relocate, NULL);
+      }
+    }
+  }
+}
+
+// Moves every object of the old generation into the lowest slots, so the
+// regions are as few as they can be
+static void packRegions(Collector *gc) {
+  int index = 0;
+  int slot = 0;
+  for (int i = 0; i < gc->regionCount; i++) {
+    Region *region = gc->regions[i];
+    for (int j = 0; j < GC_REGION_OBJECTS; j++) {
+      Obj *object = region->objects[j];
+      if (object == NULL) {
+        continue;
+      }
+      region->objects[j] = NULL;
+      region->count--;
+      if (slot == GC_REGION_OBJECTS) {
+        index++;
+        slot = 0;
+      }
+      gc->regions[index]->objects[slot] = object;
+      gc->regions[index]->count++;
+      object->region = (uint32_t)index;
+      object->slot = (uint16_t)slot++;
+    }
+  }
+  int count = slot > 0 ? index + 1 : index;
+  for (int i = count; i < gc->regionCount; i++) {
+    release(MEMORY_COLLECTOR, gc->regions[i], sizeof(Region));
+  }
+  gc->regionCount = count;
+  gc->fillRegion = index;
+  gc->fillSlot = slot;
+}
+
+// Runs a full collection, then copies the live structs and strings of vm
+// into one arena and packs the regions. A process forked from vm afterwards
+// shares the arena's pages with it for as long as both run: frozen objects
+// are never written to, their marks are kept in the regions, and they are
+// freed only with the arena. Also stops the helper threads, which a fork
+// would not copy. Returns false without moving anything while tasks vm
+// spawned are running, since they may read what would move.
+bool compactHeap(VM *vm) {
+  Collector *gc = &vm->gc;
+  collectGarbage(vm);
+  if (gc->taskCount > 0) {
+    return false;
+  }
+  MemoryAccount *outer = useAccount(&vm->memory);
+  stopHelpers(gc);
+
+  size_t size = 0;
+  int moved = 0;
+  for (int i = 0; i < gc->regionCount; i++) {
+    for (int slot = 0; slot < GC_REGION_OBJECTS; slot++) {
+      Obj *object = gc->regions[i]->objects[slot];
+      if (object != NULL && arenaSize(object) > 0) {
+        size += arenaSize(object);
+        moved++;
+      }
+    }
+  }
+  if (moved > 0) {
+    char *start = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Obj **originals = (Obj **)malloc(sizeof(Obj *) * moved);
+    if (start == MAP_FAILED || originals == NULL) {
+      exit(1);
+    }
+    addArena(gc, start, size);
+
+    char *top = start;
+    int count = 0;
+    for (int i = 0; i < gc->regionCount; i++) {
+      for (int slot = 0; slot < GC_REGION_OBJECTS; slot++) {
+        Obj *object = gc->regions[i]->objects[slot];
+        if (object == NULL || arenaSize(object) == 0) {
+          continue;
+        }
+        Obj *copy = (Obj *)top;
+        size_t objectBytes = arenaSize(object);
+        if (object->type == OBJ_STRING) {
+          ObjString *string = (ObjString *)object;
+          memcpy(copy, object, sizeof(ObjString));
+          ((ObjString *)copy)->string = top + sizeof(ObjString);
+          memcpy(top + sizeof(ObjString), string->string, string->length + 1);
+        } else {
+          memcpy(copy, object, objectSize(object));
+        }
+        copy->mark = MARK_FROZEN;
+        gc->regions[i]->objects[slot] = copy;
+        object->mark = MARK_MOVED;
+        object->next = copy;
+        originals[count++] = object;
+        top += objectBytes;
+      }
+    }
+    relocateAll(vm);
+    for (int i = 0; i < count; i++) {
+      freeObject(originals[i]);
+    }
+    free(originals);
+  }
+  packRegions(gc);
+  useAccount(outer);
+  return true;
+}
+
+// Prints how many slices the collector ran and how long they paused the
+// program, as a histogram, then how much of the young generation survived
+void printCollectorStats(Collector *gc, FILE *out) {
+  fprintf(out,
+          "gc: %u cycles, %llu pauses, %.3f ms in total, longest %.3f ms, "
+          "target %.3f ms, %d threads\n",
+          gc->cycles, (unsigned long long)gc->slices, gc->totalPause / 1e6,
+          gc->longestPause / 1e6, gc->pauseTarget / 1e3, gc->threads);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (gc->pauses[i] == 0) {
+      continue;
+    }
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(out, "  >= %6d us: %llu\n", 1 << (i - 1),
+              (unsigned long long)gc->pauses[i]);
+    } else {
+      fprintf(out, "  <  %6d us: %llu\n", 1 << i,
+              (unsigned long long)gc->pauses[i]);
+    }
+  }
+  size_t young = gc->youngBytes + (gc->nurseryTop - gc->nursery);
+  fprintf(out, "gc: %llu minor collections, %.1f MB young, %.1f%% promoted\n",
+          (unsigned long long)gc->minors, young / (1024.0 * 1024.0),
+          young > 0 ? 100.0 * gc->promotedBytes / young : 0.0);
+}
@@ -0,0 +1,253 @@
+#ifndef sethi_gc_h
+#define sethi_gc_h
+
+#include "common.h"
+#include "memory.h"
+#include "value.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Bytes a VM may allocate between two slices of the collector
+#define GC_STEP (64 * 1024)
+// Bytes a slice traces or sweeps for every byte allocated since the last one,
+// so a cycle finishes before the heap grows far past its threshold
+#define GC_WORK_RATIO 4
+// The heap a VM can grow to before its first cycle starts
+#define GC_MIN_HEAP (1024 * 1024)
+// Default longest slice, in microseconds
+#define GC_PAUSE_DEFAULT 500
+// Bytes of the young generation
+#define GC_NURSERY (256 * 1024)
+// Pauses are counted in buckets of powers of two microseconds, the last
+// bucket holding every longer one
+#define GC_PAUSE_BUCKETS 16
+// Bytes a slice works through between readings of the clock
+#define GC_CLOCK_WORK 4096
+// Most objects in a region of the old generation
+#define GC_REGION_OBJECTS 1024
+// Gray objects a slice needs before it marks on helper threads
+#define GC_PARALLEL_MIN 64
+// Most threads one collector runs on
+#define GC_MAX_THREADS 64
+
+typedef enum {
+  // Waiting for the heap to grow past the threshold
+  GC_IDLE,
+  // Tracing from the roots, a slice at a time
+  GC_MARK,
+  // Freeing what marking did not reach, a slice at a time
+  GC_SWEEP
+} GcPhase;
+
+struct Collector;
+struct ObjCoroutine;
+struct ObjTask;
+
+// Part of the old generation: a table of objects, and beside it a bit for
+// each saying whether the cycle has reached it. An object's header holds its
+// region and slot, written once when it is made, so marking and sweeping
+// write only to the region and never to the object. Regions are swept
+// independently.
+typedef struct {
+  Obj *objects[GC_REGION_OBJECTS];
+  uint64_t marks[GC_REGION_OBJECTS / 64];
+  // Slots in use
+  int count;
+} Region;
+
+// Memory compactHeap copied objects into
+typedef struct {
+  char *start;
+  size_t size;
+} Arena;
+
+// One thread's share of the collector's work. It traces gray objects from
+// its own stack, handing some to shared when other workers run out, and
+// leaves the strings and tasks it sweeps on deferred for the main thread.
+typedef struct {
+  struct Collector *gc;
+  int index;
+  Obj **stack;
+  int count;
+  int capacity;
+  // Gray objects other workers may steal, guarded by lock
+  pthread_mutex_t lock;
+  Obj **shared;
+  atomic_int sharedCount;
+  int sharedCapacity;
+  // The last job the worker ran
+  uint64_t job;
+  // Bytes traced or swept in the current job, and how many of them were
+  // added to the collector's total
+  size_t work;
+  size_t reported;
+  // Dead objects only the main thread may free, and the bytes of every
+  // object swept away
+  Obj **deferred;
+  int deferredCount;
+  int deferredCapacity;
+  size_t freed;
+} GcWorker;
+
+typedef enum { GC_JOB_MARK, GC_JOB_SWEEP } GcJob;
+
+// An incremental tri-color mark and sweep collector for the objects of one
+// VM. An object is black once its bit in its region is set, gray if it is
+// also still on a gray stack waiting to be traced, and white otherwise.
+// Clearing the bits at the start of a cycle turns every object white, and
+// objects are made with their bit set, so those made during a cycle start
+// black. Since no object is written to, a process forked from the VM shares
+// its heap's pages until it changes the objects themselves.
+//
+// Structs and concatenated strings made by the interpreter start in a young
+// generation instead, taken by bumping a pointer through the nursery. Once it
+// is full a minor collection copies what is still reachable into the old
+// generation and reuses the whole nursery, so its cost follows the survivors
+// rather than the garbage. Structs never change, so the only old objects
+// that can refer to young ones are stacks and globals: the running stacks,
+// the coroutines run since the last minor collection and, once a young value
+// was stored in one, the globals are its roots. Every cycle starts with a
+// minor collection, so the old generation's marking never has to trace young
+// objects.
+//
+// Marking finds everything reachable when the cycle began: the running
+// stacks are scanned when it starts, a suspended coroutine's stack before it
+// runs again, and a global about to be overwritten is marked first. So the
+// mutator can run between slices. Each slice does work in proportion to what
+// was allocated since the last one, stopping early once the pause target has
+// passed.
+//
+// With more than one thread, a slice with enough gray objects marks on
+// helper threads too, each claiming an object by setting its mark atomically
+// and stealing gray objects from the others once it runs out. Sweeping hands
+// out whole regions instead.
+typedef struct Collector {
+  GcPhase phase;
+  // Off for heaps whose objects other VMs may still use
+  bool enabled;
+  // Cycles started, so a coroutine can tell whether its stack was scanned
+  // in this one
+  uint32_t cycles;
+  // The main thread's worker, whose stack holds the gray objects between
+  // slices
+  GcWorker marker;
+  // The next global to trace, and the table's capacity when tracing began.
+  // A grown table is traced again from the start.
+  int globalsIndex;
+  int globalsCapacity;
+  // The old generation, and the next region to sweep
+  Region **regions;
+  int regionCount;
+  int regionCapacity;
+  atomic_int sweepIndex;
+  // Where to look for the next free slot, from the start again after every
+  // sweep
+  int fillRegion;
+  int fillSlot;
+  Arena *arenas;
+  int arenaCount;
+  // Bytes held by objects that can be freed
+  size_t allocated;
+  // Size of the heap at which the next cycle starts
+  size_t threshold;
+  // Bytes allocated since the last slice, plus those whose work a slice cut
+  // short by the pause target left to the next
+  size_t debt;
+  // Tasks that may still be running. They keep what they share alive.
+  struct ObjTask **tasks;
+  int taskCount;
+  int taskCapacity;
+  // The young generation. Objects are made at nurseryTop until it reaches
+  // nurseryEnd. NULL until the first young object.
+  char *nursery;
+  char *nurseryTop;
+  char *nurseryEnd;
+  // Coroutines that have run since the last minor collection, the old
+  // objects whose stacks may refer to young ones
+  struct ObjCoroutine **remembered;
+  int rememberedCount;
+  int rememberedCapacity;
+  // Whether a young value was stored in a global since the last minor
+  // collection
+  bool youngGlobals;
+  uint64_t minors;
+  size_t youngBytes;
+  size_t promotedBytes;
+  // Longest a slice should run, in microseconds, or 0 to run every cycle in
+  // one slice
+  int64_t pauseTarget;
+  uint64_t pauses[GC_PAUSE_BUCKETS];
+  uint64_t slices;
+  int64_t totalPause;
+  int64_t longestPause;
+  // Threads marking and sweeping, the main one included
+  int threads;
+  // Helper threads, started the first time a job needs them. A helper waits
+  // for job to change, runs it when its index is below threads, then counts
+  // busy down.
+  GcWorker *helpers;
+  pthread_t *helperThreads;
+  // The VM's account, which helpers charge what they allocate and free to
+  MemoryAccount *memory;
+  int helperCount;
+  pthread_mutex_t jobLock;
+  pthread_cond_t jobStarted;
+  pthread_cond_t jobFinished;
+  uint64_t job;
+  GcJob jobKind;
+  int busy;
+  bool stopping;
+  // While a job runs: whether marks are claimed atomically, whether the
+  // workers should stop, the workers holding gray objects, those looking for
+  // some, and the bytes done against the slice's budget and deadline
+  bool parallel;
+  atomic_bool stop;
+  atomic_int active;
+  atomic_int hungry;
+  atomic_size_t jobWork;
+  size_t budget;
+  int64_t deadline;
+} Collector;
+
+// Marks a reference about to be overwritten while a cycle is marking, so
+// that the mutator can not hide an object from the cycle by moving it
+#define WRITE_BARRIER(gc, old)                                                 \
+  do {                                                                         \
+    if ((gc)->phase == GC_MARK) {                                              \
+      markValue((gc), (old));                                                  \
+    }                                                                          \
+  } while (false)
+
+// Notes a global set to value, so the next minor collection looks for young
+// objects in the globals
+#define GLOBAL_BARRIER(gc, value)                                              \
+  do {                                                                         \
+    if (IS_OBJ(value) && (value).as.obj->mark == MARK_YOUNG) {                 \
+      (gc)->youngGlobals = true;                                               \
+    }                                                                          \
+  } while (false)
+
+void initCollector(Collector *gc);
+void freeCollector(Collector *gc);
+void trackObject(VM *vm, Obj *object);
+void makePermanent(VM *vm, Obj *since, Chunk *chunk);
+void markObject(Collector *gc, Obj *object);
+void markValue(Collector *gc, Value value);
+void markResumed(Collector *gc, struct ObjCoroutine *coroutine);
+void keepTask(Collector *gc, struct ObjTask *task);
+void collectYoung(VM *vm);
+void stepCollector(VM *vm);
+void collectGarbage(VM *vm);
+void printCollectorStats(Collector *gc, FILE *out);
+void visitHeap(VM *vm, void (*visit)(Obj *object, void *context),
+               void *context);
+void visitRoots(VM *vm, void (*visit)(Value *value, void *context),
+                void *context);
+void visitReferences(Obj *object, void (*visit)(Value *value, void *context),
+                     void *context);
+size_t objectSize(Obj *object);
+bool compactHeap(VM *vm);
+void addArena(Collector *gc, char *start, size_t size);
+
+#endif
@@ -0,0 +1,500 @@
+#include "heap.h"
+#include "gc.h"
+#include "memory.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Collects the whole heap, so what is left of it is live. A heap whose
+// collector is off is counted as it is.
+static void collectFirst(VM *vm) {
+  if (vm->gc.enabled) {
+    collectGarbage(vm);
+  }
+}
+
+typedef struct {
+  HeapStats *stats;
+  // The index in structs of each type of struct counted so far
+  Table byType;
+} Counting;
+
+static void countObject(Obj *object, void *context) {
+  Counting *counting = (Counting *)context;
+  HeapStats *stats = counting->stats;
+  size_t size = objectSize(object);
+  stats->types[object->type].count++;
+  stats->types[object->type].bytes += size;
+  stats->objects++;
+  stats->bytes += size;
+  if (object->mark == MARK_PERMANENT) {
+    stats->permanentBytes += size;
+  }
+  if (object->type != OBJ_STRUCT) {
+    return;
+  }
+  ObjString *type = ((ObjStruct *)object)->shape->type;
+  Value *index = get(&counting->byType, type);
+  HeapCount *count;
+  if (index != NULL) {
+    count = &stats->structs[index->as.number];
+  } else {
+    if (stats->structCount == stats->structCapacity) {
+      int capacity = GROW_CAPACITY(stats->structCapacity);
+      stats->structs = GROW_ARRAY(HeapCount, stats->structs,
+                                  stats->structCapacity, capacity);
+      stats->structCapacity = capacity;
+    }
+    set(&counting->byType, type, MAKE_NUM(stats->structCount));
+    count = &stats->structs[stats->structCount++];
+    count->name = type->string;
+    count->count = 0;
+    count->bytes = 0;
+  }
+  count->count++;
+  count->bytes += size;
+}
+
+static int compareBytes(const void *a, const void *b) {
+  size_t left = ((const HeapCount *)a)->bytes;
+  size_t right = ((const HeapCount *)b)->bytes;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void addTable(HeapStats *stats, const char *name, Table *table) {
+  TableUsage *usage = &stats->tables[stats->tableCount++];
+  usage->name = name;
+  usage->count = table->count;
+  usage->capacity = table->capacity;
+}
+
+// Collects vm's heap and counts what is left, by type of object and of
+// struct
+void takeHeapStats(VM *vm, HeapStats *stats) {
+  collectFirst(vm);
+  memset(stats, 0, sizeof(HeapStats));
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    Obj object = {.type = (uint8_t)i};
+    stats->types[i].name = typeName(MAKE_OBJ(&object));
+  }
+  Counting counting = {stats};
+  initTable(&counting.byType);
+  visitHeap(vm, countObject, &counting);
+  freeTable(&counting.byType);
+  qsort(stats->structs, stats->structCount, sizeof(HeapCount), compareBytes);
+
+  addTable(stats, "strings", &vm->strings);
+  addTable(stats, "globals", &vm->table);
+  if (vm->sharedTable != NULL) {
+    addTable(stats, "program globals", vm->sharedTable);
+  }
+  Collector *gc = &vm->gc;
+  stats->regions = gc->regionCount;
+  for (int i = 0; i < gc->regionCount; i++) {
+    stats->slotsUsed += gc->regions[i]->count;
+  }
+  for (int i = 0; i < gc->arenaCount; i++) {
+    stats->arenaBytes += gc->arenas[i].size;
+  }
+}
+
+void freeHeapStats(HeapStats *stats) {
+  FREE_ARRAY(HeapCount, stats->structs, stats->structCapacity);
+  stats->structs = NULL;
+  stats->structCount = 0;
+  stats->structCapacity = 0;
+}
+
+// Prints the live objects and bytes of each type, then how full the tables
+// and regions are
+void printHeapStats(HeapStats *stats, FILE *out) {
+  fprintf(out, "heap: %llu objects, %zu bytes live, %zu bytes permanent\n",
+          (unsigned long long)stats->objects, stats->bytes,
+          stats->permanentBytes);
+  fprintf(out, "%-24s %10s %12s\n", "type", "objects", "bytes");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (stats->types[i].count > 0) {
+      fprintf(out, "%-24s %10llu %12zu\n", stats->types[i].name,
+              (unsigned long long)stats->types[i].count,
+              stats->types[i].bytes);
+    }
+  }
+  if (stats->structCount > 0) {
+    fprintf(out, "%-24s %10s %12s\n", "struct", "objects", "bytes");
+  }
+  for (int i = 0; i < stats->structCount; i++) {
+    fprintf(out, "%-24s %10llu %12zu\n", stats->structs[i].name,
+            (unsigned long long)stats->structs[i].count,
+            stats->structs[i].bytes);
+  }
+  fprintf(out, "%-24s %10s %12s %6s\n", "table", "entries", "slots", "load");
+  for (int i = 0; i < stats->tableCount; i++) {
+    TableUsage *usage = &stats->tables[i];
+    fprintf(out, "%-24s %10d %12d %6.2f\n", usage->name, usage->count,
+            usage->capacity,
+            usage->capacity ? (double)usage->count / usage->capacity : 0.0);
+  }
+  fprintf(out, "regions: %d holding %llu of %llu slots\n", stats->regions,
+          (unsigned long long)stats->slotsUsed,
+          (unsigned long long)stats->regions * GC_REGION_OBJECTS);
+  if (stats->arenaBytes > 0) {
+    fprintf(out, "arenas: %zu bytes\n", stats->arenaBytes);
+  }
+}
+
+// Returns the node of object in a snapshot of vm's heap, or -1 if it is not
+// in vm's old generation, such as objects other VMs share with it
+int findHeapNode(VM *vm, Obj *object) {
+  Collector *gc = &vm->gc;
+  if (object->mark == MARK_YOUNG ||
+      object->region >= (uint32_t)gc->regionCount ||
+      gc->regions[object->region]->objects[object->slot] != object) {
+    return -1;
+  }
+  return 1 + (int)object->region * GC_REGION_OBJECTS + object->slot;
+}
+
+typedef struct {
+  VM *vm;
+  HeapSnapshot *snapshot;
+  // What the roots' edges are named while they are added, or NULL after
+  const char *rootName;
+} Building;
+
+static void addEdge(Building *building, int node) {
+  HeapSnapshot *snapshot = building->snapshot;
+  if (snapshot->edgeCount == snapshot->edgeCapacity) {
+    int capacity = GROW_CAPACITY(snapshot->edgeCapacity);
+    snapshot->edges =
+        GROW_ARRAY(int, snapshot->edges, snapshot->edgeCapacity, capacity);
+    snapshot->edgeCapacity = capacity;
+  }
+  if (building->rootName != NULL) {
+    if (snapshot->edgeCount == snapshot->rootCapacity) {
+      int capacity = GROW_CAPACITY(snapshot->rootCapacity);
+      snapshot->rootNames = GROW_ARRAY(const char *, snapshot->rootNames,
+                                       snapshot->rootCapacity, capacity);
+      snapshot->rootCapacity = capacity;
+    }
+    snapshot->rootNames[snapshot->edgeCount] = building->rootName;
+  }
+  snapshot->edges[snapshot->edgeCount++] = node;
+}
+
+static void addReference(Value *value, void *context) {
+  Building *building = (Building *)context;
+  if (value->type == VALUE_OBJ) {
+    int node = findHeapNode(building->vm, value->as.obj);
+    if (node > 0) {
+      addEdge(building, node);
+    }
+  }
+}
+
+static int intersect(HeapNode *nodes, int *order, int a, int b) {
+  while (a != b) {
+    while (order[a] < order[b]) {
+      a = nodes[a].dominator;
+    }
+    while (order[b] < order[a]) {
+      b = nodes[b].dominator;
+    }
+  }
+  return a;
+}
+
+// Finds each node's dominator with the iterative algorithm of Cooper, Harvey
+// and Kennedy, then adds up the retained sizes from the leaves of the
+// dominator tree to the roots
+static void findDominators(HeapSnapshot *snapshot) {
+  int count = snapshot->nodeCount;
+  HeapNode *nodes = snapshot->nodes;
+  int *starts = snapshot->edgeStarts;
+  int *edges = snapshot->edges;
+  // Each node's number in a depth first postorder from the roots, -1 until
+  // it is reached and -2 while its edges are followed
+  int *order = (int *)malloc(sizeof(int) * count);
+  int *postorder = (int *)malloc(sizeof(int) * count);
+  int *stack = (int *)malloc(sizeof(int) * count);
+  int *next = (int *)malloc(sizeof(int) * count);
+  int *predStarts = (int *)calloc(count + 1, sizeof(int));
+  int *preds = (int *)malloc(sizeof(int) * (snapshot->edgeCount + 1));
+  if (order == NULL || postorder == NULL || stack == NULL || next == NULL ||
+      predStarts == NULL || preds == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) {
+    order[i] = -1;
+    nodes[i].dominator = -1;
+    nodes[i].retained = nodes[i].size;
+  }
+
+  int reached = 0;
+  int depth = 1;
+  stack[0] = 0;
+  next[0] = starts[0];
+  order[0] = -2;
+  while (depth > 0) {
+    int node = stack[depth - 1];
+    if (next[node] < starts[node + 1]) {
+      int child = edges[next[node]++];
+      if (order[child] == -1) {
+        order[child] = -2;
+        next[child] = starts[child];
+        stack[depth++] = child;
+      }
+    } else {
+      order[node] = reached;
+      postorder[reached++] = node;
+      depth--;
+    }
+  }
+
+  // The reached nodes referring to each node
+  for (int node = 0; node < count; node++) {
+    if (order[node] >= 0) {
+      for (int i = starts[node]; i < starts[node + 1]; i++) {
+        predStarts[edges[i] + 1]++;
+      }
+    }
+  }
+  for (int node = 0; node < count; node++) {
+    predStarts[node + 1] += predStarts[node];
+    next[node] = predStarts[node];
+  }
+  for (int node = 0; node < count; node++) {
+    if (order[node] >= 0) {
+      for (int i = starts[node]; i < starts[node + 1]; i++) {
+        preds[next[edges[i]]++] = node;
+      }
+    }
+  }
+
+  nodes[0].dominator = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    // Reverse postorder, the roots last in postorder and so skipped
+    for (int k = reached - 2; k >= 0; k--) {
+      int node = postorder[k];
+      int dominator = -1;
+      for (int i = predStarts[node]; i < predStarts[node + 1]; i++) {
+        int pred = preds[i];
+        if (nodes[pred].dominator == -1) {
+          continue;
+        }
+        dominator =
+            dominator == -1 ? pred : intersect(nodes, order, pred, dominator);
+      }
+      if (nodes[node].dominator != dominator) {
+        nodes[node].dominator = dominator;
+        changed = true;
+      }
+    }
+  }
+
+  // A dominator comes after every node it dominates in postorder
+  for (int k = 0; k < reached - 1; k++) {
+    int node = postorder[k];
+    nodes[nodes[node].dominator].retained += nodes[node].retained;
+  }
+  free(order);
+  free(postorder);
+  free(stack);
+  free(next);
+  free(predStarts);
+  free(preds);
+}
+
+// Collects vm's heap and builds the graph of what is left, with the size
+// each object retains. The roots refer to the globals, to what the running
+// code uses and to the permanent objects, which nothing else retains since
+// they are never freed.
+void takeHeapSnapshot(VM *vm, HeapSnapshot *snapshot) {
+  collectFirst(vm);
+  Collector *gc = &vm->gc;
+  int count = 1 + gc->regionCount * GC_REGION_OBJECTS;
+  memset(snapshot, 0, sizeof(HeapSnapshot));
+  snapshot->nodeCount = count;
+  snapshot->nodes = (HeapNode *)calloc(count, sizeof(HeapNode));
+  snapshot->edgeStarts = (int *)malloc(sizeof(int) * (count + 1));
+  if (snapshot->nodes == NULL || snapshot->edgeStarts == NULL) {
+    exit(1);
+  }
+
+  Building building = {vm, snapshot, NULL};
+  snapshot->edgeStarts[0] = 0;
+  for (int i = 0; i < vm->table.capacity; i++) {
+    Entry *entry = &vm->table.entries[i];
+    if (entry->key != NULL) {
+      building.rootName = entry->key->string;
+      addReference(&entry->value, &building);
+    }
+  }
+  building.rootName = "(running)";
+  visitRoots(vm, addReference, &building);
+  building.rootName = "(permanent)";
+  for (int node = 1; node < count; node++) {
+    Region *region = gc->regions[(node - 1) / GC_REGION_OBJECTS];
+    Obj *object = region->objects[(node - 1) % GC_REGION_OBJECTS];
+    if (object != NULL && object->mark == MARK_PERMANENT) {
+      addEdge(&building, node);
+    }
+  }
+  building.rootName = NULL;
+
+  for (int node = 1; node < count; node++) {
+    Region *region = gc->regions[(node - 1) / GC_REGION_OBJECTS];
+    Obj *object = region->objects[(node - 1) % GC_REGION_OBJECTS];
+    snapshot->edgeStarts[node] = snapshot->edgeCount;
+    snapshot->nodes[node].object = object;
+    if (object != NULL) {
+      snapshot->nodes[node].size = objectSize(object);
+      visitReferences(object, addReference, &building);
+    }
+  }
+  snapshot->edgeStarts[count] = snapshot->edgeCount;
+  findDominators(snapshot);
+}
+
+void freeHeapSnapshot(HeapSnapshot *snapshot) {
+  free(snapshot->nodes);
+  free(snapshot->edgeStarts);
+  FREE_ARRAY(int, snapshot->edges, snapshot->edgeCapacity);
+  FREE_ARRAY(const char *, snapshot->rootNames, snapshot->rootCapacity);
+  memset(snapshot, 0, sizeof(HeapSnapshot));
+}
+
+static void writeJsonString(FILE *out, const char *string, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)string[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// Writes the name of an object: a string's text, or the type of a struct
+// or shape, or a native's name
+static void writeName(FILE *out, Obj *object) {
+  const char *name = NULL;
+  int length = 0;
+  switch (object->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    name = string->string;
+    length = string->length < HEAP_NAME_MAX ? string->length : HEAP_NAME_MAX;
+    break;
+  }
+  case OBJ_STRUCT:
+    name = ((ObjStruct *)object)->shape->type->string;
+    break;
+  case OBJ_SHAPE:
+    name = ((ObjShape *)object)->type->string;
+    break;
+  case OBJ_NATIVE:
+    name = ((ObjNative *)object)->name;
+    break;
+  default:
+    break;
+  }
+  if (name == NULL) {
+    fprintf(out, "null");
+    return;
+  }
+  writeJsonString(out, name, object->type == OBJ_STRING ? length
+                                                        : (int)strlen(name));
+}
+
+static void writeEdges(FILE *out, HeapSnapshot *snapshot, int node) {
+  fprintf(out, "[");
+  for (int i = snapshot->edgeStarts[node]; i < snapshot->edgeStarts[node + 1];
+       i++) {
+    fprintf(out, i > snapshot->edgeStarts[node] ? ", %d" : "%d",
+            snapshot->edges[i]);
+  }
+  fprintf(out, "]");
+}
+
+// Writes the reached nodes of snapshot as JSON, one to a line, then what
+// each of the roots' edges is named. A node's id is its index.
+void writeHeapSnapshot(HeapSnapshot *snapshot, FILE *out) {
+  fprintf(out, "{\"nodes\": [\n");
+  fprintf(out, "{\"id\": 0, \"type\": \"Roots\", \"size\": 0, "
+               "\"retained\": %zu, \"edges\": ",
+          snapshot->nodes[0].retained);
+  writeEdges(out, snapshot, 0);
+  fprintf(out, "}");
+  for (int node = 1; node < snapshot->nodeCount; node++) {
+    HeapNode *heapNode = &snapshot->nodes[node];
+    if (heapNode->object == NULL || heapNode->dominator == -1) {
+      continue;
+    }
+    fprintf(out, ",\n{\"id\": %d, \"type\": \"%s\", \"name\": ", node,
+            typeName(MAKE_OBJ(heapNode->object)));
+    writeName(out, heapNode->object);
+    fprintf(out, ", \"size\": %zu, \"retained\": %zu, \"dominator\": %d, "
+                 "\"edges\": ",
+            heapNode->size, heapNode->retained, heapNode->dominator);
+    writeEdges(out, snapshot, node);
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n],\n\"roots\": [");
+  for (int i = 0; i < snapshot->edgeStarts[1]; i++) {
+    fprintf(out, i > 0 ? ",\n" : "\n");
+    fprintf(out, "{\"name\": ");
+    writeJsonString(out, snapshot->rootNames[i],
+                    (int)strlen(snapshot->rootNames[i]));
+    fprintf(out, ", \"id\": %d}", snapshot->edges[i]);
+  }
+  fprintf(out, "\n]}\n");
+}
+
+// Writes a snapshot of vm's heap to the file at path. Returns false if it
+// could not be written.
+bool dumpHeapSnapshot(VM *vm, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    return false;
+  }
+  HeapSnapshot snapshot;
+  takeHeapSnapshot(vm, &snapshot);
+  writeHeapSnapshot(&snapshot, out);
+  freeHeapSnapshot(&snapshot);
+  return fclose(out) == 0;
+}
+
+static bool heapStatsNative(VM *vm, int argCount, Value *args,
+                            Value *result) {
+  HeapStats stats;
+  takeHeapStats(vm, &stats);
+  printHeapStats(&stats, stderr);
+  freeHeapStats(&stats);
+  *result = MAKE_NIL();
+  return true;
+}
+
+static bool heapSnapshotNative(VM *vm, int argCount, Value *args,
+                               Value *result) {
+  if (!IS_STRING(args[0])) {
+    runtimeError(vm, "heapSnapshot expects a String path, got %s",
+                 typeName(args[0]));
+    return false;
+  }
+  char *path = ((ObjString *)args[0].as.obj)->string;
+  *result = MAKE_BOOL(dumpHeapSnapshot(vm, path));
+  return true;
+}
+
+void defineHeapNatives(VM *vm) {
+  defineNative(vm, "heapStats", heapStatsNative, 0);
+  defineNative(vm, "heapSnapshot", heapSnapshotNative, 1);
+}
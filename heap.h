@@ -0,0 +1,87 @@
+#ifndef sethi_heap_h
+#define sethi_heap_h
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+#include <stdio.h>
+
+// One more than the last ObjType
+#define OBJ_TYPE_COUNT (OBJ_TASK + 1)
+// Most characters of a string a snapshot names it by
+#define HEAP_NAME_MAX 40
+
+// Objects of one kind and the bytes they hold
+typedef struct {
+  const char *name;
+  uint64_t count;
+  size_t bytes;
+} HeapCount;
+
+// Entries of one hash table against the slots it has for them
+typedef struct {
+  const char *name;
+  int count;
+  int capacity;
+} TableUsage;
+
+// What a VM's heap holds, taken right after a full collection so only live
+// objects are counted. Names point into the VM's heap.
+typedef struct {
+  HeapCount types[OBJ_TYPE_COUNT];
+  // One per type of struct, those holding the most bytes first
+  HeapCount *structs;
+  int structCount;
+  int structCapacity;
+  uint64_t objects;
+  size_t bytes;
+  // Of those bytes, the ones held by objects that are never collected
+  size_t permanentBytes;
+  // The intern table, the globals and the globals shared with the program
+  TableUsage tables[3];
+  int tableCount;
+  // Regions of the old generation, and the slots of theirs in use
+  int regions;
+  uint64_t slotsUsed;
+  // Bytes compactHeap moved into arenas
+  size_t arenaBytes;
+} HeapStats;
+
+// One object of a snapshot
+typedef struct {
+  Obj *object;
+  size_t size;
+  // The bytes freed if nothing referred to the object any more: its own and
+  // those of every object only reachable through it
+  size_t retained;
+  // The node every path from the roots to this one passes through last, or
+  // -1 if the roots do not reach it
+  int dominator;
+} HeapNode;
+
+// The graph of a VM's live objects. Node 0 stands for the roots, and every
+// object is node 1 plus the index the collector keeps it at, so nodes for
+// empty slots have no object. The edges of node i are edges[edgeStarts[i]]
+// up to edges[edgeStarts[i + 1]]; the roots' are named by rootNames.
+typedef struct {
+  HeapNode *nodes;
+  int nodeCount;
+  int *edgeStarts;
+  int *edges;
+  int edgeCount;
+  int edgeCapacity;
+  const char **rootNames;
+  int rootCapacity;
+} HeapSnapshot;
+
+void takeHeapStats(VM *vm, HeapStats *stats);
+void freeHeapStats(HeapStats *stats);
+void printHeapStats(HeapStats *stats, FILE *out);
+void takeHeapSnapshot(VM *vm, HeapSnapshot *snapshot);
+void freeHeapSnapshot(HeapSnapshot *snapshot);
+int findHeapNode(VM *vm, Obj *object);
+void writeHeapSnapshot(HeapSnapshot *snapshot, FILE *out);
+bool dumpHeapSnapshot(VM *vm, const char *path);
+void defineHeapNatives(VM *vm);
+
+#endif
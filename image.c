@@ -0,0 +1,722 @@
+#include "image.h"
+#include "buffer.h"
+#include "gc.h"
+#include "memory.h"
+#include "shared.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A heap image holds a VM's globals and every object of its heap, laid out
+// the way they sit in memory, so a VM can start from one by mapping the file
+// and fixing up its pointers instead of compiling and running the code that
+// made them.
+//
+// Pointers from the image to its own objects are written as offsets from
+// its start, and the image lists where every one of them is; loading adds
+// the address the file was mapped at. Objects the VM does not own, such as
+// the built-in natives and the strings shared between VMs, are imported:
+// written down by name and looked up again by the VM loading the image.
+// Natives are always imported, so a host defines its own before loading.
+// The image's strings are interned as they are loaded, and one the VM
+// already has takes the place of the image's copy.
+//
+// The file is mapped privately and kept as one of the collector's arenas, so
+// its objects are frozen: marked in the regions, never freed one at a time,
+// and only unmapped with the heap. Images hold bytecode and structures as
+// this build lays them out, and are only loaded by the build that wrote
+// them.
+
+#define IMAGE_MAGIC "SETHIIMG"
+#define IMAGE_VERSION 1
+// Everything in an image starts at a multiple of this
+#define IMAGE_ALIGN 8
+
+typedef enum { IMPORT_STRING, IMPORT_NATIVE } ImportKind;
+
+// An object the image refers to but does not hold, looked up by name
+typedef struct {
+  uint32_t kind;
+  uint32_t length;
+  // Where the name's characters are in the image
+  uint64_t name;
+} ImageImport;
+
+// A pointer to an import: where it is in the image, and which import
+typedef struct {
+  uint64_t at;
+  uint64_t import;
+} ImageFixup;
+
+// The start of an image. Each array is given by its offset in the image and
+// how many elements it has.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // Sizes of the structures the image holds, which have to be this build's
+  uint32_t layout;
+  uint64_t size;
+  // Offsets of the objects, the strings first
+  uint64_t objects;
+  uint64_t objectCount;
+  // Offsets of the pointers to the image's own objects
+  uint64_t relocations;
+  uint64_t relocationCount;
+  uint64_t imports;
+  uint64_t importCount;
+  uint64_t fixups;
+  uint64_t fixupCount;
+  // Entries of the globals table
+  uint64_t globals;
+  uint64_t globalCount;
+} ImageHeader;
+
+static uint32_t layout() {
+  uint32_t sizes[] = {
+      sizeof(void *),    sizeof(Value),    sizeof(Obj),
+      sizeof(ObjString), sizeof(ObjFunc),  sizeof(Chunk),
+      sizeof(ObjStruct), sizeof(ObjShape), sizeof(ObjBuffer),
+      sizeof(Entry),     OP_FIELD,         IMAGE_VERSION,
+  };
+  return hash((const char *)sizes, sizeof(sizes));
+}
+
+static size_t aligned(size_t size) {
+  return (size + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+typedef struct {
+  VM *vm;
+  // The image so far. It moves as it grows, so it is only ever pointed into
+  // between two calls to reserve.
+  char *data;
+  size_t size;
+  size_t capacity;
+  // Where each object of the heap is in the image, by the index the
+  // collector keeps it at, or 0 if it is imported
+  uint64_t *offsets;
+  int offsetCount;
+  uint64_t *objects;
+  int objectCount;
+  int objectCapacity;
+  uint64_t *relocations;
+  int relocationCount;
+  int relocationCapacity;
+  ImageImport *imports;
+  // The object of each import
+  Obj **imported;
+  int importCount;
+  int importCapacity;
+  ImageFixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  // Set when the heap holds something an image can not
+  bool failed;
+} Writer;
+
+// Adds size zeroed bytes to the end of the image and returns their offset
+static uint64_t reserve(Writer *writer, size_t size) {
+  size = aligned(size);
+  if (writer->size + size > writer->capacity) {
+    size_t capacity = writer->capacity;
+    while (writer->size + size > capacity) {
+      capacity = GROW_CAPACITY(capacity);
+    }
+    writer->data = GROW_ARRAY(char, writer->data, writer->capacity, capacity);
+    writer->capacity = capacity;
+  }
+  uint64_t offset = writer->size;
+  memset(writer->data + offset, 0, size);
+  writer->size += size;
+  return offset;
+}
+
+static void *at(Writer *writer, uint64_t offset) {
+  return writer->data + offset;
+}
+
+// Returns the index the collector keeps object at, or -1 if it is not in
+// the heap
+static int heapIndex(VM *vm, Obj *object) {
+  Collector *gc = &vm->gc;
+  if (object->region >= (uint32_t)gc->regionCount ||
+      gc->regions[object->region]->objects[object->slot] != object) {
+    return -1;
+  }
+  return (int)object->region * GC_REGION_OBJECTS + object->slot;
+}
+
+// The fallback chunk of func the image keeps. A function already
+// deoptimized is written with just the chunk it runs.
+static Chunk *imageFallback(ObjFunc *func) {
+  return func->deoptimized ? NULL : func->fallback;
+}
+
+static size_t chunkSize(Chunk *chunk) {
+  return aligned(sizeof(Chunk)) + aligned(chunk->count) +
+         aligned(sizeof(int) * chunk->count) +
+         sizeof(Value) * chunk->constants.count;
+}
+
+// Returns the bytes object takes in the image, together with what it points
+// to and owns, or 0 if it is imported
+static size_t imageSize(Obj *object) {
+  switch (object->type) {
+  case OBJ_STRING:
+    return aligned(sizeof(ObjString) + ((ObjString *)object)->length + 1);
+  case OBJ_FUNCTION: {
+    ObjFunc *func = (ObjFunc *)object;
+    Chunk *fallback = imageFallback(func);
+    return aligned(sizeof(ObjFunc)) + chunkSize(func->chunk) +
+           (fallback != NULL ? chunkSize(fallback) : 0);
+  }
+  case OBJ_STRUCT:
+    return aligned(objectSize(object));
+  case OBJ_SHAPE:
+    return aligned(sizeof(ObjShape)) +
+           sizeof(ObjString *) * (((ObjShape *)object)->count + 1);
+  case OBJ_BUFFER: {
+    ObjBuffer *buffer = (ObjBuffer *)object;
+    return aligned(sizeof(ObjBuffer)) +
+           aligned(bufferDataSize(buffer->kind, buffer->length));
+  }
+  default:
+    return 0;
+  }
+}
+
+static void addRelocation(Writer *writer, uint64_t offset) {
+  if (writer->relocationCount == writer->relocationCapacity) {
+    int capacity = GROW_CAPACITY(writer->relocationCapacity);
+    writer->relocations =
+        GROW_ARRAY(uint64_t, writer->relocations, writer->relocationCapacity,
+                   capacity);
+    writer->relocationCapacity = capacity;
+  }
+  writer->relocations[writer->relocationCount++] = offset;
+}
+
+// Writes a pointer to the part of the image at target into offset
+static void writeOffset(Writer *writer, uint64_t offset, uint64_t target) {
+  *(uint64_t *)at(writer, offset) = target;
+  addRelocation(writer, offset);
+}
+
+// Returns the import of object, adding it the first time
+static uint64_t importOf(Writer *writer, Obj *object) {
+  for (int i = 0; i < writer->importCount; i++) {
+    if (writer->imported[i] == object) {
+      return i;
+    }
+  }
+  const char *name;
+  int length;
+  if (object->type == OBJ_STRING) {
+    name = ((ObjString *)object)->string;
+    length = ((ObjString *)object)->length;
+  } else {
+    name = ((ObjNative *)object)->name;
+    length = (int)strlen(name);
+  }
+  if (writer->importCount == writer->importCapacity) {
+    int capacity = GROW_CAPACITY(writer->importCapacity);
+    writer->imports = GROW_ARRAY(ImageImport, writer->imports,
+                                 writer->importCapacity, capacity);
+    writer->imported =
+        GROW_ARRAY(Obj *, writer->imported, writer->importCapacity, capacity);
+    writer->importCapacity = capacity;
+  }
+  ImageImport *import = &writer->imports[writer->importCount];
+  import->kind = object->type == OBJ_STRING ? IMPORT_STRING : IMPORT_NATIVE;
+  import->length = (uint32_t)length;
+  import->name = reserve(writer, length + 1);
+  memcpy(at(writer, import->name), name, length);
+  writer->imported[writer->importCount] = object;
+  return writer->importCount++;
+}
+
+// Writes a reference to object into offset: to its copy in the image, or to
+// its import if the VM does not own it
+static void writeObject(Writer *writer, uint64_t offset, Obj *object) {
+  if (object == NULL) {
+    return;
+  }
+  int index = heapIndex(writer->vm, object);
+  if (index >= 0 && writer->offsets[index] != 0) {
+    writeOffset(writer, offset, writer->offsets[index]);
+  } else if (object->type == OBJ_STRING || object->type == OBJ_NATIVE) {
+    if (writer->fixupCount == writer->fixupCapacity) {
+      int capacity = GROW_CAPACITY(writer->fixupCapacity);
+      writer->fixups = GROW_ARRAY(ImageFixup, writer->fixups,
+                                  writer->fixupCapacity, capacity);
+      writer->fixupCapacity = capacity;
+    }
+    uint64_t import = importOf(writer, object);
+    writer->fixups[writer->fixupCount].at = offset;
+    writer->fixups[writer->fixupCount].import = import;
+    writer->fixupCount++;
+  } else {
+    // Such as a function of a prepared program
+    writer->failed = true;
+  }
+}
+
+static void writeValue(Writer *writer, uint64_t offset, Value value) {
+  Value *copy = (Value *)at(writer, offset);
+  copy->type = value.type;
+  if (value.type == VALUE_OBJ) {
+    writeObject(writer, offset + offsetof(Value, as.obj), value.as.obj);
+  } else {
+    copy->as = value.as;
+  }
+}
+
+// Gives object its place in the image, if it has one
+static void placeObject(Obj *object, void *context) {
+  Writer *writer = (Writer *)context;
+  if (object->type == OBJ_COROUTINE || object->type == OBJ_TASK) {
+    writer->failed = true;
+    return;
+  }
+  size_t size = imageSize(object);
+  if (size == 0) {
+    return;
+  }
+  uint64_t offset = reserve(writer, size);
+  writer->offsets[heapIndex(writer->vm, object)] = offset;
+  if (writer->objectCount == writer->objectCapacity) {
+    int capacity = GROW_CAPACITY(writer->objectCapacity);
+    writer->objects = GROW_ARRAY(uint64_t, writer->objects,
+                                 writer->objectCapacity, capacity);
+    writer->objectCapacity = capacity;
+  }
+  writer->objects[writer->objectCount++] = offset;
+}
+
+// Strings go first, so they are interned before anything else is loaded
+static void placeString(Obj *object, void *context) {
+  if (object->type == OBJ_STRING) {
+    placeObject(object, context);
+  }
+}
+
+static void placeOther(Obj *object, void *context) {
+  if (object->type != OBJ_STRING) {
+    placeObject(object, context);
+  }
+}
+
+// Copies chunk to chunkOffset, followed by its code, lines and constants
+static void writeChunkAt(Writer *writer, uint64_t chunkOffset, Chunk *chunk) {
+  uint64_t code = chunkOffset + aligned(sizeof(Chunk));
+  uint64_t lines = code + aligned(chunk->count);
+  uint64_t constants = lines + aligned(sizeof(int) * chunk->count);
+
+  Chunk *copy = (Chunk *)at(writer, chunkOffset);
+  copy->count = chunk->count;
+  copy->capacity = chunk->count;
+  copy->constants.count = chunk->constants.count;
+  copy->constants.capacity = chunk->constants.count;
+  memcpy(at(writer, code), chunk->code, chunk->count);
+  memcpy(at(writer, lines), chunk->lines, sizeof(int) * chunk->count);
+  if (chunk->count > 0) {
+    writeOffset(writer, chunkOffset + offsetof(Chunk, code), code);
+    writeOffset(writer, chunkOffset + offsetof(Chunk, lines), lines);
+  }
+  if (chunk->constants.count > 0) {
+    writeOffset(writer,
+                chunkOffset + offsetof(Chunk, constants) +
+                    offsetof(ValueArray, values),
+                constants);
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    writeValue(writer, constants + sizeof(Value) * i,
+               chunk->constants.values[i]);
+  }
+}
+
+static void writeFunction(Writer *writer, uint64_t offset, ObjFunc *func) {
+  uint64_t chunkOffset = offset + aligned(sizeof(ObjFunc));
+  ((ObjFunc *)at(writer, offset))->numParams = func->numParams;
+  writeOffset(writer, offset + offsetof(ObjFunc, chunk), chunkOffset);
+  writeChunkAt(writer, chunkOffset, func->chunk);
+  Chunk *fallback = imageFallback(func);
+  if (fallback != NULL) {
+    uint64_t fallbackOffset = chunkOffset + chunkSize(func->chunk);
+    writeOffset(writer, offset + offsetof(ObjFunc, fallback),
+                fallbackOffset);
+    writeChunkAt(writer, fallbackOffset, fallback);
+  }
+}
+
+// Copies object into the place it was given, with its references
+static void writeContents(Obj *object, void *context) {
+  Writer *writer = (Writer *)context;
+  int index = heapIndex(writer->vm, object);
+  uint64_t offset = writer->offsets[index];
+  if (offset == 0) {
+    return;
+  }
+  Obj *header = (Obj *)at(writer, offset);
+  header->type = object->type;
+  header->mark =
+      object->mark == MARK_PERMANENT ? MARK_PERMANENT : MARK_FROZEN;
+  switch (object->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    ObjString *copy = (ObjString *)header;
+    copy->length = string->length;
+    copy->hash = string->hash;
+    memcpy(copy + 1, string->string, string->length);
+    writeOffset(writer, offset + offsetof(ObjString, string),
+                offset + sizeof(ObjString));
+    break;
+  }
+  case OBJ_FUNCTION:
+    writeFunction(writer, offset, (ObjFunc *)object);
+    break;
+  case OBJ_STRUCT: {
+    ObjStruct *s = (ObjStruct *)object;
+    writeObject(writer, offset + offsetof(ObjStruct, shape),
+                (Obj *)s->shape);
+    for (int i = 0; i < s->shape->count; i++) {
+      writeValue(writer,
+                 offset + offsetof(ObjStruct, fields) + sizeof(Value) * i,
+                 s->fields[i]);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    uint64_t names = offset + aligned(sizeof(ObjShape));
+    ((ObjShape *)header)->count = shape->count;
+    writeObject(writer, offset + offsetof(ObjShape, type),
+                (Obj *)shape->type);
+    writeOffset(writer, offset + offsetof(ObjShape, names), names);
+    for (int i = 0; i < shape->count; i++) {
+      writeObject(writer, names + sizeof(ObjString *) * i,
+                  (Obj *)shape->names[i]);
+    }
+    break;
+  }
+  case OBJ_BUFFER: {
+    ObjBuffer *buffer = (ObjBuffer *)object;
+    ObjBuffer *copy = (ObjBuffer *)header;
+    uint64_t data = offset + aligned(sizeof(ObjBuffer));
+    copy->kind = buffer->kind;
+    copy->length = buffer->length;
+    memcpy(at(writer, data), buffer->data,
+           bufferDataSize(buffer->kind, buffer->length));
+    writeOffset(writer, offset + offsetof(ObjBuffer, data), data);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Appends count elements of size bytes at elements to the image and
+// returns where they start
+static uint64_t writeArray(Writer *writer, const void *elements, int count,
+                           size_t size) {
+  uint64_t offset = reserve(writer, size * count);
+  if (count > 0) {
+    memcpy(at(writer, offset), elements, size * count);
+  }
+  return offset;
+}
+
+static void freeWriter(Writer *writer) {
+  FREE_ARRAY(char, writer->data, writer->capacity);
+  FREE_ARRAY(uint64_t, writer->offsets, writer->offsetCount);
+  FREE_ARRAY(uint64_t, writer->objects, writer->objectCapacity);
+  FREE_ARRAY(uint64_t, writer->relocations, writer->relocationCapacity);
+  FREE_ARRAY(ImageImport, writer->imports, writer->importCapacity);
+  FREE_ARRAY(Obj *, writer->imported, writer->importCapacity);
+  FREE_ARRAY(ImageFixup, writer->fixups, writer->fixupCapacity);
+}
+
+// Writes size bytes of data to a file next to path, then renames it to path.
+// An image being replaced may be mapped by a VM that loaded it, and the
+// pages it has not written to are read from the file until then, so the
+// file is never written over in place.
+static bool writeFile(const char *path, const char *data, size_t size) {
+  size_t length = strlen(path);
+  char *temporary = (char *)malloc(length + sizeof(".tmp"));
+  if (temporary == NULL) {
+    return false;
+  }
+  memcpy(temporary, path, length);
+  memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+  bool written = false;
+  FILE *file = fopen(temporary, "wb");
+  if (file != NULL) {
+    written = fwrite(data, 1, size, file) == size;
+    written = fclose(file) == 0 && written;
+    written = written && rename(temporary, path) == 0;
+    if (!written) {
+      remove(temporary);
+    }
+  }
+  free(temporary);
+  return written;
+}
+
+// Writes an image of vm's globals and heap to the file at path, after a
+// full collection. Returns false, writing nothing, if the file can not be
+// written, while tasks vm spawned are running, or if the heap holds what an
+// image can not: coroutines, tasks, or objects of another heap other than
+// natives and shared strings.
+bool saveImage(VM *vm, const char *path) {
+  if (vm->gc.enabled) {
+    collectGarbage(vm);
+  }
+  if (vm->gc.taskCount > 0) {
+    return false;
+  }
+  MemoryAccount *outer = useAccount(&vm->memory);
+  Writer writer;
+  memset(&writer, 0, sizeof(writer));
+  writer.vm = vm;
+  writer.offsetCount = vm->gc.regionCount * GC_REGION_OBJECTS;
+  writer.offsets = (uint64_t *)allocateZeroed(
+      MEMORY_ARRAYS, sizeof(uint64_t) * writer.offsetCount);
+  uint64_t headerOffset = reserve(&writer, sizeof(ImageHeader));
+
+  visitHeap(vm, placeString, &writer);
+  visitHeap(vm, placeOther, &writer);
+  visitHeap(vm, writeContents, &writer);
+
+  int globalCount = 0;
+  for (int i = 0; i < vm->table.capacity; i++) {
+    globalCount += vm->table.entries[i].key != NULL;
+  }
+  uint64_t globals = reserve(&writer, sizeof(Entry) * globalCount);
+  for (int i = 0, global = 0; i < vm->table.capacity; i++) {
+    Entry *entry = &vm->table.entries[i];
+    if (entry->key == NULL) {
+      continue;
+    }
+    uint64_t offset = globals + sizeof(Entry) * global++;
+    writeObject(&writer, offset + offsetof(Entry, key), (Obj *)entry->key);
+    writeValue(&writer, offset + offsetof(Entry, value), entry->value);
+  }
+
+  // Writing the tables adds nothing more to them
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.layout = layout();
+  header.objects = writeArray(&writer, writer.objects, writer.objectCount,
+                              sizeof(uint64_t));
+  header.objectCount = writer.objectCount;
+  header.imports = writeArray(&writer, writer.imports, writer.importCount,
+                              sizeof(ImageImport));
+  header.importCount = writer.importCount;
+  header.fixups = writeArray(&writer, writer.fixups, writer.fixupCount,
+                             sizeof(ImageFixup));
+  header.fixupCount = writer.fixupCount;
+  header.relocations =
+      writeArray(&writer, writer.relocations, writer.relocationCount,
+                 sizeof(uint64_t));
+  header.relocationCount = writer.relocationCount;
+  header.globals = globals;
+  header.globalCount = globalCount;
+  header.size = writer.size;
+  memcpy(at(&writer, headerOffset), &header, sizeof(header));
+
+  bool written = !writer.failed && writeFile(path, writer.data, writer.size);
+  freeWriter(&writer);
+  useAccount(outer);
+  return written;
+}
+
+// Whether count elements of size bytes at offset lie inside an image of
+// size bytes
+static bool inImage(uint64_t offset, uint64_t count, size_t size,
+                    uint64_t imageSize) {
+  return offset <= imageSize && count <= (imageSize - offset) / size;
+}
+
+static bool validHeader(ImageHeader *header, uint64_t size) {
+  return memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0 &&
+         header->version == IMAGE_VERSION && header->layout == layout() &&
+         header->size == size &&
+         inImage(header->objects, header->objectCount, sizeof(uint64_t),
+                 size) &&
+         inImage(header->relocations, header->relocationCount,
+                 sizeof(uint64_t), size) &&
+         inImage(header->imports, header->importCount, sizeof(ImageImport),
+                 size) &&
+         inImage(header->fixups, header->fixupCount, sizeof(ImageFixup),
+                 size) &&
+         inImage(header->globals, header->globalCount, sizeof(Entry), size);
+}
+
+// Points the image's pointers at where it was mapped, and its imports at the
+// objects vm finds for them. Returns false if an offset lies outside the
+// image or vm has no native of an imported name.
+static bool fixUp(VM *vm, char *base, ImageHeader *header) {
+  uint64_t *relocations = (uint64_t *)(base + header->relocations);
+  for (uint64_t i = 0; i < header->relocationCount; i++) {
+    if (!inImage(relocations[i], 1, sizeof(uint64_t), header->size)) {
+      return false;
+    }
+    uint64_t *slot = (uint64_t *)(base + relocations[i]);
+    if (*slot >= header->size) {
+      return false;
+    }
+    *slot += (uint64_t)(uintptr_t)base;
+  }
+
+  ImageImport *imports = (ImageImport *)(base + header->imports);
+  Obj **imported =
+      (Obj **)allocate(MEMORY_ARRAYS, sizeof(Obj *) * header->importCount);
+  bool found = true;
+  for (uint64_t i = 0; i < header->importCount && found; i++) {
+    ImageImport *import = &imports[i];
+    found = inImage(import->name, import->length + 1, 1, header->size);
+    if (!found) {
+      break;
+    }
+    ObjString *name =
+        copyString(vm, base + import->name, (int)import->length);
+    if (import->kind == IMPORT_STRING) {
+      imported[i] = (Obj *)name;
+      continue;
+    }
+    Value *native = findGlobal(vm, name);
+    found = native != NULL && isObjectOfType(*native, OBJ_NATIVE);
+    imported[i] = found ? native->as.obj : NULL;
+  }
+
+  ImageFixup *fixups = (ImageFixup *)(base + header->fixups);
+  for (uint64_t i = 0; i < header->fixupCount && found; i++) {
+    found = inImage(fixups[i].at, 1, sizeof(Obj *), header->size) &&
+            fixups[i].import < header->importCount;
+    if (found) {
+      *(Obj **)(base + fixups[i].at) = imported[fixups[i].import];
+    }
+  }
+  release(MEMORY_ARRAYS, imported, sizeof(Obj *) * header->importCount);
+  return found;
+}
+
+// Points a reference to an image string the VM already had at the VM's
+static void redirect(Value *slot, void *context) {
+  if (slot->type == VALUE_OBJ && slot->as.obj->mark == MARK_MOVED) {
+    slot->as.obj = slot->as.obj->next;
+  }
+}
+
+// Adds the objects of the image at base to vm's heap, interning its strings,
+// then binds its globals
+static void adopt(VM *vm, char *base, ImageHeader *header) {
+  Collector *gc = &vm->gc;
+  uint64_t *objects = (uint64_t *)(base + header->objects);
+  bool moved = false;
+  // The image's functions only bind calls statically to each other, which
+  // the code vm already has could bind again, and the other way round
+  bool hadFunctions = false;
+  for (int i = 0; i < vm->table.capacity; i++) {
+    Entry *entry = &vm->table.entries[i];
+    hadFunctions |= entry->key != NULL &&
+                    isObjectOfType(entry->value, OBJ_FUNCTION);
+  }
+  for (uint64_t i = 0; i < header->objectCount; i++) {
+    Obj *object = (Obj *)(base + objects[i]);
+    if (object->type == OBJ_STRING) {
+      ObjString *string = (ObjString *)object;
+      ObjString *known = findSharedString(string->string, string->length,
+                                          string->hash);
+      if (known == NULL) {
+        known = findStringInTable(&vm->strings, string->string,
+                                  string->length, string->hash);
+      }
+      if (known != NULL) {
+        object->mark = MARK_MOVED;
+        object->next = (Obj *)known;
+        moved = true;
+        continue;
+      }
+      set(&vm->strings, string, MAKE_NIL());
+    }
+    if (object->type == OBJ_FUNCTION &&
+        ((ObjFunc *)object)->fallback != NULL) {
+      vm->staticCalls = true;
+    }
+    uint8_t mark = object->mark;
+    trackObject(vm, object);
+    object->mark = mark;
+    if (mark == MARK_PERMANENT) {
+      gc->allocated -= objectSize(object);
+    }
+  }
+
+  Entry *globals = (Entry *)(base + header->globals);
+  for (uint64_t i = 0; moved && i < header->objectCount; i++) {
+    Obj *object = (Obj *)(base + objects[i]);
+    if (object->mark != MARK_MOVED) {
+      visitReferences(object, redirect, NULL);
+    }
+  }
+  for (uint64_t i = 0; i < header->globalCount; i++) {
+    Value key = MAKE_OBJ((Obj *)globals[i].key);
+    if (moved) {
+      redirect(&key, NULL);
+      redirect(&globals[i].value, NULL);
+    }
+    set(&vm->table, (ObjString *)key.as.obj, globals[i].value);
+  }
+  if (hadFunctions) {
+    deoptimize(vm);
+  }
+  // The image's objects are live, the way a finished cycle leaves the heap
+  gc->threshold =
+      gc->allocated * 2 > GC_MIN_HEAP ? gc->allocated * 2 : GC_MIN_HEAP;
+  gc->debt = 0;
+}
+
+// Adds the image at path to vm's heap and binds its globals in vm, as if
+// the code that made them had run. The file is mapped, not read, and is
+// unmapped when vm is freed. Natives the image refers to have to be defined
+// in vm, or be built in, before it is loaded. Returns false, adding at most
+// the names it looked up to vm, if the file can not be read, is not an
+// image this build wrote, or refers to a native vm does not have.
+bool loadImage(VM *vm, const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0) {
+    return false;
+  }
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(ImageHeader)) {
+    close(fd);
+    return false;
+  }
+  // Fixing up writes to most of its pages, so they are all faulted in at once
+  char *base = (char *)mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  ImageHeader *header = (ImageHeader *)base;
+  MemoryAccount *outer = useAccount(&vm->memory);
+  if (!validHeader(header, info.st_size) || !fixUp(vm, base, header)) {
+    munmap(base, info.st_size);
+    useAccount(outer);
+    return false;
+  }
+  addArena(&vm->gc, base, info.st_size);
+  adopt(vm, base, header);
+  useAccount(outer);
+  return true;
+}
@@ -0,0 +1,10 @@
+#ifndef sethi_image_h
+#define sethi_image_h
+
+#include "common.h"
+#include "vm.h"
+
+bool saveImage(VM *vm, const char *path);
+bool loadImage(VM *vm, const char *path);
+
+#endif
@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+#include "loop.h"
+#include "memory.h"
+#include "value.h"
+#include "vm.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Largest read a script can ask for
+#define READ_MAX (1 << 20)
+// Events taken from epoll in one call
+#define EVENT_BATCH 64
+// Ready fibers run back to back at most this many times before the loop
+// checks for completed I/O again
+#define SWITCH_BURST 64
+
+typedef enum { ATTEMPT_DONE, ATTEMPT_AGAIN } Attempt;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the VM's loop, creating it the first time
+static EventLoop *getLoop(VM *vm) {
+  if (vm->loop != NULL) {
+    return vm->loop;
+  }
+  EventLoop *loop = (EventLoop *)allocate(MEMORY_OTHER, sizeof(EventLoop));
+  loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll < 0) {
+    exit(1);
+  }
+  loop->running = false;
+  loop->ready = NULL;
+  loop->readyHead = 0;
+  loop->readyCount = 0;
+  loop->readyCapacity = 0;
+  loop->switches = 0;
+  loop->requests = NULL;
+  loop->requestCapacity = 0;
+  loop->pending = 0;
+  loop->timers = NULL;
+  loop->timerCount = 0;
+  loop->timerCapacity = 0;
+  vm->loop = loop;
+  return loop;
+}
+
+static void makeReady(EventLoop *loop, ObjCoroutine *coroutine, Value value) {
+  if (loop->readyCount == loop->readyCapacity) {
+    // Unwrap the queue into the new array so it starts at index 0
+    int capacity = GROW_CAPACITY(loop->readyCapacity);
+    Ready *ready = GROW_ARRAY(Ready, NULL, 0, capacity);
+    for (int i = 0; i < loop->readyCount; i++) {
+      ready[i] = loop->ready[(loop->readyHead + i) % loop->readyCapacity];
+    }
+    FREE_ARRAY(Ready, loop->ready, loop->readyCapacity);
+    loop->ready = ready;
+    loop->readyHead = 0;
+    loop->readyCapacity = capacity;
+  }
+  int tail = (loop->readyHead + loop->readyCount) % loop->readyCapacity;
+  loop->ready[tail] = (Ready){.coroutine = coroutine, .value = value};
+  loop->readyCount++;
+}
+
+static void addTimer(EventLoop *loop, double deadline,
+                     ObjCoroutine *coroutine) {
+  if (loop->timerCount == loop->timerCapacity) {
+    int capacity = GROW_CAPACITY(loop->timerCapacity);
+    loop->timers =
+        GROW_ARRAY(Timer, loop->timers, loop->timerCapacity, capacity);
+    loop->timerCapacity = capacity;
+  }
+  int i = loop->timerCount++;
+  while (i > 0 && loop->timers[(i - 1) / 2].deadline > deadline) {
+    loop->timers[i] = loop->timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  loop->timers[i] = (Timer){.deadline = deadline, .coroutine = coroutine};
+}
+
+// Removes and returns the timer with the earliest deadline
+static Timer popTimer(EventLoop *loop) {
+  Timer first = loop->timers[0];
+  Timer last = loop->timers[--loop->timerCount];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= loop->timerCount) {
+      break;
+    }
+    if (child + 1 < loop->timerCount &&
+        loop->timers[child + 1].deadline < loop->timers[child].deadline) {
+      child++;
+    }
+    if (loop->timers[child].deadline >= last.deadline) {
+      break;
+    }
+    loop->timers[i] = loop->timers[child];
+    i = child;
+  }
+  if (loop->timerCount > 0) {
+    loop->timers[i] = last;
+  }
+  return first;
+}
+
+static struct sockaddr_in loopback(int port) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return address;
+}
+
+static bool wouldBlock() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Small request and reply messages should not wait to be batched
+static void noDelay(int fd) {
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Closes fd and forgets its registration, since the number can be reused
+static void closeDescriptor(VM *vm, int fd) {
+  if (vm->loop != NULL && fd < vm->loop->requestCapacity) {
+    vm->loop->requests[fd].watched = false;
+  }
+  close(fd);
+}
+
+// Tries request once without blocking. Returns ATTEMPT_DONE with result set
+// once it has completed or failed, a failure evaluating to nil.
+static Attempt attempt(VM *vm, IoRequest *request, Value *result) {
+  *result = MAKE_NIL();
+  switch (request->kind) {
+  case IO_READ: {
+    char *buffer = (char *)allocate(MEMORY_OTHER, request->length);
+    ssize_t count = read(request->fd, buffer, request->length);
+    if (count < 0 && wouldBlock()) {
+      release(MEMORY_OTHER, buffer, request->length);
+      return ATTEMPT_AGAIN;
+    }
+    if (count >= 0) {
+      *result = MAKE_OBJ((Obj *)copyString(vm, buffer, (int)count));
+    }
+    release(MEMORY_OTHER, buffer, request->length);
+    return ATTEMPT_DONE;
+  }
+  case IO_WRITE: {
+    ObjString *data = request->data;
+    while (request->written < data->length) {
+      const char *start = data->string + request->written;
+      size_t left = data->length - request->written;
+      // Writing to a closed socket fails with EPIPE instead of a signal
+      ssize_t count = send(request->fd, start, left, MSG_NOSIGNAL);
+      if (count < 0 && errno == ENOTSOCK) {
+        count = write(request->fd, start, left);
+      }
+      if (count < 0) {
+        return wouldBlock() ? ATTEMPT_AGAIN : ATTEMPT_DONE;
+      }
+      request->written += count;
+    }
+    *result = MAKE_NUM(data->length);
+    return ATTEMPT_DONE;
+  }
+  case IO_ACCEPT: {
+    int fd = accept4(request->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0 && wouldBlock()) {
+      return ATTEMPT_AGAIN;
+    }
+    if (fd >= 0) {
+      noDelay(fd);
+      *result = MAKE_NUM(fd);
+    }
+    return ATTEMPT_DONE;
+  }
+  case IO_CONNECT: {
+    // A connection that was refused while pending reports it here, calling
+    // connect again would start over
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(request->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+    if (error == 0) {
+      struct sockaddr_in address = loopback(request->length);
+      if (connect(request->fd, (struct sockaddr *)&address,
+                  sizeof(address)) == 0 ||
+          errno == EISCONN) {
+        noDelay(request->fd);
+        *result = MAKE_NUM(request->fd);
+        return ATTEMPT_DONE;
+      }
+      if (errno == EINPROGRESS || errno == EALREADY || errno == EINTR) {
+        return ATTEMPT_AGAIN;
+      }
+    }
+    closeDescriptor(vm, request->fd);
+    return ATTEMPT_DONE;
+  }
+  }
+  return ATTEMPT_DONE;
+}
+
+static bool writes(IoRequest *request) {
+  return request->kind == IO_WRITE || request->kind == IO_CONNECT;
+}
+
+// Blocks until request's descriptor is ready for it
+static void waitFor(IoRequest *request) {
+  struct pollfd pollFd = {.fd = request->fd,
+                          .events = writes(request) ? POLLOUT : POLLIN};
+  poll(&pollFd, 1, -1);
+}
+
+static IoRequest *requestSlot(EventLoop *loop, int fd) {
+  if (fd >= loop->requestCapacity) {
+    int capacity = GROW_CAPACITY(loop->requestCapacity);
+    while (capacity <= fd) {
+      capacity *= 2;
+    }
+    loop->requests = GROW_ARRAY(IoRequest, loop->requests,
+                                loop->requestCapacity, capacity);
+    for (int i = loop->requestCapacity; i < capacity; i++) {
+      loop->requests[i].coroutine = NULL;
+      loop->requests[i].watched = false;
+    }
+    loop->requestCapacity = capacity;
+  }
+  return &loop->requests[fd];
+}
+
+// Registers fd with epoll the first time a coroutine waits on it, edge
+// triggered for both directions so it never has to be armed again. An
+// operation is always tried before waiting, so an edge can not be missed.
+// Returns false for descriptors epoll can not watch.
+static bool watch(EventLoop *loop, int fd) {
+  IoRequest *slot = requestSlot(loop, fd);
+  if (slot->watched) {
+    return true;
+  }
+  struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLET,
+                              .data.fd = fd};
+  slot->watched = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+  return slot->watched;
+}
+
+// Makes ready the coroutines whose I/O has completed or whose timers have
+// expired. When block is set and none has, waits until one does.
+static void pollEvents(VM *vm, bool block) {
+  EventLoop *loop = vm->loop;
+  int timeout = 0;
+  if (block) {
+    timeout = -1;
+    if (loop->timerCount > 0) {
+      double wait = loop->timers[0].deadline - now();
+      timeout = wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+    }
+  }
+
+  struct epoll_event events[EVENT_BATCH];
+  int count = 0;
+  if (loop->pending > 0 || timeout != 0) {
+    count = epoll_wait(loop->epoll, events, EVENT_BATCH, timeout);
+  }
+  for (int i = 0; i < count; i++) {
+    IoRequest *request = &loop->requests[events[i].data.fd];
+    // Nothing waits on it, or not for this direction yet
+    if (request->coroutine == NULL) {
+      continue;
+    }
+    Value result;
+    if (attempt(vm, request, &result) == ATTEMPT_AGAIN) {
+      continue;
+    }
+    loop->pending--;
+    makeReady(loop, request->coroutine, result);
+    request->coroutine = NULL;
+  }
+
+  double time = now();
+  while (loop->timerCount > 0 && loop->timers[0].deadline <= time) {
+    makeReady(loop, popTimer(loop).coroutine, MAKE_NIL());
+  }
+}
+
+// Loads the next ready coroutine, first waiting for I/O or a timer if none
+// is, and returns the value it continues with. Once nothing is left to run
+// or wait for, loads the code that called runLoop() and returns nil.
+static Value nextFiber(VM *vm) {
+  EventLoop *loop = vm->loop;
+  if (++loop->switches >= SWITCH_BURST) {
+    loop->switches = 0;
+    pollEvents(vm, false);
+  }
+  while (loop->readyCount == 0 &&
+         (loop->pending > 0 || loop->timerCount > 0)) {
+    pollEvents(vm, true);
+  }
+  if (loop->readyCount == 0) {
+    loop->running = false;
+    vm->coroutine = NULL;
+    loadContext(vm, &loop->main);
+    return MAKE_NIL();
+  }
+
+  Ready next = loop->ready[loop->readyHead];
+  loop->readyHead = (loop->readyHead + 1) % loop->readyCapacity;
+  loop->readyCount--;
+  markResumed(&vm->gc, next.coroutine);
+  next.coroutine->state = COROUTINE_RUNNING;
+  vm->coroutine = next.coroutine;
+  loadContext(vm, &next.coroutine->context);
+  return next.value;
+}
+
+// Suspends the running coroutine inside a native taking argCount arguments
+// and continues the next fiber. Like a resume, it leaves the native's
+// epilogue room to drop the call from the stack it switched to.
+static void park(VM *vm, int argCount, Value *args, Value *result) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  saveContext(vm, &coroutine->context, args - 3);
+  coroutine->state = COROUTINE_WAITING;
+  *result = nextFiber(vm);
+  vm->stackTop += argCount + 3;
+}
+
+// Runs request to completion. Inside the loop the running coroutine waits
+// for it while other fibers run, outside it the whole VM blocks.
+static bool perform(VM *vm, IoRequest *request, int argCount, Value *args,
+                    Value *result) {
+  if (attempt(vm, request, result) == ATTEMPT_DONE) {
+    return true;
+  }
+  EventLoop *loop = vm->loop;
+  if (loop == NULL || !loop->running) {
+    do {
+      waitFor(request);
+    } while (attempt(vm, request, result) == ATTEMPT_AGAIN);
+    return true;
+  }
+
+  IoRequest *slot = requestSlot(loop, request->fd);
+  if (slot->coroutine != NULL) {
+    runtimeError(vm, "Another fiber is already waiting on file %d",
+                 request->fd);
+    return false;
+  }
+  if (!watch(loop, request->fd)) {
+    return true;
+  }
+  request->watched = true;
+  *slot = *request;
+  slot->coroutine = vm->coroutine;
+  loop->pending++;
+  park(vm, argCount, args, result);
+  return true;
+}
+
+// yield(value) inside a fiber lets the other ready fibers run first, and
+// evaluates to value
+void yieldFiber(VM *vm, int argCount, Value *args, Value *result) {
+  makeReady(vm->loop, vm->coroutine, args[0]);
+  park(vm, argCount, args, result);
+}
+
+// Called when a fiber's function returns. Loads the next fiber and returns
+// the value it continues with.
+Value finishFiber(VM *vm) { return nextFiber(vm); }
+
+// Drops every fiber when a run stopped while the loop was running them, so
+// the next run starts with an empty loop. Fibers spawned without running the
+// loop stay queued.
+void stopLoop(VM *vm) {
+  EventLoop *loop = vm->loop;
+  if (loop == NULL || !loop->running) {
+    return;
+  }
+  loop->running = false;
+  loop->readyCount = 0;
+  loop->timerCount = 0;
+  loop->pending = 0;
+  for (int i = 0; i < loop->requestCapacity; i++) {
+    loop->requests[i].coroutine = NULL;
+  }
+}
+
+void freeLoop(VM *vm) {
+  EventLoop *loop = vm->loop;
+  if (loop == NULL) {
+    return;
+  }
+  close(loop->epoll);
+  FREE_ARRAY(Ready, loop->ready, loop->readyCapacity);
+  FREE_ARRAY(IoRequest, loop->requests, loop->requestCapacity);
+  FREE_ARRAY(Timer, loop->timers, loop->timerCapacity);
+  release(MEMORY_OTHER, loop, sizeof(EventLoop));
+  vm->loop = NULL;
+}
+
+// Reads a whole Number argument of at least min into number
+static bool intArgument(VM *vm, const char *native, Value value, int min,
+                        int *number) {
+  if (!IS_NUM(value) || value.as.number != (int)value.as.number ||
+      value.as.number < min) {
+    runtimeError(vm, "%s expects a whole Number of at least %d, got %s",
+                 native, min, typeName(value));
+    return false;
+  }
+  *number = (int)value.as.number;
+  return true;
+}
+
+// spawn(function, value) queues a fiber that calls function with value once
+// the loop runs
+static bool spawnNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!isObjectOfType(args[0], OBJ_FUNCTION) ||
+      ((ObjFunc *)args[0].as.obj)->numParams != 1) {
+    runtimeError(vm, "spawn expects a function of one parameter, got %s",
+                 typeName(args[0]));
+    return false;
+  }
+  ObjCoroutine *fiber = createCoroutine(vm, (ObjFunc *)args[0].as.obj);
+  fiber->fiber = true;
+  makeReady(getLoop(vm), fiber, args[1]);
+  *result = MAKE_OBJ((Obj *)fiber);
+  return true;
+}
+
+// runLoop() runs fibers until none is left to run or wait for
+static bool runLoopNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (vm->coroutine != NULL) {
+    runtimeError(vm, "runLoop can only be called outside coroutines");
+    return false;
+  }
+  EventLoop *loop = getLoop(vm);
+  saveContext(vm, &loop->main, args - 3);
+  loop->running = true;
+  loop->switches = 0;
+  *result = nextFiber(vm);
+  vm->stackTop += argCount + 3;
+  return true;
+}
+
+// sleep(milliseconds) lets other fibers run for that long
+static bool sleepNative(VM *vm, int argCount, Value *args, Value *result) {
+  int milliseconds;
+  if (!intArgument(vm, "sleep", args[0], 0, &milliseconds)) {
+    return false;
+  }
+  *result = MAKE_NIL();
+  if (vm->loop == NULL || !vm->loop->running) {
+    struct timespec duration = {.tv_sec = milliseconds / 1000,
+                                .tv_nsec = milliseconds % 1000 * 1000000L};
+    nanosleep(&duration, NULL);
+    return true;
+  }
+  addTimer(vm->loop, now() + milliseconds / 1000.0, vm->coroutine);
+  park(vm, argCount, args, result);
+  return true;
+}
+
+// listen(port) opens a socket accepting connections on a local port, port 0
+// picking a free one. Evaluates to its descriptor, or nil.
+static bool listenNative(VM *vm, int argCount, Value *args, Value *result) {
+  int port;
+  if (!intArgument(vm, "listen", args[0], 0, &port)) {
+    return false;
+  }
+  *result = MAKE_NIL();
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return true;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in address = loopback(port);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return true;
+  }
+  *result = MAKE_NUM(fd);
+  return true;
+}
+
+// localPort(fd) is the port a socket is bound to
+static bool localPortNative(VM *vm, int argCount, Value *args, Value *result) {
+  int fd;
+  if (!intArgument(vm, "localPort", args[0], 0, &fd)) {
+    return false;
+  }
+  struct sockaddr_in address;
+  socklen_t size = sizeof(address);
+  *result = MAKE_NIL();
+  if (getsockname(fd, (struct sockaddr *)&address, &size) == 0) {
+    *result = MAKE_NUM(ntohs(address.sin_port));
+  }
+  return true;
+}
+
+// accept(fd) waits for a connection to a listening socket and evaluates to
+// its descriptor
+static bool acceptNative(VM *vm, int argCount, Value *args, Value *result) {
+  IoRequest request = {.kind = IO_ACCEPT};
+  if (!intArgument(vm, "accept", args[0], 0, &request.fd)) {
+    return false;
+  }
+  return perform(vm, &request, argCount, args, result);
+}
+
+// connect(port) connects to a local port and evaluates to the descriptor
+static bool connectNative(VM *vm, int argCount, Value *args, Value *result) {
+  IoRequest request = {.kind = IO_CONNECT};
+  if (!intArgument(vm, "connect", args[0], 1, &request.length)) {
+    return false;
+  }
+  request.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (request.fd < 0) {
+    *result = MAKE_NIL();
+    return true;
+  }
+  return perform(vm, &request, argCount, args, result);
+}
+
+// read(fd, n) waits for up to n bytes and evaluates to them as a String,
+// empty at the end of the input
+static bool readNative(VM *vm, int argCount, Value *args, Value *result) {
+  IoRequest request = {.kind = IO_READ};
+  if (!intArgument(vm, "read", args[0], 0, &request.fd) ||
+      !intArgument(vm, "read", args[1], 1, &request.length)) {
+    return false;
+  }
+  if (request.length > READ_MAX) {
+    request.length = READ_MAX;
+  }
+  // The buffer and the string read into it
+  if (!reserveMemory(vm, 2 * (size_t)request.length)) {
+    return false;
+  }
+  return perform(vm, &request, argCount, args, result);
+}
+
+// write(fd, string) waits until all of string is written and evaluates to
+// its length
+static bool writeNative(VM *vm, int argCount, Value *args, Value *result) {
+  IoRequest request = {.kind = IO_WRITE};
+  if (!intArgument(vm, "write", args[0], 0, &request.fd)) {
+    return false;
+  }
+  if (!IS_STRING(args[1])) {
+    runtimeError(vm, "write expects a String, got %s", typeName(args[1]));
+    return false;
+  }
+  request.data = (ObjString *)args[1].as.obj;
+  return perform(vm, &request, argCount, args, result);
+}
+
+// close(fd) closes a descriptor. A fiber waiting on it continues with nil.
+static bool closeNative(VM *vm, int argCount, Value *args, Value *result) {
+  int fd;
+  if (!intArgument(vm, "close", args[0], 0, &fd)) {
+    return false;
+  }
+  EventLoop *loop = vm->loop;
+  if (loop != NULL && fd < loop->requestCapacity &&
+      loop->requests[fd].coroutine != NULL) {
+    makeReady(loop, loop->requests[fd].coroutine, MAKE_NIL());
+    loop->requests[fd].coroutine = NULL;
+    loop->pending--;
+  }
+  closeDescriptor(vm, fd);
+  *result = MAKE_NIL();
+  return true;
+}
+
+// openFile(path, mode) opens a file for reading ("r"), writing ("w") or
+// appending ("a") and evaluates to its descriptor, or nil
+static bool openFileNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError(vm, "openFile expects a String path and mode");
+    return false;
+  }
+  const char *mode = ((ObjString *)args[1].as.obj)->string;
+  int flags;
+  if (strcmp(mode, "r") == 0) {
+    flags = O_RDONLY;
+  } else if (strcmp(mode, "w") == 0) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (strcmp(mode, "a") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+  } else {
+    runtimeError(vm, "openFile mode must be \"r\", \"w\" or \"a\"");
+    return false;
+  }
+  int fd = open(((ObjString *)args[0].as.obj)->string, flags | O_CLOEXEC,
+                0644);
+  *result = fd < 0 ? MAKE_NIL() : MAKE_NUM(fd);
+  return true;
+}
+
+// Binds the fiber and I/O natives as globals
+void defineLoopNatives(VM *vm) {
+  defineNative(vm, "spawn", spawnNative, 2);
+  defineNative(vm, "runLoop", runLoopNative, 0);
+  defineNative(vm, "sleep", sleepNative, 1);
+  defineNative(vm, "listen", listenNative, 1);
+  defineNative(vm, "localPort", localPortNative, 1);
+  defineNative(vm, "accept", acceptNative, 1);
+  defineNative(vm, "connect", connectNative, 1);
+  defineNative(vm, "read", readNative, 2);
+  defineNative(vm, "write", writeNative, 2);
+  defineNative(vm, "close", closeNative, 1);
+  defineNative(vm, "openFile", openFileNative, 2);
+}
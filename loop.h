@@ -0,0 +1,70 @@
+#ifndef sethi_loop_h
+#define sethi_loop_h
+
+#include "common.h"
+#include "coroutine.h"
+#include "value.h"
+#include "vm.h"
+
+typedef enum { IO_READ, IO_WRITE, IO_ACCEPT, IO_CONNECT } IoKind;
+
+// An I/O operation that could not complete straight away. The loop retries
+// it each time its file descriptor is ready, until it completes.
+typedef struct {
+  // The coroutine waiting for it, NULL for an unused slot
+  ObjCoroutine *coroutine;
+  // Whether the descriptor is registered with epoll. It stays registered
+  // until it is closed.
+  bool watched;
+  IoKind kind;
+  int fd;
+  // Bytes wanted by a read, or the port a connect goes to
+  int length;
+  // The string a write sends and how much of it has gone
+  ObjString *data;
+  int written;
+} IoRequest;
+
+typedef struct {
+  double deadline;
+  ObjCoroutine *coroutine;
+} Timer;
+
+// A coroutine that can run, and the value it continues with
+typedef struct {
+  ObjCoroutine *coroutine;
+  Value value;
+} Ready;
+
+// Runs fibers, coroutines that the loop resumes whenever the I/O or timer
+// they wait for completes. Created the first time a VM spawns a fiber.
+typedef struct EventLoop {
+  int epoll;
+  // True while runLoop() is running fibers
+  bool running;
+  // Where runLoop() was called from, continued once no fiber is left
+  Context main;
+  // Circular queue of coroutines waiting for their turn
+  Ready *ready;
+  int readyHead;
+  int readyCount;
+  int readyCapacity;
+  // Switches since the loop last checked for I/O
+  int switches;
+  // Requests indexed by their file descriptor, one per descriptor
+  IoRequest *requests;
+  int requestCapacity;
+  int pending;
+  // Binary heap ordered by deadline
+  Timer *timers;
+  int timerCount;
+  int timerCapacity;
+} EventLoop;
+
+void yieldFiber(VM *vm, int argCount, Value *args, Value *result);
+Value finishFiber(VM *vm);
+void stopLoop(VM *vm);
+void freeLoop(VM *vm);
+void defineLoopNatives(VM *vm);
+
+#endif
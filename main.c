@@ -1,59 +1,287 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "heap.h"
+#include "image.h"
+#include "perf.h"
+#include "scanner.h"
 #include "vm.h"
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static void repl() {
+// Reads one input into source, asking for more lines while brackets or a
+// string are left open. Returns false at end of input.
+static bool readInput(char **source, int *capacity) {
   char line[1024];
+  int length = 0;
+  (*source)[0] = '\0';
 
+  printf(">>> ");
   for (;;) {
-    printf(">>> ");
     if (!fgets(line, sizeof(line), stdin)) {
       printf("\n");
-      break;
+      return length > 0;
+    }
+    int lineLength = (int)strlen(line);
+    if (length + lineLength + 1 > *capacity) {
+      *capacity = (length + lineLength + 1) * 2;
+      *source = (char *)realloc(*source, *capacity);
+      if (*source == NULL) {
+        exit(1);
+      }
     }
+    memcpy(*source + length, line, lineLength + 1);
+    length += lineLength;
 
-    interpret(line);
+    // A blank line ends the input even if it is unfinished
+    if (lineLength <= 1 || !needsMoreInput(*source, length)) {
+      return true;
+    }
+    printf("... ");
   }
 }
 
-static char *readFile(const char *path) {
-  FILE *ptr = fopen(path, "rb");
+static void repl(Session *session) {
+  int capacity = 1024;
+  char *source = (char *)malloc(capacity);
+  if (source == NULL) {
+    exit(1);
+  }
 
-  fseek(ptr, 0, SEEK_END);
-  int length = ftell(ptr);
-  char *buffer = (char *)malloc(length + 1);
-  rewind(ptr);
+  while (readInput(&source, &capacity)) {
+    interpretSession(session, source, strlen(source));
+  }
+  free(source);
+}
 
-  size_t bytesRead = fread(buffer, sizeof(char), length, ptr);
-  buffer[bytesRead] = '\0';
+// A loaded source file. Regular files are mapped into memory instead of
+// copied, so the scanner reads the file's pages directly.
+typedef struct {
+  const char *data;
+  size_t length;
+  bool mapped;
+} Source;
 
-  fclose(ptr);
-  return buffer;
+// Reads everything from fd into a heap buffer. Used for input that can not be
+// mapped, such as pipes.
+static bool readAll(int fd, Source *source) {
+  size_t capacity = 4096;
+  size_t length = 0;
+  char *buffer = (char *)malloc(capacity);
+  for (;;) {
+    if (buffer == NULL) {
+      return false;
+    }
+    ssize_t bytesRead = read(fd, buffer + length, capacity - length);
+    if (bytesRead < 0) {
+      free(buffer);
+      return false;
+    }
+    if (bytesRead == 0) {
+      break;
+    }
+    length += bytesRead;
+    if (length == capacity) {
+      capacity *= 2;
+      char *grown = (char *)realloc(buffer, capacity);
+      if (grown == NULL) {
+        free(buffer);
+      }
+      buffer = grown;
+    }
+  }
+  source->data = buffer;
+  source->length = length;
+  source->mapped = false;
+  return true;
 }
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+// Loads the file at path, exiting with an error if it can not be read.
+static Source openSource(const char *path) {
+  Source source;
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  if (S_ISREG(info.st_mode) && info.st_size > 0) {
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      // The scanner makes one forward pass
+      madvise(data, info.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      source.data = (const char *)data;
+      source.length = info.st_size;
+      source.mapped = true;
+      return source;
+    }
+  }
+
+  if (!readAll(fd, &source)) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+  close(fd);
+  return source;
+}
+
+static void closeSource(Source *source) {
+  if (source->mapped) {
+    munmap((void *)source->data, source->length);
+  } else {
+    free((void *)source->data);
+  }
+}
+
+// Runs the file at path and returns the exit status for how it went
+static int runFile(VM *vm, const char *path) {
+  Source source = openSource(path);
+  InterpretResult result = interpretSource(vm, source.data, source.length);
+  closeSource(&source);
 
   if (result == INTERPRET_COMPILE_ERROR)
-    exit(65);
+    return 65;
   if (result == INTERPRET_RUNTIME_ERROR)
-    exit(77);
+    return 77;
+  return 0;
 }
 
 int main(int argc, const char *argv[]) {
-  initVM();
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  VM vm;
+  initVM(&vm);
+  int status = 0;
+  bool gcStats = false;
+  bool heapStats = false;
+  bool memoryStats = false;
+  const char *snapshotPath = NULL;
+  const char *imagePath = NULL;
+  const char *saveImagePath = NULL;
+  PerfCounters perf;
+  bool perfCounters = false;
+  bool perfByFunction = false;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-' && strcmp(argv[arg], "-i") != 0;
+       arg++) {
+    // -O0 runs what the compiler emits directly, -O1 optimizes it first
+    if (strncmp(argv[arg], "-O", 2) == 0 &&
+        (argv[arg][2] == '0' || argv[arg][2] == '1') && argv[arg][3] == '\0') {
+      vm.optimizationLevel = argv[arg][2] - '0';
+    } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+      // Prints the collector's pause histogram to stderr at exit
+      gcStats = true;
+    } else if (strncmp(argv[arg], "--gc-pause=", 11) == 0 &&
+               isdigit((unsigned char)argv[arg][11])) {
+      // The longest the collector should pause the program, in microseconds,
+      // or 0 to collect each cycle in one pause
+      vm.gc.pauseTarget = atoi(argv[arg] + 11);
+    } else if (strncmp(argv[arg], "--gc-threads=", 13) == 0 &&
+               atoi(argv[arg] + 13) >= 1 &&
+               atoi(argv[arg] + 13) <= GC_MAX_THREADS) {
+      // Threads the collector marks and sweeps on, the program's own included
+      vm.gc.threads = atoi(argv[arg] + 13);
+    } else if (strcmp(argv[arg], "--heap-stats") == 0) {
+      // Prints what the live objects are to stderr at exit
+      heapStats = true;
+    } else if (strncmp(argv[arg], "--heap-snapshot=", 16) == 0 &&
+               argv[arg][16] != '\0') {
+      // Writes the graph of the live objects to a file at exit
+      snapshotPath = argv[arg] + 16;
+    } else if (strncmp(argv[arg], "--memory-limit=", 15) == 0 &&
+               atoi(argv[arg] + 15) >= 1) {
+      // The most the program may allocate, in megabytes, before it stops
+      // with an out of memory error
+      vm.memory.limit = (size_t)atoi(argv[arg] + 15) << 20;
+    } else if (strcmp(argv[arg], "--memory-stats") == 0) {
+      // Prints what was allocated, and for what, to stderr at exit
+      memoryStats = true;
+    } else if (strncmp(argv[arg], "--image=", 8) == 0 &&
+               argv[arg][8] != '\0') {
+      // Starts from the globals and heap of an image instead of an empty VM
+      imagePath = argv[arg] + 8;
+    } else if (strncmp(argv[arg], "--save-image=", 13) == 0 &&
+               argv[arg][13] != '\0') {
+      // Writes an image of the globals and heap to a file at exit
+      saveImagePath = argv[arg] + 13;
+    } else if (strcmp(argv[arg], "--perf-counters") == 0 ||
+               strcmp(argv[arg], "--perf-counters=functions") == 0) {
+      // Counts cycles, instructions and cache and branch misses while the
+      // program runs and prints them to stderr at exit, also for each
+      // function with =functions
+      perfCounters = true;
+      perfByFunction = argv[arg][15] == '=';
+    } else {
+      break;
+    }
+  }
+
+  if (imagePath != NULL && !loadImage(&vm, imagePath)) {
+    fprintf(stderr, "Could not load image \"%s\".\n", imagePath);
+    freeVM(&vm);
+    return 74;
+  }
+  if (perfCounters) {
+    if (openPerfCounters(&perf, perfByFunction) == 0) {
+      fprintf(stderr, "Performance counters are not available.\n");
+    }
+    vm.perf = &perf;
+  }
+  if (argc - arg == 0) {
+    Session session;
+    initSession(&session, &vm);
+    repl(&session);
+    freeSession(&session);
+  } else if (argc - arg == 1) {
+    status = runFile(&vm, argv[arg]);
+  } else if (argc - arg == 2 && strcmp(argv[arg], "-i") == 0) {
+    // Loads a prelude into the session once, then continues interactively
+    Session session;
+    initSession(&session, &vm);
+    Source source = openSource(argv[arg + 1]);
+    interpretSession(&session, source.data, source.length);
+    closeSource(&source);
+    repl(&session);
+    freeSession(&session);
   } else {
-    fprintf(stderr, "There was an error too many args");
+    fprintf(stderr, "Usage: sethi [-O0|-O1] [--gc-stats] [--gc-pause=us] "
+                    "[--gc-threads=n] [--heap-stats] [--heap-snapshot=path] "
+                    "[--memory-limit=mb] [--memory-stats] [--image=path] "
+                    "[--save-image=path] [--perf-counters[=functions]] [path] | "
+                    "sethi -i [prelude]\n");
+    status = 64;
+  }
+  if (gcStats) {
+    printCollectorStats(&vm.gc, stderr);
+  }
+  if (heapStats) {
+    HeapStats stats;
+    takeHeapStats(&vm, &stats);
+    printHeapStats(&stats, stderr);
+    freeHeapStats(&stats);
+  }
+  if (snapshotPath != NULL && !dumpHeapSnapshot(&vm, snapshotPath)) {
+    fprintf(stderr, "Could not write heap snapshot \"%s\".\n", snapshotPath);
+    status = status == 0 ? 74 : status;
+  }
+  if (saveImagePath != NULL && !saveImage(&vm, saveImagePath)) {
+    fprintf(stderr, "Could not write image \"%s\".\n", saveImagePath);
+    status = status == 0 ? 74 : status;
+  }
+  if (memoryStats) {
+    printMemoryStats(&vm.memory, stderr);
+  }
+  if (perfCounters) {
+    printPerfCounters(&perf, stderr);
+    vm.perf = NULL;
+    closePerfCounters(&perf);
   }
-  freeVM();
+  freeVM(&vm);
+  return status;
 }
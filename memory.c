@@ -1,7 +1,67 @@
 #include <stdlib.h>
 #include "memory.h"
 
+// The account allocations on this thread are charged to, or NULL for none
+static __thread MemoryAccount* current = NULL;
+
+// Charges made on this thread that have not been added to current yet. They
+// are added once they come to PENDING_MAX bytes either way, or when the
+// thread flushes them, so most allocations are counted without an atomic
+// operation. Other threads may see an account up to that many bytes off.
+#define PENDING_MAX (64 * 1024)
+static __thread struct {
+    long long bytes[MEMORY_KINDS];
+    unsigned long long allocations[MEMORY_KINDS];
+    long long total;
+} pending;
+
+static const char* kindNames[MEMORY_KINDS] = {
+    "objects", "tables", "arrays", "collector", "other"
+};
+
+// Adds the charges this thread has made since it last did to its account
+// and those above it
+void flushAccount() {
+    MemoryAccount* account = current;
+    if(account == NULL) {
+        return;
+    }
+    for(int i = 0; i < MEMORY_KINDS; i++) {
+        if(pending.bytes[i] != 0) {
+            atomic_fetch_add_explicit(&account->kindBytes[i], pending.bytes[i], memory_order_relaxed);
+            pending.bytes[i] = 0;
+        }
+        if(pending.allocations[i] != 0) {
+            atomic_fetch_add_explicit(&account->allocations[i], pending.allocations[i], memory_order_relaxed);
+            pending.allocations[i] = 0;
+        }
+    }
+    long long bytes = pending.total;
+    pending.total = 0;
+    for(; account != NULL; account = account->parent) {
+        long long now = atomic_fetch_add_explicit(&account->bytes, bytes, memory_order_relaxed) + bytes;
+        long long peak = atomic_load_explicit(&account->peak, memory_order_relaxed);
+        while(now > peak && !atomic_compare_exchange_weak_explicit(&account->peak, &peak, now,
+                                memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+}
+
+static void charge(MemoryKind kind, long long bytes, bool counted) {
+    if(current == NULL) {
+        return;
+    }
+    pending.bytes[kind] += bytes;
+    pending.allocations[kind] += counted;
+    pending.total += bytes;
+    if(pending.total >= PENDING_MAX || pending.total <= -PENDING_MAX) {
+        flushAccount();
+    }
+}
+
+// Resizes an array, counted as MEMORY_ARRAYS. A newSize of 0 frees it.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    charge(MEMORY_ARRAYS, (long long)newSize - (long long)oldSize, oldSize == 0 && newSize > 0);
     if(newSize == 0) {
         free(pointer);
         return NULL;
@@ -15,3 +75,98 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+void* allocate(MemoryKind kind, size_t size) {
+    void* result = malloc(size);
+    if(result == NULL) {
+        exit(1);
+    }
+    charge(kind, (long long)size, true);
+    return result;
+}
+
+void* allocateZeroed(MemoryKind kind, size_t size) {
+    void* result = calloc(1, size);
+    if(result == NULL) {
+        exit(1);
+    }
+    charge(kind, (long long)size, true);
+    return result;
+}
+
+// Frees what allocate returned, given the size it was asked for
+void release(MemoryKind kind, void* pointer, size_t size) {
+    if(pointer == NULL) {
+        return;
+    }
+    free(pointer);
+    charge(kind, -(long long)size, false);
+}
+
+// Charges memory allocated some other way, such as mapped pages. Negative
+// bytes give it back.
+void countMemory(MemoryKind kind, long long bytes) {
+    charge(kind, bytes, bytes > 0);
+}
+
+void initAccount(MemoryAccount* account, MemoryAccount* parent) {
+    account->parent = parent;
+    account->limit = 0;
+    atomic_init(&account->bytes, 0);
+    atomic_init(&account->peak, 0);
+    for(int i = 0; i < MEMORY_KINDS; i++) {
+        atomic_init(&account->kindBytes[i], 0);
+        atomic_init(&account->allocations[i], 0);
+    }
+}
+
+// Takes what the account still holds, such as strings shared with other
+// VMs, off the accounts above it
+void closeAccount(MemoryAccount* account) {
+    long long left = atomic_exchange(&account->bytes, 0);
+    for(MemoryAccount* parent = account->parent; parent != NULL; parent = parent->parent) {
+        atomic_fetch_sub_explicit(&parent->bytes, left, memory_order_relaxed);
+    }
+}
+
+// Charges allocations on the calling thread to account from now on, which
+// may be NULL, and returns the account they were charged to before
+MemoryAccount* useAccount(MemoryAccount* account) {
+    flushAccount();
+    MemoryAccount* previous = current;
+    current = account;
+    return previous;
+}
+
+// Returns the limit of the first account from account up that size more
+// bytes would take it past, or 0 if they fit under every limit
+size_t exceededLimit(MemoryAccount* account, size_t size) {
+    if(account == current) {
+        flushAccount();
+    }
+    for(; account != NULL; account = account->parent) {
+        long long bytes = atomic_load_explicit(&account->bytes, memory_order_relaxed);
+        if(account->limit > 0 && bytes + (long long)size > (long long)account->limit) {
+            return account->limit;
+        }
+    }
+    return 0;
+}
+
+// Prints the bytes in use and at the peak, then the allocations and bytes
+// of each kind
+void printMemoryStats(MemoryAccount* account, FILE* out) {
+    if(account == current) {
+        flushAccount();
+    }
+    fprintf(out, "memory: %lld bytes in use, %lld at peak", (long long)account->bytes,
+            (long long)account->peak);
+    if(account->limit > 0) {
+        fprintf(out, ", limit %zu\n", account->limit);
+    } else {
+        fprintf(out, ", no limit\n");
+    }
+    for(int i = 0; i < MEMORY_KINDS; i++) {
+        fprintf(out, "  %-10s %12llu allocations %14lld bytes\n", kindNames[i],
+                (unsigned long long)account->allocations[i], (long long)account->kindBytes[i]);
+    }
+}
@@ -2,6 +2,8 @@
 #define sethi_memory_h
 
 #include "common.h"
+#include <stdatomic.h>
+#include <stdio.h>
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
     (type*)reallocate(pointer, sizeof(type) * (oldCount), \
@@ -9,7 +11,45 @@
 #define GROW_CAPACITY(capacity) ((capacity < 8) ? 8 : (capacity * 2))
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * oldCount, 0)
 
+// What memory is allocated for
+typedef enum {
+    MEMORY_OBJECTS,
+    MEMORY_TABLES,
+    // Growable arrays: chunks, constants, queues and the collector's stacks
+    MEMORY_ARRAYS,
+    // Regions, the nursery and arenas
+    MEMORY_COLLECTOR,
+    // The event loop, its I/O buffers and sessions' compilers
+    MEMORY_OTHER,
+    MEMORY_KINDS
+} MemoryKind;
+
+// The memory one VM holds. Each allocation is charged to the account the
+// allocating thread uses, and its bytes to every account above that one, so
+// a task's memory also counts against the VM that spawned it. The counts are
+// atomic since collector helpers and tasks change them from other threads.
+typedef struct MemoryAccount {
+    struct MemoryAccount* parent;
+    // Bytes the account may hold before its VM stops with an error, or 0
+    size_t limit;
+    // Including those charged to accounts below this one
+    atomic_llong bytes;
+    atomic_llong peak;
+    // Only those charged to this account
+    atomic_llong kindBytes[MEMORY_KINDS];
+    atomic_ullong allocations[MEMORY_KINDS];
+} MemoryAccount;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocate(MemoryKind kind, size_t size);
+void* allocateZeroed(MemoryKind kind, size_t size);
+void release(MemoryKind kind, void* pointer, size_t size);
+void countMemory(MemoryKind kind, long long bytes);
+void flushAccount();
+void initAccount(MemoryAccount* account, MemoryAccount* parent);
+void closeAccount(MemoryAccount* account);
+MemoryAccount* useAccount(MemoryAccount* account);
+size_t exceededLimit(MemoryAccount* account, size_t size);
+void printMemoryStats(MemoryAccount* account, FILE* out);
 
 #endif
-
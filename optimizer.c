@@ -0,0 +1,2315 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+#include "table.h"
+#include "value.h"
+
+#define MAX_SLOTS 256
+// Temporaries are reserved at the bottom of every frame of the function, so
+// only a few are handed out to leave stack room for recursion.
+#define MAX_TEMPS 4
+#define VALUE_UNKNOWN -1
+
+// One decoded instruction. Jumps name the instruction they land on instead of
+// a byte distance, so instructions can be added and removed freely.
+typedef struct {
+  uint8_t op;
+  // Constant index, slot, argument count or field count
+  int operand;
+  // Shape constant of OP_STRUCT
+  int operand2;
+  // Index of the instruction a jump lands on
+  int target;
+  int line;
+  // The slot of OP_GET_LOC or OP_SET_LOC is a temporary, not a stack slot
+  bool temp;
+} IrInstr;
+
+// The instructions of one chunk
+typedef struct {
+  IrInstr *code;
+  int count;
+  // Slots below the first temporary
+  int numParams;
+  int tempCount;
+} Ir;
+
+// What is known about an instruction before it runs
+typedef struct {
+  // Stack height relative to the frame, -1 if it can never run
+  int height;
+  // Instructions that can run just before this one
+  int preds;
+  // Starts a basic block
+  bool leader;
+} IrInfo;
+
+// Kinds of value a stack slot may hold, as a set
+#define TYPE_NIL 1
+#define TYPE_BOOL 2
+#define TYPE_NUM 4
+#define TYPE_STRING 8
+#define TYPE_STRUCT 16
+// Functions, natives, buffers, coroutines and tasks
+#define TYPE_OTHER 32
+#define TYPE_ANY 63
+
+// What type inference knows about a value: the kinds it may have and, where
+// every path agrees, the shape of the struct or the object of another kind
+// it is. No kinds at all means no path gets there with a value.
+typedef struct {
+  uint8_t kinds;
+  ObjShape *shape;
+  Obj *object;
+} Type;
+
+typedef struct {
+  VM *vm;
+  Chunk *chunk;
+  // Functions nothing can bind to anything else, whose globals keep their
+  // value, so reading them can be shared and hoisted. NULL if there are none.
+  Table *pinned;
+  // The chunk being optimized relied on a global in pinned
+  bool usedPinned;
+  // The last pass changed the instructions
+  bool changed;
+  // Functions whose return type has been inferred, and those types. A
+  // function is listed as returning anything while its own body is looked at.
+  ObjFunc **summarized;
+  Type *returns;
+  int summaryCount;
+  int summaryCapacity;
+} Optimizer;
+
+// Returns the number of operand bytes following op, or -1 for opcodes the
+// optimizer does not know.
+static int operandBytes(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOB:
+  case OP_SET_GLOB:
+  case OP_GET_GLOB:
+  case OP_SET_LOC:
+  case OP_GET_LOC:
+  case OP_CALL:
+  case OP_NAMESPACE:
+  case OP_FIELD:
+    return 1;
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP:
+  case OP_JUMP_BACK:
+  case OP_STRUCT:
+  case OP_CALL_DIRECT:
+    return 2;
+  case OP_RETURN:
+  case OP_NEGATE:
+  case OP_MUL:
+  case OP_DIVIDE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NIL:
+  case OP_EQUALITY:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_FALSIFY:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_AND:
+  case OP_OR:
+  case OP_TYPE:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MUL_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_EQUAL_NUM:
+  case OP_GREATER_EQUAL_NUM:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP_IF_FALSE || op == OP_JUMP || op == OP_JUMP_BACK;
+}
+
+// Returns true if the instruction after op can run next
+static bool fallsThrough(uint8_t op) {
+  return op != OP_JUMP && op != OP_JUMP_BACK && op != OP_RETURN;
+}
+
+// Returns true for operations whose result depends only on their operands
+static bool isPure(uint8_t op) {
+  switch (op) {
+  case OP_NEGATE:
+  case OP_MUL:
+  case OP_DIVIDE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_EQUALITY:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_FALSIFY:
+  case OP_NAMESPACE:
+  case OP_TYPE:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MUL_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_EQUAL_NUM:
+  case OP_GREATER_EQUAL_NUM:
+  case OP_FIELD:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Sets how many values the instruction takes off the stack and puts back.
+// Instructions that only look at the top take nothing.
+static void stackEffect(IrInstr *in, int *pops, int *pushes) {
+  *pops = 0;
+  *pushes = 0;
+  switch (in->op) {
+  case OP_CONSTANT:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NIL:
+  case OP_GET_GLOB:
+  case OP_GET_LOC:
+    *pushes = 1;
+    break;
+  case OP_NEGATE:
+  case OP_FALSIFY:
+  case OP_NAMESPACE:
+  case OP_TYPE:
+  case OP_FIELD:
+    *pops = 1;
+    *pushes = 1;
+    break;
+  case OP_MUL:
+  case OP_DIVIDE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_EQUALITY:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_AND:
+  case OP_OR:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MUL_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_EQUAL_NUM:
+  case OP_GREATER_EQUAL_NUM:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case OP_RETURN:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_DEFINE_GLOB:
+    *pops = 1;
+    break;
+  case OP_CALL:
+    // The callee, its arguments and the three frame placeholders
+    *pops = in->operand + 4;
+    *pushes = 1;
+    break;
+  case OP_CALL_DIRECT:
+    // The callee is an operand
+    *pops = in->operand + 3;
+    *pushes = 1;
+    break;
+  case OP_STRUCT:
+    *pops = in->operand;
+    *pushes = 1;
+    break;
+  default:
+    break;
+  }
+}
+
+// Decodes chunk into ir. Returns false if it holds an opcode or jump the
+// optimizer can not follow.
+static bool lift(Chunk *chunk, int numParams, Ir *ir) {
+  ir->code = (IrInstr *)malloc(sizeof(IrInstr) * (chunk->count + 1));
+  ir->count = 0;
+  ir->numParams = numParams;
+  ir->tempCount = 0;
+  int *indexAt = (int *)malloc(sizeof(int) * (chunk->count + 1));
+  for (int i = 0; i <= chunk->count; i++) {
+    indexAt[i] = -1;
+  }
+
+  bool ok = true;
+  int offset = 0;
+  while (ok && offset < chunk->count) {
+    uint8_t op = chunk->code[offset];
+    int size = operandBytes(op);
+    if (size < 0 || offset + size >= chunk->count) {
+      ok = false;
+      break;
+    }
+    IrInstr *in = &ir->code[ir->count];
+    *in = (IrInstr){.op = op, .target = -1, .line = chunk->lines[offset]};
+    if (isJump(op)) {
+      int length = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      // Held as a byte offset until every instruction has an index
+      in->target = op == OP_JUMP_BACK ? offset + 3 - length : offset + 3 + length;
+    } else if (size >= 1) {
+      in->operand = chunk->code[offset + 1];
+      if (size == 2) {
+        in->operand2 = chunk->code[offset + 2];
+      }
+    }
+    indexAt[offset] = ir->count++;
+    offset += 1 + size;
+  }
+
+  for (int i = 0; ok && i < ir->count; i++) {
+    IrInstr *in = &ir->code[i];
+    if (isJump(in->op)) {
+      if (in->target < 0 || in->target >= chunk->count ||
+          indexAt[in->target] < 0) {
+        ok = false;
+      } else {
+        in->target = indexAt[in->target];
+      }
+    }
+  }
+  free(indexAt);
+  if (!ok || ir->count == 0) {
+    free(ir->code);
+    return false;
+  }
+  return true;
+}
+
+// Finds basic blocks and the stack height before every instruction. Returns
+// false if paths meet with different heights, which the passes rely on not
+// happening.
+static bool analyze(Ir *ir, IrInfo *info) {
+  for (int i = 0; i < ir->count; i++) {
+    info[i] = (IrInfo){.height = -1, .preds = 0, .leader = i == 0};
+  }
+  for (int i = 0; i < ir->count; i++) {
+    IrInstr *in = &ir->code[i];
+    if (isJump(in->op)) {
+      info[in->target].leader = true;
+      info[in->target].preds++;
+    }
+    if (i + 1 < ir->count) {
+      if (isJump(in->op) || in->op == OP_RETURN) {
+        info[i + 1].leader = true;
+      }
+      if (fallsThrough(in->op)) {
+        info[i + 1].preds++;
+      }
+    }
+  }
+
+  int *work = (int *)malloc(sizeof(int) * ir->count);
+  int workCount = 0;
+  bool ok = true;
+  info[0].height = ir->numParams;
+  work[workCount++] = 0;
+  while (ok && workCount > 0) {
+    int i = work[--workCount];
+    IrInstr *in = &ir->code[i];
+    int pops, pushes;
+    stackEffect(in, &pops, &pushes);
+    int height = info[i].height;
+    if (pops > height || height - pops + pushes >= MAX_SLOTS ||
+        (in->op == OP_GET_LOC && !in->temp && in->operand >= height) ||
+        (in->op == OP_SET_LOC && !in->temp && in->operand >= height)) {
+      ok = false;
+      break;
+    }
+    height = height - pops + pushes;
+
+    int successors[2];
+    int successorCount = 0;
+    if (fallsThrough(in->op)) {
+      if (i + 1 >= ir->count) {
+        ok = false;
+        break;
+      }
+      successors[successorCount++] = i + 1;
+    }
+    if (isJump(in->op)) {
+      successors[successorCount++] = in->target;
+    }
+    for (int s = 0; s < successorCount; s++) {
+      IrInfo *next = &info[successors[s]];
+      if (next->height < 0) {
+        next->height = height;
+        work[workCount++] = successors[s];
+      } else if (next->height != height) {
+        ok = false;
+      }
+    }
+  }
+  free(work);
+  return ok;
+}
+
+// Writes ir back into chunk, keeping its constants. Temporaries get the
+// slots just above the parameters, and are cleared to nil on entry. Returns
+// false, leaving chunk alone, if a slot or jump no longer fits its operand.
+static bool emit(Ir *ir, Chunk *chunk) {
+  int *offsets = (int *)malloc(sizeof(int) * ir->count);
+  int offset = ir->tempCount;
+  for (int i = 0; i < ir->count; i++) {
+    offsets[i] = offset;
+    offset += 1 + operandBytes(ir->code[i].op);
+  }
+
+  Chunk out;
+  initChunk(&out);
+  bool ok = true;
+  for (int t = 0; t < ir->tempCount; t++) {
+    writeChunk(&out, OP_NIL, ir->code[0].line);
+  }
+  for (int i = 0; ok && i < ir->count; i++) {
+    IrInstr *in = &ir->code[i];
+    writeChunk(&out, in->op, in->line);
+    if (isJump(in->op)) {
+      int length = in->op == OP_JUMP_BACK
+                       ? offsets[i] + 3 - offsets[in->target]
+                       : offsets[in->target] - (offsets[i] + 3);
+      ok = length >= 0 && length <= UINT16_MAX;
+      writeChunk(&out, (length >> 8) & 0xff, in->line);
+      writeChunk(&out, length & 0xff, in->line);
+    } else if (in->op == OP_GET_LOC || in->op == OP_SET_LOC) {
+      int slot = in->operand;
+      if (in->temp) {
+        slot = ir->numParams + in->operand;
+      } else if (slot >= ir->numParams) {
+        slot += ir->tempCount;
+      }
+      ok = slot < MAX_SLOTS;
+      writeChunk(&out, slot, in->line);
+    } else if (operandBytes(in->op) >= 1) {
+      writeChunk(&out, in->operand, in->line);
+      if (operandBytes(in->op) == 2) {
+        writeChunk(&out, in->operand2, in->line);
+      }
+    }
+  }
+  free(offsets);
+
+  if (!ok) {
+    freeChunk(&out);
+    return false;
+  }
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  chunk->code = out.code;
+  chunk->lines = out.lines;
+  chunk->count = out.count;
+  chunk->capacity = out.capacity;
+  return true;
+}
+
+// Returns true if the global called name reads the same bound value for the
+// whole run.
+static bool isStableName(Optimizer *opt, ObjString *name) {
+  if (opt->pinned == NULL || get(opt->pinned, name) == NULL ||
+      get(&opt->vm->table, name) == NULL) {
+    return false;
+  }
+  opt->usedPinned = true;
+  return true;
+}
+
+// Returns true if the global named by constant index reads the same bound
+// value for the whole run.
+static bool isStable(Optimizer *opt, int index) {
+  return isStableName(opt,
+                      (ObjString *)opt->chunk->constants.values[index].as.obj);
+}
+
+// Returns true for instructions that can neither fail nor be observed
+static bool isQuiet(Optimizer *opt, IrInstr *in) {
+  switch (in->op) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOC:
+  case OP_EQUALITY:
+  case OP_TYPE:
+    return true;
+  case OP_GET_GLOB:
+    return isStable(opt, in->operand);
+  default:
+    return false;
+  }
+}
+
+//
+// Edits
+//
+
+typedef enum {
+  EDIT_NONE,
+  // Replaces instructions start..index with code
+  EDIT_REPLACE,
+  // Inserts code ahead of index. Jumps from above index go to the code, so
+  // index can be a loop header with code as its preheader.
+  EDIT_INSERT_BEFORE,
+  // Inserts code right after index
+  EDIT_INSERT_AFTER,
+} EditKind;
+
+typedef struct {
+  EditKind kind;
+  int start;
+  int index;
+  IrInstr *code;
+  int count;
+} Edit;
+
+// Changes a pass decides on. They are applied together once the pass has
+// finished reading the instructions.
+typedef struct {
+  Edit *edits;
+  int count;
+  int capacity;
+} Edits;
+
+static void addEdit(Edits *edits, EditKind kind, int start, int index,
+                    IrInstr *code, int count) {
+  if (kind == EDIT_REPLACE) {
+    // A larger replacement takes in any replacement inside it
+    for (int e = 0; e < edits->count; e++) {
+      Edit *edit = &edits->edits[e];
+      if (edit->kind == EDIT_REPLACE && edit->start >= start &&
+          edit->index <= index) {
+        edit->kind = EDIT_NONE;
+      }
+    }
+  }
+  if (edits->count + 1 > edits->capacity) {
+    int oldCapacity = edits->capacity;
+    edits->capacity = GROW_CAPACITY(oldCapacity);
+    edits->edits = GROW_ARRAY(Edit, edits->edits, oldCapacity, edits->capacity);
+  }
+  Edit *edit = &edits->edits[edits->count++];
+  edit->kind = kind;
+  edit->start = start;
+  edit->index = index;
+  edit->count = count;
+  edit->code = (IrInstr *)malloc(sizeof(IrInstr) * (count > 0 ? count : 1));
+  if (count > 0) {
+    memcpy(edit->code, code, sizeof(IrInstr) * count);
+  }
+}
+
+static void freeEdits(Edits *edits) {
+  for (int e = 0; e < edits->count; e++) {
+    free(edits->edits[e].code);
+  }
+  FREE_ARRAY(Edit, edits->edits, edits->capacity);
+}
+
+static void appendCode(IrInstr *code, int *origin, int *count, Edit *edit) {
+  for (int k = 0; k < edit->count; k++) {
+    code[*count] = edit->code[k];
+    origin[(*count)++] = -1;
+  }
+}
+
+static void applyEdits(Ir *ir, Edits *edits) {
+  if (edits->count == 0) {
+    return;
+  }
+  int n = ir->count;
+  int *replaced = (int *)malloc(sizeof(int) * n);
+  int *before = (int *)malloc(sizeof(int) * n);
+  int *after = (int *)malloc(sizeof(int) * n);
+  int *next = (int *)malloc(sizeof(int) * edits->count);
+  bool *removed = (bool *)calloc(n, sizeof(bool));
+  for (int i = 0; i < n; i++) {
+    replaced[i] = before[i] = after[i] = -1;
+  }
+
+  int total = n;
+  // Walked backwards so each list keeps the order the edits were made in
+  for (int e = edits->count - 1; e >= 0; e--) {
+    Edit *edit = &edits->edits[e];
+    total += edit->count;
+    switch (edit->kind) {
+    case EDIT_REPLACE:
+      for (int k = edit->start; k <= edit->index; k++) {
+        removed[k] = true;
+      }
+      replaced[edit->index] = e;
+      break;
+    case EDIT_INSERT_BEFORE:
+      next[e] = before[edit->index];
+      before[edit->index] = e;
+      break;
+    case EDIT_INSERT_AFTER:
+      next[e] = after[edit->index];
+      after[edit->index] = e;
+      break;
+    case EDIT_NONE:
+      break;
+    }
+  }
+
+  IrInstr *code = (IrInstr *)malloc(sizeof(IrInstr) * (total + 1));
+  int *origin = (int *)malloc(sizeof(int) * (total + 1));
+  int *first = (int *)malloc(sizeof(int) * (n + 1));
+  int *preheader = (int *)malloc(sizeof(int) * n);
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    preheader[i] = before[i] >= 0 ? count : -1;
+    for (int e = before[i]; e >= 0; e = next[e]) {
+      appendCode(code, origin, &count, &edits->edits[e]);
+    }
+    first[i] = count;
+    if (replaced[i] >= 0) {
+      appendCode(code, origin, &count, &edits->edits[replaced[i]]);
+    } else if (!removed[i]) {
+      code[count] = ir->code[i];
+      origin[count++] = i;
+    }
+    for (int e = after[i]; e >= 0; e = next[e]) {
+      appendCode(code, origin, &count, &edits->edits[e]);
+    }
+  }
+  first[n] = count;
+
+  // Jumps into a loop from above run its preheader, the back edge does not
+  for (int k = 0; k < count; k++) {
+    if (origin[k] >= 0 && isJump(code[k].op)) {
+      int target = code[k].target;
+      code[k].target = preheader[target] >= 0 && origin[k] < target
+                           ? preheader[target]
+                           : first[target];
+    }
+  }
+
+  free(ir->code);
+  ir->code = code;
+  ir->count = count;
+  free(replaced);
+  free(before);
+  free(after);
+  free(next);
+  free(removed);
+  free(origin);
+  free(first);
+  free(preheader);
+}
+
+//
+// Value numbering
+//
+
+// What a value number stands for. Values with equal keys are equal, which
+// is how common subexpressions are found.
+typedef struct {
+  // Opcode that computed the value, VALUE_UNKNOWN if nothing is known
+  int op;
+  int operand;
+  int left;
+  int right;
+} ValueKey;
+
+typedef struct {
+  ValueKey *keys;
+  // Extended block each value was last computed in and the instruction
+  // computing it there
+  int *block;
+  int *root;
+  int count;
+  int capacity;
+  // Open addressed index of known keys, -1 where empty
+  int *buckets;
+  int bucketCount;
+} Values;
+
+static uint32_t hashKey(ValueKey key) {
+  uint32_t hash = 2166136261u;
+  int parts[4] = {key.op, key.operand, key.left, key.right};
+  for (int i = 0; i < 4; i++) {
+    hash = (hash ^ (uint32_t)parts[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void insertBucket(Values *values, int value) {
+  uint32_t index = hashKey(values->keys[value]) & (values->bucketCount - 1);
+  while (values->buckets[index] >= 0) {
+    index = (index + 1) & (values->bucketCount - 1);
+  }
+  values->buckets[index] = value;
+}
+
+// Returns the number of the value with key, numbering it if it is new.
+// Unknown values are always new.
+static int numberValue(Values *values, ValueKey key) {
+  if (key.op != VALUE_UNKNOWN && values->bucketCount > 0) {
+    uint32_t index = hashKey(key) & (values->bucketCount - 1);
+    while (values->buckets[index] >= 0) {
+      ValueKey *other = &values->keys[values->buckets[index]];
+      if (memcmp(other, &key, sizeof(ValueKey)) == 0) {
+        return values->buckets[index];
+      }
+      index = (index + 1) & (values->bucketCount - 1);
+    }
+  }
+
+  if (values->count + 1 > values->capacity) {
+    int oldCapacity = values->capacity;
+    values->capacity = GROW_CAPACITY(oldCapacity);
+    values->keys =
+        GROW_ARRAY(ValueKey, values->keys, oldCapacity, values->capacity);
+    values->block = GROW_ARRAY(int, values->block, oldCapacity, values->capacity);
+    values->root = GROW_ARRAY(int, values->root, oldCapacity, values->capacity);
+  }
+  int value = values->count++;
+  values->keys[value] = key;
+  values->block[value] = 0;
+  values->root[value] = -1;
+  if (key.op == VALUE_UNKNOWN) {
+    return value;
+  }
+
+  if (values->count * 2 > values->bucketCount) {
+    FREE_ARRAY(int, values->buckets, values->bucketCount);
+    values->bucketCount = values->bucketCount == 0 ? 64 : values->bucketCount * 2;
+    values->buckets = GROW_ARRAY(int, NULL, 0, values->bucketCount);
+    memset(values->buckets, 0xff, sizeof(int) * values->bucketCount);
+    for (int v = 0; v < values->count; v++) {
+      if (values->keys[v].op != VALUE_UNKNOWN) {
+        insertBucket(values, v);
+      }
+    }
+  } else {
+    insertBucket(values, value);
+  }
+  return value;
+}
+
+static int unknownValue(Values *values) {
+  return numberValue(values, (ValueKey){VALUE_UNKNOWN, 0, 0, 0});
+}
+
+// A stack slot during value numbering
+typedef struct {
+  int value;
+  // First instruction of the expression that pushed the value, if the whole
+  // expression is side effect free and inside the current block. -1 otherwise.
+  int start;
+} NumberedSlot;
+
+typedef struct {
+  Optimizer *opt;
+  Ir *ir;
+  IrInfo *info;
+  Edits *edits;
+  Values values;
+  NumberedSlot stack[MAX_SLOTS];
+  int temps[MAX_TEMPS];
+  // Current extended block. Values computed earlier in it are available.
+  int block;
+} Numbering;
+
+// Returns true if the block starting at i only runs straight after the
+// instruction before it, so what is known there still holds.
+static bool extendsBlock(Ir *ir, IrInfo *info, int i) {
+  return i > 0 && info[i - 1].height >= 0 &&
+         fallsThrough(ir->code[i - 1].op) && info[i].preds == 1;
+}
+
+// Copy propagation. A read of a local holding a constant becomes the
+// constant, and a read of a local holding a copy of a lower slot reads that
+// slot instead, which can leave the copy dead.
+static void propagateCopy(Numbering *n, int i, int value) {
+  IrInstr replacement = n->ir->code[i];
+  ValueKey *key = &n->values.keys[value];
+  if (key->op == OP_CONSTANT || key->op == OP_NIL || key->op == OP_TRUE ||
+      key->op == OP_FALSE) {
+    replacement.op = key->op;
+    replacement.operand = key->operand;
+  } else {
+    int slot = 0;
+    while (n->stack[slot].value != value) {
+      slot++;
+    }
+    if (slot == replacement.operand) {
+      return;
+    }
+    replacement.operand = slot;
+  }
+  addEdit(n->edits, EDIT_REPLACE, i, i, &replacement, 1);
+}
+
+// Common subexpression elimination. The expression start..i computes value;
+// if it was already computed in this extended block the expression is
+// replaced by a read of a slot still holding it. When no slot does, the
+// first computation is saved in a temporary.
+static void eliminateCommon(Numbering *n, int i, int start, int value) {
+  if (start < 0) {
+    return;
+  }
+  Ir *ir = n->ir;
+  if (n->values.block[value] != n->block) {
+    n->values.block[value] = n->block;
+    n->values.root[value] = i;
+    return;
+  }
+  // A lone constant or local read costs as much as its replacement
+  if (start == i && ir->code[i].op != OP_GET_GLOB) {
+    return;
+  }
+
+  IrInstr read = {.op = OP_GET_LOC, .target = -1, .line = ir->code[i].line};
+  int slot = n->info[start].height - 1;
+  while (slot >= 0 && n->stack[slot].value != value) {
+    slot--;
+  }
+  if (slot >= 0) {
+    read.operand = slot;
+  } else {
+    int temp = 0;
+    while (temp < ir->tempCount && n->temps[temp] != value) {
+      temp++;
+    }
+    if (temp == ir->tempCount) {
+      if (ir->tempCount == MAX_TEMPS) {
+        return;
+      }
+      ir->tempCount++;
+      int root = n->values.root[value];
+      IrInstr save = {.op = OP_SET_LOC,
+                      .operand = temp,
+                      .target = -1,
+                      .line = ir->code[root].line,
+                      .temp = true};
+      addEdit(n->edits, EDIT_INSERT_AFTER, root, root, &save, 1);
+      n->temps[temp] = value;
+    }
+    read.operand = temp;
+    read.temp = true;
+  }
+  addEdit(n->edits, EDIT_REPLACE, start, i, &read, 1);
+}
+
+// Numbers every stack value within extended basic blocks, then propagates
+// copies and eliminates common subexpressions. Reads of globals are numbered
+// by an epoch that stores and calls advance, except for globals that are
+// never assigned.
+static void numberValues(Optimizer *opt, Ir *ir, IrInfo *info, Edits *edits) {
+  Numbering *n = (Numbering *)malloc(sizeof(Numbering));
+  n->opt = opt;
+  n->ir = ir;
+  n->info = info;
+  n->edits = edits;
+  n->values = (Values){0};
+  n->values.buckets = NULL;
+  n->block = 0;
+  NumberedSlot *stack = n->stack;
+  int epoch = 1;
+
+  for (int i = 0; i < ir->count; i++) {
+    IrInstr *in = &ir->code[i];
+    int height = info[i].height;
+    if (height < 0) {
+      continue;
+    }
+    if (info[i].leader) {
+      if (extendsBlock(ir, info, i)) {
+        for (int slot = 0; slot < height; slot++) {
+          stack[slot].start = -1;
+        }
+      } else {
+        n->block++;
+        for (int slot = 0; slot < height; slot++) {
+          stack[slot] = (NumberedSlot){unknownValue(&n->values), -1};
+        }
+        for (int temp = 0; temp < MAX_TEMPS; temp++) {
+          n->temps[temp] = unknownValue(&n->values);
+        }
+      }
+    }
+
+    switch (in->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      stack[height] = (NumberedSlot){
+          numberValue(&n->values, (ValueKey){in->op, in->operand, 0, 0}), i};
+      break;
+    case OP_GET_LOC: {
+      int value = in->temp ? n->temps[in->operand] : stack[in->operand].value;
+      if (!in->temp) {
+        propagateCopy(n, i, value);
+      }
+      stack[height] = (NumberedSlot){value, i};
+      break;
+    }
+    case OP_SET_LOC:
+      if (in->temp) {
+        n->temps[in->operand] = stack[height - 1].value;
+      } else {
+        stack[in->operand] = (NumberedSlot){stack[height - 1].value, -1};
+      }
+      stack[height - 1].start = -1;
+      break;
+    case OP_GET_GLOB: {
+      int version = isStable(opt, in->operand) ? 0 : epoch;
+      int value = numberValue(&n->values,
+                              (ValueKey){OP_GET_GLOB, in->operand, version, 0});
+      stack[height] = (NumberedSlot){value, i};
+      eliminateCommon(n, i, i, value);
+      break;
+    }
+    case OP_SET_GLOB:
+      epoch++;
+      stack[height - 1].start = -1;
+      break;
+    case OP_DEFINE_GLOB:
+      epoch++;
+      break;
+    case OP_MUL:
+    case OP_DIVIDE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_EQUALITY:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_AND:
+    case OP_OR:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MUL_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_GREATER_EQUAL_NUM: {
+      NumberedSlot left = stack[height - 2];
+      NumberedSlot right = stack[height - 1];
+      int start = left.start >= 0 && right.start >= 0 ? left.start : -1;
+      int value = numberValue(
+          &n->values, (ValueKey){in->op, 0, left.value, right.value});
+      stack[height - 2] = (NumberedSlot){value, start};
+      eliminateCommon(n, i, start, value);
+      break;
+    }
+    case OP_NEGATE:
+    case OP_FALSIFY:
+    case OP_NAMESPACE:
+    case OP_TYPE:
+    case OP_FIELD: {
+      NumberedSlot operand = stack[height - 1];
+      int value = numberValue(
+          &n->values, (ValueKey){in->op, in->operand, operand.value, 0});
+      stack[height - 1] = (NumberedSlot){value, operand.start};
+      eliminateCommon(n, i, operand.start, value);
+      break;
+    }
+    case OP_CALL:
+    case OP_CALL_DIRECT: {
+      int pops, pushes;
+      stackEffect(in, &pops, &pushes);
+      epoch++;
+      stack[height - pops] = (NumberedSlot){unknownValue(&n->values), -1};
+      break;
+    }
+    case OP_STRUCT:
+      stack[height - in->operand] =
+          (NumberedSlot){unknownValue(&n->values), -1};
+      break;
+    default:
+      break;
+    }
+  }
+
+  FREE_ARRAY(ValueKey, n->values.keys, n->values.capacity);
+  FREE_ARRAY(int, n->values.block, n->values.capacity);
+  FREE_ARRAY(int, n->values.root, n->values.capacity);
+  FREE_ARRAY(int, n->values.buckets, n->values.bucketCount);
+  free(n);
+}
+
+//
+// Loop-invariant code motion
+//
+
+// A stack slot while scanning a loop body
+typedef struct {
+  // First and last instruction of the expression that pushed the value, or
+  // -1 if it is not one side effect free expression in this block
+  int start;
+  int root;
+  // Computes the same value on every iteration
+  bool invariant;
+  // Can not raise an error
+  bool safe;
+  // Costs more than reading a slot
+  bool worth;
+} LoopSlot;
+
+typedef struct {
+  Optimizer *opt;
+  Ir *ir;
+  IrInfo *info;
+  Edits *edits;
+  bool *claimed;
+  // Instructions from the header that run on every entry without anything
+  // observable or failing before them
+  int quiet;
+  // First block boundary after the header
+  int firstLeader;
+  IrInstr *preheader;
+  int preheaderCount;
+} Loop;
+
+// Moves the expression slot holds into the preheader if it is invariant.
+// Expressions that can fail only move when the first pass through the loop
+// would have failed on them at the same point.
+static void hoist(Loop *loop, LoopSlot *slot) {
+  Ir *ir = loop->ir;
+  if (slot->start < 0 || !slot->invariant || !slot->worth) {
+    return;
+  }
+  if (!slot->safe &&
+      (slot->start > loop->quiet || slot->root >= loop->firstLeader)) {
+    return;
+  }
+  for (int k = slot->start; k <= slot->root; k++) {
+    if (loop->claimed[k]) {
+      return;
+    }
+  }
+  if (ir->tempCount == MAX_TEMPS) {
+    return;
+  }
+
+  int temp = ir->tempCount++;
+  int line = ir->code[slot->root].line;
+  for (int k = slot->start; k <= slot->root; k++) {
+    loop->preheader[loop->preheaderCount++] = ir->code[k];
+    loop->claimed[k] = true;
+  }
+  loop->preheader[loop->preheaderCount++] = (IrInstr){
+      .op = OP_SET_LOC, .operand = temp, .target = -1, .line = line, .temp = true};
+  loop->preheader[loop->preheaderCount++] =
+      (IrInstr){.op = OP_POP, .target = -1, .line = line};
+
+  IrInstr read = {.op = OP_GET_LOC,
+                  .operand = temp,
+                  .target = -1,
+                  .line = line,
+                  .temp = true};
+  addEdit(loop->edits, EDIT_REPLACE, slot->start, slot->root, &read, 1);
+}
+
+static void hoistLoop(Loop *loop, int header, int end) {
+  Ir *ir = loop->ir;
+  IrInfo *info = loop->info;
+  int base = info[header].height;
+  bool assigned[MAX_SLOTS] = {false};
+  bool tempAssigned[MAX_TEMPS] = {false};
+  for (int k = header; k <= end; k++) {
+    if (ir->code[k].op == OP_SET_LOC) {
+      if (ir->code[k].temp) {
+        tempAssigned[ir->code[k].operand] = true;
+      } else {
+        assigned[ir->code[k].operand] = true;
+      }
+    }
+  }
+  loop->quiet = header;
+  while (loop->quiet <= end && (loop->quiet == header || !info[loop->quiet].leader) &&
+         isQuiet(loop->opt, &ir->code[loop->quiet])) {
+    loop->quiet++;
+  }
+  loop->firstLeader = header + 1;
+  while (loop->firstLeader <= end && !info[loop->firstLeader].leader) {
+    loop->firstLeader++;
+  }
+  loop->preheader = (IrInstr *)malloc(sizeof(IrInstr) * 3 * (end - header + 1));
+  loop->preheaderCount = 0;
+
+  LoopSlot stack[MAX_SLOTS];
+  for (int k = header; k <= end; k++) {
+    IrInstr *in = &ir->code[k];
+    int height = info[k].height;
+    if (height < 0) {
+      continue;
+    }
+    if (k == header || info[k].leader) {
+      for (int slot = 0; slot < height; slot++) {
+        stack[slot] = (LoopSlot){-1, -1, false, false, false};
+      }
+    }
+    int pops, pushes;
+    stackEffect(in, &pops, &pushes);
+    LoopSlot result = {-1, k, false, false, false};
+
+    switch (in->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      result = (LoopSlot){k, k, true, true, false};
+      break;
+    case OP_GET_LOC: {
+      bool invariant = in->temp ? !tempAssigned[in->operand]
+                                : in->operand < base && !assigned[in->operand];
+      result = (LoopSlot){k, k, invariant, true, false};
+      break;
+    }
+    case OP_GET_GLOB: {
+      bool stable = isStable(loop->opt, in->operand);
+      result = (LoopSlot){k, k, stable, stable, true};
+      break;
+    }
+    default:
+      if (isPure(in->op)) {
+        bool invariant = true;
+        bool safe = in->op == OP_EQUALITY || in->op == OP_TYPE;
+        for (int slot = height - pops; slot < height; slot++) {
+          invariant = invariant && stack[slot].invariant && stack[slot].start >= 0;
+          safe = safe && stack[slot].safe;
+        }
+        if (invariant) {
+          result = (LoopSlot){stack[height - pops].start, k, true, safe, true};
+          break;
+        }
+      }
+      // Whatever takes the values is not invariant, so the largest
+      // invariant expressions under it leave the loop
+      if (in->op != OP_POP) {
+        for (int slot = height - pops; slot < height; slot++) {
+          hoist(loop, &stack[slot]);
+        }
+      }
+      if (in->op == OP_SET_LOC || in->op == OP_SET_GLOB ||
+          in->op == OP_JUMP_IF_FALSE) {
+        hoist(loop, &stack[height - 1]);
+        stack[height - 1].start = -1;
+      }
+      break;
+    }
+    if (pushes > 0) {
+      stack[height - pops] = result;
+    }
+  }
+
+  if (loop->preheaderCount > 0) {
+    addEdit(loop->edits, EDIT_INSERT_BEFORE, header, header, loop->preheader,
+            loop->preheaderCount);
+  }
+  free(loop->preheader);
+}
+
+// Finds loops by their back edges and hoists invariant expressions into a
+// preheader run once before each loop. Outer loops go first so an
+// expression leaves every loop it does not depend on.
+static void hoistInvariants(Optimizer *opt, Ir *ir, IrInfo *info, Edits *edits) {
+  int *headers = (int *)malloc(sizeof(int) * ir->count);
+  int *ends = (int *)malloc(sizeof(int) * ir->count);
+  int loopCount = 0;
+  for (int i = 0; i < ir->count; i++) {
+    if (ir->code[i].op == OP_JUMP_BACK && info[i].height >= 0) {
+      int l = loopCount++;
+      // Insertion sort, largest loop first
+      while (l > 0 && ends[l - 1] - headers[l - 1] < i - ir->code[i].target) {
+        headers[l] = headers[l - 1];
+        ends[l] = ends[l - 1];
+        l--;
+      }
+      headers[l] = ir->code[i].target;
+      ends[l] = i;
+    }
+  }
+
+  Loop loop = {.opt = opt, .ir = ir, .info = info, .edits = edits};
+  loop.claimed = (bool *)calloc(ir->count, sizeof(bool));
+  for (int l = 0; l < loopCount; l++) {
+    if (info[headers[l]].height >= 0) {
+      hoistLoop(&loop, headers[l], ends[l]);
+    }
+  }
+  free(loop.claimed);
+  free(headers);
+  free(ends);
+}
+
+//
+// Dead-store elimination
+//
+
+// Set of frame slots whose value may still be read
+typedef struct {
+  uint64_t bits[MAX_SLOTS / 64];
+} Live;
+
+#define LIVE_ADD(live, slot) ((live)->bits[(slot) / 64] |= 1ull << ((slot) % 64))
+#define LIVE_REMOVE(live, slot)                                                \
+  ((live)->bits[(slot) / 64] &= ~(1ull << ((slot) % 64)))
+#define LIVE_HAS(live, slot) (((live)->bits[(slot) / 64] >> ((slot) % 64)) & 1)
+
+static void liveOut(Ir *ir, IrInfo *info, Live *liveIn, int i, Live *out) {
+  memset(out, 0, sizeof(Live));
+  IrInstr *in = &ir->code[i];
+  int successors[2];
+  int count = 0;
+  if (fallsThrough(in->op) && i + 1 < ir->count) {
+    successors[count++] = i + 1;
+  }
+  if (isJump(in->op)) {
+    successors[count++] = in->target;
+  }
+  for (int s = 0; s < count; s++) {
+    for (int w = 0; w < MAX_SLOTS / 64; w++) {
+      out->bits[w] |= liveIn[successors[s]].bits[w];
+    }
+  }
+}
+
+// Slots live before instruction i, given those live after it. Pushing a
+// value or storing into a slot ends what it held; reading or taking a value
+// other than to discard it keeps it live.
+static void liveBefore(Ir *ir, IrInfo *info, int i, Live *out, Live *in) {
+  IrInstr *instr = &ir->code[i];
+  int height = info[i].height;
+  int pops, pushes;
+  stackEffect(instr, &pops, &pushes);
+  if (instr->op == OP_RETURN) {
+    memset(in, 0, sizeof(Live));
+    LIVE_ADD(in, height - 1);
+    return;
+  }
+
+  *in = *out;
+  for (int slot = height - pops; slot < height - pops + pushes; slot++) {
+    LIVE_REMOVE(in, slot);
+  }
+  if (instr->op == OP_SET_LOC && !instr->temp) {
+    LIVE_REMOVE(in, instr->operand);
+  }
+  if (instr->op != OP_POP) {
+    for (int slot = height - pops; slot < height; slot++) {
+      LIVE_ADD(in, slot);
+    }
+  }
+  if (instr->op == OP_SET_LOC || instr->op == OP_SET_GLOB ||
+      instr->op == OP_JUMP_IF_FALSE) {
+    LIVE_ADD(in, height - 1);
+  }
+  if (instr->op == OP_GET_LOC && !instr->temp) {
+    LIVE_ADD(in, instr->operand);
+  }
+}
+
+// Returns true if the global stored at i is stored again later in its block
+// with nothing in between that could read it or fail.
+static bool isOverwritten(Ir *ir, IrInfo *info, int i) {
+  for (int k = i + 1; k < ir->count && !info[k].leader; k++) {
+    IrInstr *in = &ir->code[k];
+    switch (in->op) {
+    case OP_SET_GLOB:
+      if (in->operand == ir->code[i].operand) {
+        return true;
+      }
+      return false;
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOC:
+    case OP_SET_LOC:
+    case OP_POP:
+      break;
+    default:
+      return false;
+    }
+  }
+  return false;
+}
+
+// Removes stores to locals that are never read again and stores to globals
+// that are overwritten before anything can see them. The stored value stays
+// on the stack either way.
+static void eliminateDeadStores(Optimizer *opt, Ir *ir, IrInfo *info,
+                                Edits *edits) {
+  Live *live = (Live *)calloc(ir->count, sizeof(Live));
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = ir->count - 1; i >= 0; i--) {
+      if (info[i].height < 0) {
+        continue;
+      }
+      Live out, in;
+      liveOut(ir, info, live, i, &out);
+      liveBefore(ir, info, i, &out, &in);
+      if (memcmp(&in, &live[i], sizeof(Live)) != 0) {
+        live[i] = in;
+        changed = true;
+      }
+    }
+  }
+
+  for (int i = 0; i < ir->count; i++) {
+    IrInstr *in = &ir->code[i];
+    if (info[i].height < 0) {
+      continue;
+    }
+    bool dead = false;
+    if (in->op == OP_SET_LOC && !in->temp) {
+      Live out;
+      liveOut(ir, info, live, i, &out);
+      dead = !LIVE_HAS(&out, in->operand);
+    } else if (in->op == OP_SET_GLOB) {
+      dead = isOverwritten(ir, info, i);
+    }
+    if (dead) {
+      addEdit(edits, EDIT_REPLACE, i, i, NULL, 0);
+    }
+  }
+  free(live);
+}
+
+// Drops values that are pushed only to be popped, as removed stores leave
+// behind.
+static void removeDeadPops(Optimizer *opt, Ir *ir, IrInfo *info, Edits *edits) {
+  for (int i = 1; i < ir->count; i++) {
+    if (ir->code[i].op != OP_POP || info[i].height < 0 || info[i].leader) {
+      continue;
+    }
+    switch (ir->code[i - 1].op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOC:
+      addEdit(edits, EDIT_REPLACE, i - 1, i, NULL, 0);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+//
+// Scalar replacement
+//
+
+// Most arguments a constructor can take for its struct to be replaced
+#define MAX_REPLACED_FIELDS 16
+
+// Returns the shape func builds if it is a constructor whose every field is
+// one of its parameters, and sets paramOf to the parameter each field holds.
+// Returns NULL for constructors that compute their fields.
+static ObjShape *constructorFields(ObjFunc *func, int *paramOf) {
+  Chunk *chunk = func->chunk;
+  int fields = 0;
+  int offset = 0;
+  while (offset + 1 < chunk->count && chunk->code[offset] == OP_GET_LOC) {
+    int slot = chunk->code[offset + 1];
+    if (fields == MAX_REPLACED_FIELDS || slot >= func->numParams + fields) {
+      return NULL;
+    }
+    // A field copied from an earlier field holds that field's parameter
+    paramOf[fields] = slot < func->numParams ? slot
+                                             : paramOf[slot - func->numParams];
+    fields++;
+    offset += 2;
+  }
+  if (offset + 3 >= chunk->count || chunk->code[offset] != OP_STRUCT ||
+      chunk->code[offset + 1] != fields ||
+      chunk->code[offset + 3] != OP_RETURN) {
+    return NULL;
+  }
+  Value shape = chunk->constants.values[chunk->code[offset + 2]];
+  return isObjectOfType(shape, OBJ_SHAPE) ? (ObjShape *)shape.as.obj : NULL;
+}
+
+// Returns the index of the constant in chunk that is value, or -1
+static int findConstant(Chunk *chunk, Value value) {
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (constant.type == VALUE_OBJ && value.type == VALUE_OBJ &&
+        constant.as.obj == value.as.obj) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns true if no jump from outside start..end lands after start, and no
+// jump inside it lands outside
+static bool isSingleEntry(Ir *ir, int start, int end) {
+  for (int i = 0; i < ir->count; i++) {
+    if (!isJump(ir->code[i].op)) {
+      continue;
+    }
+    int target = ir->code[i].target;
+    bool inside = i >= start && i <= end;
+    if (inside ? target < start || target > end
+               : target > start && target <= end) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Replaces the struct a local is built as with the constructor's arguments,
+// which stay on the stack in its place. The local must only ever have its
+// fields read or its type checked, and is only looked at from the
+// instruction that builds it to the pop that ends its scope, so the struct
+// can not escape. Field reads become reads of the argument slots and later
+// locals move up to make room. Replaces at most one struct per run.
+static void replaceStructs(Optimizer *opt, Ir *ir, IrInfo *info, Edits *edits) {
+  opt->changed = false;
+  for (int call = 0; call < ir->count; call++) {
+    IrInstr *in = &ir->code[call];
+    if (in->op != OP_CALL_DIRECT || info[call].height < 0 || in->operand == 0) {
+      continue;
+    }
+    Value callee = opt->chunk->constants.values[in->operand2];
+    int paramOf[MAX_REPLACED_FIELDS];
+    ObjShape *shape = constructorFields((ObjFunc *)callee.as.obj, paramOf);
+    if (shape == NULL) {
+      continue;
+    }
+
+    // The three frame placeholders are the last instructions before the
+    // call at the struct's height
+    int slot = info[call].height - in->operand - 3;
+    int nils = call - 1;
+    while (nils >= 0 && info[nils].height != slot) {
+      nils--;
+    }
+    if (nils < 0 || nils + 2 >= call || ir->code[nils].op != OP_NIL ||
+        ir->code[nils + 1].op != OP_NIL || ir->code[nils + 2].op != OP_NIL) {
+      continue;
+    }
+
+    int end = call + 1;
+    bool escapes = false;
+    for (; end < ir->count && !escapes; end++) {
+      IrInstr *use = &ir->code[end];
+      if (info[end].height < 0) {
+        continue;
+      }
+      int pops, pushes;
+      stackEffect(use, &pops, &pushes);
+      if (use->op == OP_POP && info[end].height == slot + 1) {
+        break;
+      } else if (info[end].height - pops <= slot) {
+        // Anything else taking the struct off the stack sees it
+        escapes = true;
+      } else if (info[end].height == slot + 1 && pops == 0 && pushes == 0 &&
+                 use->op != OP_JUMP) {
+        // So does a store or test of the top, which leaves it there
+        escapes = true;
+      } else if (use->op == OP_SET_LOC && use->operand == slot) {
+        escapes = true;
+      } else if (use->op == OP_GET_LOC && use->operand == slot) {
+        IrInstr *next = end + 1 < ir->count ? &ir->code[end + 1] : NULL;
+        if (next == NULL || info[end + 1].leader ||
+            (next->op != OP_NAMESPACE && next->op != OP_TYPE)) {
+          escapes = true;
+        } else if (next->op == OP_TYPE) {
+          escapes = findConstant(opt->chunk, MAKE_OBJ((Obj *)shape->type)) < 0;
+        } else {
+          Value name = opt->chunk->constants.values[next->operand];
+          escapes = getFieldIndex(shape, (ObjString *)name.as.obj) < 0;
+        }
+      }
+    }
+    if (escapes ||
+        !isSingleEntry(ir, nils, end < ir->count ? end : ir->count - 1)) {
+      continue;
+    }
+
+    // The arguments take in->operand slots instead of one
+    int shift = in->operand - 1;
+    addEdit(edits, EDIT_REPLACE, nils, nils + 2, NULL, 0);
+    addEdit(edits, EDIT_REPLACE, call, call, NULL, 0);
+    for (int i = call + 1; i < end && i < ir->count; i++) {
+      IrInstr *use = &ir->code[i];
+      if (info[i].height < 0 ||
+          (use->op != OP_GET_LOC && use->op != OP_SET_LOC)) {
+        continue;
+      }
+      IrInstr replacement = *use;
+      if (use->operand > slot) {
+        replacement.operand += shift;
+        addEdit(edits, EDIT_REPLACE, i, i, &replacement, 1);
+        continue;
+      }
+      if (use->operand < slot || use->op != OP_GET_LOC) {
+        continue;
+      }
+      IrInstr *next = &ir->code[i + 1];
+      if (next->op == OP_TYPE) {
+        replacement = (IrInstr){.op = OP_CONSTANT, .target = -1,
+                                .line = next->line};
+        replacement.operand =
+            findConstant(opt->chunk, MAKE_OBJ((Obj *)shape->type));
+      } else {
+        Value name = opt->chunk->constants.values[next->operand];
+        int field = getFieldIndex(shape, (ObjString *)name.as.obj);
+        replacement.operand = slot + paramOf[field];
+      }
+      addEdit(edits, EDIT_REPLACE, i, i + 1, &replacement, 1);
+      i++;
+    }
+    if (end < ir->count) {
+      IrInstr pops[MAX_REPLACED_FIELDS];
+      for (int k = 0; k < in->operand; k++) {
+        pops[k] = ir->code[end];
+      }
+      addEdit(edits, EDIT_REPLACE, end, end, pops, in->operand);
+    }
+    opt->changed = true;
+    return;
+  }
+}
+
+//
+// Type inference
+//
+
+// What a test coming out true, or false, tells about a local: the kinds it
+// can still have, and the name of its type if it is a struct
+typedef struct {
+  uint8_t kinds;
+  ObjString *name;
+} Narrowing;
+
+// A stack slot or temporary during type inference. Locals are named by their
+// slot, temporaries by MAX_SLOTS plus their number.
+typedef struct {
+  Type type;
+  // The local the value was read from while it still holds the value, or -1
+  int source;
+  // For the result of OP_TYPE, the local whose type it is, or -1
+  int typeOf;
+  // The constant the value was pushed from, or -1
+  int constant;
+  // For a boolean that tests a local, the local, or -1, and what it is known
+  // to be when the boolean is true and when it is false
+  int tested;
+  Narrowing ifTrue;
+  Narrowing ifFalse;
+} TypedSlot;
+
+typedef struct {
+  Optimizer *opt;
+  Chunk *chunk;
+  Ir *ir;
+  IrInfo *info;
+  // NULL while a function is only looked at for its return type
+  Edits *edits;
+  // The slots, then the temporaries, at the start of every block reached so
+  // far. NULL for other instructions.
+  TypedSlot **entries;
+  int *work;
+  int workCount;
+  bool *queued;
+  // Every value the chunk returns
+  Type returned;
+  // Before the current instruction, the slots and then, from MAX_SLOTS, the
+  // temporaries
+  TypedSlot stack[MAX_SLOTS + MAX_TEMPS];
+} Typing;
+
+static Type kindType(uint8_t kinds) { return (Type){kinds, NULL, NULL}; }
+
+static TypedSlot typedSlot(Type type) {
+  return (TypedSlot){type, -1, -1, -1, -1, {TYPE_ANY, NULL}, {TYPE_ANY, NULL}};
+}
+
+static Type typeOfValue(Value value) {
+  switch (value.type) {
+  case VALUE_NIL:
+    return kindType(TYPE_NIL);
+  case VALUE_BOOL:
+    return kindType(TYPE_BOOL);
+  case VALUE_NUM:
+    return kindType(TYPE_NUM);
+  default:
+    break;
+  }
+  switch (value.as.obj->type) {
+  case OBJ_STRING:
+    return kindType(TYPE_STRING);
+  case OBJ_STRUCT:
+    return (Type){TYPE_STRUCT, ((ObjStruct *)value.as.obj)->shape, NULL};
+  default:
+    return (Type){TYPE_OTHER, NULL, value.as.obj};
+  }
+}
+
+// The type of a value that comes from either a or b. A shape or object is
+// kept if the other side can not be a struct or other object at all.
+static Type joinTypes(Type a, Type b) {
+  if (a.kinds == 0) {
+    return b;
+  }
+  if (b.kinds == 0) {
+    return a;
+  }
+  Type joined = kindType(a.kinds | b.kinds);
+  if (joined.kinds & TYPE_STRUCT) {
+    joined.shape = !(a.kinds & TYPE_STRUCT)   ? b.shape
+                   : !(b.kinds & TYPE_STRUCT) ? a.shape
+                   : a.shape == b.shape       ? a.shape
+                                              : NULL;
+  }
+  if (joined.kinds & TYPE_OTHER) {
+    joined.object = !(a.kinds & TYPE_OTHER)   ? b.object
+                    : !(b.kinds & TYPE_OTHER) ? a.object
+                    : a.object == b.object    ? a.object
+                                              : NULL;
+  }
+  return joined;
+}
+
+static bool sameType(Type a, Type b) {
+  return a.kinds == b.kinds && a.shape == b.shape && a.object == b.object;
+}
+
+// What holds when either a or b does
+static Narrowing joinNarrowings(Narrowing a, Narrowing b) {
+  if (a.kinds == 0) {
+    return b;
+  }
+  if (b.kinds == 0) {
+    return a;
+  }
+  Narrowing joined = {a.kinds | b.kinds, NULL};
+  if (joined.kinds & TYPE_STRUCT) {
+    joined.name = !(a.kinds & TYPE_STRUCT)   ? b.name
+                  : !(b.kinds & TYPE_STRUCT) ? a.name
+                  : a.name == b.name         ? a.name
+                                             : NULL;
+  }
+  return joined;
+}
+
+// What holds when both a and b do
+static Narrowing meetNarrowings(Narrowing a, Narrowing b) {
+  Narrowing met = {a.kinds & b.kinds, a.name != NULL ? a.name : b.name};
+  if (a.name != NULL && b.name != NULL && a.name != b.name) {
+    met.kinds &= ~TYPE_STRUCT;
+  }
+  return met;
+}
+
+static bool sameName(ObjString *a, ObjString *b) {
+  return a == b ||
+         (a->length == b->length && memcmp(a->string, b->string, a->length) == 0);
+}
+
+static void narrow(Type *type, Narrowing narrowing) {
+  type->kinds &= narrowing.kinds;
+  if (narrowing.name != NULL && type->shape != NULL &&
+      !sameName(type->shape->type, narrowing.name)) {
+    type->kinds &= ~TYPE_STRUCT;
+  }
+  if (!(type->kinds & TYPE_STRUCT)) {
+    type->shape = NULL;
+  }
+  if (!(type->kinds & TYPE_OTHER)) {
+    type->object = NULL;
+  }
+}
+
+// Narrows local, and the values on the stack read from it, once an
+// instruction that only goes on for some kinds has gone on
+static void narrowLocal(Typing *t, int height, int local,
+                        Narrowing narrowing) {
+  if (local < 0) {
+    return;
+  }
+  narrow(&t->stack[local].type, narrowing);
+  for (int slot = 0; slot < height; slot++) {
+    if (t->stack[slot].source == local) {
+      narrow(&t->stack[slot].type, narrowing);
+    }
+  }
+}
+
+static void forgetSlot(TypedSlot *slot, int local) {
+  if (slot->source == local) {
+    slot->source = -1;
+  }
+  if (slot->typeOf == local) {
+    slot->typeOf = -1;
+  }
+  if (slot->tested == local) {
+    slot->tested = -1;
+  }
+}
+
+// Drops what is known about local's old value from the values that came
+// from it, before it is assigned
+static void forgetLocal(Typing *t, int height, int local) {
+  for (int slot = 0; slot < height; slot++) {
+    forgetSlot(&t->stack[slot], local);
+  }
+  for (int temp = 0; temp < MAX_TEMPS; temp++) {
+    forgetSlot(&t->stack[MAX_SLOTS + temp], local);
+  }
+}
+
+static bool sameSlot(TypedSlot *a, TypedSlot *b) {
+  return sameType(a->type, b->type) && a->source == b->source &&
+         a->typeOf == b->typeOf && a->constant == b->constant &&
+         a->tested == b->tested && a->ifTrue.kinds == b->ifTrue.kinds &&
+         a->ifTrue.name == b->ifTrue.name &&
+         a->ifFalse.kinds == b->ifFalse.kinds &&
+         a->ifFalse.name == b->ifFalse.name;
+}
+
+static TypedSlot joinSlots(TypedSlot *a, TypedSlot *b) {
+  TypedSlot joined = typedSlot(joinTypes(a->type, b->type));
+  joined.source = a->source == b->source ? a->source : -1;
+  joined.typeOf = a->typeOf == b->typeOf ? a->typeOf : -1;
+  joined.constant = a->constant == b->constant ? a->constant : -1;
+  if (a->tested == b->tested && a->tested >= 0) {
+    joined.tested = a->tested;
+    joined.ifTrue = joinNarrowings(a->ifTrue, b->ifTrue);
+    joined.ifFalse = joinNarrowings(a->ifFalse, b->ifFalse);
+  }
+  return joined;
+}
+
+// Merges the slots of height into what is known at the start of target,
+// narrowing tested on the way, and queues target if that changed
+static void flowTo(Typing *t, int target, int height, int tested,
+                   Narrowing narrowing) {
+  TypedSlot *entry = t->entries[target];
+  bool first = entry == NULL;
+  bool changed = first;
+  if (first) {
+    entry = (TypedSlot *)malloc(sizeof(TypedSlot) * (height + MAX_TEMPS));
+    t->entries[target] = entry;
+  }
+  for (int k = 0; k < height + MAX_TEMPS; k++) {
+    int local = k < height ? k : MAX_SLOTS + k - height;
+    TypedSlot slot = t->stack[local];
+    if (tested >= 0 && (local == tested || slot.source == tested)) {
+      narrow(&slot.type, narrowing);
+    }
+    if (first) {
+      entry[k] = slot;
+    } else {
+      TypedSlot joined = joinSlots(&entry[k], &slot);
+      if (!sameSlot(&joined, &entry[k])) {
+        entry[k] = joined;
+        changed = true;
+      }
+    }
+  }
+  if (changed && !t->queued[target]) {
+    t->queued[target] = true;
+    t->work[t->workCount++] = target;
+  }
+}
+
+static int localOf(IrInstr *in) {
+  return in->temp ? MAX_SLOTS + in->operand : in->operand;
+}
+
+static Type returnType(Optimizer *opt, ObjFunc *func);
+
+// Returns the type of what callee returns when called with argCount
+// arguments, if it is known to be a function that takes that many
+static Type callResult(Optimizer *opt, Type callee, int argCount) {
+  if (callee.kinds == TYPE_OTHER && callee.object != NULL &&
+      callee.object->type == OBJ_FUNCTION &&
+      ((ObjFunc *)callee.object)->numParams == argCount) {
+    return returnType(opt, (ObjFunc *)callee.object);
+  }
+  return kindType(TYPE_ANY);
+}
+
+// Returns true if slot holds a string constant, as the name of a struct
+// type is when an isNAME predicate compares against it
+static bool isNameConstant(Typing *t, TypedSlot *slot) {
+  return slot->constant >= 0 &&
+         isObjectOfType(t->chunk->constants.values[slot->constant], OBJ_STRING);
+}
+
+// Sets what a comparison of left and right tells about a local: the type
+// name of a struct when one is the type of a local and the other a name,
+// and whether a local is nil when the other is nil
+static void testEquality(Typing *t, TypedSlot *left, TypedSlot *right,
+                         TypedSlot *result) {
+  for (int side = 0; side < 2; side++) {
+    TypedSlot *a = side == 0 ? left : right;
+    TypedSlot *b = side == 0 ? right : left;
+    if (a->typeOf >= 0 && isNameConstant(t, b)) {
+      result->tested = a->typeOf;
+      result->ifTrue = (Narrowing){
+          TYPE_STRUCT,
+          (ObjString *)t->chunk->constants.values[b->constant].as.obj};
+      return;
+    }
+    if (a->source >= 0 && b->type.kinds == TYPE_NIL) {
+      result->tested = a->source;
+      result->ifTrue = (Narrowing){TYPE_NIL, NULL};
+      result->ifFalse = (Narrowing){TYPE_ANY & ~TYPE_NIL, NULL};
+      return;
+    }
+  }
+}
+
+// Moves the types in t->stack past instruction i. An instruction that fails
+// for some kinds narrows the locals its operands were read from, since the
+// code after it only runs when they were not of those kinds.
+static void stepType(Typing *t, int i) {
+  IrInstr *in = &t->ir->code[i];
+  int height = t->info[i].height;
+  TypedSlot *stack = t->stack;
+  int pops, pushes;
+  stackEffect(in, &pops, &pushes);
+  TypedSlot result = typedSlot(kindType(TYPE_ANY));
+  Narrowing numbers = {TYPE_NUM, NULL};
+
+  switch (in->op) {
+  case OP_CONSTANT:
+    result = typedSlot(typeOfValue(t->chunk->constants.values[in->operand]));
+    result.constant = in->operand;
+    break;
+  case OP_NIL:
+    result = typedSlot(kindType(TYPE_NIL));
+    break;
+  case OP_TRUE:
+  case OP_FALSE:
+    result = typedSlot(kindType(TYPE_BOOL));
+    break;
+  case OP_GET_LOC:
+    result = stack[localOf(in)];
+    result.source = localOf(in);
+    break;
+  case OP_SET_LOC: {
+    int local = localOf(in);
+    forgetLocal(t, height, local);
+    stack[local] = stack[height - 1];
+    return;
+  }
+  case OP_GET_GLOB: {
+    ObjString *name = (ObjString *)t->chunk->constants.values[in->operand].as.obj;
+    if (isStableName(t->opt, name)) {
+      result = typedSlot(typeOfValue(*get(&t->opt->vm->table, name)));
+    }
+    break;
+  }
+  case OP_NEGATE:
+    narrowLocal(t, height, stack[height - 1].source, numbers);
+    result = typedSlot(kindType(TYPE_NUM));
+    break;
+  case OP_ADD: {
+    // Either both are numbers or both are strings
+    uint8_t kinds = stack[height - 2].type.kinds & stack[height - 1].type.kinds &
+                    (TYPE_NUM | TYPE_STRING);
+    narrowLocal(t, height, stack[height - 2].source, (Narrowing){kinds, NULL});
+    narrowLocal(t, height, stack[height - 1].source, (Narrowing){kinds, NULL});
+    result = typedSlot(kindType(kinds));
+    break;
+  }
+  case OP_SUBTRACT:
+  case OP_MUL:
+  case OP_DIVIDE:
+    narrowLocal(t, height, stack[height - 2].source, numbers);
+    narrowLocal(t, height, stack[height - 1].source, numbers);
+    // Fall through
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MUL_NUM:
+  case OP_DIVIDE_NUM:
+    result = typedSlot(kindType(TYPE_NUM));
+    break;
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+    narrowLocal(t, height, stack[height - 2].source, numbers);
+    narrowLocal(t, height, stack[height - 1].source, numbers);
+    // Fall through
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_EQUAL_NUM:
+  case OP_GREATER_EQUAL_NUM:
+    result = typedSlot(kindType(TYPE_BOOL));
+    break;
+  case OP_EQUALITY:
+    result = typedSlot(kindType(TYPE_BOOL));
+    testEquality(t, &stack[height - 2], &stack[height - 1], &result);
+    break;
+  case OP_FALSIFY: {
+    TypedSlot operand = stack[height - 1];
+    narrowLocal(t, height, operand.source, (Narrowing){TYPE_BOOL, NULL});
+    result = typedSlot(kindType(TYPE_BOOL));
+    result.tested = operand.tested;
+    result.ifTrue = operand.ifFalse;
+    result.ifFalse = operand.ifTrue;
+    break;
+  }
+  case OP_AND: {
+    // Both are true when the result is
+    TypedSlot *left = &stack[height - 2];
+    TypedSlot *right = &stack[height - 1];
+    result = typedSlot(kindType(TYPE_BOOL));
+    if (left->tested >= 0 && left->tested == right->tested) {
+      result.tested = left->tested;
+      result.ifTrue = meetNarrowings(left->ifTrue, right->ifTrue);
+    } else if (right->tested >= 0 || left->tested >= 0) {
+      TypedSlot *test = right->tested >= 0 ? right : left;
+      result.tested = test->tested;
+      result.ifTrue = test->ifTrue;
+    }
+    break;
+  }
+  case OP_OR: {
+    // Either is true when the result is, and both false when it is not
+    TypedSlot *left = &stack[height - 2];
+    TypedSlot *right = &stack[height - 1];
+    result = typedSlot(kindType(TYPE_BOOL));
+    if (left->tested >= 0 && left->tested == right->tested) {
+      result.tested = left->tested;
+      result.ifTrue = joinNarrowings(left->ifTrue, right->ifTrue);
+      result.ifFalse = meetNarrowings(left->ifFalse, right->ifFalse);
+    }
+    break;
+  }
+  case OP_TYPE:
+    result = typedSlot(kindType(TYPE_BOOL | TYPE_STRING));
+    result.typeOf = stack[height - 1].source;
+    break;
+  case OP_NAMESPACE:
+    narrowLocal(t, height, stack[height - 1].source,
+                (Narrowing){TYPE_STRUCT, NULL});
+    break;
+  case OP_CALL: {
+    TypedSlot callee = stack[height - 1];
+    narrowLocal(t, height, callee.source, (Narrowing){TYPE_OTHER, NULL});
+    result = typedSlot(callResult(t->opt, callee.type, in->operand));
+    break;
+  }
+  case OP_CALL_DIRECT:
+    result = typedSlot(returnType(
+        t->opt, (ObjFunc *)t->chunk->constants.values[in->operand2].as.obj));
+    break;
+  case OP_STRUCT:
+    result = typedSlot((Type){
+        TYPE_STRUCT,
+        (ObjShape *)t->chunk->constants.values[in->operand2].as.obj, NULL});
+    break;
+  case OP_RETURN:
+    t->returned = joinTypes(t->returned, stack[height - 1].type);
+    break;
+  default:
+    break;
+  }
+  // Slots taken off the stack may be reused by other values
+  int base = height - pops;
+  for (int slot = base; slot < height; slot++) {
+    forgetLocal(t, base, slot);
+    forgetSlot(&result, slot);
+  }
+  if (pushes > 0) {
+    stack[base] = result;
+  }
+}
+
+static uint8_t uncheckedForm(uint8_t op) {
+  switch (op) {
+  case OP_ADD:
+    return OP_ADD_NUM;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_NUM;
+  case OP_MUL:
+    return OP_MUL_NUM;
+  case OP_DIVIDE:
+    return OP_DIVIDE_NUM;
+  case OP_LESS:
+    return OP_LESS_NUM;
+  case OP_GREATER:
+    return OP_GREATER_NUM;
+  case OP_LESS_EQUAL:
+    return OP_LESS_EQUAL_NUM;
+  case OP_GREATER_EQUAL:
+    return OP_GREATER_EQUAL_NUM;
+  default:
+    return op;
+  }
+}
+
+// Replaces instruction i with a form that skips the checks its operands
+// are known to pass: arithmetic and comparisons on numbers, field reads of
+// structs of a known shape, and calls of a known function, which go to it
+// directly once the callee is no longer pushed.
+static void specialize(Typing *t, int i) {
+  IrInstr *in = &t->ir->code[i];
+  int height = t->info[i].height;
+  TypedSlot *stack = t->stack;
+  IrInstr replacement = *in;
+  switch (in->op) {
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MUL:
+  case OP_DIVIDE:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+    if (stack[height - 2].type.kinds == TYPE_NUM &&
+        stack[height - 1].type.kinds == TYPE_NUM) {
+      replacement.op = uncheckedForm(in->op);
+      addEdit(t->edits, EDIT_REPLACE, i, i, &replacement, 1);
+    }
+    break;
+  case OP_NAMESPACE: {
+    Type type = stack[height - 1].type;
+    if (type.kinds != TYPE_STRUCT || type.shape == NULL) {
+      break;
+    }
+    Value name = t->chunk->constants.values[in->operand];
+    int field = getFieldIndex(type.shape, (ObjString *)name.as.obj);
+    if (field >= 0) {
+      replacement.op = OP_FIELD;
+      replacement.operand = field;
+      addEdit(t->edits, EDIT_REPLACE, i, i, &replacement, 1);
+    }
+    break;
+  }
+  case OP_CALL: {
+    Type callee = stack[height - 1].type;
+    if (callee.kinds != TYPE_OTHER || callee.object == NULL ||
+        callee.object->type != OBJ_FUNCTION ||
+        ((ObjFunc *)callee.object)->numParams != in->operand) {
+      break;
+    }
+    // The callee has to be pushed by the instruction just before
+    IrInstr *push = i > 0 ? &t->ir->code[i - 1] : NULL;
+    if (push == NULL || t->info[i].leader || t->info[i - 1].height != height - 1 ||
+        (push->op != OP_GET_LOC && push->op != OP_GET_GLOB &&
+         push->op != OP_CONSTANT)) {
+      break;
+    }
+    int constant = findConstant(t->chunk, MAKE_OBJ(callee.object));
+    if (constant < 0 && t->chunk->constants.count <= UINT8_MAX) {
+      constant = addConstant(t->chunk, MAKE_OBJ(callee.object));
+    }
+    if (constant >= 0) {
+      replacement.op = OP_CALL_DIRECT;
+      replacement.operand2 = constant;
+      addEdit(t->edits, EDIT_REPLACE, i - 1, i, &replacement, 1);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Runs the block starting at leader from what is known at its start. While
+// inferring, what is known at its end flows to the blocks after it; once
+// done, every instruction is specialized instead.
+static void typeBlock(Typing *t, int leader, bool specializing) {
+  int height = t->info[leader].height;
+  TypedSlot *entry = t->entries[leader];
+  for (int k = 0; k < height + MAX_TEMPS; k++) {
+    t->stack[k < height ? k : MAX_SLOTS + k - height] = entry[k];
+  }
+  Narrowing none = {TYPE_ANY, NULL};
+  for (int i = leader; i < t->ir->count; i++) {
+    if (i != leader && t->info[i].leader) {
+      if (!specializing) {
+        flowTo(t, i, t->info[i].height, -1, none);
+      }
+      return;
+    }
+    IrInstr *in = &t->ir->code[i];
+    if (specializing) {
+      specialize(t, i);
+    }
+    stepType(t, i);
+    int pops, pushes;
+    stackEffect(in, &pops, &pushes);
+    int after = t->info[i].height - pops + pushes;
+    if (in->op == OP_RETURN || (isJump(in->op) && specializing)) {
+      return;
+    }
+    if (in->op == OP_JUMP || in->op == OP_JUMP_BACK) {
+      flowTo(t, in->target, after, -1, none);
+      return;
+    }
+    if (in->op == OP_JUMP_IF_FALSE) {
+      // The test is false where the jump is taken and true where it is not
+      TypedSlot test = t->stack[after - 1];
+      t->stack[after - 1].ifTrue = (Narrowing){0, NULL};
+      flowTo(t, in->target, after, test.tested, test.ifFalse);
+      t->stack[after - 1] = test;
+      t->stack[after - 1].ifFalse = (Narrowing){0, NULL};
+      flowTo(t, i + 1, after, test.tested, test.ifTrue);
+      return;
+    }
+  }
+}
+
+// Infers the type of every slot before every instruction of ir, a lifted
+// chunk, by running its blocks until nothing more changes. A join where
+// paths meet keeps what holds on all of them. With edits, then replaces
+// checked instructions with unchecked forms where the types allow. Returns
+// the type of what the chunk returns.
+static Type inferTypes(Optimizer *opt, Chunk *chunk, Ir *ir, IrInfo *info,
+                       Edits *edits) {
+  Typing *t = (Typing *)malloc(sizeof(Typing));
+  t->opt = opt;
+  t->chunk = chunk;
+  t->ir = ir;
+  t->info = info;
+  t->edits = edits;
+  t->entries = (TypedSlot **)calloc(ir->count, sizeof(TypedSlot *));
+  t->work = (int *)malloc(sizeof(int) * ir->count);
+  t->workCount = 0;
+  t->queued = (bool *)calloc(ir->count, sizeof(bool));
+  t->returned = kindType(0);
+
+  // Parameters can be anything; temporaries start as nil
+  int params = info[0].height;
+  for (int slot = 0; slot < params; slot++) {
+    t->stack[slot] = typedSlot(kindType(TYPE_ANY));
+  }
+  for (int temp = 0; temp < MAX_TEMPS; temp++) {
+    t->stack[MAX_SLOTS + temp] = typedSlot(kindType(TYPE_NIL));
+  }
+  flowTo(t, 0, params, -1, (Narrowing){TYPE_ANY, NULL});
+  while (t->workCount > 0) {
+    int leader = t->work[--t->workCount];
+    t->queued[leader] = false;
+    typeBlock(t, leader, false);
+  }
+  if (edits != NULL) {
+    for (int i = 0; i < ir->count; i++) {
+      if (t->entries[i] != NULL) {
+        typeBlock(t, i, true);
+      }
+    }
+  }
+
+  Type returned = t->returned;
+  for (int i = 0; i < ir->count; i++) {
+    free(t->entries[i]);
+  }
+  free(t->entries);
+  free(t->work);
+  free(t->queued);
+  free(t);
+  return returned;
+}
+
+// Returns the type of what func returns, inferred once from its body with
+// its parameters unknown
+static Type returnType(Optimizer *opt, ObjFunc *func) {
+  for (int k = 0; k < opt->summaryCount; k++) {
+    if (opt->summarized[k] == func) {
+      return opt->returns[k];
+    }
+  }
+  if (opt->summaryCount + 1 > opt->summaryCapacity) {
+    int oldCapacity = opt->summaryCapacity;
+    opt->summaryCapacity = GROW_CAPACITY(oldCapacity);
+    opt->summarized = GROW_ARRAY(ObjFunc *, opt->summarized, oldCapacity,
+                                 opt->summaryCapacity);
+    opt->returns =
+        GROW_ARRAY(Type, opt->returns, oldCapacity, opt->summaryCapacity);
+  }
+  // Recursive calls return anything while the body is looked at
+  int k = opt->summaryCount++;
+  opt->summarized[k] = func;
+  opt->returns[k] = kindType(TYPE_ANY);
+
+  Type type = kindType(TYPE_ANY);
+  Ir ir;
+  if (lift(func->chunk, func->numParams, &ir)) {
+    IrInfo *info = (IrInfo *)malloc(sizeof(IrInfo) * ir.count);
+    if (analyze(&ir, info)) {
+      type = inferTypes(opt, func->chunk, &ir, info, NULL);
+    }
+    free(info);
+    free(ir.code);
+  }
+  opt->returns[k] = type;
+  return type;
+}
+
+// Proves the types of operands from constants, constructors, the functions
+// called and the tests and checked instructions they have passed, then
+// drops the checks that can not fail.
+static void specializeTypes(Optimizer *opt, Ir *ir, IrInfo *info,
+                            Edits *edits) {
+  inferTypes(opt, opt->chunk, ir, info, edits);
+}
+
+//
+// Driver
+//
+
+typedef void (*Pass)(Optimizer *opt, Ir *ir, IrInfo *info, Edits *edits);
+
+// Analyzes ir and runs pass over it. Returns false if ir can not be analyzed.
+static bool runPass(Optimizer *opt, Ir *ir, Pass pass) {
+  IrInfo *info = (IrInfo *)malloc(sizeof(IrInfo) * ir->count);
+  bool ok = analyze(ir, info);
+  if (ok && pass != NULL) {
+    Edits edits = {NULL, 0, 0};
+    pass(opt, ir, info, &edits);
+    applyEdits(ir, &edits);
+    freeEdits(&edits);
+  }
+  free(info);
+  return ok;
+}
+
+static void optimizeChunk(Optimizer *opt, Chunk *chunk, int numParams) {
+  Ir ir;
+  if (!lift(chunk, numParams, &ir)) {
+    return;
+  }
+  opt->chunk = chunk;
+  // Each run replaces one struct and renumbers the slots above it
+  bool ok = true;
+  for (int run = 0; ok && run < 32; run++) {
+    ok = runPass(opt, &ir, replaceStructs);
+    if (!opt->changed) {
+      break;
+    }
+  }
+  if (ok && runPass(opt, &ir, numberValues) && runPass(opt, &ir, hoistInvariants) &&
+      runPass(opt, &ir, eliminateDeadStores) &&
+      runPass(opt, &ir, removeDeadPops) &&
+      runPass(opt, &ir, specializeTypes) && runPass(opt, &ir, NULL)) {
+    emit(&ir, chunk);
+  }
+  free(ir.code);
+}
+
+// Records the globals chunk assigns or defines in assigned. Returns false if
+// the chunk could not be scanned.
+static bool noteAssignments(Table *assigned, Chunk *chunk) {
+  int offset = 0;
+  while (offset < chunk->count) {
+    uint8_t op = chunk->code[offset];
+    int size = operandBytes(op);
+    if (size < 0 || offset + size >= chunk->count) {
+      return false;
+    }
+    if (op == OP_SET_GLOB || op == OP_DEFINE_GLOB) {
+      Value name = chunk->constants.values[chunk->code[offset + 1]];
+      set(assigned, (ObjString *)name.as.obj, MAKE_NIL());
+    }
+    offset += 1 + size;
+  }
+  return true;
+}
+
+typedef struct {
+  Table *assigned;
+  bool complete;
+} Assignments;
+
+static void noteFunctionAssignments(Obj *object, void *context) {
+  if (object->type == OBJ_FUNCTION) {
+    Assignments *assignments = (Assignments *)context;
+    ObjFunc *func = (ObjFunc *)object;
+    assignments->complete &= noteAssignments(assignments->assigned, func->chunk);
+    if (func->fallback != NULL) {
+      assignments->complete &=
+          noteAssignments(assignments->assigned, func->fallback);
+    }
+  }
+}
+
+bool noteHeapAssignments(VM *vm, Table *assigned) {
+  Assignments assignments = {.assigned = assigned, .complete = true};
+  visitHeap(vm, noteFunctionAssignments, &assignments);
+  return assignments.complete;
+}
+
+// Returns a copy of chunk
+static Chunk *copyChunk(Chunk *chunk) {
+  Chunk *copy = (Chunk *)allocate(MEMORY_OBJECTS, sizeof(Chunk));
+  initChunk(copy);
+  for (int i = 0; i < chunk->count; i++) {
+    writeChunk(copy, chunk->code[i], chunk->lines[i]);
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    addConstant(copy, chunk->constants.values[i]);
+  }
+  return copy;
+}
+
+void optimizeProgram(VM *vm, Chunk *mainChunk, Obj *since, Table *pinned) {
+  Optimizer opt;
+  opt.vm = vm;
+  opt.chunk = NULL;
+  opt.pinned = pinned != NULL && pinned->count > 0 ? pinned : NULL;
+  opt.usedPinned = false;
+  opt.changed = false;
+  opt.summarized = NULL;
+  opt.returns = NULL;
+  opt.summaryCount = 0;
+  opt.summaryCapacity = 0;
+
+  optimizeChunk(&opt, mainChunk, 0);
+  for (Obj *object = vm->objects; object != since; object = object->next) {
+    if (object->type == OBJ_FUNCTION) {
+      ObjFunc *func = (ObjFunc *)object;
+      // A function that comes to rely on a pinned global keeps its code as
+      // it was as the fallback, unless the compiler already made one
+      Chunk *original = opt.pinned != NULL && func->fallback == NULL
+                            ? copyChunk(func->chunk)
+                            : NULL;
+      opt.usedPinned = false;
+      optimizeChunk(&opt, func->chunk, func->numParams);
+      if (original != NULL && opt.usedPinned) {
+        func->fallback = original;
+        vm->staticCalls = true;
+      } else if (original != NULL) {
+        freeChunk(original);
+        release(MEMORY_OBJECTS, original, sizeof(Chunk));
+      }
+    }
+  }
+  FREE_ARRAY(ObjFunc *, opt.summarized, opt.summaryCapacity);
+  FREE_ARRAY(Type, opt.returns, opt.summaryCapacity);
+}
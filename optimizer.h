@@ -0,0 +1,26 @@
+#ifndef sethi_optimizer_h
+#define sethi_optimizer_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// Rewrites the freshly compiled main chunk and every function created after
+// since (objects are listed newest first) through the optimizing middle-end.
+// Each chunk is lifted into basic blocks of instructions whose stack values
+// are numbered SSA style. Structs that never leave the local they are built
+// in are replaced by their fields, then copy propagation, common
+// subexpression elimination, loop-invariant code motion and dead-store
+// elimination run before bytecode is emitted again. Last, types inferred from
+// literals, constructors and tests pick unchecked forms of the instructions
+// whose operands they prove. A chunk the passes can not follow is left
+// as the direct emitter wrote it. Only the globals in pinned, which may be
+// NULL, are taken to keep their value; a function that relies on one keeps
+// its unoptimized code as its fallback.
+void optimizeProgram(VM *vm, Chunk *mainChunk, Obj *since, Table *pinned);
+
+// Adds the globals the code of vm's functions assigns or defines to
+// assigned. Returns false if some of it could not be scanned, so any global
+// may be assigned.
+bool noteHeapAssignments(VM *vm, Table *assigned);
+
+#endif
@@ -0,0 +1,353 @@
+#include "perf.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *counterNames[PERF_COUNTERS] = {
+    "cycles",     "instructions", "branch-misses",
+    "L1d misses", "LLC misses",   "task clock ns"};
+
+// The event behind each counter, only those of this thread in user space
+static void describe(PerfCounter counter, struct perf_event_attr *attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->type = PERF_TYPE_HARDWARE;
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+  switch (counter) {
+  case PERF_CYCLES:
+    attr->config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PERF_INSTRUCTIONS:
+    attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PERF_BRANCH_MISSES:
+    attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+    break;
+  case PERF_L1D_MISSES:
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->config = PERF_COUNT_HW_CACHE_L1D |
+                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case PERF_LLC_MISSES:
+    attr->config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  default:
+    attr->type = PERF_TYPE_SOFTWARE;
+    attr->config = PERF_COUNT_SW_TASK_CLOCK;
+    break;
+  }
+}
+
+// Opens every counter the machine has as one group, so they are all read at
+// once and count over the same instructions. The hardware ones are opened
+// first, one of them leading the group if there are any. Returns how many
+// were opened, none if the kernel does not allow it.
+int openPerfCounters(PerfCounters *perf, bool byFunction) {
+  memset(perf, 0, sizeof(PerfCounters));
+  perf->group = -1;
+  perf->byFunction = byFunction;
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    describe((PerfCounter)i, &attr);
+    // The group starts disabled and members follow their leader
+    attr.disabled = perf->group < 0;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, perf->group, 0);
+    perf->fds[i] = fd;
+    perf->slots[i] = fd < 0 ? -1 : perf->opened++;
+    if (fd >= 0 && perf->group < 0) {
+      perf->group = fd;
+    }
+  }
+  return perf->opened;
+}
+
+void closePerfCounters(PerfCounters *perf) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf->fds[i] >= 0) {
+      close(perf->fds[i]);
+    }
+  }
+  free(perf->functions);
+  perf->functions = NULL;
+  perf->functionCount = 0;
+  perf->functionCapacity = 0;
+}
+
+bool hasPerfCounter(PerfCounters *perf, PerfCounter counter) {
+  return perf->slots[counter] >= 0;
+}
+
+// Reads the whole group into counts. Counts of a group that had to share the
+// hardware with other programs are scaled up to the time it was enabled.
+static void readCounters(PerfCounters *perf, PerfCounts *counts) {
+  memset(counts, 0, sizeof(PerfCounts));
+  uint64_t values[3 + PERF_COUNTERS];
+  if (perf->group < 0 ||
+      read(perf->group, values, sizeof(values)) < (ssize_t)(3 * 8)) {
+    return;
+  }
+  uint64_t enabled = values[1];
+  uint64_t running = values[2];
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf->slots[i] < 0) {
+      continue;
+    }
+    uint64_t value = values[3 + perf->slots[i]];
+    if (running > 0 && running < enabled) {
+      value = (uint64_t)((double)value * enabled / running);
+    }
+    counts->counts[i] = value;
+  }
+}
+
+static uint32_t hashChunk(Chunk *chunk) {
+  uintptr_t bits = (uintptr_t)chunk;
+  return (uint32_t)((bits >> 4) ^ (bits >> 20)) * 2654435761u;
+}
+
+// The name of the global holding the function whose code chunk is, from the
+// VM's own globals or those of the program it runs
+static void nameFunction(VM *vm, Chunk *chunk, char *name) {
+  Table *tables[] = {&vm->table, vm->sharedTable};
+  for (int t = 0; t < 2; t++) {
+    if (tables[t] == NULL) {
+      continue;
+    }
+    for (int i = 0; i < tables[t]->capacity; i++) {
+      Entry *entry = &tables[t]->entries[i];
+      if (entry->key != NULL && IS_OBJ(entry->value) &&
+          entry->value.as.obj->type == OBJ_FUNCTION &&
+          (((ObjFunc *)entry->value.as.obj)->chunk == chunk ||
+           ((ObjFunc *)entry->value.as.obj)->fallback == chunk)) {
+        snprintf(name, PERF_NAME_MAX, "%s", entry->key->string);
+        return;
+      }
+    }
+  }
+  snprintf(name, PERF_NAME_MAX, "<top level>");
+}
+
+// Returns the counts of the function chunk is the code of, adding it the
+// first time it runs
+static PerfFunction *functionOf(VM *vm, Chunk *chunk) {
+  PerfCounters *perf = vm->perf;
+  if ((perf->functionCount + 1) * 2 > perf->functionCapacity) {
+    int capacity = perf->functionCapacity < 16 ? 16 : perf->functionCapacity * 2;
+    PerfFunction *functions =
+        (PerfFunction *)calloc(capacity, sizeof(PerfFunction));
+    for (int i = 0; i < perf->functionCapacity; i++) {
+      PerfFunction *old = &perf->functions[i];
+      if (old->chunk == NULL) {
+        continue;
+      }
+      uint32_t index = hashChunk(old->chunk) & (capacity - 1);
+      while (functions[index].chunk != NULL) {
+        index = (index + 1) & (capacity - 1);
+      }
+      functions[index] = *old;
+    }
+    free(perf->functions);
+    perf->functions = functions;
+    perf->functionCapacity = capacity;
+  }
+  uint32_t index = hashChunk(chunk) & (perf->functionCapacity - 1);
+  for (;;) {
+    PerfFunction *function = &perf->functions[index];
+    if (function->chunk == chunk) {
+      return function;
+    }
+    if (function->chunk == NULL) {
+      function->chunk = chunk;
+      nameFunction(vm, chunk, function->name);
+      perf->functionCount++;
+      return function;
+    }
+    index = (index + 1) & (perf->functionCapacity - 1);
+  }
+}
+
+// Adds what was counted since the last reading to the totals and, counting
+// by function, to the function that was running, which is now the VM's
+static void charge(VM *vm) {
+  PerfCounters *perf = vm->perf;
+  PerfCounts now;
+  readCounters(perf, &now);
+  PerfFunction *function =
+      perf->byFunction && perf->running != NULL
+          ? functionOf(vm, perf->running)
+          : NULL;
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    uint64_t delta = now.counts[i] - perf->last.counts[i];
+    perf->total.counts[i] += delta;
+    if (function != NULL) {
+      function->self.counts[i] += delta;
+    }
+  }
+  perf->last = now;
+  perf->running = vm->chunk;
+}
+
+// Starts counting a slice of vm's run, from the chunk it is at
+void startPerfRun(VM *vm) {
+  PerfCounters *perf = vm->perf;
+  readCounters(perf, &perf->last);
+  perf->running = vm->chunk;
+  if (perf->group >= 0) {
+    ioctl(perf->group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+void stopPerfRun(VM *vm) {
+  PerfCounters *perf = vm->perf;
+  if (perf->group >= 0) {
+    ioctl(perf->group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  }
+  charge(vm);
+  perf->running = NULL;
+  perf->runs++;
+}
+
+// Called once vm has gone on to another chunk, because a call started, which
+// is counted, or a call ended or a coroutine switched
+void switchPerfFunction(VM *vm, bool call) {
+  charge(vm);
+  if (call) {
+    functionOf(vm, vm->chunk)->calls++;
+  }
+}
+
+// Returns the counts of the first function named name, or NULL if it never
+// ran
+PerfFunction *findPerfFunction(PerfCounters *perf, const char *name) {
+  for (int i = 0; i < perf->functionCapacity; i++) {
+    if (perf->functions[i].chunk != NULL &&
+        strcmp(perf->functions[i].name, name) == 0) {
+      return &perf->functions[i];
+    }
+  }
+  return NULL;
+}
+
+// Prints each counter of counts, and instructions per cycle
+void printPerfCounts(PerfCounters *perf, PerfCounts *counts, FILE *out) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (hasPerfCounter(perf, (PerfCounter)i)) {
+      fprintf(out, "  %-14s %16llu\n", counterNames[i],
+              (unsigned long long)counts->counts[i]);
+    } else {
+      fprintf(out, "  %-14s %16s\n", counterNames[i], "not supported");
+    }
+  }
+  if (hasPerfCounter(perf, PERF_CYCLES) &&
+      hasPerfCounter(perf, PERF_INSTRUCTIONS) &&
+      counts->counts[PERF_CYCLES] > 0) {
+    fprintf(out, "  %-14s %16.2f\n", "IPC",
+            (double)counts->counts[PERF_INSTRUCTIONS] /
+                counts->counts[PERF_CYCLES]);
+  }
+}
+
+// A function and what it is ranked by, copied out so the comparison reads
+// nothing else and printing is safe from any thread
+typedef struct {
+  uint64_t key;
+  uint64_t calls;
+  PerfFunction *function;
+} RankedFunction;
+
+static int compareFunctions(const void *a, const void *b) {
+  const RankedFunction *left = (const RankedFunction *)a;
+  const RankedFunction *right = (const RankedFunction *)b;
+  uint64_t x = left->key;
+  uint64_t y = right->key;
+  if (x == y) {
+    x = left->calls;
+    y = right->calls;
+  }
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Prints a count of a function's, or a dash for counters the machine does
+// not have
+static void printCount(PerfCounters *perf, PerfFunction *function,
+                       PerfCounter counter, int width, FILE *out) {
+  if (hasPerfCounter(perf, counter)) {
+    fprintf(out, " %*llu", width,
+            (unsigned long long)function->self.counts[counter]);
+  } else {
+    fprintf(out, " %*s", width, "-");
+  }
+}
+
+// Prints the totals of every run, then, if counted, the functions that
+// counted the most
+void printPerfCounters(PerfCounters *perf, FILE *out) {
+  fprintf(out, "perf: %llu runs, %d of %d counters\n",
+          (unsigned long long)perf->runs, perf->opened, PERF_COUNTERS);
+  printPerfCounts(perf, &perf->total, out);
+  if (!perf->byFunction || perf->functionCount == 0) {
+    return;
+  }
+
+  // Functions are ranked by cycles, or the first counter the machine has
+  // after them
+  PerfCounter rankedBy = PERF_CYCLES;
+  while (rankedBy < PERF_TASK_CLOCK && !hasPerfCounter(perf, rankedBy)) {
+    rankedBy++;
+  }
+  RankedFunction *ranked = (RankedFunction *)malloc(perf->functionCount *
+                                                    sizeof(RankedFunction));
+  int count = 0;
+  for (int i = 0; i < perf->functionCapacity; i++) {
+    PerfFunction *function = &perf->functions[i];
+    if (function->chunk != NULL) {
+      ranked[count].key = function->self.counts[rankedBy];
+      ranked[count].calls = function->calls;
+      ranked[count].function = function;
+      count++;
+    }
+  }
+  qsort(ranked, count, sizeof(RankedFunction), compareFunctions);
+
+  fprintf(out, "perf: by function, its own code only\n");
+  fprintf(out, "  %-24s %10s %14s %14s %6s %12s %12s %12s %10s\n", "function",
+          "calls", "cycles", "instructions", "IPC", "branch-miss", "L1d miss",
+          "LLC miss", "ms");
+  for (int i = 0; i < count && i < PERF_TOP_FUNCTIONS; i++) {
+    PerfFunction *function = ranked[i].function;
+    fprintf(out, "  %-24s %10llu", function->name,
+            (unsigned long long)function->calls);
+    printCount(perf, function, PERF_CYCLES, 14, out);
+    printCount(perf, function, PERF_INSTRUCTIONS, 14, out);
+    uint64_t cycles = function->self.counts[PERF_CYCLES];
+    if (hasPerfCounter(perf, PERF_INSTRUCTIONS) && cycles > 0) {
+      fprintf(out, " %6.2f",
+              (double)function->self.counts[PERF_INSTRUCTIONS] / cycles);
+    } else {
+      fprintf(out, " %6s", "-");
+    }
+    printCount(perf, function, PERF_BRANCH_MISSES, 12, out);
+    printCount(perf, function, PERF_L1D_MISSES, 12, out);
+    printCount(perf, function, PERF_LLC_MISSES, 12, out);
+    if (hasPerfCounter(perf, PERF_TASK_CLOCK)) {
+      fprintf(out, " %10.3f", function->self.counts[PERF_TASK_CLOCK] / 1e6);
+    } else {
+      fprintf(out, " %10s", "-");
+    }
+    fprintf(out, "\n");
+  }
+  if (count > PERF_TOP_FUNCTIONS) {
+    fprintf(out, "  ... and %d more\n", count - PERF_TOP_FUNCTIONS);
+  }
+  free(ranked);
+}
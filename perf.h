@@ -0,0 +1,79 @@
+#ifndef sethi_perf_h
+#define sethi_perf_h
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+#include <stdio.h>
+
+// Most functions printPerfCounters lists, those with the most cycles first
+#define PERF_TOP_FUNCTIONS 20
+// Most characters of a function's name that are kept
+#define PERF_NAME_MAX 40
+
+// What is counted. The task clock is the kernel's count of nanoseconds on the
+// CPU, which machines without hardware counters, such as most virtual ones,
+// still have.
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_TASK_CLOCK,
+  PERF_COUNTERS
+} PerfCounter;
+
+typedef struct {
+  uint64_t counts[PERF_COUNTERS];
+} PerfCounts;
+
+// The counts of one function's own code, without those of the functions it
+// calls. Functions are told apart by their chunks, and named by the global
+// they were bound to when first run.
+typedef struct {
+  Chunk *chunk;
+  char name[PERF_NAME_MAX];
+  uint64_t calls;
+  PerfCounts self;
+} PerfFunction;
+
+// Counters of the thread a VM runs on, only counting while one of its runs
+// is. Set a VM's perf to them to count its runs, each slice of a suspended
+// run included; code of tasks and collector helpers, on other threads, is not
+// counted. With byFunction, the counts are also charged to the function
+// running, reading the counters with a system call each time a call starts
+// or ends or a coroutine switches. That makes calls tens of times slower, and
+// the task clock, unlike the hardware counters, counts the reads.
+typedef struct PerfCounters {
+  // The counters open, and where each is in a reading of the group, or -1 if
+  // the machine does not have it
+  int group;
+  int fds[PERF_COUNTERS];
+  int slots[PERF_COUNTERS];
+  int opened;
+  bool byFunction;
+  // All runs so far
+  uint64_t runs;
+  PerfCounts total;
+  // The reading when the counts were last charged, and the chunk charged the
+  // counts since
+  PerfCounts last;
+  Chunk *running;
+  // Open addressed by chunk
+  PerfFunction *functions;
+  int functionCount;
+  int functionCapacity;
+} PerfCounters;
+
+int openPerfCounters(PerfCounters *perf, bool byFunction);
+void closePerfCounters(PerfCounters *perf);
+bool hasPerfCounter(PerfCounters *perf, PerfCounter counter);
+void startPerfRun(VM *vm);
+void stopPerfRun(VM *vm);
+void switchPerfFunction(VM *vm, bool call);
+PerfFunction *findPerfFunction(PerfCounters *perf, const char *name);
+void printPerfCounts(PerfCounters *perf, PerfCounts *counts, FILE *out);
+void printPerfCounters(PerfCounters *perf, FILE *out);
+
+#endif
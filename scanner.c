@@ -2,38 +2,71 @@
 #include "common.h"
 #include <string.h>
 
-typedef struct {
-    const char* source;
-    const char* current;
-    int line;
-} Scanner;
-
-Scanner scanner;
+//SSE2 is part of every x86-64 cpu, so no runtime check is needed. Other targets use the lookup tables alone, as does building with -DSETHI_SCALAR_SCANNER.
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(SETHI_SCALAR_SCANNER)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#endif
 
-void initScanner(const char* source) {
-    scanner.source = source;
-    scanner.current = source;
-    scanner.line = 1;
+//Scans the length bytes at source. The source does not need to be NUL terminated and tokens point directly into it, so it must outlive them.
+void initScanner(Scanner* scanner, const char* source, size_t length) {
+    scanner->source = source;
+    scanner->current = source;
+    scanner->end = source + length;
+    scanner->line = 1;
 }
 
-static bool isDigit(char c) {
-    return c >= '0' && c <= '9';
-}
-static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-}
+static const char* unterminatedString = "Could not find string ending";
+
+//Character classes, looked up once per byte instead of chains of comparisons
+#define CLASS_ALPHA 1
+#define CLASS_DIGIT 2
+#define CLASS_SPACE 4
+#define CLASS_NEWLINE 8
+#define CLASS_IDENTIFIER (CLASS_ALPHA | CLASS_DIGIT)
 
-static char next() {
-    scanner.current++;
-    return scanner.current[-1];
+static const uint8_t charClass[256] = {
+    [' '] = CLASS_SPACE, ['\t'] = CLASS_SPACE, ['\r'] = CLASS_SPACE, ['\n'] = CLASS_NEWLINE,
+    ['0'] = CLASS_DIGIT, ['1'] = CLASS_DIGIT, ['2'] = CLASS_DIGIT, ['3'] = CLASS_DIGIT, ['4'] = CLASS_DIGIT,
+    ['5'] = CLASS_DIGIT, ['6'] = CLASS_DIGIT, ['7'] = CLASS_DIGIT, ['8'] = CLASS_DIGIT, ['9'] = CLASS_DIGIT,
+    ['_'] = CLASS_ALPHA,
+    ['a'] = CLASS_ALPHA, ['b'] = CLASS_ALPHA, ['c'] = CLASS_ALPHA, ['d'] = CLASS_ALPHA, ['e'] = CLASS_ALPHA,
+    ['f'] = CLASS_ALPHA, ['g'] = CLASS_ALPHA, ['h'] = CLASS_ALPHA, ['i'] = CLASS_ALPHA, ['j'] = CLASS_ALPHA,
+    ['k'] = CLASS_ALPHA, ['l'] = CLASS_ALPHA, ['m'] = CLASS_ALPHA, ['n'] = CLASS_ALPHA, ['o'] = CLASS_ALPHA,
+    ['p'] = CLASS_ALPHA, ['q'] = CLASS_ALPHA, ['r'] = CLASS_ALPHA, ['s'] = CLASS_ALPHA, ['t'] = CLASS_ALPHA,
+    ['u'] = CLASS_ALPHA, ['v'] = CLASS_ALPHA, ['w'] = CLASS_ALPHA, ['x'] = CLASS_ALPHA, ['y'] = CLASS_ALPHA,
+    ['z'] = CLASS_ALPHA,
+    ['A'] = CLASS_ALPHA, ['B'] = CLASS_ALPHA, ['C'] = CLASS_ALPHA, ['D'] = CLASS_ALPHA, ['E'] = CLASS_ALPHA,
+    ['F'] = CLASS_ALPHA, ['G'] = CLASS_ALPHA, ['H'] = CLASS_ALPHA, ['I'] = CLASS_ALPHA, ['J'] = CLASS_ALPHA,
+    ['K'] = CLASS_ALPHA, ['L'] = CLASS_ALPHA, ['M'] = CLASS_ALPHA, ['N'] = CLASS_ALPHA, ['O'] = CLASS_ALPHA,
+    ['P'] = CLASS_ALPHA, ['Q'] = CLASS_ALPHA, ['R'] = CLASS_ALPHA, ['S'] = CLASS_ALPHA, ['T'] = CLASS_ALPHA,
+    ['U'] = CLASS_ALPHA, ['V'] = CLASS_ALPHA, ['W'] = CLASS_ALPHA, ['X'] = CLASS_ALPHA, ['Y'] = CLASS_ALPHA,
+    ['Z'] = CLASS_ALPHA,
+};
+
+#define IS_CLASS(c, class) (charClass[(uint8_t)(c)] & (class))
+
+//Tokens that are always one character. Zero means the character needs more work.
+static const uint8_t singleCharTokens[256] = {
+    ['('] = TOKEN_LEFT_PAREN + 1, [')'] = TOKEN_RIGHT_PAREN + 1,
+    ['{'] = TOKEN_LEFT_CURLY + 1, ['}'] = TOKEN_RIGHT_CURLY + 1,
+    [','] = TOKEN_COMMA + 1, ['.'] = TOKEN_DOT + 1, [';'] = TOKEN_SEMI + 1,
+    ['+'] = TOKEN_PLUS + 1, ['-'] = TOKEN_MINUS + 1,
+    ['/'] = TOKEN_SLASH + 1, ['*'] = TOKEN_STAR + 1,
+};
+
+static bool isAtEnd(Scanner* scanner) {
+    return scanner->current >= scanner->end;
 }
 
-static char peek() {
-    return *scanner.current;
+static char next(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peekNext() {
-    return *(scanner.current + 1);
+//Returns '\0' past the end of the source
+static char peek(Scanner* scanner) {
+    return isAtEnd(scanner) ? '\0' : *scanner->current;
 }
 
 static void buildErrorToken(Token* token, const char* message) {
@@ -42,191 +75,268 @@ static void buildErrorToken(Token* token, const char* message) {
     token->length = strlen(message);
 }
 
-static void buildNumber(Token* token) {
-    token->type = TOKEN_NUMBER;
-    for(;;) {
-        char c = peek();
-        if(isDigit(c)) {
-            next();
-            token->length++;
-        } else {
-            return;
+#ifdef SCANNER_SSE2
+//Each of these returns a bit mask with bit i set when byte i of the 16 at p is in the class.
+//Bytes above 127 are negative as signed chars so they never fall in a range.
+
+static int identifierMask(const char* p) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+    //Setting bit 5 folds upper case letters onto lower case ones
+    __m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+    __m128i underscore = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_'));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), underscore));
+}
+
+static int digitMask(const char* p) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                           _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1))));
+}
+
+static int byteMask(const char* p, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi8(c)));
+}
+
+static int whitespaceMask(const char* p) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')));
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+    return _mm_movemask_epi8(_mm_or_si128(space, other));
+}
+
+//Number of leading set bits in a 16 bit mask
+static int leadingRun(int mask) {
+    return __builtin_ctz(~mask | 0x10000);
+}
+#endif
+
+//Most runs are short, so the first bytes are checked one at a time before switching to 16 byte blocks
+#define SCALAR_PREFIX 8
+
+//Returns true if the run of bytes in class continues past the first SCALAR_PREFIX bytes at current, advancing past the bytes checked
+static bool skipShortRun(Scanner* scanner, uint8_t class) {
+    for(int i = 0; i < SCALAR_PREFIX; i++) {
+        if(isAtEnd(scanner) || !IS_CLASS(*scanner->current, class)) {
+            return false;
+        }
+        if(*scanner->current == '\n') {
+            scanner->line++;
         }
+        scanner->current++;
     }
+    return true;
 }
 
-static void buildString(Token* token) {
-    token->type = TOKEN_STRING;
-    for(;;) {
-        token->length++;
-        char c = next(); 
-        
-        if(c == '\0') {
-            buildErrorToken(token, "Could not find string ending");
-            return;
-        }
-        else if(c == '\n') {
-            scanner.line++;
-        } else if (c == '"') {
+//Advances past the run of bytes in class, 16 at a time while that many remain
+static void skipClass(Scanner* scanner, uint8_t class) {
+    if(!skipShortRun(scanner, class)) {
+        return;
+    }
+#ifdef SCANNER_SSE2
+    while(scanner->end - scanner->current >= 16) {
+        int run = leadingRun(class == CLASS_DIGIT ? digitMask(scanner->current)
+                                                  : identifierMask(scanner->current));
+        scanner->current += run;
+        if(run < 16) {
             return;
         }
     }
+#endif
+    while(!isAtEnd(scanner) && IS_CLASS(*scanner->current, class)) {
+        scanner->current++;
+    }
 }
 
-static void checkKeyword(Token* token, const char* name, TokenType type, int length) {
-   for(;;) {
-        char currentChar = peek();
-        if(isDigit(currentChar) || isAlpha(currentChar) || currentChar == '_') {
-            token->length++;
-            next(); 
-        } else {
-            break;
+static void skipWhitespace(Scanner* scanner) {
+    if(!skipShortRun(scanner, CLASS_SPACE | CLASS_NEWLINE)) {
+        return;
+    }
+#ifdef SCANNER_SSE2
+    while(scanner->end - scanner->current >= 16) {
+        int run = leadingRun(whitespaceMask(scanner->current));
+        int newlines = byteMask(scanner->current, '\n') & ((1 << run) - 1);
+        scanner->line += __builtin_popcount(newlines);
+        scanner->current += run;
+        if(run < 16) {
+            return;
         }
-   }
-
-    if(token->length == length && strncmp(name, token->start, length) == 0) {
-        token->type = type;  
     }
-    
+#endif
+    while(!isAtEnd(scanner) && IS_CLASS(*scanner->current, CLASS_SPACE | CLASS_NEWLINE)) {
+        if(*scanner->current == '\n') {
+            scanner->line++;
+        }
+        scanner->current++;
+    }
 }
 
-static void skipWhitespace() {
+static void buildNumber(Scanner* scanner, Token* token) {
+    token->type = TOKEN_NUMBER;
+    skipClass(scanner, CLASS_DIGIT);
+    token->length = (int)(scanner->current - token->start);
+}
+
+//Scans the rest of a string whose opening quote has been consumed
+static void buildString(Scanner* scanner, Token* token) {
+    token->type = TOKEN_STRING;
+#ifdef SCANNER_SSE2
+    while(scanner->end - scanner->current >= 16) {
+        int quotes = byteMask(scanner->current, '"');
+        int newlines = byteMask(scanner->current, '\n');
+        if(quotes != 0) {
+            int run = __builtin_ctz(quotes);
+            scanner->line += __builtin_popcount(newlines & ((1 << run) - 1));
+            scanner->current += run + 1;
+            token->length = (int)(scanner->current - token->start);
+            return;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        scanner->current += 16;
+    }
+#endif
     for(;;) {
-        char c = peek();
-        if(c == ' ' || c == '\t') {
-            next();
-        } else if(c == '\n') {
-            next();
-            scanner.line++;
-        } else {
+        if(isAtEnd(scanner)) {
+            buildErrorToken(token, unterminatedString);
+            return;
+        }
+        char c = next(scanner);
+        if(c == '\n') {
+            scanner->line++;
+        } else if (c == '"') {
+            token->length = (int)(scanner->current - token->start);
             return;
         }
     }
 }
 
-static void buildIdentifier(Token* token) {
-    token->type = TOKEN_IDENTIFIER;
-    const char* start = token->start;
-    char nextChar = peek();
-    switch(*start) 
-    {
-        case 'i': checkKeyword(token, "if", TOKEN_IF, 2); break;
-        case 'p': checkKeyword(token, "print", TOKEN_PRINT, 5); break;
-        case 'w': checkKeyword(token, "while", TOKEN_WHILE, 5); break;
-        case 't': checkKeyword(token, "true", TOKEN_TRUE, 4); break;
-        case 'n': checkKeyword(token, "nil", TOKEN_NIL, 3); break;
-        case 'v': checkKeyword(token, "var", TOKEN_VAR, 3); break;
-        case 'd': checkKeyword(token, "def", TOKEN_DEF, 3); break;
-        case 'e': checkKeyword(token, "else", TOKEN_ELSE, 4); break;
-        case 'a': checkKeyword(token, "and", TOKEN_AND, 3); break;
-        case 'o': checkKeyword(token, "or", TOKEN_OR, 2); break;
-        case 'r': checkKeyword(token, "return", TOKEN_RETURN, 6); break;
-        case 's': checkKeyword(token, "struct", TOKEN_STRUCT, 6); break;
-        case 'f': 
-            switch (nextChar)
-            {
-            case 'o': checkKeyword(token, "for", TOKEN_FOR, 3); break;
-            case 'a': checkKeyword(token, "false", TOKEN_FALSE, 5); break;
-            default: checkKeyword(token, "", TOKEN_IDENTIFIER, 0); break;
-            }
-            break;
-        default: checkKeyword(token, "", TOKEN_IDENTIFIER, 0); break;
-        
-    } 
+//Keywords are found with a perfect hash of their length and first and last characters, so each identifier needs at most one comparison.
+//The hash has no collisions between keywords; tests/scanner_tests.c checks every keyword.
+#define KEYWORD_HASH(first, last, length) (((uint8_t)(first) + (uint8_t)(last) * 5 + (length)) & 31)
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
+
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+#define KEYWORD(first, last, name, type) [KEYWORD_HASH(first, last, sizeof(name) - 1)] = {name, sizeof(name) - 1, type}
 
+static const Keyword keywords[32] = {
+    KEYWORD('i', 'f', "if", TOKEN_IF),
+    KEYWORD('f', 'r', "for", TOKEN_FOR),
+    KEYWORD('w', 'e', "while", TOKEN_WHILE),
+    KEYWORD('t', 'e', "true", TOKEN_TRUE),
+    KEYWORD('f', 'e', "false", TOKEN_FALSE),
+    KEYWORD('p', 't', "print", TOKEN_PRINT),
+    KEYWORD('n', 'l', "nil", TOKEN_NIL),
+    KEYWORD('v', 'r', "var", TOKEN_VAR),
+    KEYWORD('e', 'e', "else", TOKEN_ELSE),
+    KEYWORD('a', 'd', "and", TOKEN_AND),
+    KEYWORD('o', 'r', "or", TOKEN_OR),
+    KEYWORD('d', 'f', "def", TOKEN_DEF),
+    KEYWORD('r', 'n', "return", TOKEN_RETURN),
+    KEYWORD('s', 't', "struct", TOKEN_STRUCT),
+};
 
+static TokenType identifierType(const char* start, int length) {
+    if(length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) {
+        return TOKEN_IDENTIFIER;
+    }
+    const Keyword* keyword = &keywords[KEYWORD_HASH(start[0], start[length - 1], length)];
+    if(keyword->length == length && memcmp(keyword->name, start, length) == 0) {
+        return keyword->type;
+    }
+    return TOKEN_IDENTIFIER;
 }
 
+static void buildIdentifier(Scanner* scanner, Token* token) {
+    skipClass(scanner, CLASS_IDENTIFIER);
+    token->length = (int)(scanner->current - token->start);
+    token->type = identifierType(token->start, token->length);
+}
 
+//Builds a token that is one character, or two if the next one is '='
+static void buildOperator(Scanner* scanner, Token* token, TokenType single, TokenType withEqual) {
+    if(peek(scanner) == '=') {
+        next(scanner);
+        token->type = withEqual;
+        token->length = 2;
+    } else {
+        token->type = single;
+    }
+}
 
-Token scanToken() {
-    skipWhitespace();
-    char c = next();
+Token scanToken(Scanner* scanner) {
+    skipWhitespace(scanner);
     Token token;
-    token.start = scanner.current - 1;
+    token.start = scanner->current;
+    token.length = 0;
+    token.line = scanner->line;
+    //Stays at the end so scanning again keeps returning EOF
+    if(isAtEnd(scanner)) {
+        token.type = TOKEN_EOF;
+        return token;
+    }
+
+    char c = next(scanner);
     token.length = 1;
-    token.line = scanner.line;
 
-    if(isAlpha(c) || c == '_') {
-        buildIdentifier(&token);
+    uint8_t single = singleCharTokens[(uint8_t)c];
+    if(single != 0) {
+        token.type = (TokenType)(single - 1);
         return token;
     }
 
-    if(isDigit(c)) {
-        buildNumber(&token);
+    if(IS_CLASS(c, CLASS_ALPHA)) {
+        buildIdentifier(scanner, &token);
         return token;
     }
 
-    if(c == '"') {
-        buildString(&token);
+    if(IS_CLASS(c, CLASS_DIGIT)) {
+        buildNumber(scanner, &token);
         return token;
     }
 
     switch (c)
     {
-    case '\0': token.type = TOKEN_EOF; break;
-    case '(': token.type = TOKEN_LEFT_PAREN; break;
-    case ')': token.type = TOKEN_RIGHT_PAREN; break;
-    case '{': token.type = TOKEN_LEFT_CURLY; break;
-    case '}': token.type = TOKEN_RIGHT_CURLY; break;
-    case ',': token.type = TOKEN_COMMA; break;
-    case '.': token.type = TOKEN_DOT; break;
-    case ';': token.type = TOKEN_SEMI; break;
-    case '+': token.type = TOKEN_PLUS; break;
-    case '-': token.type = TOKEN_MINUS; break;
-    case '/': token.type = TOKEN_SLASH; break;
-    case '*': token.type = TOKEN_STAR; break;
-    case '!': {
-        char nextC = peek();
-        if(nextC == '=') {
-            token.type = TOKEN_BANG_EQUAL;
-            token.length++;
-            next();
-        } else {
-            token.type = TOKEN_BANG;
-        }
-        break;
-    }
-    case '<': {
-       char nextC = peek();
-        if(nextC == '=') {
-            token.type = TOKEN_LESS_EQUAL;
-            token.length++;
-            next();
-        } else {
-            token.type = TOKEN_LESS;
-        }
-        break;
-    }
-    case '>':  {
-       char nextC = peek();
-        if(nextC == '=') {
-            token.type = TOKEN_GREATER_EQUAL;
-            token.length++;
-            next();
-        } else {
-            token.type = TOKEN_GREATER;
-        }
-        break;
+    case '"': buildString(scanner, &token); break;
+    case '!': buildOperator(scanner, &token, TOKEN_BANG, TOKEN_BANG_EQUAL); break;
+    case '<': buildOperator(scanner, &token, TOKEN_LESS, TOKEN_LESS_EQUAL); break;
+    case '>': buildOperator(scanner, &token, TOKEN_GREATER, TOKEN_GREATER_EQUAL); break;
+    case '=': buildOperator(scanner, &token, TOKEN_EQUAL, TOKEN_EQUAL_EQUAL); break;
+    default: buildErrorToken(&token, "Token does not exist"); break;
     }
 
-    case '=': {
-        char nextC = peek();
-        if(nextC == '=') {
-            token.type = TOKEN_EQUAL_EQUAL;
-            token.length++;
-            next();
-        } else {
-            token.type = TOKEN_EQUAL;
+    return token;
+}
+
+//Returns true if source ends inside a string or with brackets left open, so an interactive reader should wait for more lines before compiling it
+bool needsMoreInput(const char* source, size_t length) {
+    Scanner scanner;
+    initScanner(&scanner, source, length);
+    int depth = 0;
+    for(;;) {
+        Token token = scanToken(&scanner);
+        switch(token.type) {
+        case TOKEN_EOF: return depth > 0;
+        case TOKEN_LEFT_PAREN:
+        case TOKEN_LEFT_CURLY: depth++; break;
+        case TOKEN_RIGHT_PAREN:
+        case TOKEN_RIGHT_CURLY: depth--; break;
+        case TOKEN_ERROR:
+            if(token.start == unterminatedString) {
+                return true;
+            }
+            break;
+        default: break;
         }
-        break;
-    }
-    
-    default: {
-        buildErrorToken(&token, "Token does not exist");
-        break;
     }
-    }
-
-    return token;
-}
\ No newline at end of file
+}
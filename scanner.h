@@ -1,6 +1,8 @@
 #ifndef sethi_scanner_h
 #define sethi_scanner_h
 
+#include "common.h"
+
 typedef enum {
     //Single characters
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN, TOKEN_LEFT_CURLY, TOKEN_RIGHT_CURLY,
@@ -31,7 +33,17 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+//Represents the position of a scan through a source of known length
+typedef struct {
+    const char* source;
+    const char* current;
+    //One past the last byte of the source
+    const char* end;
+    int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source, size_t length);
+Token scanToken(Scanner* scanner);
+bool needsMoreInput(const char* source, size_t length);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "shared.h"
+#include "value.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The process-wide intern table. It holds the strings of prepared programs
+// and the names of the built-in natives, which every VM finds here instead of
+// interning its own copy. Strings are only ever added, and live until the
+// process ends, so VMs on any thread can hold them without copying.
+//
+// Readers search without locking. Writers take the lock, and grow the table
+// by filling a bigger copy and then publishing it, so a reader sees either
+// the old table or the new one, each complete. A reader that misses a string
+// added meanwhile falls back to the locked path when it needs it interned.
+
+typedef struct InternTable {
+  // A power of two
+  int capacity;
+  _Atomic(ObjString *) *slots;
+  // Replaced tables are kept, a reader may still be searching one
+  struct InternTable *previous;
+} InternTable;
+
+static _Atomic(InternTable *) current = NULL;
+static pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+static int count = 0;
+
+static InternTable *createTable(int capacity, InternTable *previous) {
+  InternTable *table = (InternTable *)malloc(sizeof(InternTable));
+  _Atomic(ObjString *) *slots =
+      (_Atomic(ObjString *) *)malloc(sizeof(*slots) * capacity);
+  if (table == NULL || slots == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < capacity; i++) {
+    atomic_init(&slots[i], NULL);
+  }
+  table->capacity = capacity;
+  table->slots = slots;
+  table->previous = previous;
+  return table;
+}
+
+static ObjString *search(InternTable *table, const char *string, int length,
+                         uint32_t hash) {
+  if (table == NULL) {
+    return NULL;
+  }
+  int mask = table->capacity - 1;
+  for (int index = hash & mask;; index = (index + 1) & mask) {
+    ObjString *entry =
+        atomic_load_explicit(&table->slots[index], memory_order_acquire);
+    if (entry == NULL) {
+      return NULL;
+    }
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->string, string, length) == 0) {
+      return entry;
+    }
+  }
+}
+
+// Stores string in the first free slot of its probe sequence. The release
+// makes its contents visible to readers that find it.
+static void insert(InternTable *table, ObjString *string) {
+  int mask = table->capacity - 1;
+  int index = string->hash & mask;
+  while (atomic_load_explicit(&table->slots[index], memory_order_relaxed) !=
+         NULL) {
+    index = (index + 1) & mask;
+  }
+  atomic_store_explicit(&table->slots[index], string, memory_order_release);
+}
+
+// Returns the shared string with these characters, or NULL. Never blocks.
+ObjString *findSharedString(const char *string, int length, uint32_t hash) {
+  return search(atomic_load_explicit(&current, memory_order_acquire), string,
+                length, hash);
+}
+
+// Returns the shared string with these characters, adding it if there is
+// none yet
+ObjString *internSharedString(const char *string, int length, uint32_t hash) {
+  pthread_mutex_lock(&writeLock);
+  InternTable *table = atomic_load_explicit(&current, memory_order_relaxed);
+  ObjString *entry = search(table, string, length, hash);
+  if (entry == NULL) {
+    // Kept at most three quarters full so probe sequences stay short
+    if (table == NULL || (count + 1) * 4 > table->capacity * 3) {
+      InternTable *bigger =
+          createTable(table == NULL ? 256 : table->capacity * 2, table);
+      for (int i = 0; table != NULL && i < table->capacity; i++) {
+        ObjString *old =
+            atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (old != NULL) {
+          insert(bigger, old);
+        }
+      }
+      atomic_store_explicit(&current, bigger, memory_order_release);
+      table = bigger;
+    }
+    entry = allocateString(string, length, hash);
+    insert(table, entry);
+    count++;
+  }
+  pthread_mutex_unlock(&writeLock);
+  return entry;
+}
@@ -0,0 +1,10 @@
+#ifndef sethi_shared_h
+#define sethi_shared_h
+
+#include "common.h"
+#include "value.h"
+
+ObjString *findSharedString(const char *string, int length, uint32_t hash);
+ObjString *internSharedString(const char *string, int length, uint32_t hash);
+
+#endif
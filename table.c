@@ -1,4 +1,5 @@
 #include "table.h"
+#include "gc.h"
 #include "memory.h"
 #include "string.h"
 #include "value.h"
@@ -26,7 +27,8 @@ void grow(Table *table) {
     table->capacity = 2 * table->capacity;
   }
   Entry *oldEntries = table->entries;
-  table->entries = (Entry *)malloc(table->capacity * sizeof(Entry));
+  table->entries =
+      (Entry *)allocate(MEMORY_TABLES, table->capacity * sizeof(Entry));
 
   for (int i = 0; i < table->capacity; i++) {
     table->entries[i].key = NULL;
@@ -39,7 +41,7 @@ void grow(Table *table) {
     }
   }
 
-  free(oldEntries);
+  release(MEMORY_TABLES, oldEntries, oldCapacity * sizeof(Entry));
 }
 
 // Sets the given key to the given Value
@@ -51,9 +53,12 @@ void set(Table *table, ObjString *key, Value value) {
   int index = key->hash % table->capacity;
   for (;;) {
     if (table->entries[index].key == NULL || table->entries[index].key == key) {
+      // Only new keys add to the load, so rebinding a key never grows the table
+      if (table->entries[index].key == NULL) {
+        table->count = table->count + 1;
+      }
       table->entries[index].key = key;
       table->entries[index].value = value;
-      table->count = table->count + 1;
       break;
     }
     index = (index + 1) % table->capacity;
@@ -77,10 +82,45 @@ Value *get(Table *table, ObjString *key) {
   }
 }
 
+// Removes key from table. The entries after it in its probe sequence are
+// moved back into the gap, so lookups still stop only at empty entries.
+void removeKey(Table *table, ObjString *key) {
+  if (table->entries == NULL) {
+    return;
+  }
+  int index = key->hash % table->capacity;
+  while (table->entries[index].key != key) {
+    if (table->entries[index].key == NULL) {
+      return;
+    }
+    index = (index + 1) % table->capacity;
+  }
+  int gap = index;
+  for (;;) {
+    index = (index + 1) % table->capacity;
+    ObjString *next = table->entries[index].key;
+    if (next == NULL) {
+      break;
+    }
+    // An entry whose home is between the gap and it has to stay after its
+    // home
+    int home = next->hash % table->capacity;
+    bool stays = gap < index ? gap < home && home <= index
+                             : gap < home || home <= index;
+    if (!stays) {
+      table->entries[gap] = table->entries[index];
+      gap = index;
+    }
+  }
+  table->entries[gap].key = NULL;
+  table->entries[gap].value = MAKE_NIL();
+  table->count--;
+}
+
 void freeTable(Table *table) {
+  release(MEMORY_TABLES, table->entries, table->capacity * sizeof(Entry));
   table->count = 0;
   table->capacity = 0;
-  free(table->entries);
 }
 
 /// @brief Returns NULL if the string does not exist in the table, otherwise
@@ -109,15 +149,47 @@ ObjString *findStringInTable(Table *table, const char *string, int length,
   }
 }
 
-// Creates a Table on the heap
-ObjStruct *createStruct(ObjString *type) {
-  ObjStruct *output = (ObjStruct *)malloc(sizeof(ObjStruct));
+// Creates the shape of a struct type with a copy of the count field names
+ObjShape *createShape(VM *vm, ObjString *type, int count, ObjString **names) {
+  ObjShape *output = (ObjShape *)allocate(MEMORY_OBJECTS, sizeof(ObjShape));
+  ObjString **copy = (ObjString **)allocate(
+      MEMORY_OBJECTS, sizeof(ObjString *) * (count + 1));
+  output->names = copy;
+  memcpy(output->names, names, sizeof(ObjString *) * count);
 
   output->type = type;
-  output->obj.type = OBJ_STRUCT;
-  output->obj.next = vm.objects;
-  vm.objects = &output->obj;
+  output->count = count;
+  output->obj.type = OBJ_SHAPE;
+  trackObject(vm, &output->obj);
+  return output;
+}
+
+// Creates a struct on the heap in a single allocation, copying one value per
+// field of shape from fields
+ObjStruct *createStruct(VM *vm, ObjShape *shape, Value *fields) {
+  ObjStruct *output = (ObjStruct *)allocate(
+      MEMORY_OBJECTS, sizeof(ObjStruct) + sizeof(Value) * shape->count);
+  memcpy(output->fields, fields, sizeof(Value) * shape->count);
 
-  initTable(&output->table);
+  output->shape = shape;
+  output->obj.type = OBJ_STRUCT;
+  trackObject(vm, &output->obj);
   return output;
 }
+
+// Returns the index of the field of shape called name, or -1 if it has none.
+// A name declared twice is the later field.
+int getFieldIndex(ObjShape *shape, ObjString *name) {
+  for (int i = shape->count - 1; i >= 0; i--) {
+    if (shape->names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns the field of s called name, or NULL if it has none
+Value *getField(ObjStruct *s, ObjString *name) {
+  int index = getFieldIndex(s->shape, name);
+  return index < 0 ? NULL : &s->fields[index];
+}
@@ -15,24 +15,35 @@ typedef struct {
   Entry *entries;
 } Table;
 
-// Represents a struct in SethiScript
+// The fields of one type of struct, in the order its constructor declares
+// them. Made once by the compiler and shared by every instance.
 typedef struct {
   Obj obj;
-  // Stores key-value pairs
-  Table table;
   // The type of struct
   ObjString *type;
+  int count;
+  ObjString **names;
+} ObjShape;
+
+// Represents a struct in SethiScript. The field values are stored inline, in
+// the order of the shape's names.
+typedef struct {
+  Obj obj;
+  ObjShape *shape;
+  Value fields[];
 } ObjStruct;
 
 void initTable(Table *table);
 Value *get(Table *table, ObjString *key);
 void set(Table *table, ObjString *key, Value value);
 void grow(Table *table);
+void removeKey(Table *table, ObjString *key);
 void freeTable(Table *table);
 ObjString *findStringInTable(Table *table, const char *string, int length,
                              uint32_t hash);
-ObjStruct *createStruct(ObjString *type);
-
-#define GET_TABLE(struct) (((ObjStruct *)struct.as.obj)->table)
+ObjShape *createShape(VM *vm, ObjString *type, int count, ObjString **names);
+ObjStruct *createStruct(VM *vm, ObjShape *shape, Value *fields);
+int getFieldIndex(ObjShape *shape, ObjString *name);
+Value *getField(ObjStruct *s, ObjString *name);
 
 #endif
@@ -0,0 +1,425 @@
+#include "task.h"
+#include "buffer.h"
+#include "memory.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Tasks of one thread. The owner pushes and pops at the bottom, so it runs
+// its newest task first while it is still warm in cache; other threads steal
+// the oldest from the top.
+typedef struct {
+  pthread_mutex_t lock;
+  ObjTask **tasks;
+  int head;
+  int count;
+  int capacity;
+} Deque;
+
+// Worker threads shared by every VM in the process
+static struct {
+  pthread_mutex_t lock;
+  // Signalled when a task is queued or finishes
+  pthread_cond_t changed;
+  int workers;
+  pthread_t *threads;
+  // One deque per worker, and a last one for threads outside the pool
+  Deque *deques;
+  // Tasks sitting in the deques, guarded by lock
+  int queued;
+  bool stopping;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .changed = PTHREAD_COND_INITIALIZER};
+
+// The deque index of the worker running on this thread, -1 outside the pool
+static __thread int currentWorker = -1;
+
+static void pushBottom(Deque *deque, ObjTask *task) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->capacity) {
+    // The pool outlives the VM spawning the task, so this is not its memory
+    MemoryAccount *outer = useAccount(NULL);
+    // Unwrap the deque into the new array so it starts at index 0
+    int capacity = GROW_CAPACITY(deque->capacity);
+    ObjTask **tasks = GROW_ARRAY(ObjTask *, NULL, 0, capacity);
+    for (int i = 0; i < deque->count; i++) {
+      tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+    }
+    FREE_ARRAY(ObjTask *, deque->tasks, deque->capacity);
+    deque->tasks = tasks;
+    deque->head = 0;
+    deque->capacity = capacity;
+    useAccount(outer);
+  }
+  deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static ObjTask *popBottom(Deque *deque) {
+  ObjTask *task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+static ObjTask *stealTop(Deque *deque) {
+  ObjTask *task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+// Takes a task for the calling thread: its own newest, or else the oldest of
+// another deque, visiting them in order from its own. Returns NULL if every
+// deque is empty.
+static ObjTask *takeTask() {
+  int deques = pool.workers + 1;
+  int self = currentWorker < 0 ? pool.workers : currentWorker;
+  ObjTask *task = NULL;
+  if (currentWorker >= 0) {
+    task = popBottom(&pool.deques[self]);
+  }
+  for (int i = 0; task == NULL && i < deques; i++) {
+    int victim = (self + i) % deques;
+    if (victim != currentWorker) {
+      task = stealTop(&pool.deques[victim]);
+    }
+  }
+  if (task != NULL) {
+    pthread_mutex_lock(&pool.lock);
+    pool.queued--;
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return task;
+}
+
+static void runTask(ObjTask *task) {
+  Value args[1] = {task->arg};
+  InterpretResult status = sethiCall(&task->vm, task->func, 1, args,
+                                     &task->result);
+  pthread_mutex_lock(&pool.lock);
+  task->status = status;
+  task->done = true;
+  pthread_cond_broadcast(&pool.changed);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Runs other tasks until task is done, sleeping only when there are none
+static void waitForTask(ObjTask *task) {
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (!task->done && pool.queued == 0) {
+      pthread_cond_wait(&pool.changed, &pool.lock);
+    }
+    bool done = task->done;
+    pthread_mutex_unlock(&pool.lock);
+    if (done) {
+      return;
+    }
+    ObjTask *other = takeTask();
+    if (other != NULL) {
+      runTask(other);
+    }
+  }
+}
+
+static void *workerMain(void *arg) {
+  currentWorker = (int)(intptr_t)arg;
+  for (;;) {
+    ObjTask *task = takeTask();
+    if (task != NULL) {
+      runTask(task);
+      continue;
+    }
+    pthread_mutex_lock(&pool.lock);
+    while (pool.queued == 0 && !pool.stopping) {
+      pthread_cond_wait(&pool.changed, &pool.lock);
+    }
+    bool stop = pool.stopping && pool.queued == 0;
+    pthread_mutex_unlock(&pool.lock);
+    if (stop) {
+      return NULL;
+    }
+  }
+}
+
+// Starts the worker threads unless they are running. With workers 0 there is
+// one per cpu, or as many as SETHI_WORKERS says.
+void startTaskPool(int workers) {
+  pthread_mutex_lock(&pool.lock);
+  if (pool.workers > 0) {
+    pthread_mutex_unlock(&pool.lock);
+    return;
+  }
+  if (workers <= 0) {
+    const char *setting = getenv("SETHI_WORKERS");
+    workers = setting != NULL ? atoi(setting) : 0;
+  }
+  if (workers <= 0) {
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers <= 0) {
+    workers = 1;
+  }
+  pool.threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+  pool.deques = (Deque *)malloc(sizeof(Deque) * (workers + 1));
+  if (pool.threads == NULL || pool.deques == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i <= workers; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deques[i].tasks = NULL;
+    pool.deques[i].head = 0;
+    pool.deques[i].count = 0;
+    pool.deques[i].capacity = 0;
+  }
+  pool.workers = workers;
+  for (int i = 0; i < workers; i++) {
+    pthread_create(&pool.threads[i], NULL, workerMain, (void *)(intptr_t)i);
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Lets the workers finish the queued tasks, then stops them. No VM may spawn
+// tasks meanwhile.
+void stopTaskPool() {
+  pthread_mutex_lock(&pool.lock);
+  int workers = pool.workers;
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.changed);
+  pthread_mutex_unlock(&pool.lock);
+  for (int i = 0; i < workers; i++) {
+    pthread_join(pool.threads[i], NULL);
+  }
+  for (int i = 0; i < workers + 1 && workers > 0; i++) {
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    FREE_ARRAY(ObjTask *, pool.deques[i].tasks, pool.deques[i].capacity);
+  }
+  free(pool.threads);
+  free(pool.deques);
+  pool.threads = NULL;
+  pool.deques = NULL;
+  pool.workers = 0;
+  pool.stopping = false;
+}
+
+// Copies value into vm's heap. While kept is not NULL the original objects
+// outlive vm, so immutable old ones are used as they are, and added to kept,
+// and only buffers, young objects and structs that reach one are copied.
+// Otherwise every string, struct and buffer is copied. Functions, shapes and
+// natives are only ever made by the compiler and defineNative, so they always
+// outlive the tasks using them. Returns false for values that belong to one
+// VM, which it sets error to.
+static bool copyValue(VM *vm, Value value, ValueArray *kept, Value *out,
+                      Obj **error) {
+  *out = value;
+  if (value.type != VALUE_OBJ) {
+    return true;
+  }
+  Obj *object = value.as.obj;
+  switch (object->type) {
+  case OBJ_STRING:
+    // Young objects may be moved by the next minor collection, so they are
+    // copied rather than shared
+    if (kept == NULL || object->mark == MARK_YOUNG) {
+      ObjString *string = (ObjString *)object;
+      *out = MAKE_OBJ((Obj *)copyString(vm, string->string, string->length));
+    } else {
+      writeValueArray(kept, value);
+    }
+    return true;
+  case OBJ_FUNCTION:
+  case OBJ_SHAPE:
+  case OBJ_NATIVE:
+    return true;
+  case OBJ_BUFFER: {
+    ObjBuffer *buffer = (ObjBuffer *)object;
+    ObjBuffer *copy = createBuffer(vm, buffer->kind, buffer->length);
+    size_t size = buffer->kind == BUFFER_INT32 ? sizeof(int32_t)
+                                               : sizeof(int64_t);
+    memcpy(copy->data, buffer->data, size * buffer->length);
+    *out = MAKE_OBJ((Obj *)copy);
+    return true;
+  }
+  case OBJ_STRUCT: {
+    ObjStruct *original = (ObjStruct *)object;
+    // A shared struct is only copied once one of its fields had to be
+    ObjStruct *copy = kept != NULL && object->mark != MARK_YOUNG
+                          ? NULL
+                          : createStruct(vm, original->shape, original->fields);
+    int keptCount = kept != NULL ? kept->count : 0;
+    for (int i = 0; i < original->shape->count; i++) {
+      Value field;
+      if (!copyValue(vm, original->fields[i], kept, &field, error)) {
+        return false;
+      }
+      if (copy == NULL && field.as.obj != original->fields[i].as.obj) {
+        copy = createStruct(vm, original->shape, original->fields);
+      }
+      if (copy != NULL) {
+        copy->fields[i] = field;
+      }
+    }
+    if (copy != NULL) {
+      *out = MAKE_OBJ((Obj *)copy);
+    } else if (kept != NULL) {
+      // The whole struct is shared, which keeps its fields alive too
+      kept->count = keptCount;
+      writeValueArray(kept, value);
+    }
+    return true;
+  }
+  default:
+    *error = object;
+    return false;
+  }
+}
+
+// Frees the VM a task ran in, along with the values copied into it
+static void freeTaskVM(ObjTask *task) {
+  MemoryAccount *outer = useAccount(&task->vm.memory);
+  freeValueArray(&task->kept);
+  useAccount(outer);
+  freeVM(&task->vm);
+}
+
+// spawnTask(function, value) queues function(value) to run in parallel and
+// evaluates to the Task
+static bool spawnTaskNative(VM *vm, int argCount, Value *args,
+                            Value *result) {
+  if (!isObjectOfType(args[0], OBJ_FUNCTION) ||
+      ((ObjFunc *)args[0].as.obj)->numParams != 1) {
+    runtimeError(vm, "spawnTask expects a function of one parameter, got %s",
+                 typeName(args[0]));
+    return false;
+  }
+  ObjTask *task = (ObjTask *)allocate(MEMORY_OBJECTS, sizeof(ObjTask));
+  initVM(&task->vm);
+  task->vm.gc.enabled = false;
+  // What the task allocates also counts against the VM spawning it, so it
+  // is held to the same limit
+  task->vm.memory.parent = &vm->memory;
+  initValueArray(&task->kept);
+  MemoryAccount *outer = useAccount(&task->vm.memory);
+  Obj *error = NULL;
+  if (!copyValue(&task->vm, args[1], &task->kept, &task->arg, &error)) {
+    useAccount(outer);
+    freeTaskVM(task);
+    release(MEMORY_OBJECTS, task, sizeof(ObjTask));
+    runtimeError(vm, "A %s can not be passed to a task",
+                 typeName(MAKE_OBJ(error)));
+    return false;
+  }
+  // The task sees the globals as they are now. Ones that can not be copied
+  // are left undefined.
+  task->vm.sharedTable = vm->sharedTable;
+  for (int i = 0; i < vm->table.capacity; i++) {
+    Entry *entry = &vm->table.entries[i];
+    Value copy;
+    if (entry->key != NULL &&
+        copyValue(&task->vm, entry->value, &task->kept, &copy, &error)) {
+      set(&task->vm.table, entry->key, copy);
+    }
+  }
+  useAccount(outer);
+  task->func = (ObjFunc *)args[0].as.obj;
+  task->done = false;
+  task->joined = false;
+  task->result = MAKE_NIL();
+
+  task->obj.type = OBJ_TASK;
+  trackObject(vm, &task->obj);
+  keepTask(&vm->gc, task);
+
+  startTaskPool(0);
+  int deque = currentWorker < 0 ? pool.workers : currentWorker;
+  pushBottom(&pool.deques[deque], task);
+  pthread_mutex_lock(&pool.lock);
+  pool.queued++;
+  pthread_cond_signal(&pool.changed);
+  pthread_mutex_unlock(&pool.lock);
+
+  *result = MAKE_OBJ((Obj *)task);
+  return true;
+}
+
+// join(task) waits for a task, running other queued tasks meanwhile, and
+// evaluates to a copy of what its function returned
+static bool joinNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!isObjectOfType(args[0], OBJ_TASK)) {
+    runtimeError(vm, "join expects a Task, got %s", typeName(args[0]));
+    return false;
+  }
+  ObjTask *task = (ObjTask *)args[0].as.obj;
+  if (!task->joined) {
+    waitForTask(task);
+    if (task->status != INTERPRET_OK) {
+      runtimeError(vm, "The joined task stopped with an error");
+      return false;
+    }
+    Value copy;
+    Obj *error = NULL;
+    if (!copyValue(vm, task->result, NULL, &copy, &error)) {
+      runtimeError(vm, "A task can not return a %s",
+                   typeName(MAKE_OBJ(error)));
+      return false;
+    }
+    freeTaskVM(task);
+    task->result = copy;
+    task->joined = true;
+  }
+  *result = task->result;
+  return true;
+}
+
+// Returns whether a worker has finished running task
+bool taskFinished(ObjTask *task) {
+  pthread_mutex_lock(&pool.lock);
+  bool done = task->done;
+  pthread_mutex_unlock(&pool.lock);
+  return done;
+}
+
+// Frees a task once it has finished running
+void freeTask(ObjTask *task) {
+  waitForTask(task);
+  if (!task->joined) {
+    freeTaskVM(task);
+  }
+  release(MEMORY_OBJECTS, task, sizeof(ObjTask));
+}
+
+static void finishTask(Obj *object, void *context) {
+  if (object->type == OBJ_TASK) {
+    ObjTask *task = (ObjTask *)object;
+    waitForTask(task);
+    if (!task->joined) {
+      finishTasks(&task->vm);
+    }
+  }
+}
+
+// Waits until no task vm spawned, or any of those spawned, is running
+void finishTasks(VM *vm) {
+  visitHeap(vm, finishTask, NULL);
+}
+
+// Binds the task natives as globals
+void defineTaskNatives(VM *vm) {
+  defineNative(vm, "spawnTask", spawnTaskNative, 2);
+  defineNative(vm, "join", joinNative, 1);
+}
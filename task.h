@@ -0,0 +1,39 @@
+#ifndef sethi_task_h
+#define sethi_task_h
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+// A function call run in parallel by the task pool. It runs in a VM of its
+// own, which starts with copies of the spawning VM's globals and argument.
+// Strings, functions and structs never change, so they are shared with the
+// spawning VM instead of copied; buffers are copied. The spawning VM's
+// collector keeps the task alive while it runs, and what it shares until it
+// is joined. The task's own VM is not collected, since other VMs' objects
+// are in it; it is freed whole when the task is joined.
+typedef struct ObjTask {
+  Obj obj;
+  ObjFunc *func;
+  Value arg;
+  // The objects of the spawning VM's heap the task uses
+  ValueArray kept;
+  VM vm;
+  // Set once the task has run, guarded by the pool's lock
+  bool done;
+  InterpretResult status;
+  // The function's return value, in vm's heap until joined and in the
+  // spawning VM's heap after
+  Value result;
+  // Set once the result has been copied out and vm freed
+  bool joined;
+} ObjTask;
+
+void startTaskPool(int workers);
+void stopTaskPool();
+bool taskFinished(ObjTask *task);
+void freeTask(ObjTask *task);
+void finishTasks(VM *vm);
+void defineTaskNatives(VM *vm);
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../buffer.h"
+#include "../vm.h"
+#include <assert.h>
+
+#define MAX_LENGTH 70
+
+static int32_t a32[MAX_LENGTH], b32[MAX_LENGTH], mask[MAX_LENGTH];
+static int64_t a64[MAX_LENGTH], b64[MAX_LENGTH];
+
+static void randomize() {
+    for (int i = 0; i < MAX_LENGTH; i++) {
+        // Mix small values with values near the limits so wrapping is covered
+        a32[i] = (i % 7 == 0) ? (int32_t)(0x7fffffff - rand() % 3) : rand() % 2001 - 1000;
+        b32[i] = (i % 5 == 0) ? (int32_t)(-0x7fffffff - rand() % 2) : rand() % 2001 - 1000;
+        a64[i] = (int64_t)(((uint64_t)rand() << 33) ^ (uint64_t)rand());
+        b64[i] = (i % 3 == 0) ? -(((int64_t)rand() << 31) ^ rand()) : rand() % 100;
+        mask[i] = rand() % 3 == 0;
+    }
+}
+
+//Checks every kernel of the given set against the scalar kernels
+static void compareKernels(const BufferKernels* k, const BufferKernels* s) {
+    int32_t out32[MAX_LENGTH], expected32[MAX_LENGTH];
+    int64_t out64[MAX_LENGTH], expected64[MAX_LENGTH];
+
+    for (int n = 0; n <= MAX_LENGTH; n++) {
+        assert(k->sum32(a32, n) == s->sum32(a32, n));
+        assert(k->sum64(a64, n) == s->sum64(a64, n));
+        assert(k->dot32(a32, b32, n) == s->dot32(a32, b32, n));
+        assert(k->dot64(a64, b64, n) == s->dot64(a64, b64, n));
+
+        if (n > 0) {
+            assert(k->min32(b32, n) == s->min32(b32, n));
+            assert(k->max32(a32, n) == s->max32(a32, n));
+            assert(k->min64(b64, n) == s->min64(b64, n));
+            assert(k->max64(a64, n) == s->max64(a64, n));
+        }
+
+        k->add32(a32, b32, out32, n); s->add32(a32, b32, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->mul32(a32, b32, out32, n); s->mul32(a32, b32, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->scale32(a32, -3, out32, n); s->scale32(a32, -3, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->prefix32(a32, out32, n); s->prefix32(a32, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->greater32(b32, 10, out32, n); s->greater32(b32, 10, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->less32(b32, 10, out32, n); s->less32(b32, 10, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->greater64(b64, 10, out32, n); s->greater64(b64, 10, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+        k->less64(b64, 10, out32, n); s->less64(b64, 10, expected32, n);
+        assert(memcmp(out32, expected32, n * sizeof(int32_t)) == 0);
+
+        int32_t kept = k->filter32(a32, mask, out32, n);
+        assert(kept == s->filter32(a32, mask, expected32, n));
+        assert(memcmp(out32, expected32, kept * sizeof(int32_t)) == 0);
+        kept = k->filter64(a64, mask, out64, n);
+        assert(kept == s->filter64(a64, mask, expected64, n));
+        assert(memcmp(out64, expected64, kept * sizeof(int64_t)) == 0);
+
+        k->add64(a64, b64, out64, n); s->add64(a64, b64, expected64, n);
+        assert(memcmp(out64, expected64, n * sizeof(int64_t)) == 0);
+        k->mul64(a64, b64, out64, n); s->mul64(a64, b64, expected64, n);
+        assert(memcmp(out64, expected64, n * sizeof(int64_t)) == 0);
+        k->scale64(a64, -7, out64, n); s->scale64(a64, -7, expected64, n);
+        assert(memcmp(out64, expected64, n * sizeof(int64_t)) == 0);
+        k->prefix64(a64, out64, n); s->prefix64(a64, expected64, n);
+        assert(memcmp(out64, expected64, n * sizeof(int64_t)) == 0);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    VM vm;
+    initVM(&vm);
+    const BufferKernels* scalar = kernelsForLevel(SIMD_SCALAR);
+
+    //Scalar kernels on known values
+    int32_t values[5] = {3, -1, 4, -1, 5};
+    int32_t keep[5] = {1, 0, 1, 0, 1};
+    int32_t out[5];
+    assert(scalar->sum32(values, 5) == 10);
+    assert(scalar->min32(values, 5) == -1);
+    assert(scalar->max32(values, 5) == 5);
+    assert(scalar->dot32(values, values, 5) == 52);
+    assert(scalar->filter32(values, keep, out, 5) == 3);
+    assert(out[0] == 3 && out[1] == 4 && out[2] == 5);
+    scalar->prefix32(values, out, 5);
+    assert(out[0] == 3 && out[1] == 2 && out[2] == 6 && out[3] == 5 && out[4] == 10);
+
+    //Every SIMD level this cpu supports agrees with the scalar kernels
+    srand(26);
+    SimdLevel best = detectSimdLevel();
+    for (int round = 0; round < 20; round++) {
+        randomize();
+        for (SimdLevel level = SIMD_SSE4; level <= best; level++) {
+            const BufferKernels* k = kernelsForLevel(level);
+            if (k != NULL) {
+                compareKernels(k, scalar);
+            }
+        }
+    }
+
+    //Buffers start zeroed
+    ObjBuffer* buffer = createBuffer(&vm, BUFFER_INT64, 3);
+    assert(buffer->length == 3);
+    assert(((int64_t*)buffer->data)[2] == 0);
+    freeVM(&vm);
+
+    printf("buffer kernels checked up to %s\n", kernelsForLevel(best)->name);
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../coroutine.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//A generator feeding another, and a yield from deep inside recursion
+static const char* script =
+    "def count(n) { var i = 0; while (i < n) { yield(i); i = i + 1; } return nil; }\n"
+    "def squares(source) {\n"
+    "  var v = resume(source, 5);\n"
+    "  while (!isDone(source)) { yield(v * v); v = resume(source, nil); }\n"
+    "  return nil;\n"
+    "}\n"
+    "var s = coroutine(squares);\n"
+    "var sum = 0;\n"
+    "var v = resume(s, coroutine(count));\n"
+    "while (!isDone(s)) { sum = sum + v; v = resume(s, nil); }\n"
+    "def deep(n) { if (n == 0) { return yield(100); } return deep(n - 1) + 1; }\n"
+    "var d = coroutine(deep);\n"
+    "var first = resume(d, 10);\n"
+    "var last = resume(d, 5);\n"
+    "var done = isDone(d);\n";
+
+static Value* readGlobal(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL);
+    return val;
+}
+
+static InterpretResult runAt(const char* source, int level) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    InterpretResult result = interpret(&vm, source);
+    freeVM(&vm);
+    return result;
+}
+
+//Tests resuming and yielding between coroutines and the errors around them
+int main(int argc, const char* argv[]) {
+    for(int level = 0; level <= 1; level++) {
+        VM vm;
+        initVM(&vm);
+        vm.optimizationLevel = level;
+        assert(interpret(&vm, script) == INTERPRET_OK);
+        assert(readGlobal(&vm, "sum")->as.number == 0 + 1 + 4 + 9 + 16);
+        assert(readGlobal(&vm, "first")->as.number == 100);
+        assert(readGlobal(&vm, "last")->as.number == 15);
+        assert(readGlobal(&vm, "done")->as.boolean);
+
+        //The main stack is back in use once every coroutine has finished
+        assert(vm.coroutine == NULL && vm.stack == vm.mainStack);
+        freeVM(&vm);
+
+        //Finished coroutines can not be resumed, running ones can not be resumed again
+        assert(runAt("def f(x) { return x; }\nvar c = coroutine(f);\nresume(c, 1);\nresume(c, 2);\n", level) == INTERPRET_RUNTIME_ERROR);
+        assert(runAt("var c = nil;\ndef f(x) { return resume(c, x); }\nc = coroutine(f);\nresume(c, 1);\n", level) == INTERPRET_RUNTIME_ERROR);
+        assert(runAt("yield(1);\n", level) == INTERPRET_RUNTIME_ERROR);
+        assert(runAt("def f(a, b) { return a; }\nvar c = coroutine(f);\n", level) == INTERPRET_RUNTIME_ERROR);
+    }
+
+    printf("coroutine ok\n");
+}
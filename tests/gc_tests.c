@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../gc.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//Churns through garbage while a list grows in a global, and moves a struct between globals so only the write barrier keeps it found.
+//The recent list lives long enough to leave the nursery, so the old generation fills with garbage too.
+//The scripts keep their garbage in a global, since the optimizer replaces structs that stay in a local by their fields.
+static const char* churn =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "struct Node(value, next) { var value = value; var next = next; }\n"
+    "var list = nil;\n"
+    "var recent = nil;\n"
+    "var a = P(1, \"kept\" + \"!\");\n"
+    "var b = nil;\n"
+    "var junk = nil;\n"
+    "var i = 0;\n"
+    "while (i < 100000) {\n"
+    "  junk = P(i, P(i, i));\n"
+    "  recent = Node(i, recent);\n"
+    "  if (i / 5000 * 5000 == i) { recent = nil; }\n"
+    "  if (i / 100 * 100 == i) { list = Node(i, list); }\n"
+    "  b = a; a = nil; a = b; b = nil;\n"
+    "  i = i + 1;\n"
+    "}\n"
+    "var sum = 0;\n"
+    "var n = list;\n"
+    "while (!(n == nil)) { sum = sum + n.value; n = n.next; }\n"
+    "var kept = a.y;\n";
+
+//A struct only a suspended coroutine's stack refers to
+static const char* suspended =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "var junk = nil;\n"
+    "var recent = nil;\n"
+    "def gen(n) {\n"
+    "  var held = P(n, \"held\" + \"!\");\n"
+    "  var i = 0;\n"
+    "  while (i < 30000) {\n"
+    "    junk = P(i, P(i, i)); recent = P(i, recent);\n"
+    "    if (i / 5000 * 5000 == i) { recent = nil; }\n"
+    "    yield(held.x + i); i = i + 1;\n"
+    "  }\n"
+    "  return held;\n"
+    "}\n"
+    "var c = coroutine(gen);\n"
+    "var total = 0;\n"
+    "var r = resume(c, 7);\n"
+    "while (!isDone(c)) { total = total + r; r = resume(c, nil); }\n"
+    "var heldName = r.y;\n";
+
+//Fibers parked by the event loop with structs on their stacks
+static const char* fibers =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "var done = 0;\n"
+    "var recent = nil;\n"
+    "def worker(n) {\n"
+    "  var mine = P(n, \"w\" + \"k\");\n"
+    "  var i = 0;\n"
+    "  while (i < 5000) {\n"
+    "    var junk = P(i, mine); recent = P(i, recent);\n"
+    "    if (i / 1000 * 1000 == i) { recent = nil; }\n"
+    "    yield(junk); i = i + 1;\n"
+    "  }\n"
+    "  done = done + mine.x;\n"
+    "  return nil;\n"
+    "}\n"
+    "var k = 0;\n"
+    "while (k < 10) { spawn(worker, k); k = k + 1; }\n"
+    "runLoop();\n";
+
+//A struct only a running task still uses
+static const char* task =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "def work(p) {\n"
+    "  var i = 0; var t = 0;\n"
+    "  while (i < 20000) { var junk = P(i, i); t = t + p.x; i = i + 1; }\n"
+    "  return t + p.y.x;\n"
+    "}\n"
+    "var shared = P(3, P(4, \"name\" + \"!\"));\n"
+    "var t = spawnTask(work, shared);\n"
+    "shared = nil;\n"
+    "var junk = nil;\n"
+    "var recent = nil;\n"
+    "var i = 0;\n"
+    "while (i < 50000) {\n"
+    "  junk = P(i, P(i, i)); recent = P(i, recent);\n"
+    "  if (i / 5000 * 5000 == i) { recent = nil; }\n"
+    "  i = i + 1;\n"
+    "}\n"
+    "var result = join(t);\n";
+
+//Young strings made from the same pieces, each compared to a constant and to the last one
+static const char* young =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "var same = 0;\n"
+    "var last = nil;\n"
+    "var i = 0;\n"
+    "while (i < 20000) {\n"
+    "  var s = \"ab\" + \"c\";\n"
+    "  if (s == \"abc\" and s == last) { same = same + 1; }\n"
+    "  last = P(s, i).x;\n"
+    "  i = i + 1;\n"
+    "}\n";
+
+//Strings that are dropped as soon as the next one is made
+static const char* strings =
+    "var s = \"\";\n"
+    "var i = 0;\n"
+    "while (i < 2000) { s = s + \"x\"; i = i + 1; }\n";
+
+//A binary tree, wide enough that marking it leaves many gray objects to share between threads
+static const char* tree =
+    "struct T(left, right) { var left = left; var right = right; }\n"
+    "def make(depth) {\n"
+    "  if (depth == 0) { return nil; }\n"
+    "  return T(make(depth - 1), make(depth - 1));\n"
+    "}\n"
+    "def count(t) {\n"
+    "  if (t == nil) { return 0; }\n"
+    "  return 1 + count(t.left) + count(t.right);\n"
+    "}\n"
+    "var root = make(14);\n";
+
+static Value* readGlobal(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL);
+    return val;
+}
+
+//Starts a VM whose collector begins early and works in the shortest slices, so every cycle is spread over many
+static void initEagerVM(VM* vm, int level, int threads) {
+    initVM(vm);
+    vm->optimizationLevel = level;
+    vm->gc.threads = threads;
+    vm->gc.threshold = 64 * 1024;
+    vm->gc.pauseTarget = 1;
+}
+
+static bool isString(Value value, const char* expected) {
+    return IS_STRING(value) && strcmp(((ObjString*)value.as.obj)->string, expected) == 0;
+}
+
+//Sums the bytes of an arena, to tell whether anything wrote to it
+static uint64_t checksum(Arena* arena) {
+    uint64_t sum = 0;
+    for(size_t i = 0; i < arena->size; i++) {
+        sum = sum * 31 + (unsigned char)arena->start[i];
+    }
+    return sum;
+}
+
+//Tests that the incremental collector frees garbage and nothing reachable, marking and sweeping on one thread and on several
+int main(int argc, const char* argv[]) {
+    size_t kept[2] = {0, 0};
+    for(int run = 0; run < 4; run++) {
+        int threads = run < 2 ? 1 : 4;
+        int level = run % 2;
+        VM vm;
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, churn) == INTERPRET_OK);
+        assert(readGlobal(&vm, "sum")->as.number == 49950000);
+        assert(isString(*readGlobal(&vm, "kept"), "kept!"));
+        assert(vm.gc.cycles > 1);
+        assert(vm.gc.allocated < 4 * GC_MIN_HEAP);
+
+        //Every slice is counted once in the histogram
+        uint64_t counted = 0;
+        for(int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+            counted += vm.gc.pauses[i];
+        }
+        assert(counted == vm.gc.slices && vm.gc.longestPause > 0);
+
+        //Most of what the loop made died young, and nothing young is left once it returned
+        assert(vm.gc.minors > 0 && vm.gc.promotedBytes < vm.gc.youngBytes / 2);
+        assert(vm.gc.nurseryTop == vm.gc.nursery);
+
+        //Once the lists are dropped a full collection leaves almost nothing
+        assert(interpret(&vm, "list = nil; recent = nil;\n") == INTERPRET_OK);
+        collectGarbage(&vm);
+        assert(vm.gc.phase == GC_IDLE && vm.gc.allocated < 4096);
+        assert(isString(*readGlobal(&vm, "kept"), "kept!"));
+
+        //Several threads keep exactly what one does, and the helpers did some of the work
+        assert(threads == 1 || (vm.gc.job > 0 && vm.gc.helperCount == 3));
+        if(threads == 1) {
+            kept[level] = vm.gc.allocated;
+        }
+        assert(vm.gc.allocated == kept[level]);
+        freeVM(&vm);
+
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, suspended) == INTERPRET_OK);
+        assert(readGlobal(&vm, "total")->as.number == 450195000);
+        assert(isString(*readGlobal(&vm, "heldName"), "held!"));
+        assert(vm.gc.cycles > 1);
+        freeVM(&vm);
+
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, fibers) == INTERPRET_OK);
+        assert(readGlobal(&vm, "done")->as.number == 45);
+        assert(vm.gc.cycles > 1);
+        freeVM(&vm);
+
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, task) == INTERPRET_OK);
+        assert(readGlobal(&vm, "result")->as.number == 60004);
+        assert(vm.gc.cycles > 1);
+        freeVM(&vm);
+
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, young) == INTERPRET_OK);
+        assert(readGlobal(&vm, "same")->as.number == 19999);
+        assert(vm.gc.minors > 0);
+        freeVM(&vm);
+
+        //Every node survives a full collection, which frees them all once the tree is dropped
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, tree) == INTERPRET_OK);
+        collectGarbage(&vm);
+        assert(interpret(&vm, "var n = count(root);\n") == INTERPRET_OK);
+        assert(readGlobal(&vm, "n")->as.number == 16383);
+        assert(interpret(&vm, "root = nil;\n") == INTERPRET_OK);
+        collectGarbage(&vm);
+        assert(vm.gc.allocated < 4096);
+        freeVM(&vm);
+
+        //Compacting moves the tree and a string into an arena, which cycles and minor collections never write to after
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, tree) == INTERPRET_OK);
+        assert(interpret(&vm, "var name = \"ro\" + \"ad\";\n") == INTERPRET_OK);
+        assert(compactHeap(&vm));
+        assert(vm.gc.arenaCount == 1);
+        assert(readGlobal(&vm, "root")->as.obj->mark == MARK_FROZEN);
+        assert(readGlobal(&vm, "name")->as.obj->mark == MARK_FROZEN);
+        uint64_t sum = checksum(&vm.gc.arenas[0]);
+        assert(interpret(&vm, churn) == INTERPRET_OK);
+        collectGarbage(&vm);
+        assert(interpret(&vm, "var n = count(root);\n") == INTERPRET_OK);
+        assert(readGlobal(&vm, "n")->as.number == 16383);
+        assert(isString(*readGlobal(&vm, "name"), "road"));
+        assert((Obj*)copyString(&vm, "road", 4) == readGlobal(&vm, "name")->as.obj);
+        assert(checksum(&vm.gc.arenas[0]) == sum);
+        assert(interpret(&vm, "root = nil; name = nil; list = nil; recent = nil;\n") == INTERPRET_OK);
+        collectGarbage(&vm);
+        assert(vm.gc.allocated < 4096);
+        freeVM(&vm);
+
+        //Freed strings leave the intern table, and the one still used is found again
+        initEagerVM(&vm, level, threads);
+        assert(interpret(&vm, strings) == INTERPRET_OK);
+        collectGarbage(&vm);
+        assert(vm.strings.count < 16);
+        Value* s = readGlobal(&vm, "s");
+        char* text = ((ObjString*)s->as.obj)->string;
+        assert((Obj*)copyString(&vm, text, strlen(text)) == s->as.obj);
+        freeVM(&vm);
+    }
+
+    printf("gc ok\n");
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../gc.h"
+#include "../heap.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//A list only one global reaches, a struct two others share and garbage that is gone by the time the heap is counted
+static const char* script =
+    "struct Node(value, next) { var value = value; var next = next; }\n"
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "var list = nil;\n"
+    "var i = 0;\n"
+    "while (i < 1000) { list = Node(P(i, i), list); i = i + 1; }\n"
+    "var shared = P(\"sh\" + \"ard\", 0);\n"
+    "var a = Node(shared, nil);\n"
+    "var b = Node(shared, nil);\n"
+    "shared = nil;\n"
+    "var junk = nil;\n"
+    "i = 0;\n"
+    "while (i < 5000) { junk = P(i, i); i = i + 1; }\n"
+    "junk = nil;\n";
+
+static Obj* readGlobal(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && val->type == VALUE_OBJ);
+    return val->as.obj;
+}
+
+static HeapCount* findStruct(HeapStats* stats, const char* name) {
+    for(int i = 0; i < stats->structCount; i++) {
+        if(strcmp(stats->structs[i].name, name) == 0) {
+            return &stats->structs[i];
+        }
+    }
+    return NULL;
+}
+
+//Checks the sizes each global retains
+static void checkSnapshot(VM* vm, size_t total) {
+    size_t structBytes = sizeof(ObjStruct) + 2 * sizeof(Value);
+    HeapSnapshot snapshot;
+    takeHeapSnapshot(vm, &snapshot);
+    //Every node and the sizes of them all are reached from the roots
+    assert(snapshot.nodes[0].retained == total);
+
+    //The list holds a Node and a P for each element
+    int list = findHeapNode(vm, readGlobal(vm, "list"));
+    assert(list > 0 && snapshot.nodes[list].dominator == 0);
+    assert(snapshot.nodes[list].retained == 1000 * 2 * structBytes);
+
+    //Neither of the two Nodes sharing a struct retains it or its string, so the roots do
+    int a = findHeapNode(vm, readGlobal(vm, "a"));
+    int shared = findHeapNode(vm, ((ObjStruct*)readGlobal(vm, "a"))->fields[0].as.obj);
+    assert(snapshot.nodes[a].retained == structBytes);
+    assert(snapshot.nodes[shared].dominator == 0);
+    assert(snapshot.nodes[shared].retained > structBytes);
+
+    //The roots' edges are named by the globals
+    bool named = false;
+    for(int i = 0; i < snapshot.edgeStarts[1]; i++) {
+        if(snapshot.edges[i] == list) {
+            named = strcmp(snapshot.rootNames[i], "list") == 0;
+        }
+    }
+    assert(named);
+
+    FILE* out = tmpfile();
+    writeHeapSnapshot(&snapshot, out);
+    long length = ftell(out);
+    char* json = (char*)malloc(length + 1);
+    rewind(out);
+    assert(fread(json, 1, length, out) == (size_t)length);
+    json[length] = '\0';
+    fclose(out);
+    assert(strncmp(json, "{\"nodes\": [", 11) == 0);
+    assert(strstr(json, "\"type\": \"String\", \"name\": \"shard\"") != NULL);
+    assert(strstr(json, "{\"name\": \"list\", \"id\": ") != NULL);
+    free(json);
+    freeHeapSnapshot(&snapshot);
+}
+
+//Tests the counts and retained sizes of a heap, before and after it is compacted
+int main(int argc, const char* argv[]) {
+    for(int level = 0; level < 2; level++) {
+        VM vm;
+        initVM(&vm);
+        vm.optimizationLevel = level;
+        assert(interpret(&vm, script) == INTERPRET_OK);
+
+        HeapStats stats;
+        takeHeapStats(&vm, &stats);
+        //The garbage was collected first, so only the live structs are counted
+        HeapCount* node = findStruct(&stats, "Node");
+        HeapCount* p = findStruct(&stats, "P");
+        assert(node != NULL && node->count == 1002);
+        assert(p != NULL && p->count == 1001);
+        assert(stats.structCount == 2 && stats.structs[0].bytes >= stats.structs[1].bytes);
+        assert(stats.types[OBJ_STRUCT].count == 2003);
+        assert(stats.types[OBJ_STRUCT].bytes == node->bytes + p->bytes);
+        assert(stats.objects == stats.slotsUsed && stats.bytes > stats.permanentBytes);
+        assert(strcmp(stats.tables[1].name, "globals") == 0);
+        assert(stats.tables[1].count == vm.table.count && stats.tables[1].capacity == vm.table.capacity);
+        assert(stats.tables[0].count == vm.strings.count);
+        size_t total = stats.bytes;
+        freeHeapStats(&stats);
+
+        checkSnapshot(&vm, total);
+        assert(compactHeap(&vm));
+        checkSnapshot(&vm, total);
+        freeVM(&vm);
+    }
+
+    //Scripts can write a snapshot of their own heap
+    char path[] = "/tmp/heap_testsXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    char source[256];
+    snprintf(source, sizeof(source), "var list = nil;\nvar written = heapSnapshot(\"%s\");\n", path);
+    VM vm;
+    initVM(&vm);
+    assert(interpret(&vm, source) == INTERPRET_OK);
+    Value* written = get(&vm.table, copyString(&vm, "written", 7));
+    assert(written != NULL && written->type == VALUE_BOOL && written->as.boolean);
+    FILE* file = fopen(path, "r");
+    assert(file != NULL && fgetc(file) == '{');
+    fclose(file);
+    remove(path);
+    assert(interpret(&vm, "heapSnapshot(1);\n") == INTERPRET_RUNTIME_ERROR);
+    freeVM(&vm);
+
+    printf("heap ok\n");
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../gc.h"
+#include "../image.h"
+#include "../memory.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//Structs, functions and data of every kind an image holds, some of it referring to built-in natives and a host's own
+static const char* prelude =
+    "struct Point(x, y) { var x = x; var y = y; }\n"
+    "struct Node(value, next) { var value = value; var next = next; }\n"
+    "def add(a, b) { return Point(a.x + b.x, a.y + b.y); }\n"
+    "def build(n) { var list = nil; var i = 0; while (i < n) { list = Node(i, list); i = i + 1; } return list; }\n"
+    "def sum(list) { var s = 0; while (!(list == nil)) { s = s + list.value; list = list.next; } return s; }\n"
+    "def length(s) { return stringLength(s); }\n"
+    "var origin = Point(1, 2);\n"
+    "var names = Node(\"alpha\", Node(\"be\" + \"ta\", nil));\n"
+    "var numbers = build(1000);\n"
+    "var buf = int32Buffer(8);\n"
+    "var sized = bufLength;\n"
+    "var answer = 42;\n";
+
+static const char* check =
+    "var total = sum(numbers);\n"
+    "var p = add(origin, Point(3, 4));\n"
+    "var xy = p.x * 10 + p.y;\n"
+    "var second = names.next.value == \"beta\";\n"
+    "var typed = isPoint(p) and !isNode(p);\n"
+    "var size = sized(buf) + length(\"four\");\n";
+
+static char path[] = "/tmp/image_testsXXXXXX";
+
+static bool stringLengthNative(VM* vm, int argCount, Value* args, Value* result) {
+    *result = MAKE_NUM(((ObjString*)args[0].as.obj)->length);
+    return true;
+}
+
+static double readNumber(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && val->type == VALUE_NUM);
+    return val->as.number;
+}
+
+static bool readBool(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && val->type == VALUE_BOOL);
+    return val->as.boolean;
+}
+
+//Checks that the globals of the prelude work as if it had run in vm
+static void checkPrelude(VM* vm) {
+    assert(interpret(vm, check) == INTERPRET_OK);
+    assert(readNumber(vm, "total") == 999 * 1000 / 2);
+    assert(readNumber(vm, "xy") == 46);
+    assert(readBool(vm, "second") && readBool(vm, "typed"));
+    assert(readNumber(vm, "size") == 12);
+    assert(readNumber(vm, "answer") == 42);
+}
+
+static void initHost(VM* vm, int level) {
+    initVM(vm);
+    vm->optimizationLevel = level;
+    defineNative(vm, "stringLength", stringLengthNative, 1);
+}
+
+//Frees the VM and checks every piece of memory charged to it was given back
+static void freeAndCheck(VM* vm) {
+    freeVM(vm);
+    for(int i = 0; i < MEMORY_KINDS; i++) {
+        assert(vm->memory.kindBytes[i] == 0);
+    }
+}
+
+//Tests that a VM loaded from an image runs like the one that wrote it, collects what it drops and can be written again
+static void testRoundTrip(int level) {
+    VM writer;
+    initHost(&writer, level);
+    assert(interpret(&writer, prelude) == INTERPRET_OK);
+    assert(saveImage(&writer, path));
+    freeAndCheck(&writer);
+
+    VM vm;
+    initHost(&vm, level);
+    //Strings the VM already has, names of globals among them, take the place of the image's
+    assert(interpret(&vm, "var known = \"alpha\";\nvar numbers = 5;\n") == INTERPRET_OK);
+    assert(loadImage(&vm, path));
+    checkPrelude(&vm);
+    ObjString* alpha = copyString(&vm, "alpha", 5);
+    Value* names = get(&vm.table, copyString(&vm, "names", 5));
+    assert(((ObjStruct*)names->as.obj)->fields[0].as.obj == (Obj*)alpha);
+
+    //Image objects nothing refers to any more are swept, and the rest survive collections and compaction
+    assert(interpret(&vm, "numbers = nil;\nvar i = 0;\nwhile (i < 200000) { var junk = Node(i, i); i = i + 1; }\nnumbers = build(1000);\n") == INTERPRET_OK);
+    collectGarbage(&vm);
+    assert(compactHeap(&vm));
+    checkPrelude(&vm);
+
+    //An image of a VM loaded from one holds the same
+    assert(saveImage(&vm, path));
+    freeAndCheck(&vm);
+    initHost(&vm, level);
+    assert(loadImage(&vm, path));
+    checkPrelude(&vm);
+    freeAndCheck(&vm);
+}
+
+//Saves an image of source and interprets script in a VM loaded from it, returning the number in its global result
+static double runOnImage(const char* source, const char* script, int level) {
+    VM vm;
+    initHost(&vm, level);
+    assert(interpret(&vm, source) == INTERPRET_OK);
+    assert(saveImage(&vm, path));
+    freeAndCheck(&vm);
+    initHost(&vm, level);
+    assert(loadImage(&vm, path));
+    assert(interpret(&vm, script) == INTERPRET_OK);
+    double result = readNumber(&vm, "result");
+    freeAndCheck(&vm);
+    return result;
+}
+
+//Tests that calls the image or the script bound statically follow globals that the other binds again
+static void testRebound(int level) {
+    const char* functions =
+        "def one() { return 1; }\n"
+        "def two() { return 2; }\n"
+        "def f() { return 1; }\n"
+        "def setF(g) { f = g; return nil; }\n"
+        "def h() { return one() * 10; }\n";
+    assert(runOnImage(functions, "var a = f();\nsetF(two);\nvar result = a * 10 + f();\n", level) == 12);
+    assert(runOnImage(functions, "var a = h();\none = two;\nvar result = a + h();\n", level) == 30);
+    assert(runOnImage(functions, "def one() { return 3; }\nvar result = h();\n", level) == 30);
+}
+
+//Tests what can not be written or loaded
+static void testRefused() {
+    VM vm;
+    initHost(&vm, 0);
+    assert(interpret(&vm, "def f(x) { return x; }\nvar co = coroutine(f);\n") == INTERPRET_OK);
+    assert(!saveImage(&vm, path));
+    assert(interpret(&vm, "co = nil;\n") == INTERPRET_OK);
+    assert(saveImage(&vm, path));
+    assert(!saveImage(&vm, "/nonexistent/image"));
+    freeAndCheck(&vm);
+
+    //The host's natives have to be defined first
+    initHost(&vm, 0);
+    assert(interpret(&vm, prelude) == INTERPRET_OK);
+    assert(saveImage(&vm, path));
+    freeAndCheck(&vm);
+    initVM(&vm);
+    assert(!loadImage(&vm, path));
+    freeAndCheck(&vm);
+
+    //Files that are not whole images are not loaded
+    FILE* file = fopen(path, "r+b");
+    assert(file != NULL);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    assert(ftruncate(fileno(file), size - 8) == 0);
+    fclose(file);
+    initHost(&vm, 0);
+    assert(!loadImage(&vm, path));
+    assert(!loadImage(&vm, "/nonexistent/image"));
+    file = fopen(path, "wb");
+    fputs("not an image, but long enough to hold the header of one", file);
+    fputs("not an image, but long enough to hold the header of one", file);
+    fclose(file);
+    assert(!loadImage(&vm, path));
+    assert(interpret(&vm, "var works = 1 + 1;\n") == INTERPRET_OK);
+    assert(readNumber(&vm, "works") == 2);
+    freeAndCheck(&vm);
+}
+
+int main(int argc, const char* argv[]) {
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    for(int level = 0; level < 2; level++) {
+        testRoundTrip(level);
+        testRebound(level);
+    }
+    testRefused();
+    remove(path);
+    printf("image ok\n");
+}
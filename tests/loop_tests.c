@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../loop.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+#define CLIENTS 200
+
+//Fibers sleeping at the same time, then clients and echo handlers on loopback sockets
+static const char* script =
+    "var order = 0;\n"
+    "def napper(id) { sleep(id * 20); order = order * 10 + id; return nil; }\n"
+    "spawn(napper, 3); spawn(napper, 1); spawn(napper, 2);\n"
+    "runLoop();\n"
+    "var server = listen(0);\n"
+    "var port = localPort(server);\n"
+    "def echo(fd) { var msg = read(fd, 64); while (!(msg == \"\")) { write(fd, msg); msg = read(fd, 64); } close(fd); return nil; }\n"
+    "def serve(n) { while (n > 0) { spawn(echo, accept(server)); n = n - 1; } return nil; }\n"
+    "var replies = 0;\n"
+    "def client(rounds) {\n"
+    "  var fd = connect(port);\n"
+    "  while (rounds > 0) { write(fd, \"ping\"); if (read(fd, 64) == \"ping\") { replies = replies + 1; } rounds = rounds - 1; }\n"
+    "  close(fd);\n"
+    "  return nil;\n"
+    "}\n"
+    "spawn(serve, clients);\n"
+    "var i = 0;\n"
+    "while (i < clients) { spawn(client, 5); i = i + 1; }\n"
+    "runLoop();\n";
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int readGlobal(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && IS_NUM((*val)));
+    return val->as.number;
+}
+
+static InterpretResult runScript(const char* source) {
+    VM vm;
+    initVM(&vm);
+    InterpretResult result = interpret(&vm, source);
+    freeVM(&vm);
+    return result;
+}
+
+//Tests fibers waiting on timers and sockets together
+int main(int argc, const char* argv[]) {
+    VM vm;
+    initVM(&vm);
+    char source[2048];
+    snprintf(source, sizeof(source), "var clients = %d;\n%s", CLIENTS, script);
+    double start = now();
+    assert(interpret(&vm, source) == INTERPRET_OK);
+    assert(readGlobal(&vm, "order") == 123);
+    assert(readGlobal(&vm, "replies") == CLIENTS * 5);
+    //The sleeps overlap instead of adding up to 120ms
+    assert(now() - start < 0.110);
+    assert(vm.loop->pending == 0 && vm.loop->readyCount == 0 && !vm.loop->running);
+
+    //Outside the loop the same natives block, and a failed operation is nil
+    assert(interpret(&vm,
+        "var f = openFile(\"loop_tests.tmp\", \"w\");\n"
+        "var written = write(f, \"hello\");\n"
+        "close(f);\n"
+        "f = openFile(\"loop_tests.tmp\", \"r\");\n"
+        "var same = read(f, 100) == \"hello\" and read(f, 100) == \"\";\n"
+        "close(f);\n"
+        "var refused = connect(1) == nil;\n") == INTERPRET_OK);
+    remove("loop_tests.tmp");
+    assert(readGlobal(&vm, "written") == 5);
+    assert(IS_TRUE((*get(&vm.table, copyString(&vm, "same", 4)))));
+    assert(IS_TRUE((*get(&vm.table, copyString(&vm, "refused", 7)))));
+
+    //An error in a fiber stops the loop, and the next run starts with it empty
+    assert(interpret(&vm, "def f(x) { sleep(1000); return nil; }\ndef g(x) { return x + nil; }\nspawn(f, 1); spawn(g, 1);\nrunLoop();\n") == INTERPRET_RUNTIME_ERROR);
+    assert(interpret(&vm, "runLoop();\n") == INTERPRET_OK);
+    freeVM(&vm);
+
+    //Fibers belong to the loop, which only runs from the main stack
+    assert(runScript("def f(x) { sleep(10); return nil; }\nvar a = spawn(f, 1);\ndef g(x) { return resume(a, 1); }\nspawn(g, 1);\nrunLoop();\n") == INTERPRET_RUNTIME_ERROR);
+    assert(runScript("def f(x) { return runLoop(); }\nvar c = coroutine(f);\nresume(c, 1);\n") == INTERPRET_RUNTIME_ERROR);
+
+    printf("loop ok\n");
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../gc.h"
+#include "../memory.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+#define LIMIT (4 << 20)
+
+static const char* structs =
+    "struct Node(value, next) { var value = value; var next = next; }\n"
+    "def build(n) { var list = nil; var i = 0; while (i < n) { list = Node(i, list); i = i + 1; } return list; }\n";
+
+static long long bytesOf(VM* vm, MemoryKind kind) {
+    return (long long)vm->memory.kindBytes[kind];
+}
+
+//Frees the VM and checks every piece of memory charged to it was given back
+static void freeAndCheck(VM* vm) {
+    freeVM(vm);
+    for(int i = 0; i < MEMORY_KINDS; i++) {
+        assert(bytesOf(vm, i) == 0);
+    }
+}
+
+//A VM with the structs defined and, if limit is not 0, that much memory
+static void initLimited(VM* vm, size_t limit, int level) {
+    initVM(vm);
+    vm->optimizationLevel = level;
+    vm->memory.limit = limit;
+    assert(interpret(vm, structs) == INTERPRET_OK);
+}
+
+//Tests what is counted and that it all comes back
+static void testCounting(int level) {
+    VM vm;
+    initLimited(&vm, 0, level);
+    assert(interpret(&vm, "var list = build(10000);\nvar i = 0;\nwhile (i < 100000) { var junk = Node(i, i); i = i + 1; }\n") == INTERPRET_OK);
+    collectGarbage(&vm);
+    long long sum = 0;
+    for(int i = 0; i < MEMORY_KINDS; i++) {
+        sum += bytesOf(&vm, i);
+    }
+    assert(sum == vm.memory.bytes);
+    assert(vm.memory.peak >= vm.memory.bytes);
+    //The list alone needs this much, and the garbage was allocated too
+    long long structBytes = sizeof(ObjStruct) + 2 * sizeof(Value);
+    assert(bytesOf(&vm, MEMORY_OBJECTS) >= 10000 * structBytes);
+    assert(vm.memory.allocations[MEMORY_OBJECTS] > 10000);
+    assert(bytesOf(&vm, MEMORY_TABLES) > 0 && bytesOf(&vm, MEMORY_COLLECTOR) > 0);
+
+    //Dropping the list gives back its memory once it is collected
+    long long held = vm.memory.bytes;
+    assert(interpret(&vm, "list = nil;\n") == INTERPRET_OK);
+    collectGarbage(&vm);
+    assert(vm.memory.bytes < held - 10000 * structBytes);
+    assert(vm.memory.peak >= held);
+
+    //Compacting moves objects into an arena, charged to the collector
+    assert(interpret(&vm, "list = build(5000);\n") == INTERPRET_OK);
+    assert(compactHeap(&vm));
+    assert(interpret(&vm, "list = nil;\nvar s = \"ab\" + \"cd\";\n") == INTERPRET_OK);
+    collectGarbage(&vm);
+    freeAndCheck(&vm);
+}
+
+//Tests that passing the limit stops the program and leaves the VM usable
+static void testLimit(int level) {
+    VM vm;
+    initLimited(&vm, LIMIT, level);
+    assert(interpret(&vm, "var list = build(1000000);\n") == INTERPRET_RUNTIME_ERROR);
+    //The limit is checked every step, and a minor collection may promote a whole nursery in between
+    assert(vm.memory.bytes <= LIMIT + GC_NURSERY + GC_STEP);
+    assert(interpret(&vm, "var small = build(100);\nvar count = 0;\nwhile (!(small == nil)) { count = count + 1; small = small.next; }\n") == INTERPRET_OK);
+    Value* count = get(&vm.table, copyString(&vm, "count", 5));
+    assert(count != NULL && count->as.number == 100);
+
+    //Garbage is collected rather than counted against the limit
+    assert(interpret(&vm, "var i = 0;\nwhile (i < 1000000) { var junk = Node(i, i); i = i + 1; }\n") == INTERPRET_OK);
+
+    //Allocations too large to make are refused before they are made
+    assert(interpret(&vm, "var b = int64Buffer(10000000);\n") == INTERPRET_RUNTIME_ERROR);
+    assert(vm.memory.bytes < LIMIT);
+    assert(interpret(&vm, "var s = \"ab\";\nwhile (true) { s = s + s; }\n") == INTERPRET_RUNTIME_ERROR);
+    assert(vm.memory.bytes <= LIMIT + GC_NURSERY + GC_STEP);
+    freeAndCheck(&vm);
+}
+
+//Tests that natives making a buffer from others are refused before they pass the limit
+static void testDerivedBuffers() {
+    const char* derived[] = {
+        "bufAdd(a, m)", "bufMul(a, m)", "bufScale(a, 2)", "bufFilter(a, m)",
+        "bufPrefixSum(a)", "bufGreater(a, 1)", "bufLess(a, 1)",
+    };
+    VM vm;
+    initLimited(&vm, 1 << 20, 0);
+    assert(interpret(&vm, "var a = int32Buffer(100000);\nvar m = int32Buffer(100000);\n") == INTERPRET_OK);
+    for(int i = 0; i < 7; i++) {
+        char source[64];
+        snprintf(source, sizeof(source), "var out = %s;\n", derived[i]);
+        assert(interpret(&vm, source) == INTERPRET_RUNTIME_ERROR);
+        assert(vm.memory.peak <= 1 << 20);
+    }
+    assert(interpret(&vm, "var total = bufSum(a);\n") == INTERPRET_OK);
+    freeAndCheck(&vm);
+}
+
+//Tests that what tasks allocate counts against the VM spawning them
+static void testTasks() {
+    VM vm;
+    initLimited(&vm, 0, 0);
+    assert(interpret(&vm, "def length(n) { var list = build(n); var count = 0; while (!(list == nil)) { count = count + 1; list = list.next; } return count; }\n"
+                          "var count = join(spawnTask(length, 20000));\n") == INTERPRET_OK);
+    Value* count = get(&vm.table, copyString(&vm, "count", 5));
+    assert(count != NULL && count->as.number == 20000);
+    //The task's list was in the parent's peak, and went with the task
+    long long structBytes = sizeof(ObjStruct) + 2 * sizeof(Value);
+    assert(vm.memory.peak >= 20000 * structBytes);
+    assert(bytesOf(&vm, MEMORY_OBJECTS) < 20000 * structBytes);
+
+    //A task that grows past its parent's limit stops, and so does the join
+    vm.memory.limit = LIMIT;
+    assert(interpret(&vm, "var endless = join(spawnTask(length, 1000000));\n") == INTERPRET_RUNTIME_ERROR);
+    assert(interpret(&vm, "count = join(spawnTask(length, 100));\n") == INTERPRET_OK);
+    count = get(&vm.table, copyString(&vm, "count", 5));
+    assert(count != NULL && count->as.number == 100);
+    freeAndCheck(&vm);
+}
+
+int main(int argc, const char* argv[]) {
+    for(int level = 0; level < 2; level++) {
+        testCounting(level);
+        testLimit(level);
+    }
+    testDerivedBuffers();
+    testTasks();
+    printf("memory ok\n");
+}
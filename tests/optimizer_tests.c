@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../chunk.h"
+#include "../compiler.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//Programs whose global result must come out the same with and without the optimizer
+static const char* programs[] = {
+    //Common subexpressions and copies
+    "def f(a, b) { var c = a; var t = (a + b) * (a + b); var u = c + b; return t + u; }\n"
+    "var result = f(3, 4);\n",
+    //Invariant expressions and calls in nested loops, with ifs jumping to the loop headers
+    "def sq(n) { return n * n; }\n"
+    "def f(a) {\n"
+    "  var i = 0; var s = 0;\n"
+    "  if (a > 1) { s = 1; }\n"
+    "  while (i < a * 2) {\n"
+    "    var j = 0;\n"
+    "    while (j < a + 1) { s = s + sq(i) + sq(a); j = j + 1; }\n"
+    "    i = i + 1;\n"
+    "  }\n"
+    "  return s;\n"
+    "}\n"
+    "var result = f(3);\n",
+    //Dead stores and stores that are read on only one path
+    "def f(a) { var x = 1; x = 2; var y = a; if (a > 2) { y = 5; } x = 3; return x * 100 + y; }\n"
+    "var result = f(1) + f(4);\n",
+    //Globals assigned inside the loop must be read every time
+    "var g = 0; var n = 0;\n"
+    "def bump() { g = g + 1; return g; }\n"
+    "while (n < 5) { n = n + bump() * 0 + 1; }\n"
+    "g = 10; g = 20;\n"
+    "var result = g + n;\n",
+    //Struct fields, predicates and short circuits
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "def f(p) { var s = 0; var i = 0; while (i < 3 and isP(p)) { s = s + p.x * p.y + p.x * p.y; i = i + 1; } return s; }\n"
+    "var result = f(P(2, 5));\n",
+    //A function name rebound at the top level is not constant
+    "def one() { return 1; }\n"
+    "def two() { return 2; }\n"
+    "def f() { var i = 0; var s = 0; while (i < 4) { s = s + one(); i = i + 1; } return s; }\n"
+    "var a = f();\n"
+    "one = two;\n"
+    "var result = a * 10 + f();\n",
+    //Predicates, accessors and small functions inlined at their calls
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "def getX(p) { return p.x; }\n"
+    "def scale(a, b) { return a * b + 1; }\n"
+    "def f(p) { if (isP(p) and !isP(3)) { return scale(getX(p), p.y); } return 0; }\n"
+    "var result = f(P(4, 5)) + scale(2, scale(1, 1));\n",
+    //Recursive calls bound straight to the function
+    "def fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }\n"
+    "var result = fib(10);\n",
+    //Struct locals that only have their fields read, next to ones that escape
+    "struct P(a, b) { var x = a; var y = b; var z = x; }\n"
+    "def sum(p) { return p.x + p.y; }\n"
+    "def f(n) {\n"
+    "  var s = 0; var i = 0;\n"
+    "  while (i < n) { var p = P(i, 2); var k = 3; if (isP(p)) { s = s + p.x * k + p.y + p.z; } i = i + 1; }\n"
+    "  var q = P(1, 1); var r = P(5, 6); r = q;\n"
+    "  return s + sum(q) + r.y;\n"
+    "}\n"
+    "var result = f(4);\n",
+    //Types known from literals, constructors and guards, where structs of the same fields keep them in different orders
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "struct Q(y, x) { var y = y; var x = x; var z = 1; }\n"
+    "def sq(n) { return n * n; }\n"
+    "def walk(n) {\n"
+    "  var s = 0; var i = 0; var p = nil; var g = sq;\n"
+    "  while (i < n) {\n"
+    "    if (i < 3) { p = P(i, 2); } else { p = Q(i, 3); }\n"
+    "    if (isQ(p)) { s = s + p.x * 10; } else { s = s + p.y; }\n"
+    "    var q = P(i * 2, i); var r = q;\n"
+    "    s = s + r.x - r.y + g(0);\n"
+    "    i = i + 1;\n"
+    "  }\n"
+    "  return s;\n"
+    "}\n"
+    "var result = walk(6);\n",
+};
+
+//Calls the same functions as programs[6], but getX is rebound so its calls stay calls
+static const char* rebound =
+    "struct P(x, y) { var x = x; var y = y; }\n"
+    "def getX(p) { return p.x; }\n"
+    "def scale(a, b) { return a * b + 1; }\n"
+    "def f(p) { if (isP(p) and !isP(3)) { return scale(getX(p), p.y); } return 0; }\n"
+    "def getX(p) { return p.y; }\n"
+    "var result = f(P(4, 5)) + scale(2, scale(1, 1));\n";
+
+//Runs source at the given optimization level and returns the number in its global result
+static int run(const char* source, int level) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    assert(interpret(&vm, source) == INTERPRET_OK);
+    Value* result = get(&vm.table, copyString(&vm, "result", 6));
+    assert(result != NULL && IS_NUM((*result)));
+    int number = result->as.number;
+    freeVM(&vm);
+    return number;
+}
+
+//Interprets first and then second on one VM at the given optimization level and returns the number in its global result
+static int runBoth(const char* first, const char* second, int level) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    assert(interpret(&vm, first) == INTERPRET_OK);
+    assert(interpret(&vm, second) == INTERPRET_OK);
+    Value* result = get(&vm.table, copyString(&vm, "result", 6));
+    assert(result != NULL && IS_NUM((*result)));
+    int number = result->as.number;
+    freeVM(&vm);
+    return number;
+}
+
+//Returns how many structs running source makes
+static int structsAllocated(const char* source, int level) {
+    VM vm;
+    initVM(&vm);
+    //Without a collector every struct is made in the old generation and kept
+    vm.gc.enabled = false;
+    vm.optimizationLevel = level;
+    assert(interpret(&vm, source) == INTERPRET_OK);
+    int count = 0;
+    for(Obj* object = vm.objects; object != NULL; object = object->next) {
+        count += object->type == OBJ_STRUCT;
+    }
+    freeVM(&vm);
+    return count;
+}
+
+//Returns how many bytes of code the function named name compiles to
+static int functionSize(const char* source, const char* name, int level) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    Chunk chunk;
+    initChunk(&chunk);
+    assert(compile(&vm, source, strlen(source), &chunk));
+    Value* func = get(&vm.table, copyString(&vm, name, (int)strlen(name)));
+    int size = ((ObjFunc*)func->as.obj)->chunk->count;
+    freeChunk(&chunk);
+    freeVM(&vm);
+    return size;
+}
+
+int main(int argc, const char* argv[]) {
+    int count = sizeof(programs) / sizeof(programs[0]);
+    for(int i = 0; i < count; i++) {
+        assert(run(programs[i], 0) == run(programs[i], 1));
+    }
+    assert(run(programs[0], 1) == 56);
+    assert(run(programs[5], 1) == 48);
+    assert(run(programs[6], 0) == 26);
+    assert(run(rebound, 0) == 31);
+
+    //Inlined calls are smaller than calls
+    assert(functionSize(programs[6], "f", 0) < functionSize(rebound, "f", 0));
+
+    //Calls bound straight to a function skip the lookup, unless the name may be bound again
+    assert(run(programs[7], 0) == 55);
+    char fib[256];
+    snprintf(fib, sizeof(fib), "%svar fib = fib;\n", programs[7]);
+    assert(functionSize(programs[7], "fib", 0) + 2 == functionSize(fib, "fib", 0));
+
+    //A later interpret can bind again the functions earlier code calls directly or inlines, and earlier code can bind the functions a later one defines
+    const char* defines =
+        "def one() { return 1; }\n"
+        "def two() { return 2; }\n"
+        "def h() { return one(); }\n"
+        "def loop() { var i = 0; var s = 0; while (i < 3) { s = s + one() + one(); i = i + 1; } return s; }\n"
+        "struct P(x) { var v = one() + x; }\n"
+        "var result = h() + loop() + P(1).v;\n";
+    for(int level = 0; level < 2; level++) {
+        assert(run(defines, level) == 9);
+        assert(runBoth(defines, "one = two;\nvar result = h() + loop() + P(1).v;\n", level) == 17);
+        assert(runBoth(defines, "def one() { return 3; }\nvar result = h() + loop() + P(1).v;\n", level) == 25);
+        assert(runBoth("def one() { return 1; } def two() { return 2; } var f = one; def h() { return f(); }\n",
+                       "f = two;\nvar result = h();\n", level) == 2);
+        assert(runBoth("def two() { return 2; } def setK(g) { k = g; return nil; }\n",
+                       "def k() { return 1; } def h() { return k(); } setK(two);\nvar result = h();\n", level) == 2);
+    }
+
+    //Structs that never leave their function live on the stack, the two that escape stay on the heap
+    assert(run(programs[8], 0) == 35);
+    assert(structsAllocated(programs[8], 0) == 6);
+    assert(structsAllocated(programs[8], 1) == 2);
+
+    //The repeated sum and the dead store are gone
+    assert(functionSize(programs[0], "f", 1) < functionSize(programs[0], "f", 0));
+    assert(functionSize(programs[2], "f", 1) < functionSize(programs[2], "f", 0));
+
+    //Runtime errors still happen in optimized code
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = 1;
+    assert(interpret(&vm, "def f(a) { var x = a + 1; x = 2; return x; }\nvar r = f(nil);\n") == INTERPRET_RUNTIME_ERROR);
+    freeVM(&vm);
+
+    //Checks are only left out where every path proves the types
+    assert(run(programs[9], 1) == 111);
+    const char* unproven[] = {
+        "struct P(x, y) { var x = x; var y = y; }\ndef f(p) { var x = 1; if (isP(p)) { x = p.x; } return x + p; }\nvar r = f(nil);\n",
+        "struct P(x, y) { var x = x; var y = y; }\ndef f(a) { var s = P(1, 2); if (a > 0) { s = 3; } return s.x; }\nvar r = f(1);\n",
+        "def f(a) { var x = 1; var i = 0; while (i < 2) { x = x * 2; if (i == 1) { x = nil; } i = i + 1; } return x < a; }\nvar r = f(1);\n",
+    };
+    for(int i = 0; i < 3; i++) {
+        initVM(&vm);
+        vm.optimizationLevel = 1;
+        assert(interpret(&vm, unproven[i]) == INTERPRET_RUNTIME_ERROR);
+        freeVM(&vm);
+    }
+
+    printf("optimizer ok\n");
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../perf.h"
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//Recursion, a loop of calls, and a coroutine switching back and forth with the top level
+static const char* script =
+    "def fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }\n"
+    "def leaf(x) { if (x < 0) { return leaf(x + 1); } return x + 1; }\n"
+    "def spin(n) { var i = 0; var s = 0; while (i < n) { s = leaf(s); i = i + 1; } return s; }\n"
+    "def gen(n) { var i = 0; while (i < n) { yield(i); i = i + 1; } return nil; }\n"
+    "var c = coroutine(gen);\n"
+    "var v = resume(c, 4);\n"
+    "var t = 0;\n"
+    "while (!isDone(c)) { t = t + v; v = resume(c, nil); }\n"
+    "var result = fib(10) + spin(500) + t;\n";
+
+static double readNumber(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && val->type == VALUE_NUM);
+    return val->as.number;
+}
+
+//Checks that what the functions counted adds up to the totals, so nothing was counted twice or lost
+static void checkCharged(PerfCounters* perf) {
+    PerfCounts sum;
+    memset(&sum, 0, sizeof(sum));
+    for(int i = 0; i < perf->functionCapacity; i++) {
+        for(int j = 0; j < PERF_COUNTERS; j++) {
+            sum.counts[j] += perf->functions[i].self.counts[j];
+        }
+    }
+    for(int j = 0; j < PERF_COUNTERS; j++) {
+        assert(sum.counts[j] == perf->total.counts[j]);
+    }
+}
+
+//Tests the counts of each function, whichever counters the machine has
+static void testByFunction(int level) {
+    PerfCounters perf;
+    openPerfCounters(&perf, true);
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    vm.perf = &perf;
+    assert(interpret(&vm, script) == INTERPRET_OK);
+    assert(readNumber(&vm, "result") == 55 + 500 + 6);
+    assert(perf.runs == 1);
+
+    //fib(10) is called 177 times, the first from the top level
+    assert(findPerfFunction(&perf, "fib")->calls == 177);
+    assert(findPerfFunction(&perf, "spin")->calls == 1);
+    assert(findPerfFunction(&perf, "leaf")->calls == 500);
+    //A coroutine is switched to, not called
+    assert(findPerfFunction(&perf, "gen")->calls == 0);
+    assert(findPerfFunction(&perf, "<top level>") != NULL);
+    assert(findPerfFunction(&perf, "result") == NULL);
+    checkCharged(&perf);
+    if (hasPerfCounter(&perf, PERF_TASK_CLOCK)) {
+        assert(perf.total.counts[PERF_TASK_CLOCK] > 0);
+        assert(findPerfFunction(&perf, "fib")->self.counts[PERF_TASK_CLOCK] > 0);
+    }
+    if (hasPerfCounter(&perf, PERF_INSTRUCTIONS)) {
+        assert(findPerfFunction(&perf, "fib")->self.counts[PERF_INSTRUCTIONS] > 0);
+    }
+    freeVM(&vm);
+    closePerfCounters(&perf);
+}
+
+//Tests that each slice of a suspended run counts as a run, and only runs are counted
+static void testSlices() {
+    PerfCounters perf;
+    openPerfCounters(&perf, true);
+    VM vm;
+    initVM(&vm);
+    vm.perf = &perf;
+    vm.sliceTicks = 50;
+    int slices = 1;
+    InterpretResult status = interpret(&vm, script);
+    while (status == INTERPRET_SUSPENDED) {
+        status = sethiResume(&vm, NULL);
+        slices++;
+    }
+    assert(status == INTERPRET_OK && slices > 10);
+    assert(perf.runs == (uint64_t)slices);
+    assert(findPerfFunction(&perf, "fib")->calls == 177);
+    checkCharged(&perf);
+
+    //A VM without counters leaves them alone
+    PerfCounts before = perf.total;
+    vm.perf = NULL;
+    vm.sliceTicks = 0;
+    assert(interpret(&vm, "var more = fib(12);\n") == INTERPRET_OK);
+    assert(memcmp(&before, &perf.total, sizeof(PerfCounts)) == 0);
+    assert(findPerfFunction(&perf, "fib")->calls == 177);
+    freeVM(&vm);
+    closePerfCounters(&perf);
+}
+
+//Tests counting whole runs only
+static void testTotals() {
+    PerfCounters perf;
+    openPerfCounters(&perf, false);
+    VM vm;
+    initVM(&vm);
+    vm.perf = &perf;
+    assert(interpret(&vm, script) == INTERPRET_OK);
+    assert(interpret(&vm, "var again = fib(5);\n") == INTERPRET_OK);
+    assert(perf.runs == 2 && perf.functionCount == 0);
+    if (hasPerfCounter(&perf, PERF_TASK_CLOCK)) {
+        assert(perf.total.counts[PERF_TASK_CLOCK] > 0);
+    }
+    freeVM(&vm);
+    closePerfCounters(&perf);
+}
+
+int main(int argc, const char* argv[]) {
+    for(int level = 0; level < 2; level++) {
+        testByFunction(level);
+    }
+    testSlices();
+    testTotals();
+    printf("perf ok\n");
+}
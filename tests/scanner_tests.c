@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../scanner.h"
+#include <assert.h>
+
+//Scans source (not NUL terminated when copied into a larger buffer) and checks the next token
+static Token expectToken(Scanner* scanner, TokenType type, const char* lexeme, int line) {
+    Token token = scanToken(scanner);
+    assert(token.type == type);
+    if(lexeme != NULL) {
+        assert(token.length == (int)strlen(lexeme));
+        assert(memcmp(token.start, lexeme, token.length) == 0);
+    }
+    assert(token.line == line);
+    return token;
+}
+
+static void scanOne(const char* source, TokenType type) {
+    Scanner scanner;
+    initScanner(&scanner, source, strlen(source));
+    expectToken(&scanner, type, source, 1);
+    expectToken(&scanner, TOKEN_EOF, NULL, 1);
+}
+
+int main(int argc, const char* argv[]) {
+    //Every keyword has its own slot in the keyword hash
+    const char* keywords[] = {"if", "for", "while", "true", "false", "print", "nil", "var", "else", "and", "or", "def", "return", "struct"};
+    TokenType types[] = {TOKEN_IF, TOKEN_FOR, TOKEN_WHILE, TOKEN_TRUE, TOKEN_FALSE, TOKEN_PRINT, TOKEN_NIL, TOKEN_VAR, TOKEN_ELSE, TOKEN_AND, TOKEN_OR, TOKEN_DEF, TOKEN_RETURN, TOKEN_STRUCT};
+    for(int i = 0; i < 14; i++) {
+        scanOne(keywords[i], types[i]);
+    }
+
+    //Near misses are identifiers
+    const char* identifiers[] = {"i", "iff", "fo", "forr", "_if", "If", "nil_", "whilE", "ts", "an", "d", "structs", "retur", "x1", "_"};
+    for(int i = 0; i < 15; i++) {
+        scanOne(identifiers[i], TOKEN_IDENTIFIER);
+    }
+
+    //Operators
+    scanOne("<=", TOKEN_LESS_EQUAL);
+    scanOne("==", TOKEN_EQUAL_EQUAL);
+    scanOne("!=", TOKEN_BANG_EQUAL);
+    scanOne("!", TOKEN_BANG);
+    scanOne("12345", TOKEN_NUMBER);
+
+    //Runs of every length around the 16 byte blocks, ending exactly at the end of the source and followed by more tokens
+    char buffer[128];
+    char expected[64];
+    for(int length = 1; length < 48; length++) {
+        for(int i = 0; i < length; i++) {
+            expected[i] = "abcXYZ_019"[i % 10];
+        }
+        expected[length] = '\0';
+        memcpy(buffer, expected, length);
+        buffer[length] = 'X';
+        Scanner scanner;
+        initScanner(&scanner, buffer, length);
+        expectToken(&scanner, TOKEN_IDENTIFIER, expected, 1);
+        expectToken(&scanner, TOKEN_EOF, NULL, 1);
+
+        snprintf(buffer, sizeof(buffer), "%s+%s", expected, expected);
+        initScanner(&scanner, buffer, strlen(buffer));
+        expectToken(&scanner, TOKEN_IDENTIFIER, expected, 1);
+        expectToken(&scanner, TOKEN_PLUS, "+", 1);
+        expectToken(&scanner, TOKEN_IDENTIFIER, expected, 1);
+
+        //Whitespace with a newline every third byte
+        int newlines = 0;
+        for(int i = 0; i < length; i++) {
+            buffer[i] = i % 3 == 2 ? '\n' : " \t\r"[i % 3];
+            newlines += buffer[i] == '\n';
+        }
+        memcpy(buffer + length, "x;", 2);
+        initScanner(&scanner, buffer, length + 2);
+        expectToken(&scanner, TOKEN_IDENTIFIER, "x", 1 + newlines);
+        expectToken(&scanner, TOKEN_SEMI, ";", 1 + newlines);
+        expectToken(&scanner, TOKEN_EOF, NULL, 1 + newlines);
+
+        //Strings with newlines inside
+        buffer[0] = '"';
+        for(int i = 1; i <= length; i++) {
+            buffer[i] = i % 5 == 0 ? '\n' : 'a';
+        }
+        buffer[length + 1] = '"';
+        memcpy(buffer + length + 2, " 7", 2);
+        initScanner(&scanner, buffer, length + 4);
+        Token string = expectToken(&scanner, TOKEN_STRING, NULL, 1);
+        assert(string.length == length + 2);
+        expectToken(&scanner, TOKEN_NUMBER, "7", 1 + length / 5);
+
+        //The same string without its closing quote
+        initScanner(&scanner, buffer, length + 1);
+        assert(scanToken(&scanner).type == TOKEN_ERROR);
+        expectToken(&scanner, TOKEN_EOF, NULL, 1 + length / 5);
+
+        //Digits
+        for(int i = 0; i < length; i++) {
+            buffer[i] = '0' + i % 10;
+        }
+        buffer[length] = '.';
+        initScanner(&scanner, buffer, length + 1);
+        Token number = expectToken(&scanner, TOKEN_NUMBER, NULL, 1);
+        assert(number.length == length);
+        expectToken(&scanner, TOKEN_DOT, ".", 1);
+    }
+
+    //Bytes outside ascii are errors, not identifiers
+    Scanner scanner;
+    initScanner(&scanner, "\xc3\xa9", 2);
+    assert(scanToken(&scanner).type == TOKEN_ERROR);
+
+    //Multi-line input detection
+    assert(needsMoreInput("def f() {", 9));
+    assert(needsMoreInput("print \"abc", 10));
+    assert(!needsMoreInput("print (1);", 10));
+
+    printf("scanner ok\n");
+}
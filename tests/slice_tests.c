@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+static const char* counting =
+    "def fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }\n"
+    "var total = 0;\n"
+    "var i = 0;\n"
+    "while (i < 20000) { total = total + i; i = i + 1; }\n"
+    "total = total + fib(15);\n";
+
+static double readNumber(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && val->type == VALUE_NUM);
+    return val->as.number;
+}
+
+//Resumes a suspended run until it is over, returning how many slices it took
+static int finish(VM* vm, Value* result) {
+    int slices = 1;
+    InterpretResult status;
+    do {
+        status = sethiResume(vm, result);
+        slices++;
+    } while (status == INTERPRET_SUSPENDED);
+    assert(status == INTERPRET_OK);
+    return slices;
+}
+
+//Tests a loop that never ends can be stopped, continued and dropped
+static void testEndless(int level) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    vm.sliceTicks = 100;
+    assert(interpret(&vm, "var i = 0;\nwhile (true) { i = i + 1; }\n") == INTERPRET_SUSPENDED);
+    //One tick per time round the loop
+    assert(readNumber(&vm, "i") == 100);
+    assert(sethiResume(&vm, NULL) == INTERPRET_SUSPENDED);
+    assert(readNumber(&vm, "i") == 200);
+
+    //A new run drops the suspended one and the VM carries on as usual
+    vm.sliceTicks = 0;
+    assert(interpret(&vm, "var j = i + 1;\n") == INTERPRET_OK);
+    assert(readNumber(&vm, "j") == 201);
+    assert(!vm.suspended && sethiResume(&vm, NULL) == INTERPRET_RUNTIME_ERROR);
+
+    //Freeing a VM in the middle of a run frees the run too
+    vm.sliceTicks = 10;
+    assert(interpret(&vm, "while (true) { i = i + 1; }\n") == INTERPRET_SUSPENDED);
+    freeVM(&vm);
+}
+
+//Tests that running in slices gives the same result as running straight
+static void testSameResult(int level) {
+    VM straight;
+    initVM(&straight);
+    straight.optimizationLevel = level;
+    assert(interpret(&straight, counting) == INTERPRET_OK);
+
+    VM sliced;
+    initVM(&sliced);
+    sliced.optimizationLevel = level;
+    sliced.sliceTicks = 37;
+    assert(interpret(&sliced, counting) == INTERPRET_SUSPENDED);
+    //Calls count as well as loops, so fib alone takes many slices
+    assert(finish(&sliced, NULL) > 20000 / 37);
+    assert(readNumber(&sliced, "total") == readNumber(&straight, "total"));
+    freeVM(&straight);
+    freeVM(&sliced);
+}
+
+//Tests that two VMs can take turns on the same thread
+static void testRoundRobin(int level) {
+    VM vms[2];
+    InterpretResult status[2];
+    for (int i = 0; i < 2; i++) {
+        initVM(&vms[i]);
+        vms[i].optimizationLevel = level;
+        vms[i].sliceTicks = 50;
+    }
+    char source[128];
+    for (int i = 0; i < 2; i++) {
+        snprintf(source, sizeof(source), "var n = 0;\nwhile (n < %d) { n = n + 1; }\n", 1000 * (i + 1));
+        status[i] = interpret(&vms[i], source);
+    }
+    int turns = 0;
+    while (status[0] == INTERPRET_SUSPENDED || status[1] == INTERPRET_SUSPENDED) {
+        for (int i = 0; i < 2; i++) {
+            if (status[i] == INTERPRET_SUSPENDED) {
+                status[i] = sethiResume(&vms[i], NULL);
+            }
+        }
+        turns++;
+    }
+    assert(status[0] == INTERPRET_OK && status[1] == INTERPRET_OK);
+    assert(turns >= 2000 / 50 - 1);
+    for (int i = 0; i < 2; i++) {
+        assert(readNumber(&vms[i], "n") == 1000 * (i + 1));
+        freeVM(&vms[i]);
+    }
+}
+
+//Tests that prepared programs and calls hand back their results once resumed
+static void testResults(int level) {
+    Program* program = sethiPrepare(
+        "def sum(n) { var s = 0; var i = 0; while (i < n) { s = s + i; i = i + 1; } return s; }\n"
+        "return sum(arg(0));\n");
+    assert(program != NULL);
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    vm.sliceTicks = 64;
+    Value args[1] = {MAKE_NUM(1000)};
+    Value result = MAKE_NIL();
+    assert(sethiRun(&vm, program, 1, args, &result) == INTERPRET_SUSPENDED);
+    finish(&vm, &result);
+    assert(result.type == VALUE_NUM && result.as.number == 999 * 1000 / 2);
+
+    vm.sliceTicks = 0;
+    assert(interpret(&vm, "def triple(n) { var i = 0; var t = 0; while (i < 3) { t = t + n; i = i + 1; } return t; }\n") == INTERPRET_OK);
+    Value* triple = get(&vm.table, copyString(&vm, "triple", 6));
+    assert(triple != NULL);
+    vm.sliceTicks = 2;
+    Value seven = MAKE_NUM(7);
+    assert(sethiCall(&vm, (ObjFunc*)triple->as.obj, 1, &seven, &result) == INTERPRET_SUSPENDED);
+    finish(&vm, &result);
+    assert(result.type == VALUE_NUM && result.as.number == 21);
+    freeVM(&vm);
+    sethiFreeProgram(program);
+}
+
+//Tests a time slice, and a loop suspended inside a coroutine
+static void testTimeSlice(int level) {
+    VM vm;
+    initVM(&vm);
+    vm.optimizationLevel = level;
+    vm.sliceMicros = 1000;
+    assert(interpret(&vm,
+                     "def count(n) { var i = 0; while (i < n) { i = i + 1; } yield(i); return i + 1; }\n"
+                     "var co = coroutine(count);\n"
+                     "var first = resume(co, 3000000);\n"
+                     "var second = resume(co, nil);\n") == INTERPRET_SUSPENDED);
+    assert(finish(&vm, NULL) > 1);
+    assert(readNumber(&vm, "first") == 3000000);
+    assert(readNumber(&vm, "second") == 3000001);
+    freeVM(&vm);
+}
+
+//Tests that instruction budgets suspend runs and resuming them finishes the work
+int main(int argc, const char* argv[]) {
+    for (int level = 0; level < 2; level++) {
+        testEndless(level);
+        testSameResult(level);
+        testRoundRobin(level);
+        testResults(level);
+        testTimeSlice(level);
+    }
+    printf("slice ok\n");
+}
@@ -11,14 +11,15 @@
 int main(int argc, const char* argv[]) {
 Table t;
 initTable(&t);
-initVM();
+VM vm;
+initVM(&vm);
 
 //Table getters and setters
 assert(t.count == 0);
 assert(t.capacity == 0);
 
-// ObjString* key1 = copyString("key1", 4);
-// ObjString* key2 = copyString("key2", 4);
+// ObjString* key1 = copyString(&vm, "key1", 4);
+// ObjString* key2 = copyString(&vm, "key2", 4);
 
 uint32_t key1_hash = hash("key1", 4);
 uint32_t key2_hash = hash("key2", 4);
@@ -76,4 +77,14 @@ assert(findStringInTable(&t, "key2", 4, key2_hash) == &key2);
 
 ObjString* key3_string = findStringInTable(&t, "key3", 4, hash("key3", 4));
 assert(key3_string == NULL);
+
+//Structs hold their fields inline in the shape's order, and a repeated name reads the later field
+ObjString* names[3] = {&key1, &key2, &key1};
+ObjShape* shape = createShape(&vm, &key3, 3, names);
+Value fields[3] = {MAKE_NUM(1), MAKE_NUM(2), MAKE_NUM(3)};
+ObjStruct* s = createStruct(&vm, shape, fields);
+assert(s->shape == shape && shape->type == &key3);
+assert(getField(s, &key1)->as.number == 3);
+assert(getField(s, &key2)->as.number == 2);
+assert(getField(s, &key4) == NULL);
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../table.h"
+#include "../task.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+//Sorts lists in tasks, some spawned by other tasks, and checks what crosses between the VMs
+static const char* script =
+    "struct Cons(first, r) { var first = first; var rest = r; }\n"
+    "def insert(list, element) {\n"
+    "  if (list == nil) { return Cons(element, nil); }\n"
+    "  if (list.first < element) { return Cons(list.first, insert(list.rest, element)); }\n"
+    "  return Cons(element, list);\n"
+    "}\n"
+    "def sort(list) { if (list == nil) { return list; } return insert(sort(list.rest), list.first); }\n"
+    "def down(n) { var list = nil; var i = 0; while (i < n) { list = Cons(i, list); i = i + 1; } return list; }\n"
+    "def sum(list) { var s = 0; var i = 1; while (!(list == nil)) { s = s + list.first * i; i = i + 1; list = list.rest; } return s; }\n"
+    "def work(n) { return sum(sort(down(n))); }\n"
+    "def split(n) { var a = spawnTask(work, n); var b = spawnTask(work, n + 1); return join(a) + join(b); }\n"
+    "var tasks = nil;\n"
+    "var i = 0;\n"
+    "while (i < 32) { tasks = Cons(spawnTask(split, i / 2 + 1), tasks); i = i + 1; }\n"
+    "var parallel = 0;\n"
+    "while (!(tasks == nil)) { parallel = parallel + join(tasks.first); tasks = tasks.rest; }\n"
+    "var serial = 0;\n"
+    "i = 0;\n"
+    "while (i < 32) { serial = serial + work(i / 2 + 1) + work(i / 2 + 2); i = i + 1; }\n"
+    //Globals are copied when the task is spawned, strings cross both ways
+    "var greeting = \"hello\";\n"
+    "def greet(name) { return Cons(greeting + \" \" + name, name); }\n"
+    "var early = spawnTask(greet, \"task\");\n"
+    "greeting = \"bye\";\n"
+    "var greeted = join(early);\n"
+    "var sameString = greeted.first == \"hello task\" and join(early).rest == \"task\";\n"
+    //A buffer argument is a copy, and so is the one returned
+    "var b = int32Buffer(4);\n"
+    "def fill(buf) { bufFill(buf, 5); return buf; }\n"
+    "var filled = join(spawnTask(fill, b));\n"
+    "var sums = bufSum(b) * 100 + bufSum(filled);\n";
+
+static Value* readGlobal(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL);
+    return val;
+}
+
+static InterpretResult runScript(const char* source) {
+    VM vm;
+    initVM(&vm);
+    InterpretResult result = interpret(&vm, source);
+    freeVM(&vm);
+    return result;
+}
+
+//Tests tasks running on a pool of workers
+int main(int argc, const char* argv[]) {
+    //More workers than tasks at a time, so deques run empty and tasks get stolen
+    startTaskPool(4);
+    for(int level = 0; level <= 1; level++) {
+        VM vm;
+        initVM(&vm);
+        vm.optimizationLevel = level;
+        assert(interpret(&vm, script) == INTERPRET_OK);
+        assert(readGlobal(&vm, "parallel")->as.number == readGlobal(&vm, "serial")->as.number);
+        assert(IS_TRUE((*readGlobal(&vm, "sameString"))));
+        assert(readGlobal(&vm, "sums")->as.number == 20);
+        freeVM(&vm);
+    }
+
+    //Errors in a task surface when it is joined, values tied to one VM can not cross
+    assert(runScript("def f(x) { return x + nil; }\nvar t = spawnTask(f, 1);\njoin(t);\n") == INTERPRET_RUNTIME_ERROR);
+    assert(runScript("def f(x) { return x; }\nvar c = coroutine(f);\nspawnTask(f, c);\n") == INTERPRET_RUNTIME_ERROR);
+    assert(runScript("def f(x) { return coroutine(f); }\njoin(spawnTask(f, 1));\n") == INTERPRET_RUNTIME_ERROR);
+
+    //Tasks that are never joined finish before their VM is freed
+    assert(runScript("def f(n) { var i = 0; while (i < n) { i = i + 1; } return i; }\nvar i = 0;\nwhile (i < 20) { spawnTask(f, 1000); i = i + 1; }\n") == INTERPRET_OK);
+    stopTaskPool();
+
+    printf("task ok\n");
+}
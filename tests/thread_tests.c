@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../table.h"
+#include "../value.h"
+#include "../vm.h"
+#include <assert.h>
+
+#define THREADS 8
+#define ROUNDS 50
+
+//Each thread defines the same globals with its own values, so any state shared between VMs would show up as a wrong result
+static const char* script =
+    "struct Pair(a, b) { var first = a; var second = b; }\n"
+    "def fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }\n"
+    "var p = Pair(seed, fib(15));\n"
+    "var result = p.first * 1000 + p.second;\n"
+    "var name = \"thread\" + \"-\" + \"vm\";\n";
+
+//Prepared once and run by every thread at the same time
+static const char* ruleScript =
+    "struct Pair(a, b) { var first = a; var second = b; }\n"
+    "def fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }\n"
+    "var p = Pair(arg(0), fib(12));\n"
+    "if (arg(1) == \"rule-vm\") { return p.first * 1000 + p.second; }\n"
+    "return nil;\n";
+
+static Program* program;
+
+//Names every preparing thread interns at once, most of them new to the shared table
+static ObjString* interned[THREADS][ROUNDS];
+
+static int readGlobal(VM* vm, const char* name) {
+    Value* val = get(&vm->table, copyString(vm, name, strlen(name)));
+    assert(val != NULL && val->type == VALUE_NUM);
+    return val->as.number;
+}
+
+static void* worker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    for (int round = 0; round < ROUNDS; round++) {
+        VM vm;
+        initVM(&vm);
+        char source[512];
+        snprintf(source, sizeof(source), "var seed = %d;\n%s", id * ROUNDS + round, script);
+        assert(interpret(&vm, source) == INTERPRET_OK);
+        assert(readGlobal(&vm, "result") == (id * ROUNDS + round) * 1000 + 610);
+        assert(get(&vm.table, copyString(&vm, "name", 4))->as.obj == (Obj*)copyString(&vm, "thread-vm", 9));
+        freeVM(&vm);
+    }
+    return NULL;
+}
+
+static void* programWorker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    VM vm;
+    initVM(&vm);
+    for (int round = 0; round < ROUNDS; round++) {
+        Value args[2] = {MAKE_NUM(id * ROUNDS + round), MAKE_OBJ((Obj*)copyString(&vm, "rule-vm", 7))};
+        Value result;
+        assert(sethiRun(&vm, program, 2, args, &result) == INTERPRET_OK);
+        assert(result.type == VALUE_NUM && result.as.number == (id * ROUNDS + round) * 1000 + 144);
+    }
+    freeVM(&vm);
+    return NULL;
+}
+
+static void* prepareWorker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    VM vm;
+    initVM(&vm);
+    for (int round = 0; round < ROUNDS; round++) {
+        char source[128];
+        snprintf(source, sizeof(source), "def shared%d(n) { return n + %d; }\nvar local%d_%d = shared%d(1);\n", round, round, id, round, round);
+        Program* prepared = sethiPrepare(source);
+        assert(prepared != NULL);
+        char name[32];
+        snprintf(name, sizeof(name), "shared%d", round);
+        interned[id][round] = copyString(&vm, name, strlen(name));
+        Value result;
+        assert(sethiRun(&vm, prepared, 0, NULL, &result) == INTERPRET_OK);
+        sethiFreeProgram(prepared);
+    }
+    freeVM(&vm);
+    return NULL;
+}
+
+static void runThreads(void* (*start)(void*)) {
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, start, (void*)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+//Tests that independent VMs can run concurrently
+int main(int argc, const char* argv[]) {
+    runThreads(worker);
+
+    //One prepared program shared by all threads
+    program = sethiPrepare(ruleScript);
+    assert(program != NULL);
+    runThreads(programWorker);
+    sethiFreeProgram(program);
+
+    //Programs prepared on many threads at once intern each name once, and VMs use the shared string
+    runThreads(prepareWorker);
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 1; i < THREADS; i++) {
+            assert(interned[i][round] == interned[0][round]);
+        }
+    }
+
+    //Programs that do not compile are not prepared
+    assert(sethiPrepare("var = ;") == NULL);
+
+    printf("%d threads x %d rounds ok\n", THREADS, ROUNDS);
+}
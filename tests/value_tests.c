@@ -9,13 +9,14 @@
 
 
 int main(int argc, const char* argv[]) {
-    initVM();
-    ObjString* string1 = copyString("string1", 7);
-    ObjString* string1_dup = copyString("string1", 7);
-       ObjString* string1_dup1 = copyString("string1", 7);
-          ObjString* string1_dup2 = copyString("string1", 7);
-             ObjString* string1_dup3 = copyString("string1", 7);
-    ObjString* string2 = copyString("string2", 7);
+    VM vm;
+    initVM(&vm);
+    ObjString* string1 = copyString(&vm, "string1", 7);
+    ObjString* string1_dup = copyString(&vm, "string1", 7);
+       ObjString* string1_dup1 = copyString(&vm, "string1", 7);
+          ObjString* string1_dup2 = copyString(&vm, "string1", 7);
+             ObjString* string1_dup3 = copyString(&vm, "string1", 7);
+    ObjString* string2 = copyString(&vm, "string2", 7);
 
     assert(string1 == string1);
     assert(string1 == string1_dup);
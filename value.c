@@ -1,7 +1,12 @@
 #include "value.h"
+#include "buffer.h"
 #include "chunk.h"
+#include "coroutine.h"
+#include "gc.h"
 #include "memory.h"
+#include "shared.h"
 #include "table.h"
+#include "task.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,26 +29,61 @@ void writeValueArray(ValueArray *arr, Value val) {
   arr->count++;
 }
 
+// Frees an object, giving each piece's size back to the account it was
+// charged to
 void freeObject(Obj *obj) {
   ObjType type = obj->type;
   switch (type) {
   case OBJ_STRING: {
     ObjString *ptr = (ObjString *)obj;
-    free((void *)ptr->string);
-    free((void *)ptr);
+    release(MEMORY_OBJECTS, (void *)ptr->string, ptr->length + 1);
+    release(MEMORY_OBJECTS, ptr, sizeof(ObjString));
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunc *ptr = (ObjFunc *)obj;
     freeChunk(ptr->chunk);
-    free((void *)ptr);
+    release(MEMORY_OBJECTS, ptr->chunk, sizeof(Chunk));
+    if (ptr->fallback != NULL) {
+      freeChunk(ptr->fallback);
+      release(MEMORY_OBJECTS, ptr->fallback, sizeof(Chunk));
+    }
+    release(MEMORY_OBJECTS, ptr, sizeof(ObjFunc));
     break;
   }
   case OBJ_STRUCT: {
-    ObjStruct *ptr = (ObjStruct *)obj;
-    freeTable(&(ptr->table));
-    freeObject((Obj *)ptr->type);
-    free((void *)ptr);
+    // The fields are in the same allocation, and the shape is freed with the
+    // other objects
+    release(MEMORY_OBJECTS, obj, objectSize(obj));
+    break;
+  }
+  case OBJ_COROUTINE: {
+    // Its stack is part of the object
+    release(MEMORY_OBJECTS, obj, sizeof(ObjCoroutine));
+    break;
+  }
+  case OBJ_TASK: {
+    freeTask((ObjTask *)obj);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *ptr = (ObjShape *)obj;
+    // The type and field names are interned strings freed with the other
+    // objects
+    release(MEMORY_OBJECTS, ptr->names,
+            sizeof(ObjString *) * (ptr->count + 1));
+    release(MEMORY_OBJECTS, ptr, sizeof(ObjShape));
+    break;
+  }
+  case OBJ_NATIVE: {
+    release(MEMORY_OBJECTS, obj, sizeof(ObjNative));
+    break;
+  }
+  case OBJ_BUFFER: {
+    ObjBuffer *ptr = (ObjBuffer *)obj;
+    release(MEMORY_OBJECTS, ptr->data, bufferDataSize(ptr->kind, ptr->length));
+    release(MEMORY_OBJECTS, ptr, sizeof(ObjBuffer));
+    break;
   }
   default:
     break;
@@ -51,7 +91,7 @@ void freeObject(Obj *obj) {
 }
 
 void freeValueArray(ValueArray *arr) {
-  FREE_ARRAY(Value, arr->values, arr->count);
+  FREE_ARRAY(Value, arr->values, arr->capacity);
   initValueArray(arr);
 }
 
@@ -75,11 +115,29 @@ void printValue(Value val) {
       printf("%s", ((ObjString *)val.as.obj)->string);
       break;
     case OBJ_STRUCT:
-      printf("`%s`", ((ObjStruct *)val.as.obj)->type->string);
+      printf("`%s`", ((ObjStruct *)val.as.obj)->shape->type->string);
+      break;
+    case OBJ_SHAPE:
+      printf("shape: %s", ((ObjShape *)val.as.obj)->type->string);
+      break;
+    case OBJ_COROUTINE:
+      printf("coroutine");
+      break;
+    case OBJ_TASK:
+      printf("task");
       break;
     case OBJ_FUNCTION:
       printf("function: %d params", ((ObjFunc *)val.as.obj)->numParams);
       break;
+    case OBJ_NATIVE:
+      printf("native function: %s", ((ObjNative *)val.as.obj)->name);
+      break;
+    case OBJ_BUFFER: {
+      ObjBuffer *buffer = (ObjBuffer *)val.as.obj;
+      printf("buffer: %s[%d]", buffer->kind == BUFFER_INT32 ? "int32" : "int64",
+             buffer->length);
+      break;
+    }
     default:
       break;
     }
@@ -103,45 +161,74 @@ uint32_t hash(const char *string, int length) {
   return hash;
 }
 
+// Creates an ObjString holding a copy of string that belongs to no VM
+ObjString *allocateString(const char *string, int length, uint32_t hash) {
+  char *heapPtr = (char *)allocate(MEMORY_OBJECTS, sizeof(char) * (length + 1));
+  memcpy(heapPtr, string, length);
+  heapPtr[length] = '\0';
+  ObjString *heapObj = (ObjString *)allocate(MEMORY_OBJECTS, sizeof(ObjString));
+  ((Obj *)heapObj)->type = OBJ_STRING;
+  ((Obj *)heapObj)->mark = MARK_PERMANENT;
+  ((Obj *)heapObj)->next = NULL;
+  heapObj->length = length;
+  heapObj->string = heapPtr;
+  heapObj->hash = hash;
+  return heapObj;
+}
+
 // Checks if string exists in intern table, otherwise creates string in heap,
 // creates objstring, and adds it to table
-ObjString *copyString(const char *string, int length) {
+ObjString *copyString(VM *vm, const char *string, int length) {
   uint32_t hashVal = hash(string, length);
-  ObjString *intern = findStringInTable(&vm.strings, string, length, hashVal);
+  // Strings of prepared programs and names of natives are shared by every
+  // VM, so they stay identical to the constants and globals using them
+  ObjString *shared = findSharedString(string, length, hashVal);
+  if (shared != NULL) {
+    return shared;
+  }
+  if (vm->internShared) {
+    return internSharedString(string, length, hashVal);
+  }
+  ObjString *intern = findStringInTable(&vm->strings, string, length, hashVal);
   if (intern != NULL) {
+    // The intern table does not keep strings alive, so one found during a
+    // cycle may not have been reached yet
+    markObject(&vm->gc, &intern->obj);
     return intern;
   }
 
-  char *heapPtr = (char *)malloc(sizeof(char) * (length + 1));
-  if (heapPtr == NULL) {
-    exit(1);
-  }
-  memcpy(heapPtr, string, length);
-  heapPtr[length] = '\0';
-  ObjString *heapObj = (ObjString *)malloc(sizeof(ObjString));
-  if (heapObj == NULL) {
-    exit(1);
-  }
-  ((Obj *)heapObj)->type = OBJ_STRING;
-  ((Obj *)heapObj)->next = vm.objects;
-  vm.objects = &heapObj->obj;
-  heapObj->length = length;
-  heapObj->string = heapPtr;
-  heapObj->hash = hashVal;
-  set(&vm.strings, heapObj, MAKE_NIL());
+  ObjString *heapObj = allocateString(string, length, hashVal);
+  trackObject(vm, &heapObj->obj);
+  set(&vm->strings, heapObj, MAKE_NIL());
 
   return heapObj;
 }
 
 // Creates a ObjFunc on the heap
-ObjFunc *createFunc(Chunk *chunk, int numParams) {
-  ObjFunc *output = (ObjFunc *)malloc(sizeof(ObjFunc));
+ObjFunc *createFunc(VM *vm, Chunk *chunk, int numParams) {
+  ObjFunc *output = (ObjFunc *)allocate(MEMORY_OBJECTS, sizeof(ObjFunc));
 
   ((Obj *)output)->type = OBJ_FUNCTION;
-  ((Obj *)output)->next = vm.objects;
-  vm.objects = &output->obj;
   output->chunk = chunk;
+  output->fallback = NULL;
+  output->deoptimized = false;
   output->numParams = numParams;
+  trackObject(vm, &output->obj);
+
+  return output;
+}
+
+// Creates a ObjNative on the heap
+ObjNative *createNative(VM *vm, NativeFn function, int arity,
+                        const char *name) {
+  ObjNative *output =
+      (ObjNative *)allocate(MEMORY_OBJECTS, sizeof(ObjNative));
+
+  ((Obj *)output)->type = OBJ_NATIVE;
+  output->function = function;
+  output->arity = arity;
+  output->name = name;
+  trackObject(vm, &output->obj);
 
   return output;
 }
@@ -162,6 +249,16 @@ char *typeName(Value val) {
       return "Function Object";
     case OBJ_STRUCT:
       return "Struct";
+    case OBJ_NATIVE:
+      return "Native Function";
+    case OBJ_BUFFER:
+      return "Buffer";
+    case OBJ_SHAPE:
+      return "Struct Shape";
+    case OBJ_COROUTINE:
+      return "Coroutine";
+    case OBJ_TASK:
+      return "Task";
     default:
       return "Unknown Object";
     }
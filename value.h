@@ -5,15 +5,47 @@
 
 typedef enum { VALUE_NIL, VALUE_NUM, VALUE_OBJ, VALUE_BOOL } ValueType;
 
-typedef enum { OBJ_STRING, OBJ_FUNCTION, OBJ_STRUCT } ObjType;
+typedef enum {
+  OBJ_STRING,
+  OBJ_FUNCTION,
+  OBJ_STRUCT,
+  OBJ_NATIVE,
+  OBJ_BUFFER,
+  OBJ_SHAPE,
+  OBJ_COROUTINE,
+  OBJ_TASK
+} ObjType;
 
 typedef struct Obj Obj;
+typedef struct VM VM;
 
 struct Obj {
-  ObjType type;
+  // An ObjType, in a byte so the header stays two words
+  uint8_t type;
+  // Which part of the heap the object is in, set when it is made
+  uint8_t mark;
+  // Where the collector keeps its mark bit, see gc.h
+  uint16_t slot;
+  uint32_t region;
   Obj *next;
 };
 
+// The mark of objects the collector never frees or traces: compiled code and
+// its constants, and objects shared between VMs
+#define MARK_PERMANENT 0
+// The mark of objects in the old generation
+#define MARK_OLD 1
+// The mark of old objects compactHeap moved into an arena. They are never
+// written to, and their memory is freed with the arena.
+#define MARK_FROZEN 2
+// The mark of objects in the young generation, which a minor collection
+// either copies out or frees. Their next is NULL until they are copied, and
+// then points at the copy.
+#define MARK_YOUNG 3
+// The mark compactHeap leaves on an object it has copied, whose next points
+// at the copy until it is freed
+#define MARK_MOVED 4
+
 typedef struct {
   Obj obj;
   int length;
@@ -27,6 +59,13 @@ typedef struct {
   Obj obj;
   // Points to the chunk where the function is defined
   Chunk *chunk;
+  // The same body compiled to look every call up by name, run instead once a
+  // function chunk binds statically is bound to something else. NULL if
+  // chunk binds none. Once swapped in, this holds the replaced chunk, which
+  // frames may still be running.
+  Chunk *fallback;
+  // Set once fallback has been swapped in
+  bool deoptimized;
   uint8_t numParams;
 } ObjFunc;
 
@@ -45,15 +84,30 @@ typedef struct {
   Value *values;
 } ValueArray;
 
+// A function implemented in C. Args points at the first argument on the vm
+// stack. Writes its return value to result and returns false if it raised a
+// runtime error.
+typedef bool (*NativeFn)(VM *vm, int argCount, Value *args, Value *result);
+
+typedef struct {
+  Obj obj;
+  NativeFn function;
+  uint8_t arity;
+  const char *name;
+} ObjNative;
+
 void freeObject(Obj *obj);
 void initValueArray(ValueArray *arr);
 void writeValueArray(ValueArray *arr, Value val);
 void freeValueArray(ValueArray *arr);
 void printValue(Value val);
 bool isObjectOfType(Value val, ObjType type);
-ObjString *copyString(const char *string, int length);
+ObjString *allocateString(const char *string, int length, uint32_t hash);
+ObjString *copyString(VM *vm, const char *string, int length);
 uint32_t hash(const char *string, int length);
-ObjFunc *createFunc(Chunk *chunk, int numParams);
+ObjFunc *createFunc(VM *vm, Chunk *chunk, int numParams);
+ObjNative *createNative(VM *vm, NativeFn function, int arity,
+                        const char *name);
 char *typeName(Value val);
 
 #define IS_NIL(value) (value.type == VALUE_NIL)
@@ -1,46 +1,144 @@
 #include "vm.h"
+#include "buffer.h"
 #include "compiler.h"
+#include "coroutine.h"
 #include "debug.h"
+#include "heap.h"
+#include "loop.h"
+#include "memory.h"
+#include "perf.h"
 #include "string.h"
 #include "table.h"
+#include "task.h"
 #include "value.h"
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+// Ends the VM's last run, suspended or not: frees the chunk it owned and
+// forgets the program and arguments it was given
+static void dropRun(VM *vm) {
+  if (vm->ownedChunk != NULL) {
+    freeChunk(vm->ownedChunk);
+    release(MEMORY_ARRAYS, vm->ownedChunk, sizeof(Chunk));
+    vm->ownedChunk = NULL;
+  }
+  vm->suspended = false;
+  vm->sharedTable = NULL;
+  vm->args = NULL;
+  vm->argCount = 0;
+}
+
+static void resetStack(VM *vm) {
+  // A run left suspended is abandoned
+  dropRun(vm);
+  vm->frameBottom = 0;
+  vm->stack = vm->mainStack;
+  vm->stackTop = vm->stack;
+  vm->coroutine = NULL;
+  stopLoop(vm);
+}
 
-VM vm;
+static bool argNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!IS_NUM(args[0])) {
+    runtimeError(vm, "arg expects a Number index, got %s", typeName(args[0]));
+    return false;
+  }
+  int index = args[0].as.number;
+  if (index < 0 || index >= vm->argCount) {
+    runtimeError(vm, "arg index %d is out of range for %d arguments", index,
+                 vm->argCount);
+    return false;
+  }
+  *result = vm->args[index];
+  return true;
+}
+
+static bool argCountNative(VM *vm, int argCount, Value *args, Value *result) {
+  *result = MAKE_NUM(vm->argCount);
+  return true;
+}
+
+// Holds the built-in natives and their names, made once per process and
+// read only after. Every VM finds them after its own and its program's
+// globals, so creating a VM allocates nothing for them.
+static VM builtins;
+static pthread_once_t builtinsDefined = PTHREAD_ONCE_INIT;
+
+static void initHeap(VM *vm) {
+  vm->loop = NULL;
+  vm->perf = NULL;
+  vm->ownedChunk = NULL;
+  vm->sliceTicks = 0;
+  vm->sliceMicros = 0;
+  resetStack(vm);
+  initTable(&vm->table);
+  initTable(&vm->strings);
+  vm->objects = NULL;
+  initCollector(&vm->gc);
+  initAccount(&vm->memory, NULL);
+  vm->gc.memory = &vm->memory;
+  vm->internShared = false;
+  vm->optimizationLevel = 0;
+  vm->staticCalls = false;
+}
+
+static void defineBuiltins() {
+  initHeap(&builtins);
+  builtins.internShared = true;
+  MemoryAccount *outer = useAccount(&builtins.memory);
+  defineNative(&builtins, "arg", argNative, 1);
+  defineNative(&builtins, "argCount", argCountNative, 0);
+  defineBufferNatives(&builtins);
+  defineCoroutineNatives(&builtins);
+  defineLoopNatives(&builtins);
+  defineTaskNatives(&builtins);
+  defineHeapNatives(&builtins);
+  makePermanent(&builtins, NULL, NULL);
+  useAccount(outer);
+}
 
-static void resetStack() {
-  vm.frameBottom = 0;
-  vm.stackTop = vm.stack;
+void initVM(VM *vm) {
+  pthread_once(&builtinsDefined, defineBuiltins);
+  initHeap(vm);
 }
 
-void initVM() {
-  resetStack();
-  initTable(&vm.table);
-  initTable(&vm.strings);
-  vm.objects = NULL;
+// Binds a C function to a global name
+void defineNative(VM *vm, const char *name, NativeFn function, int arity) {
+  MemoryAccount *outer = useAccount(&vm->memory);
+  ObjString *key = copyString(vm, name, (int)strlen(name));
+  Value *old = get(&vm->table, key);
+  if (old != NULL && isObjectOfType(*old, OBJ_FUNCTION)) {
+    deoptimize(vm);
+  }
+  set(&vm->table, key,
+      MAKE_OBJ((Obj *)createNative(vm, function, arity, name)));
+  useAccount(outer);
 }
 
 // Removes value from top of stack and returns it
-Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+Value pop(VM *vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-void push(Value val) {
-  *vm.stackTop = val;
-  vm.stackTop++;
+void push(VM *vm, Value val) {
+  *vm->stackTop = val;
+  vm->stackTop++;
 }
 
 // Returns the Value that is "distance" values away from the top of the stack
-Value peek(int distance) { return *(vm.stackTop - distance); }
+Value peek(VM *vm, int distance) { return *(vm->stackTop - distance); }
 
 // Returns a INTERPRET_RUNETIME_ERROR and print the given message, indicating
 // the current line the program is at. Adds new line
-InterpretResult runtimeError(const char *message, ...) {
-  int line = vm.chunk->lines[vm.ip - vm.chunk->code];
+InterpretResult runtimeError(VM *vm, const char *message, ...) {
+  // ip has moved past the failing instruction's opcode, and possibly its
+  // operands, which share its line
+  int line = vm->chunk->lines[vm->ip - vm->chunk->code - 1];
   printf("Error at line %d: ", line);
 
   va_list args;
@@ -54,6 +152,47 @@ InterpretResult runtimeError(const char *message, ...) {
   return INTERPRET_RUNTIME_ERROR;
 }
 
+// Returns the global bound to key, looking in the running program's globals
+// and then the built-in natives when the VM has none. Returns NULL if it is
+// not defined.
+Value *findGlobal(VM *vm, ObjString *key) {
+  Value *val = get(&vm->table, key);
+  if (val == NULL && vm->sharedTable != NULL) {
+    val = get(vm->sharedTable, key);
+  }
+  if (val == NULL) {
+    val = get(&builtins.table, key);
+  }
+  return val;
+}
+
+static void swapFallback(Obj *object, void *context) {
+  if (object->type != OBJ_FUNCTION) {
+    return;
+  }
+  ObjFunc *func = (ObjFunc *)object;
+  if (func->fallback != NULL && !func->deoptimized) {
+    Chunk *bound = func->chunk;
+    func->chunk = func->fallback;
+    func->fallback = bound;
+    func->deoptimized = true;
+  }
+}
+
+// Makes every function of vm that binds calls statically run its fallback
+// instead, which looks each call up by name. Called before a function that
+// may be bound statically is bound to something else. Frames in the old
+// chunks finish in them. Tasks, which share vm's functions, are waited for
+// first.
+void deoptimize(VM *vm) {
+  if (!vm->staticCalls) {
+    return;
+  }
+  finishTasks(vm);
+  visitHeap(vm, swapFallback, NULL);
+  vm->staticCalls = false;
+}
+
 bool sameObject(Value a, Value b) {
   Obj *aObj = a.as.obj;
   Obj *bObj = b.as.obj;
@@ -66,51 +205,168 @@ bool sameObject(Value a, Value b) {
   case OBJ_STRING: {
     ObjString *objStringA = (ObjString *)aObj;
     ObjString *objStringB = (ObjString *)bObj;
-    return objStringA == objStringB;
+    if (objStringA == objStringB) {
+      return true;
+    }
+    // A string made by the VM before a program ran may be interned separately
+    // from the same string in the program
+    return objStringA->hash == objStringB->hash &&
+           objStringA->length == objStringB->length &&
+           memcmp(objStringA->string, objStringB->string,
+                  objStringA->length) == 0;
   }
   default:
     return false;
   }
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+// Takes size bytes for an object of type from the nursery, running a minor
+// collection first when it is full. Only called between instructions, with
+// the values the object is made from still on the stack, since the
+// collection may move them. Returns NULL for VMs without a collector and
+// objects too big for the nursery, which are made in the old generation.
+static inline Obj *allocateYoung(VM *vm, ObjType type, size_t size) {
+  Collector *gc = &vm->gc;
+  size = (size + 7) & ~(size_t)7;
+  if ((size_t)(gc->nurseryEnd - gc->nurseryTop) < size) {
+    if (!gc->enabled || size > GC_NURSERY / 8) {
+      return NULL;
+    }
+    collectYoung(vm);
+  }
+  Obj *object = (Obj *)gc->nurseryTop;
+  gc->nurseryTop += size;
+  object->type = type;
+  object->mark = MARK_YOUNG;
+  object->next = NULL;
+  return object;
+}
+
+// Fills in the three placeholders below the arguments with the caller's
+// frame and starts running func.
+static inline void enterFunction(VM *vm, ObjFunc *func,
+                                 uint8_t numActualParams) {
+  *(vm->stackTop - numActualParams - 1) =
+      (Value){.type = VALUE_NUM, .as.number = vm->frameBottom};
+  *(vm->stackTop - numActualParams - 2) =
+      (Value){.type = VALUE_OBJ, .as.obj = (Obj *)vm->returnIp};
+  *(vm->stackTop - numActualParams - 3) =
+      (Value){.type = VALUE_OBJ, .as.obj = (Obj *)vm->chunk};
+
+  vm->frameBottom =
+      (uint8_t)(vm->stackTop - vm->stack) - (uint8_t)(numActualParams);
+  vm->returnIp = vm->ip;
+  vm->chunk = func->chunk;
+
+  vm->ip = vm->chunk->code;
+  if (vm->perf != NULL && vm->perf->byFunction) {
+    switchPerfFunction(vm, true);
+  }
+}
+
+static int64_t nanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Gives the ticks left to count down before the slice is checked again
+static void countTicks(VM *vm) {
+  int64_t ticks = vm->sliceEnd != 0 && vm->ticksRemaining > SLICE_CLOCK_TICKS
+                      ? SLICE_CLOCK_TICKS
+                      : vm->ticksRemaining;
+  vm->ticksLeft = ticks;
+  vm->ticksRemaining -= ticks;
+}
+
+static void startSlice(VM *vm) {
+  vm->ticksRemaining = vm->sliceTicks > 0 ? vm->sliceTicks : INT64_MAX;
+  vm->sliceEnd =
+      vm->sliceMicros > 0 ? nanoseconds() + vm->sliceMicros * 1000 : 0;
+  countTicks(vm);
+}
+
+// Called once the ticks counted down run out. Returns whether the slice is
+// over, or else counts down the next ticks.
+static bool sliceOver(VM *vm) {
+  if (vm->ticksRemaining == 0 ||
+      (vm->sliceEnd != 0 && nanoseconds() >= vm->sliceEnd)) {
+    return true;
+  }
+  countTicks(vm);
+  return false;
+}
+
+static InterpretResult run(VM *vm) {
+#define READ_BYTE() (*vm->ip++)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
 // Increments the ip twice and returns the uint16_t value of the next two bytes.
-#define READ_JUMP() ((((uint16_t) * vm.ip++) << 8) + *vm.ip++)
+#define READ_JUMP() ((((uint16_t) * vm->ip++) << 8) + *vm->ip++)
 #define BINARY_OP(op)                                                          \
   do {                                                                         \
-    if (peek(1).type != VALUE_NUM || peek(2).type != VALUE_NUM) {              \
-      return runtimeError("Can not operate on these types: %s and %s",         \
-                          typeName(peek(1)), typeName(peek(2)));               \
+    if (peek(vm, 1).type != VALUE_NUM || peek(vm, 2).type != VALUE_NUM) {      \
+      return runtimeError(vm, "Can not operate on these types: %s and %s",     \
+                          typeName(peek(vm, 1)), typeName(peek(vm, 2)));       \
     }                                                                          \
-    Value b = pop();                                                           \
-    Value a = pop();                                                           \
+    Value b = pop(vm);                                                         \
+    Value a = pop(vm);                                                         \
     Value final = {.type = VALUE_NUM,                                          \
                    .as.number = (a.as.number op b.as.number)};                 \
-    push(final);                                                               \
+    push(vm, final);                                                           \
   } while (false);
 #define COMP_OP(op)                                                            \
   do {                                                                         \
-    if (peek(1).type != VALUE_NUM || peek(2).type != VALUE_NUM) {              \
-      return runtimeError("Can not operate on these types: %s and %s",         \
-                          typeName(peek(1)), typeName(peek(2)));               \
+    if (peek(vm, 1).type != VALUE_NUM || peek(vm, 2).type != VALUE_NUM) {      \
+      return runtimeError(vm, "Can not operate on these types: %s and %s",     \
+                          typeName(peek(vm, 1)), typeName(peek(vm, 2)));       \
     }                                                                          \
-    Value b = pop();                                                           \
-    Value a = pop();                                                           \
+    Value b = pop(vm);                                                         \
+    Value a = pop(vm);                                                         \
     Value final = {.type = VALUE_BOOL,                                         \
                    .as.boolean = (a.as.number op b.as.number)};                \
-    push(final);                                                               \
+    push(vm, final);                                                           \
   } while (false);
+// An operation the optimizer has proven to have two numbers to work on
+#define NUMBER_OP(valueType, field, op)                                        \
+  do {                                                                         \
+    Value b = pop(vm);                                                         \
+    Value *a = vm->stackTop - 1;                                               \
+    *a = (Value){.type = valueType, .as.field = (a->as.number op b.as.number)}; \
+  } while (false)
+// Gives the collector a slice once enough has been allocated since the last,
+// then stops the program if the VM holds more than its memory limit even
+// after a full collection. Only used between instructions, where every live
+// value is on a stack.
+#define COLLECT_IF_DUE()                                                       \
+  do {                                                                         \
+    if (vm->gc.debt >= GC_STEP) {                                              \
+      stepCollector(vm);                                                       \
+      if (!reserveMemory(vm, 0)) {                                             \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      }                                                                        \
+    }                                                                          \
+  } while (false)
+
+// Suspends the run once its slice is over. Used after backward jumps and
+// calls, which every loop and recursion passes through, when the VM is ready
+// to carry on from the next instruction. Counting down costs a decrement;
+// the slice itself is only looked at when the count reaches zero.
+#define CHECK_SLICE()                                                          \
+  do {                                                                         \
+    if (--vm->ticksLeft <= 0 && sliceOver(vm)) {                               \
+      vm->suspended = true;                                                    \
+      return INTERPRET_SUSPENDED;                                              \
+    }                                                                          \
+  } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
   printf("== VM State == \n");
 #endif
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    dissasembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    dissasembleInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
     printf("   stack before (bottom first): ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
       printf("[");
       printValue(*slot);
       printf("]");
@@ -120,43 +376,73 @@ static InterpretResult run() {
     uint8_t instruction = READ_BYTE();
     switch (instruction) {
     case OP_RETURN: {
-      if (vm.frameBottom == 0) {
-        return INTERPRET_OK;
+      if (vm->frameBottom == 0) {
+        if (vm->coroutine == NULL) {
+          // Nothing young outlives a run, so values the host keeps are not
+          // moved by the next one
+          if (vm->gc.nurseryTop != vm->gc.nursery) {
+            collectYoung(vm);
+          }
+          return INTERPRET_OK;
+        }
+        finishCoroutine(vm, pop(vm));
+        break;
+      }
+      Value returnVal = pop(vm);
+      vm->ip = vm->returnIp;
+      vm->stackTop = vm->stack + vm->frameBottom;
+
+      vm->frameBottom = pop(vm).as.number;
+      vm->returnIp = (uint8_t *)pop(vm).as.obj;
+      vm->chunk = (Chunk *)pop(vm).as.obj;
+      if (vm->perf != NULL && vm->perf->byFunction) {
+        switchPerfFunction(vm, false);
       }
-      Value returnVal = pop();
-      vm.ip = vm.returnIp;
-      vm.stackTop = vm.stack + vm.frameBottom;
-
-      vm.frameBottom = pop().as.number;
-      vm.returnIp = (uint8_t *)pop().as.obj;
-      vm.chunk = (Chunk *)pop().as.obj;
 
-      push(returnVal);
+      push(vm, returnVal);
       break;
     }
     case OP_CONSTANT: {
-      push(READ_CONSTANT());
+      push(vm, READ_CONSTANT());
       break;
     }
     case OP_NEGATE:
-      if (!IS_NUM(peek(1))) {
-        return runtimeError("Cannot negate: %s, only Number",
-                            typeName(peek(1)));
+      if (!IS_NUM(peek(vm, 1))) {
+        return runtimeError(vm, "Cannot negate: %s, only Number",
+                            typeName(peek(vm, 1)));
       }
-      push(pop());
+      push(vm, pop(vm));
       break;
     case OP_ADD: {
-      Value b = peek(2);
-      Value a = peek(1);
+      Value b = peek(vm, 2);
+      Value a = peek(vm, 1);
       if (a.type == b.type && IS_STRING(a)) {
-        ObjString *b = (ObjString *)pop().as.obj;
-        ObjString *a = (ObjString *)pop().as.obj;
-        char *output = (char *)malloc(a->length + b->length);
-        strcpy(output, a->string);
-        strcat(output, b->string);
-        ObjString *objString = copyString(output, a->length + b->length);
-        free(output);
-        push(MAKE_OBJ((Obj *)objString));
+        int length = ((ObjString *)a.as.obj)->length +
+                     ((ObjString *)b.as.obj)->length;
+        // Strings too long for the nursery are allocated straight away
+        if (length > GC_NURSERY / 8 && !reserveMemory(vm, 2 * length)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        // Young strings are not interned, strings compare by their text
+        ObjString *objString = (ObjString *)allocateYoung(
+            vm, OBJ_STRING, sizeof(ObjString) + length + 1);
+        ObjString *b = (ObjString *)pop(vm).as.obj;
+        ObjString *a = (ObjString *)pop(vm).as.obj;
+        char *output = objString != NULL ? (char *)(objString + 1)
+                                         : (char *)malloc(length + 1);
+        memcpy(output, a->string, a->length);
+        memcpy(output + a->length, b->string, b->length);
+        output[length] = '\0';
+        if (objString != NULL) {
+          objString->length = length;
+          objString->string = output;
+          objString->hash = hash(output, length);
+        } else {
+          objString = copyString(vm, output, length);
+          free(output);
+        }
+        push(vm, MAKE_OBJ((Obj *)objString));
+        COLLECT_IF_DUE();
       } else {
         BINARY_OP(+);
       }
@@ -172,13 +458,13 @@ static InterpretResult run() {
       BINARY_OP(/);
       break;
     case OP_FALSE:
-      push(MAKE_BOOL(false));
+      push(vm, MAKE_BOOL(false));
       break;
     case OP_TRUE:
-      push(MAKE_BOOL(true));
+      push(vm, MAKE_BOOL(true));
       break;
     case OP_NIL:
-      push(MAKE_NIL());
+      push(vm, MAKE_NIL());
       break;
     case OP_LESS:
       COMP_OP(<);
@@ -193,111 +479,143 @@ static InterpretResult run() {
       COMP_OP(>=);
       break;
     case OP_EQUALITY: {
-      Value b = pop();
-      Value a = pop();
+      Value b = pop(vm);
+      Value a = pop(vm);
       if (a.type != b.type) {
-        push(MAKE_BOOL(false));
+        push(vm, MAKE_BOOL(false));
       } else {
         switch (b.type) {
         case VALUE_BOOL:
-          push(MAKE_BOOL(b.as.boolean == a.as.boolean));
+          push(vm, MAKE_BOOL(b.as.boolean == a.as.boolean));
           break;
         case VALUE_NUM:
-          push(MAKE_BOOL(a.as.number == b.as.number));
+          push(vm, MAKE_BOOL(a.as.number == b.as.number));
           break;
         case VALUE_OBJ:
-          push(MAKE_BOOL(sameObject(a, b)));
+          push(vm, MAKE_BOOL(sameObject(a, b)));
           break;
         default:
-          push(MAKE_BOOL(true));
+          push(vm, MAKE_BOOL(true));
         }
       }
       break;
     }
     case OP_FALSIFY:
-      if (peek(1).type != VALUE_BOOL) {
-        return runtimeError("Cannot falsify %s, only booleans",
-                            typeName(peek(1)));
+      if (peek(vm, 1).type != VALUE_BOOL) {
+        return runtimeError(vm, "Cannot falsify %s, only booleans",
+                            typeName(peek(vm, 1)));
       }
-      push(MAKE_BOOL((!pop().as.boolean)));
+      push(vm, MAKE_BOOL((!pop(vm).as.boolean)));
       break;
     case OP_PRINT:
-      printValue(pop());
+      printValue(pop(vm));
       printf("\n");
       break;
     case OP_POP:
-      pop();
+      pop(vm);
       break;
     case OP_DEFINE_GLOB: {
       ObjString *s = (ObjString *)READ_CONSTANT().as.obj;
-      set(&vm.table, s, peek(1));
-      pop();
+      if (vm->gc.phase == GC_MARK) {
+        Value *old = get(&vm->table, s);
+        if (old != NULL) {
+          markValue(&vm->gc, *old);
+        }
+      }
+      GLOBAL_BARRIER(&vm->gc, peek(vm, 1));
+      set(&vm->table, s, peek(vm, 1));
+      pop(vm);
       break;
     }
     case OP_SET_GLOB: {
       ObjString *s = (ObjString *)READ_CONSTANT().as.obj;
-      if (get(&vm.table, s) == NULL) {
-        return runtimeError("Global variable, %s, is not defined", s->string);
+      Value *old = findGlobal(vm, s);
+      if (old == NULL) {
+        return runtimeError(vm, "Global variable, %s, is not defined",
+                            s->string);
       }
-      set(&vm.table, s, peek(1));
+      WRITE_BARRIER(&vm->gc, *old);
+      GLOBAL_BARRIER(&vm->gc, peek(vm, 1));
+      set(&vm->table, s, peek(vm, 1));
 
       break;
     }
     case OP_GET_GLOB: {
       ObjString *s = (ObjString *)READ_CONSTANT().as.obj;
-      Value *val = get(&vm.table, s);
+      Value *val = findGlobal(vm, s);
       if (val == NULL) {
-        return runtimeError("Global variable, %s, is not defined", s->string);
+        return runtimeError(vm, "Global variable, %s, is not defined",
+                            s->string);
       } else {
-        push(*val);
+        push(vm, *val);
       }
       break;
     }
     case OP_SET_LOC: {
       uint8_t index = READ_BYTE();
-      vm.stack[vm.frameBottom + index] = peek(1);
+      vm->stack[vm->frameBottom + index] = peek(vm, 1);
       break;
     }
     case OP_GET_LOC: {
       uint8_t index = READ_BYTE();
-      push(vm.stack[vm.frameBottom + index]);
+      push(vm, vm->stack[vm->frameBottom + index]);
       break;
     }
     case OP_JUMP_IF_FALSE: {
       uint16_t jumpLength = READ_JUMP();
-      if (IS_FALSE(peek(1))) {
-        vm.ip += jumpLength;
+      if (IS_FALSE(peek(vm, 1))) {
+        vm->ip += jumpLength;
       }
       break;
     }
     case OP_JUMP: {
       uint16_t jumpLength = READ_JUMP();
-      vm.ip += jumpLength;
+      vm->ip += jumpLength;
       break;
     }
     case OP_AND: {
-      Value temp = MAKE_BOOL(IS_TRUE(peek(1)) && IS_TRUE(peek(2)));
-      pop();
-      pop();
-      push(temp);
+      Value temp = MAKE_BOOL(IS_TRUE(peek(vm, 1)) && IS_TRUE(peek(vm, 2)));
+      pop(vm);
+      pop(vm);
+      push(vm, temp);
       break;
     }
     case OP_OR: {
-      Value temp = MAKE_BOOL(IS_TRUE(peek(1)) || IS_TRUE(peek(2)));
-      pop();
-      pop();
-      push(temp);
+      Value temp = MAKE_BOOL(IS_TRUE(peek(vm, 1)) || IS_TRUE(peek(vm, 2)));
+      pop(vm);
+      pop(vm);
+      push(vm, temp);
       break;
     }
     case OP_JUMP_BACK: {
       uint16_t jumpLength = READ_JUMP();
-      vm.ip -= jumpLength;
+      vm->ip -= jumpLength;
+      CHECK_SLICE();
       break;
     }
     case OP_CALL: {
-      Value last = pop();
+      Value last = pop(vm);
+      if (isObjectOfType(last, OBJ_NATIVE)) {
+        ObjNative *native = (ObjNative *)last.as.obj;
+        uint8_t numActualParams = READ_BYTE();
+        if (native->arity != numActualParams) {
+          return runtimeError(vm,
+              "Invalid number of parameters. Expecting %u got %u",
+              native->arity, numActualParams);
+        }
+        // Natives run in place on the arguments, so no frame is set up
+        Value result;
+        if (!native->function(vm, numActualParams,
+                              vm->stackTop - numActualParams, &result)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        vm->stackTop -= numActualParams + 3;
+        push(vm, result);
+        COLLECT_IF_DUE();
+        break;
+      }
       if (last.type != VALUE_OBJ || last.as.obj->type != OBJ_FUNCTION) {
-        return runtimeError(
+        return runtimeError(vm,
             "Value type, %s, is not callable. Must be function object.",
             typeName(last));
       }
@@ -307,67 +625,103 @@ static InterpretResult run() {
       uint8_t numActualParams = READ_BYTE();
       if (func->numParams != numActualParams) {
         for (int i = 0; i < numActualParams + 3; i++) {
-          pop();
+          pop(vm);
         }
-        return runtimeError("Invalid number of parameters. Expecting %u got %u",
+        return runtimeError(vm,
+                            "Invalid number of parameters. Expecting %u got %u",
                             func->numParams, numActualParams);
       }
-      int currentCount = vm.ip - vm.chunk->code;
-      *(vm.stackTop - numActualParams - 1) =
-          (Value){.type = VALUE_NUM, .as.number = vm.frameBottom};
-      *(vm.stackTop - numActualParams - 2) =
-          (Value){.type = VALUE_OBJ, .as.obj = (Obj *)vm.returnIp};
-      *(vm.stackTop - numActualParams - 3) =
-          (Value){.type = VALUE_OBJ, .as.obj = (Obj *)vm.chunk};
-
-      vm.frameBottom =
-          (uint8_t)(vm.stackTop - vm.stack) - (uint8_t)(numActualParams);
-      vm.returnIp = vm.ip;
-      vm.chunk = func->chunk;
-
-      vm.ip = vm.chunk->code;
+      enterFunction(vm, func, numActualParams);
+      CHECK_SLICE();
       break;
     }
-    case OP_TABLE: {
+    case OP_CALL_DIRECT: {
+      // The compiler already knows the callee and that it takes this many
+      // arguments
+      uint8_t numActualParams = READ_BYTE();
+      ObjFunc *func = (ObjFunc *)READ_CONSTANT().as.obj;
+      enterFunction(vm, func, numActualParams);
+      CHECK_SLICE();
+      break;
+    }
+    case OP_STRUCT: {
+      // The field values are the top of the stack, in the shape's order
       uint8_t fields = READ_BYTE();
-      Value type = READ_CONSTANT();
-      Value table =
-          (Value){.type = VALUE_OBJ,
-                  .as.obj = (Obj *)createStruct((ObjString *)type.as.obj)};
-      for (int i = fields; i > 0; i--) {
-        Value top = pop();
-        Value next = pop();
-        set(&((ObjStruct *)table.as.obj)->table, (ObjString *)top.as.obj, next);
+      ObjShape *shape = (ObjShape *)READ_CONSTANT().as.obj;
+      ObjStruct *s = (ObjStruct *)allocateYoung(
+          vm, OBJ_STRUCT, sizeof(ObjStruct) + sizeof(Value) * shape->count);
+      vm->stackTop -= fields;
+      if (s != NULL) {
+        s->shape = shape;
+        memcpy(s->fields, vm->stackTop, sizeof(Value) * shape->count);
+      } else {
+        // Only without a collector, since even 255 fields fit the nursery,
+        // so no old struct refers to a young object
+        s = createStruct(vm, shape, vm->stackTop);
       }
-      push(table);
+      push(vm, MAKE_OBJ((Obj *)s));
+      COLLECT_IF_DUE();
       break;
     }
     case OP_NAMESPACE: {
-      Value top = pop();
+      Value top = pop(vm);
 
       if (!IS_OBJ(top) || top.as.obj->type != OBJ_STRUCT) {
-        return runtimeError("Cannot access field of type %s. Must be a struct",
+        return runtimeError(vm,
+                            "Cannot access field of type %s. Must be a struct",
                             typeName(top));
       }
 
       ObjString *key = (ObjString *)READ_CONSTANT().as.obj;
-      Value *val = get(&GET_TABLE(top), key);
+      Value *val = getField((ObjStruct *)top.as.obj, key);
 
       if (val == NULL) {
-        return runtimeError("Struct does not have key: %s", key->string);
+        return runtimeError(vm, "Struct does not have key: %s", key->string);
       }
 
-      push(*val);
+      push(vm, *val);
       break;
     }
     case OP_TYPE: {
-      Value top = pop();
+      Value top = pop(vm);
       if (top.type != VALUE_OBJ || top.as.obj->type != OBJ_STRUCT) {
-        push(MAKE_BOOL(false));
+        push(vm, MAKE_BOOL(false));
         break;
       }
       ObjStruct *s = (ObjStruct *)top.as.obj;
-      push((Value){.type = VALUE_OBJ, .as.obj = (Obj *)s->type});
+      push(vm, (Value){.type = VALUE_OBJ, .as.obj = (Obj *)s->shape->type});
+      break;
+    }
+    case OP_ADD_NUM:
+      NUMBER_OP(VALUE_NUM, number, +);
+      break;
+    case OP_SUBTRACT_NUM:
+      NUMBER_OP(VALUE_NUM, number, -);
+      break;
+    case OP_MUL_NUM:
+      NUMBER_OP(VALUE_NUM, number, *);
+      break;
+    case OP_DIVIDE_NUM:
+      NUMBER_OP(VALUE_NUM, number, /);
+      break;
+    case OP_LESS_NUM:
+      NUMBER_OP(VALUE_BOOL, boolean, <);
+      break;
+    case OP_GREATER_NUM:
+      NUMBER_OP(VALUE_BOOL, boolean, >);
+      break;
+    case OP_LESS_EQUAL_NUM:
+      NUMBER_OP(VALUE_BOOL, boolean, <=);
+      break;
+    case OP_GREATER_EQUAL_NUM:
+      NUMBER_OP(VALUE_BOOL, boolean, >=);
+      break;
+    case OP_FIELD: {
+      // The top is a struct of a shape the optimizer knows, and the operand
+      // is where the field is in it
+      uint8_t index = READ_BYTE();
+      Value *top = vm->stackTop - 1;
+      *top = ((ObjStruct *)top->as.obj)->fields[index];
       break;
     }
 
@@ -379,40 +733,254 @@ static InterpretResult run() {
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_JUMP
+#undef NUMBER_OP
+#undef COLLECT_IF_DUE
+#undef CHECK_SLICE
 }
 
-// Frees all objects from the heap as well as their associated strings.
-static void freeObjects() {
-  while (vm.objects != NULL) {
-    Obj *ptr = vm.objects;
-    vm.objects = ptr->next;
-    freeObject(ptr);
+// Runs vm for one slice. Once the run is over, rather than suspended, sets
+// result, if not NULL, to the value it returned, or nil, and drops the run.
+static InterpretResult runSlice(VM *vm, Value *result) {
+  startSlice(vm);
+  vm->suspended = false;
+  if (vm->perf != NULL) {
+    startPerfRun(vm);
   }
+  InterpretResult status = run(vm);
+  if (vm->perf != NULL) {
+    stopPerfRun(vm);
+  }
+  if (status == INTERPRET_SUSPENDED) {
+    return status;
+  }
+  if (result != NULL) {
+    *result = status == INTERPRET_OK && vm->stackTop > vm->stack
+                  ? *(vm->stackTop - 1)
+                  : MAKE_NIL();
+  }
+  dropRun(vm);
+  return status;
 }
 
 // Frees all objects, string table, and global vars table.
-void freeVM() {
-  freeObjects();
-  freeTable(&vm.strings);
-  freeTable(&vm.table);
-}
-
-InterpretResult interpret(const char *source) {
-  Chunk chunk;
-  initChunk(&chunk);
-  Compiler compiler;
-  initCompiler(&compiler);
-  if (!compile(source, &chunk)) {
-    freeChunk(&chunk);
+void freeVM(VM *vm) {
+  MemoryAccount *outer = useAccount(&vm->memory);
+  dropRun(vm);
+  freeLoop(vm);
+  // The collector holds every object
+  freeCollector(&vm->gc);
+  freeTable(&vm->strings);
+  freeTable(&vm->table);
+  useAccount(outer);
+  closeAccount(&vm->memory);
+}
+
+// Returns whether size more bytes fit under vm's memory limit and those of
+// the VMs above it, collecting vm's heap first if they do not. Raises a
+// runtime error if they still do not.
+bool reserveMemory(VM *vm, size_t size) {
+  if (exceededLimit(&vm->memory, size) == 0) {
+    return true;
+  }
+  if (vm->gc.enabled) {
+    collectGarbage(vm);
+  }
+  size_t limit = exceededLimit(&vm->memory, size);
+  if (limit == 0) {
+    return true;
+  }
+  runtimeError(vm, "Out of memory: over the limit of %zu bytes", limit);
+  return false;
+}
+
+// Compiles and runs a NUL terminated source
+InterpretResult interpret(VM *vm, const char *source) {
+  return interpretSource(vm, source, strlen(source));
+}
+
+// Compiles and runs the length bytes at source
+InterpretResult interpretSource(VM *vm, const char *source, size_t length) {
+  MemoryAccount *outer = useAccount(&vm->memory);
+  // The chunk outlives this call if the run is suspended, and frames of the
+  // functions it calls point to it
+  Chunk *chunk = (Chunk *)allocate(MEMORY_ARRAYS, sizeof(Chunk));
+  initChunk(chunk);
+  if (!compile(vm, source, length, chunk)) {
+    freeChunk(chunk);
+    release(MEMORY_ARRAYS, chunk, sizeof(Chunk));
+    useAccount(outer);
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm.chunk = &chunk;
-  vm.ip = chunk.code;
+  resetStack(vm);
+  vm->chunk = chunk;
+  vm->ip = chunk->code;
+  vm->ownedChunk = chunk;
+
+  // dissasembleChunk(chunk, "Chunk");
+  InterpretResult result = runSlice(vm, NULL);
+
+  useAccount(outer);
+  return result;
+}
+
+// Once a session's chunk holds this many constants it starts over after the
+// current input, leaving room for the next one
+#define SESSION_CONSTANTS_MAX 128
+
+void initSession(Session *session, VM *vm) {
+  MemoryAccount *outer = useAccount(&vm->memory);
+  session->vm = vm;
+  initChunk(&session->chunk);
+  session->compiler = (Compiler *)allocate(MEMORY_OTHER, sizeof(Compiler));
+  initCompiler(session->compiler, vm);
+  session->compiler->mainChunk = &session->chunk;
+  session->end = 0;
+  useAccount(outer);
+}
+
+// Compiles source onto the end of the session's chunk and runs just the new
+// code. An input that does not compile leaves the session unchanged. Inputs
+// may bind any global, so functions compiled earlier stop binding calls
+// statically.
+static InterpretResult runSession(Session *session, const char *source,
+                                  size_t length) {
+  Chunk *chunk = &session->chunk;
+  deoptimize(session->vm);
+  // Earlier inputs have finished running, so their code and constants can be
+  // dropped when the constant pool fills up
+  if (chunk->constants.count > SESSION_CONSTANTS_MAX) {
+    chunk->count = 0;
+    chunk->constants.count = 0;
+    session->end = 0;
+  }
 
-  // dissasembleChunk(&chunk, "Chunk");
-  InterpretResult result = run();
+  int start = session->end;
+  int constantCount = chunk->constants.count;
+  chunk->count = start;
+  Obj *existing = session->vm->objects;
+  bool compiled = compileAppend(session->compiler, source, length);
+  makePermanent(session->vm, existing, chunk);
+  if (!compiled) {
+    chunk->count = start;
+    chunk->constants.count = constantCount;
+    return INTERPRET_COMPILE_ERROR;
+  }
+  // Skip the OP_NIL, OP_RETURN that ends every input
+  session->end = chunk->count - 2;
+
+  VM *vm = session->vm;
+  resetStack(vm);
+  vm->chunk = chunk;
+  vm->ip = chunk->code + start;
+  return runSlice(vm, NULL);
+}
+
+InterpretResult interpretSession(Session *session, const char *source,
+                                 size_t length) {
+  MemoryAccount *outer = useAccount(&session->vm->memory);
+  InterpretResult result = runSession(session, source, length);
+  useAccount(outer);
+  return result;
+}
+
+void freeSession(Session *session) {
+  MemoryAccount *outer = useAccount(&session->vm->memory);
+  freeChunk(&session->chunk);
+  release(MEMORY_OTHER, session->compiler, sizeof(Compiler));
+  useAccount(outer);
+}
+
+// Compiles source into a program that can be run any number of times with
+// sethiRun. Returns NULL if it does not compile.
+Program *sethiPrepare(const char *source) {
+  Program *program = (Program *)malloc(sizeof(Program));
+  if (program == NULL) {
+    exit(1);
+  }
+  initVM(&program->heap);
+  program->heap.internShared = true;
+  MemoryAccount *outer = useAccount(&program->heap.memory);
+  initChunk(&program->chunk);
+  bool compiled =
+      compile(&program->heap, source, strlen(source), &program->chunk);
+  useAccount(outer);
+  if (!compiled) {
+    sethiFreeProgram(program);
+    return NULL;
+  }
+  return program;
+}
+
+// Runs program on a fresh stack in vm. Objects created while running belong
+// to vm, and globals the program defines stay in vm. If result is not NULL it
+// is set to the value returned by a top level return, or nil. Programs are
+// shared, so calls the program bound statically keep going to its own
+// functions even if vm binds their names to something else.
+InterpretResult sethiRun(VM *vm, Program *program, int argCount, Value *args,
+                         Value *result) {
+  resetStack(vm);
+  vm->chunk = &program->chunk;
+  vm->ip = program->chunk.code;
+  vm->sharedTable = &program->heap.table;
+  vm->args = args;
+  vm->argCount = argCount;
+
+  MemoryAccount *outer = useAccount(&vm->memory);
+  InterpretResult status = runSlice(vm, result);
+  useAccount(outer);
+  return status;
+}
+
+// Calls func with args on a fresh stack of vm, as if from the top level, and
+// sets result to what it returns, or nil.
+InterpretResult sethiCall(VM *vm, ObjFunc *func, int argCount, Value *args,
+                          Value *result) {
+  MemoryAccount *outer = useAccount(&vm->memory);
+  // A chunk of just the call and the top level return
+  Chunk *chunk = (Chunk *)allocate(MEMORY_ARRAYS, sizeof(Chunk));
+  initChunk(chunk);
+  writeChunk(chunk, OP_CALL, 0);
+  writeChunk(chunk, argCount, 0);
+  writeChunk(chunk, OP_RETURN, 0);
+
+  resetStack(vm);
+  vm->chunk = chunk;
+  vm->ip = chunk->code;
+  vm->ownedChunk = chunk;
+  for (int i = 0; i < 3; i++) {
+    push(vm, MAKE_NIL());
+  }
+  for (int i = 0; i < argCount; i++) {
+    push(vm, args[i]);
+  }
+  push(vm, MAKE_OBJ((Obj *)func));
+
+  InterpretResult status = runSlice(vm, result);
+  useAccount(outer);
+  return status;
+}
+
+// Continues the run vm suspended for another slice. Returns
+// INTERPRET_SUSPENDED again if that one runs out too; otherwise the run is
+// over and result, if not NULL, is set as by sethiRun. Returns
+// INTERPRET_RUNTIME_ERROR if no run is suspended.
+InterpretResult sethiResume(VM *vm, Value *result) {
+  if (!vm->suspended) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  MemoryAccount *outer = useAccount(&vm->memory);
+  InterpretResult status = runSlice(vm, result);
+  useAccount(outer);
+  return status;
+}
 
-  freeChunk(&chunk);
-  return INTERPRET_OK;
+// Frees the program and everything it owns. No VM may be running it. Its
+// strings stay in the process-wide shared table.
+void sethiFreeProgram(Program *program) {
+  MemoryAccount *outer = useAccount(&program->heap.memory);
+  freeChunk(&program->chunk);
+  useAccount(outer);
+  freeVM(&program->heap);
+  free(program);
 }
@@ -4,10 +4,14 @@
 #define STACK_MAX 256
 
 #include "chunk.h"
+#include "gc.h"
+#include "memory.h"
 #include "table.h"
 #include "value.h"
 
-typedef struct {
+// Holds all state of one interpreter. Each VM is independent, so separate
+// VMs can run on separate threads.
+struct VM {
   // All Op Codes.
   Chunk *chunk;
   // Points to the current OpCode that has just been read.
@@ -19,31 +23,122 @@ typedef struct {
   // The number of values off the bottom which should not be in the current
   // frame.
   uint8_t frameBottom;
-  // Array of Values representing the stack.
-  Value stack[STACK_MAX];
+  // The running stack: mainStack, or the stack of the running coroutine.
+  Value *stack;
+  Value mainStack[STACK_MAX];
+  // The running coroutine, NULL on the main stack
+  struct ObjCoroutine *coroutine;
+  // Fibers and their pending I/O, NULL until the first spawn
+  struct EventLoop *loop;
+  // Hardware counters its runs are counted with, NULL if not counted
+  struct PerfCounters *perf;
   // Points to the top of the stack (The Value above, pop will return the value
   // below this)
   Value *stackTop;
   // All objects that have been created on the heap.
   Obj *objects;
-  // All interned strings.
+  // Frees the objects nothing refers to any more
+  Collector gc;
+  // What the VM has allocated, and how much it may
+  MemoryAccount memory;
+  // Interned strings that are not in the process-wide shared table.
   Table strings;
   // All global vars.
   Table table;
-} VM;
+  // Globals of the prepared program being run, read only and consulted after
+  // the VM's own. NULL otherwise.
+  Table *sharedTable;
+  // Interns new strings into the process-wide shared table rather than
+  // strings. Set for the heaps of prepared programs and built-in natives.
+  bool internShared;
+  // Arguments passed to the running program, read with arg(i)
+  Value *args;
+  int argCount;
+  // 0 compiles straight to bytecode, 1 also runs the optimizing middle-end
+  int optimizationLevel;
+  // Set while some function of the heap binds calls statically and has not
+  // been deoptimized
+  bool staticCalls;
+  // Backward jumps and calls a run may make before it suspends, or 0 for no
+  // limit. Counted afresh each time the run is resumed.
+  int64_t sliceTicks;
+  // Microseconds a run may take before it suspends, or 0 for no limit. The
+  // clock is read once every SLICE_CLOCK_TICKS ticks.
+  int64_t sliceMicros;
+  // Ticks until the slice is checked again, those of sliceTicks left after
+  // them, and when the slice ends, 0 if never
+  int64_t ticksLeft;
+  int64_t ticksRemaining;
+  int64_t sliceEnd;
+  // Set while a run is suspended, until it is resumed or abandoned
+  bool suspended;
+  // The chunk of the source or call being run, freed once the run is over.
+  // NULL if the run's chunk belongs to a session or program.
+  Chunk *ownedChunk;
+};
+
+// Ticks between readings of the clock for a time slice
+#define SLICE_CLOCK_TICKS 1024
 
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  // The run used up its slice and can be continued with sethiResume
+  INTERPRET_SUSPENDED
 } InterpretResult;
 
-extern VM vm;
+// A script compiled once so it can be run many times. It owns its main chunk
+// and the functions and chunks created while compiling it. Its strings go
+// into the process-wide shared table, so VMs running it intern nothing for
+// its names and literals. Runs never modify it, so one program can be run by
+// many VMs at once.
+//
+// Shared strings are never freed, not even by sethiFreeProgram, as VMs that
+// ran a program may still hold its strings. The shared table therefore grows
+// with every distinct name and literal of every program prepared, so a
+// process should prepare a fixed set of programs, not one per request from
+// generated source.
+typedef struct {
+  Chunk chunk;
+  // Heap holding the program's objects and function bindings
+  VM heap;
+} Program;
+
+// An interactive session. Each input is compiled onto the end of one
+// long-lived main chunk by a compiler that is kept between inputs, so only
+// the new input is ever scanned and compiled.
+typedef struct {
+  VM *vm;
+  struct Compiler *compiler;
+  Chunk chunk;
+  // Where the implicit return of the last input starts. The next input is
+  // written over it.
+  int end;
+} Session;
 
-InterpretResult interpret(const char *source);
-void initVM();
-void freeVM();
-void push(Value val);
-Value pop();
+InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretSource(VM *vm, const char *source, size_t length);
+void initSession(Session *session, VM *vm);
+InterpretResult interpretSession(Session *session, const char *source,
+                                 size_t length);
+void freeSession(Session *session);
+void initVM(VM *vm);
+void freeVM(VM *vm);
+void push(VM *vm, Value val);
+Value pop(VM *vm);
+InterpretResult runtimeError(VM *vm, const char *message, ...);
+bool reserveMemory(VM *vm, size_t size);
+void defineNative(VM *vm, const char *name, NativeFn function, int arity);
+Value *findGlobal(VM *vm, ObjString *key);
+void deoptimize(VM *vm);
+// Interns the program's strings for the life of the process, see Program
+Program *sethiPrepare(const char *source);
+InterpretResult sethiRun(VM *vm, Program *program, int argCount, Value *args,
+                         Value *result);
+InterpretResult sethiCall(VM *vm, ObjFunc *func, int argCount, Value *args,
+                          Value *result);
+InterpretResult sethiResume(VM *vm, Value *result);
+void sethiFreeProgram(Program *program);
 
 #endif